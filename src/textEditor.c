@@ -3,19 +3,53 @@
 // Включает виртуальные терминальные последовательности (ANSI) в консоли Windows 10+
 // Компиляция (MinGW-w64):
 //   gcc -std=c99 -Wall -Wextra -O2 -o kilo.exe kilo_win.c
+// Бенчмарки (вместо редактора собирается замерщик; собирается и под Linux):
+//   gcc -std=c99 -Wall -Wextra -O2 -DKILO_BENCH -o kilo_bench.exe kilo_win.c
+//   gcc -std=c99 -Wall -Wextra -O2 -DKILO_BENCH -o kilo_bench kilo_win.c -lpthread
+//   kilo_bench [all] — набор основных операций; all — ещё и прицельные замеры
+//   kilo_bench replay trace.txt [файл] — воспроизвести трассу kilo --record
 // Запуск:
-//   kilo.exe [файл]
+//   kilo.exe [--record trace.txt] [--stats stats.txt] [файл]
+// Подсветка: встроенные C/C++ и языки из файлов syntax/*.syn рядом с
+// программой (или из каталога в переменной KILO_SYNTAX), см. editorSyntaxParse.
+// Несохранённые правки пишутся в журнал <файл>.kilo-swp; если редактор
+// упал, при следующем открытии файла он предложит их восстановить.
+// Файл, изменённый на диске другой программой, перечитывается, если в
+// буфере нет несохранённых правок (иначе — предупреждение).
 // Управление:
 //   Стрелки/Home/End/PageUp/PageDown — перемещение
 //   Ctrl-S — сохранить (спросит имя, если нет)
 //   Ctrl-Q — выход (просит подтвердить при несохранённых)
-//   Ctrl-F — поиск (ESC — выйти, стрелки — след./пред.)
+//   Ctrl-F — поиск (ESC — выйти, стрелки — след./пред., Ctrl-T — регистр,
+//            Ctrl-R — регулярное выражение)
+//   Ctrl-E — заменить все вхождения (запрос — как в поиске)
+//   Ctrl-Z / Ctrl-Y — отменить / повторить
+//   Ctrl-P — замеры в строке сообщений (--stats — отчёт в файл при выходе)
 //   Backspace/Delete/Enter/печать — редактирование
 
+#ifdef _WIN32
 #define _CRT_SECURE_NO_WARNINGS
 #define _WIN32_WINNT 0x0A00 // Windows 10
-
 #include <windows.h>
+#include <psapi.h>
+#else
+#define _XOPEN_SOURCE 700 // POSIX 2008 и realpath
+#define _DEFAULT_SOURCE     // и MAP_ANONYMOUS
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <signal.h>
+#include <setjmp.h>
+#define _strdup strdup
+#define _stricmp strcasecmp
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,12 +57,62 @@
 #include <stdbool.h>
 #include <time.h>
 #include <ctype.h>
+#include <limits.h>
+
+// Счётчики выделений памяти для замерщика и замеров в работе: все
+// malloc/realloc/calloc файла идут через них, пока включён mem_counting
+// (потоки сохранения и индексации тоже выделяют — отсюда атомики).
+static bool mem_counting;
+static unsigned long long mem_allocs, mem_bytes;
+static void memCount(size_t n) {
+  if (!mem_counting) return;
+  __atomic_fetch_add(&mem_allocs, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&mem_bytes, (unsigned long long)n, __ATOMIC_RELAXED);
+}
+static void *memMalloc(size_t n) { memCount(n); return malloc(n); }
+static void *memRealloc(void *p, size_t n) { memCount(n); return realloc(p, n); }
+static void *memCalloc(size_t c, size_t n) { memCount(c * n); return calloc(c, n); }
+#define malloc(n) memMalloc(n)
+#define realloc(p, n) memRealloc(p, n)
+#define calloc(c, n) memCalloc(c, n)
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define KILO_SIMD_X86 1
+#endif
 
 /* ============================ Константы ============================= */
 
 #define KILO_VERSION "win-0.1"
 #define KILO_TAB_STOP 8
+#define KILO_COL_STEP 256 // шаг контрольных точек cx -> rx в строках с табами и не-ASCII
+#define KILO_HL_ROWS 4096 // строк с hl, после которых он снимается с невидимых
+#define KILO_LONG_LINE (256 << 10)  // строки длиннее подсвечиваются окном у экрана
+#define KILO_LEX_CHUNK (4 << 10)    // шаг контрольных точек лексера длинной строки
+#define KILO_LEX_BUDGET (256 << 10) // сколько перелексировать после правки в длинной строке
+#define KILO_LEX_FINE 64           // шаг точек у места правки в длинной строке
 #define KILO_QUIT_TIMES 2
+#define KILO_INDEX_PAR_MIN (16u << 20) // файлы меньше индексируются одним потоком
+#define KILO_INDEX_MAX_THREADS 16
+#define KILO_INDEX_BLOCK (256u << 10) // один поток размечает файл кусками такого размера
+#define KILO_INPUT_RING 65536 // байт ввода, прочитанных впрок (степень двойки)
+#define KILO_SEARCH_MAX_MATCHES (1u << 22) // больше вхождений только считаются
+#define KILO_SEARCH_INDEX_MIN (16u << 20) // файлы меньше ищутся сканированием, без индекса
+#ifndef KILO_SEARCH_INDEX_LIMIT
+#define KILO_SEARCH_INDEX_LIMIT (256u << 20) // память индекса поиска (-DKILO_SEARCH_INDEX_LIMIT=...)
+#endif
+#define KILO_SAVE_ASYNC_MIN (8u << 20) // файлы больше сохраняются в фоновом потоке
+#define KILO_SAVE_BATCH (1u << 20)     // мелкие куски копятся до одной записи
+#define KILO_SAVE_TICK_MS 100          // как часто обновлять прогресс сохранения
+#define KILO_JOURNAL_BATCH (64u << 10) // правки копятся до одной записи в журнал восстановления
+#define KILO_JOURNAL_SYNC_MS 500       // дольше правка не ждёт записи в журнал и сброса на диск
+#define KILO_WATCH_MS 1000             // как часто смотреть, не поменялся ли файл на диске
+#define KILO_WATCH_TAIL 4096           // хвост файла, по которому видно, что его только дописали
+#define KILO_PERF_WINDOW 256           // кадров в скользящем окне замеров (Ctrl-P)
+#ifndef KILO_UNDO_LIMIT
+#define KILO_UNDO_LIMIT (64u << 20)    // память под историю отмены (-DKILO_UNDO_LIMIT=...)
+#endif
+#define KILO_UNDO_BLOCK (64u << 10)    // блок журнала отмены (крупные записи — в своём блоке)
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -42,7 +126,8 @@ enum editorKey {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  PASTE_START          // ESC [200~: дальше вставка до ESC [201~
 };
 
 enum editorHighlight {
@@ -59,719 +144,7024 @@ enum editorHighlight {
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
-/* ============================ Структуры ============================= */
-
-struct editorSyntax {
-  char *filetype;
-  char **filematch;
-  char **keywords;
-  char *singleline_comment_start;
-  char *multiline_comment_start;
-  char *multiline_comment_end;
-  int flags;
-};
-
-typedef struct erow {
-  int idx;
-  int size;
-  int rsize;
-  char *chars;
-  char *render;
-  unsigned char *hl;
-  bool hl_open_comment;
-} erow;
+// Байт hl упакован: младшие 3 бита — цвет (editorHighlight), биты 3..6 —
+// состояние лексера на входе в позицию, бит 7 — лексер принимал здесь решение.
+// По сохранённому состоянию строку можно перелексировать с любого такого места.
+#define HL_COLOR_MASK 0x07
+#define HL_ST_SHIFT 3
+#define HL_ST_MASK 0x78
+#define HL_STEP 0x80
 
-struct editorConfig {
-  int cx, cy;          // курсор (chars)
-  int rx;              // курсор (render)
-  int rowoff;          // вертикальный скролл
-  int coloff;          // горизонтальный скролл
-  int screenrows;
-  int screencols;
-  int numrows;
-  erow *row;
-  int dirty;
-  char *filename;
-  char statusmsg[160];
-  time_t statusmsg_time;
-  struct editorSyntax *syntax;
-  // WinAPI
-  HANDLE hIn, hOut;
-  DWORD inOrigMode, outOrigMode;
-};
+/* ============================ Платформа ============================= */
 
-static struct editorConfig E;
+// Всё, что зависит от ОС, — здесь: консоль, время, потоки, файлы. Ядро
+// (строки, подсветка, поиск, вывод кадра) работает только через эти
+// функции. Под Windows это Console API и WinAPI; в остальных системах —
+// POSIX, а консоль — просто потоки stdin/stdout без raw-режима: так
+// ядро гоняется без терминала (замерщиком, по записанному вводу).
 
-/* ============================ Утилиты =============================== */
+typedef struct platThread {
+#ifdef _WIN32
+  HANDLE h;
+#else
+  pthread_t t;
+  int done;
+#endif
+  void (*fn)(void *);
+  void *arg;
+} platThread;
 
-static void ewrite(const void *s, size_t n) {
-  fwrite(s, 1, n, stdout);
-}
+// Открытый (и, если не пустой, отображённый в память) файл.
+typedef struct platMapping {
+#ifdef _WIN32
+  HANDLE file, map;
+#else
+  int fd;
+#endif
+  bool held;           // файл открыт
+} platMapping;
 
-static void ewrites(const char *s) { ewrite(s, strlen(s)); }
+// Участок отображённого файла, взятый копией при записи, с разрывом своей
+// памяти посередине (см. platMapCopy).
+typedef struct platCopy {
+  char *base;          // NULL — нет
+  size_t head, mid, len; // файл [0, head), своя память [head, mid), снова файл [mid, len)
+} platCopy;
 
-static void die(const char *msg) {
-  ewrites("\x1b[2J\x1b[H");
-  fprintf(stderr, "%s\n", msg);
-  ExitProcess(1);
+// Разметка platMapCopy: g — шаг, с которым отображается файл.
+static void platCopyLayout(platCopy *c, size_t g, size_t skew, size_t at, size_t size, size_t *gl) {
+  *gl = (*gl + g - 1) / g * g;
+  c->len = skew + size + *gl;
+  c->head = (skew + at) / g * g;
+  c->mid = (skew + at + *gl + g - 1) / g * g;
 }
 
-static void editorSetStatusMessage(const char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
-  va_end(ap);
-  E.statusmsg_time = time(NULL);
+// Докладывает в свою память части строки, не попавшие в отображения.
+static char *platCopyFill(platCopy *c, const char *map, size_t off, size_t skew, size_t at, size_t gl) {
+  char *b = c->base;
+  memcpy(b + c->head, map + off - skew + c->head, skew + at - c->head);
+  size_t t = skew + at + gl, end = c->mid < c->len ? c->mid : c->len;
+  if (end > t) memcpy(b + t, map + off + at, end - t);
+  return b + skew;
 }
 
-/* ============================ Терминал ============================== */
+#ifdef _WIN32
 
-static void disableRawMode(void) {
-  if (E.hIn) SetConsoleMode(E.hIn, E.inOrigMode);
-  if (E.hOut) SetConsoleMode(E.hOut, E.outOrigMode);
-}
+typedef HANDLE platFile;
+#define PLAT_NOFILE INVALID_HANDLE_VALUE
+#define PLAT_ENOMEM ERROR_NOT_ENOUGH_MEMORY
 
-static void enableRawMode(void) {
-  E.hIn = GetStdHandle(STD_INPUT_HANDLE);
-  E.hOut = GetStdHandle(STD_OUTPUT_HANDLE);
-  if (!E.hIn || !E.hOut) die("GetStdHandle failed");
+static struct platConsole {
+  HANDLE in, out;
+  DWORD inMode, outMode;
+  UINT inCP, outCP;    // кодовые страницы до запуска: ввод и вывод идут в UTF-8
+} P;
 
-  if (!GetConsoleMode(E.hIn, &E.inOrigMode)) die("GetConsoleMode(in)");
-  if (!GetConsoleMode(E.hOut, &E.outOrigMode)) die("GetConsoleMode(out)");
+#ifndef KILO_BENCH // консоль нужна только редактору
+static bool platConsoleRaw(void) {
+  P.in = GetStdHandle(STD_INPUT_HANDLE);
+  P.out = GetStdHandle(STD_OUTPUT_HANDLE);
+  if (!P.in || !P.out) return false;
+  if (!GetConsoleMode(P.in, &P.inMode) || !GetConsoleMode(P.out, &P.outMode)) return false;
 
-  DWORD in = E.inOrigMode;
+  DWORD in = P.inMode;
   in &= ~(ENABLE_ECHO_INPUT | ENABLE_LINE_INPUT | ENABLE_PROCESSED_INPUT | ENABLE_QUICK_EDIT_MODE);
   in |= ENABLE_VIRTUAL_TERMINAL_INPUT; // стрелки как ESC [ A
-  if (!SetConsoleMode(E.hIn, in)) die("SetConsoleMode(in)");
+  if (!SetConsoleMode(P.in, in)) return false;
 
-  DWORD out = E.outOrigMode;
+  DWORD out = P.outMode;
   out |= ENABLE_VIRTUAL_TERMINAL_PROCESSING; // ANSI-escape
   out &= ~(DISABLE_NEWLINE_AUTO_RETURN);     // на всякий случай
-  if (!SetConsoleMode(E.hOut, out)) die("SetConsoleMode(out)");
+  if (!SetConsoleMode(P.out, out)) return false;
 
-  atexit(disableRawMode);
+  P.inCP = GetConsoleCP(); P.outCP = GetConsoleOutputCP();
+  SetConsoleCP(CP_UTF8); SetConsoleOutputCP(CP_UTF8);
+  return true;
 }
 
-static int editorReadKey(void) {
-  DWORD n = 0; char c;
-  while (1) {
-    if (!ReadFile(E.hIn, &c, 1, &n, NULL)) die("ReadFile");
-    if (n == 1) break;
-  }
-
-  if (c == '\x1b') {
-    char seq[3]; DWORD m;
-    if (!ReadFile(E.hIn, &seq[0], 1, &m, NULL) || m != 1) return '\x1b';
-    if (!ReadFile(E.hIn, &seq[1], 1, &m, NULL) || m != 1) return '\x1b';
-
-    if (seq[0] == '[') {
-      if (seq[1] >= '0' && seq[1] <= '9') {
-        if (!ReadFile(E.hIn, &seq[2], 1, &m, NULL) || m != 1) return '\x1b';
-        if (seq[2] == '~') {
-          switch (seq[1]) {
-            case '1': return HOME_KEY;
-            case '3': return DEL_KEY;
-            case '4': return END_KEY;
-            case '5': return PAGE_UP;
-            case '6': return PAGE_DOWN;
-            case '7': return HOME_KEY;
-            case '8': return END_KEY;
-          }
-        }
-      } else {
-        switch (seq[1]) {
-          case 'A': return ARROW_UP;
-          case 'B': return ARROW_DOWN;
-          case 'C': return ARROW_RIGHT;
-          case 'D': return ARROW_LEFT;
-          case 'H': return HOME_KEY;
-          case 'F': return END_KEY;
-        }
-      }
-    } else if (seq[0] == 'O') {
-      switch (seq[1]) {
-        case 'H': return HOME_KEY;
-        case 'F': return END_KEY;
-      }
-    }
-    return '\x1b';
-  }
-  // Backspace в Windows часто приходит как 8
-  if (c == 8) return BACKSPACE;
-  return (unsigned char)c;
+static void platConsoleRestore(void) {
+  if (P.in) SetConsoleMode(P.in, P.inMode);
+  if (P.out) SetConsoleMode(P.out, P.outMode);
+  if (P.inCP) SetConsoleCP(P.inCP);
+  if (P.outCP) SetConsoleOutputCP(P.outCP);
 }
 
-static int getWindowSize(int *rows, int *cols) {
+static int platWindowSize(int *rows, int *cols) {
   CONSOLE_SCREEN_BUFFER_INFO info;
-  if (!GetConsoleScreenBufferInfo(E.hOut, &info)) return -1;
+  if (!GetConsoleScreenBufferInfo(P.out ? P.out : GetStdHandle(STD_OUTPUT_HANDLE), &info)) return -1;
   *cols = info.srWindow.Right - info.srWindow.Left + 1;
   *rows = info.srWindow.Bottom - info.srWindow.Top + 1;
   return 0;
 }
+#endif
 
-/* ========================= Синтакс-подсветка ======================== */
-
-static bool is_separator(int c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];{}", c) != NULL;
+static bool platKeyChar(const INPUT_RECORD *r) {
+  return r->EventType == KEY_EVENT && r->Event.KeyEvent.bKeyDown && r->Event.KeyEvent.uChar.UnicodeChar;
 }
 
-static char *C_HL_extensions[] = { ".c", ".h", ".cpp", NULL };
-static char *C_HL_keywords[] = {
-  // управляющие
-  "switch", "if", "while", "for", "break", "continue", "return", "else",
-  "struct", "union", "typedef", "static", "enum", "class", "case", "default",
-  // типы (KEYWORD2)
-  "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
-  "void|", "short|", "size_t|", "ssize_t|", "const|", "volatile|", NULL
-};
+// Есть ли в консоли нажатия с символами (отпускания клавиш и прочие
+// события ReadFile не вернёт — на них ждать нельзя).
+static bool platInputReady(void) {
+  DWORD n = 0;
+  if (!GetNumberOfConsoleInputEvents(P.in, &n) || n == 0) return false;
+  INPUT_RECORD rec[64];
+  if (!PeekConsoleInputW(P.in, rec, 64, &n)) return false;
+  for (DWORD j = 0; j < n; j++) if (platKeyChar(&rec[j])) return true;
+  return false;
+}
 
-static struct editorSyntax HLDB[] = {
-  {
-    .filetype = "c",
-    .filematch = C_HL_extensions,
-    .keywords = C_HL_keywords,
-    .singleline_comment_start = "//",
-    .multiline_comment_start = "/*",
-    .multiline_comment_end = "*/",
-    .flags = HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
-  },
-};
+// Ждёт ввода не дольше ms; false — за это время символов не пришло.
+// Не консоль (ввод перенаправлен) — ждать нечем, пусть ждёт чтение.
+static bool platInputWait(unsigned ms) {
+  DWORD n = 0;
+  if (!GetNumberOfConsoleInputEvents(P.in, &n)) return true;
+  if (platInputReady()) return true;
+  if (WaitForSingleObject(P.in, ms) != WAIT_OBJECT_0) return false;
+  if (platInputReady()) return true;
+  // пришли только события без символов (фокус, отпускание клавиш): забираем
+  // их, иначе хэндл так и останется сигнальным
+  INPUT_RECORD rec[64];
+  if (!PeekConsoleInputW(P.in, rec, 64, &n)) return false;
+  DWORD k = 0;
+  while (k < n && !platKeyChar(&rec[k])) k++;
+  if (k) ReadConsoleInputW(P.in, rec, k, &n);
+  return false;
+}
 
-#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+// Читает то, что уже пришло (ждёт хотя бы байт); 0 — ввод кончился, -1 — ошибка.
+static long platRead(void *buf, size_t n) {
+  DWORD got = 0;
+  if (!ReadFile(P.in ? P.in : GetStdHandle(STD_INPUT_HANDLE), buf, (DWORD)n, &got, NULL))
+    return GetLastError() == ERROR_BROKEN_PIPE ? 0 : -1; // пишущий конец канала закрыт
+  return (long)got;
+}
 
-static void editorUpdateSyntax(erow *row);
+static void platExit(int code) { ExitProcess((UINT)code); }
 
-static int editorSyntaxToColor(int hl) {
-  switch (hl) {
-    case HL_COMMENT:
-    case HL_MLCOMMENT: return 36; // cyan
-    case HL_KEYWORD1: return 33;  // yellow
-    case HL_KEYWORD2: return 32;  // green
-    case HL_STRING: return 35;    // magenta
-    case HL_NUMBER: return 31;    // red
-    case HL_MATCH: return 34;     // blue
-    default: return 39;           // default
-  }
+static double platNow(void) { // секунды монотонных часов
+  LARGE_INTEGER f, c;
+  QueryPerformanceFrequency(&f);
+  QueryPerformanceCounter(&c);
+  return (double)c.QuadPart / (double)f.QuadPart;
 }
 
-static void editorSelectSyntaxHighlight(void) {
-  E.syntax = NULL;
-  if (!E.filename) return;
-  char *ext = strrchr(E.filename, '.');
-  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-    struct editorSyntax *s = &HLDB[j];
-    for (unsigned int i = 0; s->filematch[i]; i++) {
-      int is_ext = (s->filematch[i][0] == '.');
-      if ((is_ext && ext && _stricmp(ext, s->filematch[i]) == 0) ||
-          (!is_ext && strstr(E.filename, s->filematch[i]))) {
-        E.syntax = s;
-        for (int r = 0; r < E.numrows; r++) editorUpdateSyntax(&E.row[r]);
-        return;
-      }
-    }
-  }
+#ifdef KILO_BENCH
+static size_t platResident(void) { // рабочий набор процесса; нужно только замерщику
+  PROCESS_MEMORY_COUNTERS pmc;
+  return K32GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)) ? pmc.WorkingSetSize : 0;
 }
+#endif
 
-static void editorUpdateSyntax(erow *row) {
-  row->hl = (unsigned char*)realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
-  if (!E.syntax) return;
-
-  char **keywords = E.syntax->keywords;
-  char *scs = E.syntax->singleline_comment_start;
-  char *mcs = E.syntax->multiline_comment_start;
-  char *mce = E.syntax->multiline_comment_end;
+static int platCpuCount(void) {
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return (int)si.dwNumberOfProcessors;
+}
 
-  int scs_len = scs ? (int)strlen(scs) : 0;
-  int mcs_len = mcs ? (int)strlen(mcs) : 0;
-  int mce_len = mce ? (int)strlen(mce) : 0;
+static DWORD WINAPI platThreadMain(LPVOID arg) {
+  platThread *t = (platThread*)arg;
+  t->fn(t->arg);
+  return 0;
+}
 
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment = row->hl_open_comment;
+static bool platThreadStart(platThread *t, void (*fn)(void *), void *arg) {
+  t->fn = fn; t->arg = arg;
+  t->h = CreateThread(NULL, 0, platThreadMain, t, 0, NULL);
+  return t->h != NULL;
+}
 
-  for (int i = 0; i < row->rsize; i++) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i-1] : HL_NORMAL;
+static void platThreadJoin(platThread *t) {
+  WaitForSingleObject(t->h, INFINITE);
+  CloseHandle(t->h);
+}
 
-    if (scs_len && !in_string && !in_comment) {
-      if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-        break;
-      }
-    }
+// Поток закончился — тогда он и освобождён; иначе false сразу.
+static bool platThreadDone(platThread *t) {
+  if (WaitForSingleObject(t->h, 0) != WAIT_OBJECT_0) return false;
+  CloseHandle(t->h);
+  return true;
+}
 
-    if (mcs_len && mce_len && !in_string) {
-      if (in_comment) {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len)) {
-          for (int j = 0; j < mce_len; j++) row->hl[i + j] = HL_MLCOMMENT;
-          i += mce_len - 1;
-          in_comment = 0; prev_sep = 1; continue;
-        } else { continue; }
-      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-        for (int j = 0; j < mcs_len; j++) row->hl[i + j] = HL_MLCOMMENT;
-        i += mcs_len - 1; in_comment = 1; continue;
-      }
-    }
+// Открывает файл и отображает его в память только на чтение. Чужие
+// программы могут писать, переименовывать и удалять его, пока он открыт.
+static int platMapFile(const char *name, platMapping *m, const char **p, size_t *size) {
+  *p = NULL; *size = 0;
+  m->map = NULL;
+  m->file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (m->file == INVALID_HANDLE_VALUE) return -1;
+  m->held = true;
+  LARGE_INTEGER sz;
+  if (!GetFileSizeEx(m->file, &sz)) return -1;
+  if (sz.QuadPart == 0) return 0; // пустой файл не отображается
+  m->map = CreateFileMappingA(m->file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (!m->map) return -1;
+  *p = (const char*)MapViewOfFile(m->map, FILE_MAP_READ, 0, 0, 0);
+  if (!*p) return -1;
+  *size = (size_t)sz.QuadPart;
+  return 0;
+}
 
-    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (in_string) {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->rsize) { row->hl[i+1] = HL_STRING; i += 2; continue; }
-        if (c == in_string) in_string = 0;
-        prev_sep = 1; continue;
-      } else {
-        if (c == '"' || c == '\'') { in_string = c; row->hl[i] = HL_STRING; continue; }
-      }
-    }
+static void platUnmapFile(platMapping *m, const char *p, size_t size) {
+  (void)size;
+  if (p) UnmapViewOfFile(p);
+  if (m->map) CloseHandle(m->map);
+  if (m->held) CloseHandle(m->file);
+  m->map = NULL; m->held = false;
+}
 
-    if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit((unsigned char)c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-          (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER; prev_sep = 0; continue;
-      }
+// Символы [off, off + size) отображённого файла как своя строка с разрывом
+// не короче *gl после первых at символов. Разрыв — своя память, остальное —
+// копия при записи: страницы копируются системой, только когда в них пишут.
+// Возвращает символы и настоящую длину разрыва в *gl; NULL — не вышло.
+static char *platMapCopy(platMapping *m, const char *map, size_t off, size_t at, size_t size,
+                         size_t *gl, platCopy *c) {
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  size_t g = si.dwAllocationGranularity, skew = off % g;
+  platCopyLayout(c, g, skew, at, size, gl);
+  ULONGLONG fh = off - skew, ft = fh + c->mid - *gl;
+  size_t all = c->len > c->mid ? c->len : c->mid;
+  for (int tries = 0; tries < 4; tries++) { // свободный адрес могут занять другие потоки
+    char *b = (char*)VirtualAlloc(NULL, all, MEM_RESERVE, PAGE_NOACCESS);
+    if (!b) break;
+    VirtualFree(b, 0, MEM_RELEASE);
+    if (c->head && !MapViewOfFileEx(m->map, FILE_MAP_COPY, (DWORD)(fh >> 32), (DWORD)fh, c->head, b))
+      continue;
+    if (!VirtualAlloc(b + c->head, c->mid - c->head, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE)) {
+      if (c->head) UnmapViewOfFile(b);
+      continue;
     }
-
-    if (prev_sep) {
-      for (int j = 0; keywords[j]; j++) {
-        int klen = (int)strlen(keywords[j]);
-        int kw2 = keywords[j][klen-1] == '|';
-        if (kw2) klen--;
-        if (!strncmp(&row->render[i], keywords[j], klen) && is_separator(row->render[i + klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen - 1; break;
-        }
-      }
+    if (c->len > c->mid &&
+        !MapViewOfFileEx(m->map, FILE_MAP_COPY, (DWORD)(ft >> 32), (DWORD)ft, c->len - c->mid, b + c->mid)) {
+      if (c->head) UnmapViewOfFile(b);
+      VirtualFree(b + c->head, 0, MEM_RELEASE);
+      continue;
     }
-
-    prev_sep = is_separator(c);
+    c->base = b;
+    return platCopyFill(c, map, off, skew, at, *gl);
   }
+  c->base = NULL;
+  return NULL;
+}
 
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < E.numrows) editorUpdateSyntax(&E.row[row->idx + 1]);
+static void platUnmapCopy(platCopy *c) {
+  if (c->head) UnmapViewOfFile(c->base);
+  VirtualFree(c->base + c->head, 0, MEM_RELEASE);
+  if (c->len > c->mid) UnmapViewOfFile(c->base + c->mid);
+  c->base = NULL;
 }
 
-/* ============================ Строки ================================ */
+// Нынешний размер открытого файла; не узнать — ULLONG_MAX.
+static unsigned long long platMapSize(platMapping *m) {
+  LARGE_INTEGER sz;
+  return GetFileSizeEx(m->file, &sz) ? (unsigned long long)sz.QuadPart : ULLONG_MAX;
+}
 
-static int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
-  for (int j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t') rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-    rx++;
+// Читает n байт открытого файла с места off мимо отображения; возвращает,
+// сколько прочлось (меньше n — файл кончился раньше).
+static size_t platReadAt(platMapping *m, unsigned long long off, void *p, size_t n) {
+  size_t got = 0;
+  while (got < n) {
+    OVERLAPPED ov;
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD)(off + got); ov.OffsetHigh = (DWORD)((off + got) >> 32);
+    DWORD want = n - got > (1u << 30) ? (1u << 30) : (DWORD)(n - got), rd;
+    if (!ReadFile(m->file, (char*)p + got, want, &rd, &ov) || rd == 0) break;
+    got += rd;
   }
-  return rx;
+  return got;
 }
 
-static int editorRowRxToCx(erow *row, int rx) {
-  int cur_rx = 0, cx;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t') cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-    cur_rx++;
-    if (cur_rx > rx) return cx;
-  }
-  return cx;
+// Копирует n байт из отображения файла, который могли укоротить, пропуская
+// страницы за новым концом файла; возвращает, сколько байт скопировалось.
+// Отображённый файл Windows укоротить не даёт — копируется всё.
+static size_t platProbeCopy(char *dst, const char *src, size_t n) {
+  memcpy(dst, src, n);
+  return n;
 }
 
-static void editorUpdateRow(erow *row) {
-  int tabs = 0;
-  for (int j = 0; j < row->size; j++) if (row->chars[j] == '\t') tabs++;
-  free(row->render);
-  row->render = (char*)malloc(row->size + tabs * (KILO_TAB_STOP - 1) + 1);
-  int idx = 0;
-  for (int j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
-    } else {
-      row->render[idx++] = row->chars[j];
-    }
-  }
-  row->render[idx] = '\0';
-  row->rsize = idx;
-  editorUpdateSyntax(row);
+static platFile platCreate(const char *name) {
+  return CreateFileA(name, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 }
 
-static void editorInsertRow(int at, const char *s, size_t len) {
-  if (at < 0 || at > E.numrows) return;
-  E.row = (erow*)realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-  for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
-
-  E.row[at].idx = at;
-  E.row[at].size = (int)len;
-  E.row[at].chars = (char*)malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = false;
-  editorUpdateRow(&E.row[at]);
-  E.numrows++;
-  E.dirty++;
+// Пишет не больше n байт; возвращает записанное, 0 — ошибка.
+static size_t platWrite(platFile f, const void *p, size_t n) {
+  DWORD wr = 0;
+  if (!WriteFile(f, p, n > (1u << 30) ? (1u << 30) : (DWORD)n, &wr, NULL)) return 0;
+  return wr;
 }
 
-static void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+static bool platSync(platFile f) { return FlushFileBuffers(f) != 0; }
+static void platClose(platFile f) { CloseHandle(f); }
+
+static bool platRename(const char *from, const char *to, bool replace) {
+  return MoveFileExA(from, to, MOVEFILE_WRITE_THROUGH | (replace ? MOVEFILE_REPLACE_EXISTING : 0)) != 0;
 }
 
-static void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows) return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-  E.numrows--;
-  E.dirty++;
+// Ставит from на место to; права (ACL), атрибуты и владельца новый файл
+// берёт у прежнего. Прежний удаляется, а если задан backup — отодвигается
+// под этим именем.
+static bool platReplace(const char *from, const char *to, const char *backup) {
+  if (GetFileAttributesA(to) == INVALID_FILE_ATTRIBUTES) return platRename(from, to, false); // файла ещё нет
+  return ReplaceFileA(to, from, backup, REPLACEFILE_IGNORE_MERGE_ERRORS, NULL, NULL) != 0;
 }
 
-static void editorRowInsertChar(erow *row, int at, int c) {
-  if (at < 0 || at > row->size) at = row->size;
-  row->chars = (char*)realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = (char)c;
-  editorUpdateRow(row);
-  E.dirty++;
+// Замена не потеряет у name ничего, кроме содержимого: false — у файла
+// несколько жёстких ссылок, и писать надо поверх него.
+static bool platCanReplace(const char *name) {
+  HANDLE h = CreateFileA(name, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                         FILE_ATTRIBUTE_NORMAL, NULL);
+  if (h == INVALID_HANDLE_VALUE) return true; // файла ещё нет
+  BY_HANDLE_FILE_INFORMATION fi;
+  bool ok = !GetFileInformationByHandle(h, &fi) || fi.nNumberOfLinks <= 1;
+  CloseHandle(h);
+  return ok;
 }
 
-static void editorRowAppendString(erow *row, const char *s, size_t len) {
-  row->chars = (char*)realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += (int)len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+// Права и владельца переносит ReplaceFile.
+static bool platCopyMeta(platFile f, const char *like) { (void)f; (void)like; return true; }
+
+// Имя самого файла: ссылки (symlink, junction) разыменованы. Файла нет — имя как есть.
+static char *platRealPath(const char *name) {
+  char buf[MAX_PATH * 4];
+  HANDLE h = CreateFileA(name, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                         FILE_FLAG_BACKUP_SEMANTICS, NULL);
+  if (h == INVALID_HANDLE_VALUE) return _strdup(name);
+  DWORD n = GetFinalPathNameByHandleA(h, buf, sizeof(buf), FILE_NAME_NORMALIZED);
+  CloseHandle(h);
+  if (n == 0 || n >= sizeof(buf)) return _strdup(name);
+  if (!strncmp(buf, "\\\\?\\UNC\\", 8)) memmove(buf + 2, buf + 8, n - 7); // \\?\UNC\srv\... -> \\srv\...
+  else if (!strncmp(buf, "\\\\?\\", 4) && buf[5] == ':') memmove(buf, buf + 4, n - 3); // \\?\C:\... -> C:\...
+  return _strdup(buf);
 }
 
-static void editorRowDelChar(erow *row, int at) {
-  if (at < 0 || at >= row->size) return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+// Открывает существующий файл на дозапись в конец.
+static platFile platAppend(const char *name) {
+  return CreateFileA(name, FILE_APPEND_DATA, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
 }
 
-/* ============================ Редактирование ======================== */
+static bool platDelete(const char *name) { return DeleteFileA(name) != 0; }
+static unsigned long platError(void) { return GetLastError(); }
 
-static void editorInsertChar(int c) {
-  if (E.cy == E.numrows) editorInsertRow(E.numrows, "", 0);
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx++;
+// Размер и время изменения файла (в единицах системы: их только сравнивают);
+// false — файла нет.
+static bool platFileStamp(const char *name, unsigned long long *size, unsigned long long *mtime) {
+  WIN32_FILE_ATTRIBUTE_DATA fa;
+  if (!GetFileAttributesExA(name, GetFileExInfoStandard, &fa)) return false;
+  *size = (unsigned long long)fa.nFileSizeHigh << 32 | fa.nFileSizeLow;
+  *mtime = (unsigned long long)fa.ftLastWriteTime.dwHighDateTime << 32 | fa.ftLastWriteTime.dwLowDateTime;
+  return true;
 }
 
-static void editorInsertNewline(void) {
-  if (E.cx == 0) {
-    editorInsertRow(E.cy, "", 0);
-  } else {
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-  }
-  E.cy++; E.cx = 0;
+// Оба отображения — один и тот же файл (а не новый под тем же именем).
+static bool platSameFile(const platMapping *a, const platMapping *b) {
+  BY_HANDLE_FILE_INFORMATION fa, fb;
+  return a->held && b->held && GetFileInformationByHandle(a->file, &fa) && GetFileInformationByHandle(b->file, &fb) &&
+         fa.dwVolumeSerialNumber == fb.dwVolumeSerialNumber &&
+         fa.nFileIndexHigh == fb.nFileIndexHigh && fa.nFileIndexLow == fb.nFileIndexLow;
 }
 
-static void editorDelChar(void) {
-  if (E.cy == E.numrows) return;
-  if (E.cx == 0 && E.cy == 0) return;
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
-  } else {
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy);
-    E.cy--;
-  }
+// Каталог, где лежит программа, с разделителем в конце.
+static void platExeDir(char *buf, size_t n, const char *argv0) {
+  (void)argv0;
+  DWORD len = GetModuleFileNameA(NULL, buf, (DWORD)n);
+  if (len >= n) len = 0;
+  while (len > 0 && buf[len - 1] != '\\' && buf[len - 1] != '/') len--;
+  buf[len] = '\0';
 }
 
-/* ============================ Файл I/O ============================== */
-
-static char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  for (int j = 0; j < E.numrows; j++) totlen += E.row[j].size + 1;
-  *buflen = totlen;
-  char *buf = (char*)malloc(totlen);
-  int p = 0;
-  for (int j = 0; j < E.numrows; j++) {
-    memcpy(&buf[p], E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    buf[p++] = '\n';
-  }
-  return buf;
+// fn(путь) для каждого файла каталога dir, имя которого кончается на ext,
+// по порядку имён (его даёт NTFS).
+static void platListDir(const char *dir, const char *ext, void (*fn)(const char *path)) {
+  char path[MAX_PATH * 2];
+  WIN32_FIND_DATAA fd;
+  snprintf(path, sizeof(path), "%s\\*%s", dir, ext);
+  HANDLE h = FindFirstFileA(path, &fd);
+  if (h == INVALID_HANDLE_VALUE) return;
+  do {
+    if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+    snprintf(path, sizeof(path), "%s\\%s", dir, fd.cFileName);
+    fn(path);
+  } while (FindNextFileA(h, &fd));
+  FindClose(h);
 }
 
-static void editorOpen(const char *filename) {
-  free(E.filename);
-  E.filename = _strdup(filename);
-  editorSelectSyntaxHighlight();
+#else
 
-  FILE *fp = fopen(filename, "rb");
-  if (!fp) return; // новый файл
+typedef int platFile;
+#define PLAT_NOFILE (-1)
+#define PLAT_ENOMEM ENOMEM
 
-  fseek(fp, 0, SEEK_END);
-  long sz = ftell(fp);
-  fseek(fp, 0, SEEK_SET);
-  if (sz < 0) { fclose(fp); return; }
-  char *data = (char*)malloc((size_t)sz + 1);
-  if (!data) { fclose(fp); return; }
-  size_t rd = fread(data, 1, (size_t)sz, fp);
-  fclose(fp);
-  data[rd] = '\0';
+#ifndef KILO_BENCH // консоль нужна только редактору
+static bool platConsoleRaw(void) { return true; }
+static void platConsoleRestore(void) {}
 
-  // Разбиваем по "\n" (поддержим CRLF)
-  char *start = data;
-  for (size_t i = 0; i < rd; i++) {
-    if (data[i] == '\n') {
-      size_t len = &data[i] - start;
-      if (len && start[len-1] == '\r') len--; // CRLF
-      editorInsertRow(E.numrows, start, len);
-      start = &data[i+1];
-    }
-  }
-  if (start < data + rd) {
-    size_t len = data + rd - start;
-    if (len && start[len-1] == '\r') len--;
-    editorInsertRow(E.numrows, start, len);
-  }
-  free(data);
-  E.dirty = 0;
+static int platWindowSize(int *rows, int *cols) {
+  *rows = 24; *cols = 80; // экрана нет — кадр считается для 80x24
+  return 0;
 }
+#endif
 
-static void editorSave(void) {
-  if (!E.filename) {
-    // Мини prompt имени файла
-    editorSetStatusMessage("Save as: (ESC cancel)");
-    size_t cap = 0; char *buf = NULL; size_t len = 0;
-    while (1) {
-      int c = editorReadKey();
-      if (c == '\x1b') { editorSetStatusMessage("Сохранение отменено"); free(buf); return; }
-      if (c == '\r') break;
-      if (!isprint(c) && c != ' ' && c != '_' && c != '-' && c != '.') continue;
-      if (len + 1 >= cap) { cap = cap ? cap * 2 : 32; buf = (char*)realloc(buf, cap); }
-      buf[len++] = (char)c; buf[len] = '\0';
-      editorSetStatusMessage("Save as: %s", buf);
-    }
-    if (!buf || !buf[0]) { editorSetStatusMessage("Сохранение отменено"); free(buf); return; }
-    E.filename = buf; // владение переходит в E
-    editorSelectSyntaxHighlight();
-  }
+static bool platInputWait(unsigned ms) {
+  struct pollfd pf = { 0, POLLIN, 0 };
+  return poll(&pf, 1, (int)ms) != 0;
+}
 
-  int len;
-  char *buf = editorRowsToString(&len);
-  FILE *fp = fopen(E.filename, "wb");
-  if (!fp) { free(buf); editorSetStatusMessage("Не удалось сохранить: %s", E.filename); return; }
-  size_t wr = fwrite(buf, 1, (size_t)len, fp);
-  fclose(fp);
-  free(buf);
-  if ((int)wr == len) { E.dirty = 0; editorSetStatusMessage("%d bytes written", len); }
-  else { editorSetStatusMessage("Ошибка записи"); }
+static bool platInputReady(void) { return false; } // ввод из потока ждать не мешает
+
+static long platRead(void *buf, size_t n) {
+  ssize_t r;
+  while ((r = read(0, buf, n)) < 0 && errno == EINTR) ;
+  return (long)r;
 }
 
-/* ============================== Поиск =============================== */
+static void platExit(int code) { exit(code); }
 
-static char *editorPrompt(const char *prompt, void (*callback)(const char *, int));
+static double platNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-static void editorFindCallback(const char *query, int key) {
-  static int saved_hl_line = -1;
-  static unsigned char *saved_hl = NULL;
+static int platCpuCount(void) { return (int)sysconf(_SC_NPROCESSORS_ONLN); }
 
-  if (saved_hl) {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl); saved_hl = NULL;
-  }
+#ifdef KILO_BENCH
+static size_t platResident(void) { // 0 — система не говорит
+  FILE *fp = fopen("/proc/self/statm", "r");
+  unsigned long pages = 0, rss = 0;
+  if (!fp) return 0;
+  if (fscanf(fp, "%lu %lu", &pages, &rss) != 2) rss = 0;
+  fclose(fp);
+  return (size_t)rss * (size_t)sysconf(_SC_PAGESIZE);
+}
+#endif
 
-  if (key == '\r' || key == '\x1b' || key == CTRL_KEY('g')) { saved_hl_line = -1; return; }
+static void *platThreadMain(void *arg) {
+  platThread *t = (platThread*)arg;
+  t->fn(t->arg);
+  __atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
 
-  static int last_match = -1; static int direction = 1;
-  if (key == ARROW_RIGHT || key == ARROW_DOWN) direction = 1;
-  else if (key == ARROW_LEFT || key == ARROW_UP) direction = -1;
-  else { last_match = -1; direction = 1; }
+static bool platThreadStart(platThread *t, void (*fn)(void *), void *arg) {
+  t->fn = fn; t->arg = arg; t->done = 0;
+  return pthread_create(&t->t, NULL, platThreadMain, t) == 0;
+}
 
-  if (last_match == -1) direction = 1;
-  int current = last_match;
+static void platThreadJoin(platThread *t) { pthread_join(t->t, NULL); }
 
-  for (int i = 0; i < E.numrows; i++) {
-    current += direction;
-    if (current == -1) current = E.numrows - 1;
-    else if (current == E.numrows) current = 0;
+static bool platThreadDone(platThread *t) {
+  if (!__atomic_load_n(&t->done, __ATOMIC_ACQUIRE)) return false;
+  pthread_join(t->t, NULL);
+  return true;
+}
 
-    erow *row = &E.row[current];
-    char *match = strstr(row->render, query);
-    if (match) {
-      last_match = current;
-      E.cy = current;
-      E.cx = editorRowRxToCx(row, (int)(match - row->render));
-      E.rowoff = E.numrows;
+static int platMapFile(const char *name, platMapping *m, const char **p, size_t *size) {
+  *p = NULL; *size = 0;
+  m->fd = open(name, O_RDONLY);
+  if (m->fd < 0) return -1;
+  m->held = true;
+  struct stat st;
+  if (fstat(m->fd, &st) != 0) return -1;
+  if (st.st_size == 0) return 0;
+  void *v = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, m->fd, 0);
+  if (v == MAP_FAILED) return -1;
+  *p = (const char*)v;
+  *size = (size_t)st.st_size;
+  return 0;
+}
 
-      saved_hl_line = current;
-      saved_hl = (unsigned char*)malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
-    }
-  }
+static void platUnmapFile(platMapping *m, const char *p, size_t size) {
+  if (p) munmap((void*)p, size);
+  if (m->held) close(m->fd);
+  m->held = false;
 }
 
-static char *editorPrompt(const char *prompt, void (*callback)(const char *, int)) {
-  size_t bufsize = 128; char *buf = (char*)malloc(bufsize); size_t buflen = 0; buf[0] = '\0';
-  while (1) {
-    editorSetStatusMessage(prompt, buf);
-    // перерисуем экран перед чтением
-    // произойдет в основном цикле
-    int c = editorReadKey();
-    if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) { if (buflen) buf[--buflen] = '\0'; }
-    else if (c == '\x1b') { editorSetStatusMessage(""); if (callback) callback(buf, c); free(buf); return NULL; }
-    else if (c == '\r') { if (buflen) { editorSetStatusMessage(""); if (callback) callback(buf, c); return buf; } }
-    else if (!iscntrl(c) && c < 128) {
-      if (buflen == bufsize - 1) { bufsize *= 2; buf = (char*)realloc(buf, bufsize); }
-      buf[buflen++] = (char)c; buf[buflen] = '\0';
-    }
-    if (callback) callback(buf, c);
+static char *platMapCopy(platMapping *m, const char *map, size_t off, size_t at, size_t size,
+                         size_t *gl, platCopy *c) {
+  size_t g = (size_t)sysconf(_SC_PAGESIZE), skew = off % g;
+  platCopyLayout(c, g, skew, at, size, gl);
+  off_t fh = (off_t)(off - skew), ft = fh + (off_t)(c->mid - *gl);
+  char *b = (char*)mmap(NULL, c->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (b == MAP_FAILED) return c->base = NULL;
+  if ((c->head && mmap(b, c->head, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, m->fd, fh) == MAP_FAILED) ||
+      (c->len > c->mid &&
+       mmap(b + c->mid, c->len - c->mid, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, m->fd, ft) == MAP_FAILED)) {
+    munmap(b, c->len);
+    return c->base = NULL;
   }
+  c->base = b;
+  return platCopyFill(c, map, off, skew, at, *gl);
 }
 
-/* ============================ Вывод ================================ */
+static void platUnmapCopy(platCopy *c) {
+  munmap(c->base, c->len);
+  c->base = NULL;
+}
 
-typedef struct abuf { char *b; size_t len; } abuf;
-#define ABUF_INIT {NULL, 0}
+static unsigned long long platMapSize(platMapping *m) {
+  struct stat st;
+  return fstat(m->fd, &st) == 0 ? (unsigned long long)st.st_size : ULLONG_MAX;
+}
+
+static size_t platReadAt(platMapping *m, unsigned long long off, void *p, size_t n) {
+  size_t got = 0;
+  while (got < n) {
+    ssize_t r = pread(m->fd, (char*)p + got, n - got, (off_t)(off + got));
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) break;
+    got += (size_t)r;
+  }
+  return got;
+}
+
+// Страница отображения за концом файла при чтении даёт SIGBUS: копируем по
+// страницам, и сигнал возвращает к следующей.
+static sigjmp_buf plat_probe;
+
+static void platProbeFault(int sig) {
+  (void)sig;
+  siglongjmp(plat_probe, 1);
+}
+
+static size_t platProbeCopy(char *dst, const char *src, size_t n) {
+  struct sigaction sa, old;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = platProbeFault;
+  sa.sa_flags = SA_NODEFER; // выход прыжком: маску сигналов не сохраняем и не чиним
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGBUS, &sa, &old);
+  size_t g = (size_t)sysconf(_SC_PAGESIZE);
+  volatile size_t done = 0, out = 0, step;
+  while (done < n) {
+    step = g - (size_t)(src + done) % g;
+    if (step > n - done) step = n - done;
+    if (!sigsetjmp(plat_probe, 0)) {
+      memcpy(dst + out, src + done, step);
+      out += step;
+    }
+    done += step;
+  }
+  sigaction(SIGBUS, &old, NULL);
+  return out;
+}
+
+static platFile platCreate(const char *name) { return open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666); }
+
+static size_t platWrite(platFile f, const void *p, size_t n) {
+  ssize_t r;
+  while ((r = write(f, p, n)) < 0 && errno == EINTR) ;
+  return r > 0 ? (size_t)r : 0;
+}
+
+static bool platSync(platFile f) { return fsync(f) == 0; }
+static void platClose(platFile f) { close(f); }
+
+static bool platRename(const char *from, const char *to, bool replace) {
+  if (!replace && access(to, F_OK) == 0) { errno = EEXIST; return false; }
+  return rename(from, to) == 0;
+}
+
+static bool platReplace(const char *from, const char *to, const char *backup) {
+  if (backup && rename(to, backup) != 0) return false;
+  if (rename(from, to) == 0) return true;
+  int err = errno;
+  if (backup) rename(backup, to);
+  errno = err;
+  return false;
+}
+
+// Права и владельца прежнего файла можно перенести на новый (fchown
+// разрешён только на себя и на свою группу), и жёстких ссылок, которые
+// разорвала бы замена, у него нет.
+static bool platCanReplace(const char *name) {
+  struct stat st;
+  if (stat(name, &st) != 0) return true; // файла ещё нет
+  if (st.st_nlink > 1) return false;
+  if (geteuid() == 0) return true;
+  if (st.st_uid != geteuid()) return false;
+  if (st.st_gid == getegid()) return true;
+  gid_t g[256];
+  int n = getgroups(256, g);
+  for (int i = 0; i < n; i++) if (g[i] == st.st_gid) return true;
+  return false;
+}
+
+// Новому файлу f — владельца и права файла like (сначала владельца: chown
+// снимает setuid).
+static bool platCopyMeta(platFile f, const char *like) {
+  struct stat st;
+  if (stat(like, &st) != 0) return errno == ENOENT;
+  return fchown(f, st.st_uid, st.st_gid) == 0 && fchmod(f, st.st_mode & 07777) == 0;
+}
+
+static char *platRealPath(const char *name) {
+  char *p = realpath(name, NULL);
+  return p ? p : _strdup(name);
+}
+
+static platFile platAppend(const char *name) { return open(name, O_WRONLY | O_APPEND); }
+
+static bool platDelete(const char *name) { return unlink(name) == 0; }
+static unsigned long platError(void) { return (unsigned long)errno; }
+
+static bool platFileStamp(const char *name, unsigned long long *size, unsigned long long *mtime) {
+  struct stat st;
+  if (stat(name, &st) != 0) return false;
+  *size = (unsigned long long)st.st_size;
+  *mtime = (unsigned long long)st.st_mtim.tv_sec * 1000000000ull + (unsigned long long)st.st_mtim.tv_nsec;
+  return true;
+}
+
+static bool platSameFile(const platMapping *a, const platMapping *b) {
+  struct stat sa, sb;
+  return a->held && b->held && fstat(a->fd, &sa) == 0 && fstat(b->fd, &sb) == 0 &&
+         sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+static void platExeDir(char *buf, size_t n, const char *argv0) {
+  ssize_t len = readlink("/proc/self/exe", buf, n - 1);
+  if (len <= 0) { snprintf(buf, n, "%s", argv0 ? argv0 : ""); len = (ssize_t)strlen(buf); }
+  while (len > 0 && buf[len - 1] != '/') len--;
+  if (len == 0) snprintf(buf, n, "./");
+  else buf[len] = '\0';
+}
+
+static int platNameCmp(const void *a, const void *b) {
+  return strcmp(*(char *const*)a, *(char *const*)b);
+}
+
+static void platListDir(const char *dir, const char *ext, void (*fn)(const char *path)) {
+  DIR *d = opendir(dir);
+  char **names = NULL, **grown;
+  int n = 0;
+  size_t el = strlen(ext);
+  if (!d) return;
+  for (struct dirent *e; (e = readdir(d)) != NULL; ) {
+    size_t l = strlen(e->d_name);
+    if (l <= el || strcmp(e->d_name + l - el, ext) != 0) continue;
+    if (!(grown = (char**)realloc(names, sizeof(char*) * (n + 1)))) break;
+    names = grown;
+    if ((names[n] = strdup(e->d_name)) != NULL) n++;
+  }
+  closedir(d);
+  if (n) qsort(names, n, sizeof(char*), platNameCmp);
+  for (int j = 0; j < n; j++) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, names[j]);
+    fn(path);
+    free(names[j]);
+  }
+  free(names);
+}
+
+#endif
+
+/* ============================ Структуры ============================= */
+
+// Ячейка таблицы ключевых слов: слово без суффикса '|' и его цвет.
+typedef struct kwslot {
+  const char *word;
+  unsigned char len;
+  unsigned char color;
+} kwslot;
+
+#define KW_MAXLEN 32         // длиннее ключевых слов не бывает (проверяется при сборке таблицы)
+
+// Правило, которое открывается разделителем в коде: комментарий до конца
+// строки, многострочный комментарий, строка в кавычках (до конца строки)
+// или многострочная строка (закрывается тем же разделителем).
+enum { HR_COMMENT, HR_BLOCK, HR_STRING, HR_MSTRING };
+
+#define HR_MAXLEN 3          // длиннее разделителей правил не бывает
+#define HL_MAXRULES 16
+#define HL_MAXBLOCKS 3       // многострочных правил (номер на границе строк — 2 бита)
+
+typedef struct hlrule {
+  unsigned char kind;
+  char open[HR_MAXLEN + 1], close[HR_MAXLEN + 1];
+  char esc;            // экранирующий символ внутри, 0 — нет
+} hlrule;
+
+struct lxdfa;
+
+struct editorSyntax {
+  char *filetype;
+  char **filematch;
+  char **keywords;
+  char *singleline_comment_start;
+  char *multiline_comment_start;
+  char *multiline_comment_end;
+  int flags;
+  // правила лексера: у определений из файлов — прочитанные, у встроенных
+  // собираются из полей выше
+  hlrule rule[HL_MAXRULES];
+  int nrules;
+  struct lxdfa *dfa;   // таблицы лексера, строятся при первом выборе
+  // совершенный хеш keywords, строится вместе с таблицами
+  kwslot *kwtab;
+  unsigned kwmask, kwseed;
+  int kwmaxlen;
+};
+
+// Строка хранится как gap buffer: символы [0, gap) лежат в начале chars,
+// символы [gap, size) — в конце буфера, между ними разрыв длины cap - size.
+// hl индексируется так же, как chars, и его разрыв всегда совпадает с разрывом
+// chars. Отдельного render нет: табы раскрываются при выводе. Своя строка —
+// один блок: chars[cap], за ним hl[cap]; у окна в отображённый файл hl — свой
+// блок. hl заводится, когда строку надо показать, и снимается со строк
+// вдали от экрана; без него от подсветки остаётся только состояние на концах.
+// У длинной строки (windowed) hl — отдельный блок на окно у экрана, а не на
+// всю строку. Вставка в середину строки любой длины — сдвиг разрыва, без
+// копирования всей строки.
+struct ltleaf;
+
+// Контрольная точка лексера длинной строки: байт hl с HL_STEP в позиции pos.
+typedef struct lxpoint {
+  int pos;
+  unsigned char st;
+} lxpoint;
+
+// Редкие добавки к строке, заводятся по первой надобности.
+typedef struct erowExt {
+  int ncols, colcap;   // cols[0..ncols) верны; cols[k] — rx символа k * KILO_COL_STEP
+  int *cols;           // только у строк с табами и не-ASCII
+  lxpoint *pt;         // длинная строка: точки по возрастанию позиции, первая — начало строки
+  int npt, pt_ok, ptcap; // верны первые pt_ok точек; дальше — точки до правки, ещё не сверенные
+  int pa, pb;          // разрыв в pt, как у chars: pt[0..pa) хранят позицию, pt[pb..ptcap) —
+                       // расстояние до конца строки, и правка их не сдвигает
+  int lsize;           // длина строки, от конца которой отсчитаны pt[pb..ptcap)
+  platCopy copy;       // chars — копия при записи из отображения (см. editorRowOwn)
+  int win_from, win_to, wincap; // hl — окно на символы [win_from, win_to)
+} erowExt;
+
+typedef struct erow {
+  struct ltleaf *leaf; // лист дерева строк, в котором лежит строка
+  int size;            // логическая длина строки
+  int cap;             // ёмкость chars и hl (всегда > size)
+  int gap;             // начало разрыва
+  int nspecial;        // байтов '\t' и >= 0x80 (колонка не равна байту); при 0 rx == cx
+  int tri;             // для индекса поиска: >= 0 — строка файла с этим номером
+                       // в lineoff, < 0 — новая строка из группы -tri - 1
+  erowExt *x;          // колонки и точки лексера; NULL у большинства строк
+  char *chars;
+  unsigned char *hl;
+  unsigned char hl_entry; // многострочное правило, внутри которого строка
+                       // начинается (с этим hl посчитан); 0 — код
+  unsigned char hl_exit; // и внутри которого заканчивается
+  bool hl_ok;          // hl посчитан для текущего текста и hl_entry
+  bool hl_known;       // hl_exit посчитан для текущего текста и hl_entry
+  bool mapped;         // chars — окно в отображённый файл, не наше
+  bool windowed;       // длинная строка: hl — только окно у экрана (см. editorRowLongWindow)
+} erow;
+
+typedef struct abuf {
+  char *b;
+  size_t len, cap;
+} abuf;
+
+// Ячейка экрана: символ UTF-8 (с комбинируемыми, до 7 байт; короче — с
+// нулём в конце) и атрибут (код цвета 30..39, 0 — по умолчанию;
+// SCELL_INVERSE). Пустой ch — правая половина широкого символа слева.
+typedef struct scell {
+  char ch[7];
+  unsigned char attr;
+} scell;
+
+#define SCELL_INVERSE 0x80
+
+struct editorConfig {
+  int cx, cy;          // курсор (chars)
+  int rx;              // курсор (render)
+  int rowoff;          // вертикальный скролл
+  int coloff;          // горизонтальный скролл
+  int screenrows;
+  int screencols;
+  int numrows;
+  struct ltnode *root; // дерево строк
+  int dirty;
+  char *filename;
+  char statusmsg[160];
+  time_t statusmsg_time;
+  struct editorSyntax *syntax;
+  int hl_upto;         // строки [0, hl_upto) подсвечены согласованной цепочкой
+  int hl_rows;         // строк с заведённым hl
+  // открытый файл отображается в память; строки вне экрана живут только
+  // как смещения в lineoff (lineoff[n] — конец последней строки + 1)
+  const char *map;
+  size_t mapsize;
+  size_t *lineoff;
+  unsigned char *linestate; // LS_* для строк в диапазонах, по номеру в lineoff
+  size_t nlines;       // строк в индексе
+  platMapping mapping;
+  bool mapcopy;        // map — своя копия того, что осталось от укороченного
+                       // на диске файла (см. editorMapDetach), а не отображение
+  unsigned long long fsize, ftime; // файл на диске при открытии или последнем сохранении
+  unsigned long long ftail; // хеш последних KILO_WATCH_TAIL байт отображения
+  char *stale;         // прежняя версия файла, отодвинутая сохранением;
+                       // удаляется, когда закрывается отображение
+  struct saveJob *save; // идущее фоновое сохранение, NULL — нет
+  // теневой кадр: что сейчас на экране терминала, по нему выводятся только
+  // изменившиеся участки строк
+  scell *shadow;       // (screenrows + 2) строк по screencols ячеек
+  bool *shadow_ok;     // строка кадра совпадает с терминалом
+  int shadow_rows, shadow_cols;
+  int shadow_rowoff, shadow_coloff; // прокрутка, с которой нарисован кадр
+  int shadow_cy, shadow_cx;         // курсор терминала, -1 — неизвестно
+  int damage_lo, damage_hi;         // строки буфера [lo, hi), изменённые после кадра
+  abuf out;            // буфер кадра, переиспользуется
+  size_t frame_bytes;  // байт в последнем кадре
+  unsigned long long frames, frames_bytes;
+  // ввод читается пачками в кольцевой буфер; in_head — следующий байт
+  unsigned char in[KILO_INPUT_RING];
+  unsigned in_head, in_tail;
+  bool in_idle;        // главный цикл ждёт клавишу команды: файл можно перечитать
+  bool in_eof;         // ввод кончился: дочитать кольцо и выйти
+};
+
+static struct editorConfig E;
+
+/* ============================ Утилиты =============================== */
+
+static void ewrite(const void *s, size_t n) {
+#ifdef KILO_BENCH
+  (void)s; (void)n; // замерщик только считает байты кадров
+#else
+  fwrite(s, 1, n, stdout);
+#endif
+}
+
+static void ewrites(const char *s) { ewrite(s, strlen(s)); }
+
+static void die(const char *msg) {
+  ewrites("\x1b[2J\x1b[H");
+  fprintf(stderr, "%s\n", msg);
+  platExit(1);
+}
+
+static void editorSetStatusMessage(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+  va_end(ap);
+  E.statusmsg_time = time(NULL);
+}
+
+// Строки буфера [from, to) изменились (или сдвинулись) — перерисовать.
+static void editorDamage(int from, int to) {
+  if (E.damage_lo >= E.damage_hi) { E.damage_lo = from; E.damage_hi = to; return; }
+  if (from < E.damage_lo) E.damage_lo = from;
+  if (to > E.damage_hi) E.damage_hi = to;
+}
+
+/* ======================== Замеры в работе ========================== */
+
+// Время главного цикла по стадиям: разбор ввода, правка, подсветка, сборка
+// кадра, вывод. perfEnter переключает стадию и возвращает прежнюю, так что
+// вложенная стадия (подсветка внутри сборки кадра) не считается дважды, а
+// ожидание ввода уходит в PS_IDLE и не считается вовсе. Итерация цикла —
+// один кадр: perfFrame кладёт его времена, выделения и байты вывода в
+// кольца последних KILO_PERF_WINDOW кадров и в гистограммы за всю сессию.
+// Пока замеры выключены, каждая точка замера — одна проверка флага.
+
+enum { PS_IDLE = 0, PS_INPUT, PS_EDIT, PS_SYNTAX, PS_DRAW, PS_WRITE, PS_FRAME, PS_N }; // PS_FRAME — сумма за кадр
+#define PERF_BUCKETS 24      // гистограмма по степеням двойки микросекунд
+
+static struct editorPerf {
+  bool on;             // замеры идут
+  bool overlay;        // показывать их в строке сообщений
+  const char *dump;    // куда записать отчёт при выходе
+  int stage;
+  double since;        // начало текущей стадии
+  double cur[PS_N];    // время стадий в текущем кадре, с
+  unsigned long long allocs0, bytes0, out0;
+  unsigned long long frames;
+  float ring[PS_N][KILO_PERF_WINDOW]; // мкс
+  unsigned ring_allocs[KILO_PERF_WINDOW], ring_bytes[KILO_PERF_WINDOW], ring_out[KILO_PERF_WINDOW];
+  unsigned hist[PS_N][PERF_BUCKETS];
+  double sum[PS_N], max[PS_N];
+} PF;
+
+static int perfEnter(int stage) {
+  if (!PF.on) return PS_IDLE;
+  double now = platNow();
+  PF.cur[PF.stage] += now - PF.since;
+  PF.since = now;
+  int prev = PF.stage;
+  PF.stage = stage;
+  return prev;
+}
+
+static void perfLeave(int prev) { if (PF.on) perfEnter(prev); }
+
+static void perfStart(void) {
+  if (PF.on) return;
+  PF.on = mem_counting = true;
+  PF.stage = PS_IDLE;
+  PF.since = platNow();
+  PF.allocs0 = mem_allocs; PF.bytes0 = mem_bytes; PF.out0 = E.frames_bytes;
+}
+
+#ifndef KILO_BENCH
+// Конец итерации главного цикла (стадия сейчас — ожидание).
+static void perfFrame(void) {
+  if (!PF.on) return;
+  perfEnter(PS_IDLE);
+  PF.cur[PS_FRAME] = 0;
+  for (int s = PS_INPUT; s < PS_FRAME; s++) PF.cur[PS_FRAME] += PF.cur[s];
+  int slot = (int)(PF.frames % KILO_PERF_WINDOW);
+  for (int s = PS_INPUT; s < PS_N; s++) {
+    double us = PF.cur[s] * 1e6;
+    PF.ring[s][slot] = (float)us;
+    PF.sum[s] += us;
+    if (us > PF.max[s]) PF.max[s] = us;
+    int b = 0;
+    while (us >= 2 && b < PERF_BUCKETS - 1) { us /= 2; b++; }
+    PF.hist[s][b]++;
+  }
+  memset(PF.cur, 0, sizeof(PF.cur));
+  unsigned long long allocs = mem_allocs, bytes = mem_bytes;
+  PF.ring_allocs[slot] = (unsigned)(allocs - PF.allocs0);
+  PF.ring_bytes[slot] = (unsigned)(bytes - PF.bytes0);
+  PF.ring_out[slot] = (unsigned)(E.frames_bytes - PF.out0);
+  PF.allocs0 = allocs; PF.bytes0 = bytes; PF.out0 = E.frames_bytes;
+  PF.frames++;
+}
+#endif
+
+static int perfCmp(const void *a, const void *b) {
+  float x = *(const float*)a, y = *(const float*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Процентили стадии s по окну (ближайший ранг), мкс.
+static void perfWindowPct(int s, const int *pct, int npct, double *out) {
+  static float v[KILO_PERF_WINDOW];
+  int n = PF.frames < KILO_PERF_WINDOW ? (int)PF.frames : KILO_PERF_WINDOW;
+  memcpy(v, PF.ring[s], sizeof(float) * n);
+  qsort(v, n, sizeof(float), perfCmp);
+  for (int j = 0; j < npct; j++) {
+    int k = (n * pct[j] + 99) / 100;
+    out[j] = n ? v[k > 0 ? k - 1 : 0] : 0;
+  }
+}
+
+static double perfWindowMean(const float *ring) {
+  int n = PF.frames < KILO_PERF_WINDOW ? (int)PF.frames : KILO_PERF_WINDOW;
+  double sum = 0;
+  for (int j = 0; j < n; j++) sum += ring[j];
+  return n ? sum / n : 0;
+}
+
+static double perfWindowMeanU(const unsigned *ring) {
+  int n = PF.frames < KILO_PERF_WINDOW ? (int)PF.frames : KILO_PERF_WINDOW;
+  double sum = 0;
+  for (int j = 0; j < n; j++) sum += ring[j];
+  return n ? sum / n : 0;
+}
+
+// Строка для строки сообщений: кадр по окну, средние стадий, память, вывод.
+static void perfOverlay(char *buf, size_t size) {
+  static const int pct[] = { 50, 99 };
+  double fp[2];
+  perfWindowPct(PS_FRAME, pct, 2, fp);
+  snprintf(buf, size, "frame p50 %.0f p99 %.0f us | in %.0f ed %.0f hl %.0f draw %.0f out %.0f | %.1f alloc %.1fK | %.0fB",
+           fp[0], fp[1], perfWindowMean(PF.ring[PS_INPUT]), perfWindowMean(PF.ring[PS_EDIT]),
+           perfWindowMean(PF.ring[PS_SYNTAX]), perfWindowMean(PF.ring[PS_DRAW]), perfWindowMean(PF.ring[PS_WRITE]),
+           perfWindowMeanU(PF.ring_allocs), perfWindowMeanU(PF.ring_bytes) / 1024, perfWindowMeanU(PF.ring_out));
+}
+
+static void perfToggleOverlay(void) {
+  PF.overlay = !PF.overlay;
+  if (PF.overlay) perfStart();
+  else if (!PF.dump) PF.on = mem_counting = false;
+}
+
+#ifndef KILO_BENCH
+static const char *const perfStageName[PS_N] = { "idle", "input", "edit", "syntax", "draw", "write", "frame" };
+
+// Отчёт при выходе (kilo --stats файл): стадии за сессию и по окну, гистограммы.
+static void perfDump(void) {
+  static const int pct[] = { 50, 90, 99 };
+  FILE *fp = fopen(PF.dump, "w");
+  if (!fp) return;
+  fprintf(fp, "frames %llu\n", PF.frames);
+  fprintf(fp, "%-8s %10s %10s | last %d frames: %8s %8s %8s  (us)\n", "stage", "mean", "max",
+          KILO_PERF_WINDOW, "p50", "p90", "p99");
+  for (int s = PS_INPUT; s < PS_N; s++) {
+    double p[3];
+    perfWindowPct(s, pct, 3, p);
+    fprintf(fp, "%-8s %10.1f %10.1f | %*s %8.1f %8.1f %8.1f\n", perfStageName[s],
+            PF.frames ? PF.sum[s] / PF.frames : 0, PF.max[s], 17, "", p[0], p[1], p[2]);
+  }
+  fprintf(fp, "allocs/frame %.1f  alloc KB/frame %.1f  output B/frame %.0f  (last %d frames)\n",
+          perfWindowMeanU(PF.ring_allocs), perfWindowMeanU(PF.ring_bytes) / 1024,
+          perfWindowMeanU(PF.ring_out), KILO_PERF_WINDOW);
+  fprintf(fp, "\nhistogram, frames per bucket [us, 2*us)\n%8s", "us");
+  for (int s = PS_INPUT; s < PS_N; s++) fprintf(fp, " %8s", perfStageName[s]);
+  fputc('\n', fp);
+  for (int b = 0; b < PERF_BUCKETS; b++) {
+    unsigned any = 0;
+    for (int s = PS_INPUT; s < PS_N; s++) any |= PF.hist[s][b];
+    if (!any) continue;
+    fprintf(fp, "%8llu", b ? 1ull << b : 0ull);
+    for (int s = PS_INPUT; s < PS_N; s++) fprintf(fp, " %8u", PF.hist[s][b]);
+    fputc('\n', fp);
+  }
+  fclose(fp);
+}
+#endif
+
+/* ========================= Трасса ввода ============================ */
+
+// kilo --record trace.txt [файл] пишет каждую клавишу, разобранную
+// editorReadKey, со временем от начала записи в микросекундах:
+//   kilo-trace 1 <строк> <столбцов> <хеш буфера> <файл или ->
+//   <мкс> k <код>      клавиша: символ или editorKey
+//   <мкс> r <код>      символ, набранный впрок и вставленный тем же шагом
+//   <мкс> p <длина>    вставка; следом её текст и перевод строки
+//   <мкс> end <хеш>    выход; хеш итогового буфера
+// Замерщик воспроизводит трассу без консоли (kilo_bench replay trace.txt):
+// клавиши идут из неё в тот же editorProcessKeypress.
+
+typedef struct traceEvent {
+  unsigned long long us;
+  char kind;           // 'k', 'r' или 'p'
+  int key;
+  const char *text;    // 'p': вставленный текст
+  size_t len;
+} traceEvent;
+
+static struct editorTrace {
+  FILE *out;           // идёт запись
+  double t0;
+  traceEvent *ev;      // идёт воспроизведение
+  int n, at;
+} T;
+
+static unsigned long long editorBufferHash(void);
+
+#ifndef KILO_BENCH
+static void traceStart(const char *path) {
+  T.out = fopen(path, "wb");
+  if (!T.out) die("не удалось открыть файл трассы");
+  fprintf(T.out, "kilo-trace 1 %d %d %016llx %s\n", E.screenrows, E.screencols,
+          editorBufferHash(), E.filename ? E.filename : "-");
+  T.t0 = platNow();
+}
+#endif
+
+static void traceRecord(char kind, int key, const char *text, size_t len) {
+  if (!T.out) return;
+  unsigned long long us = (unsigned long long)((platNow() - T.t0) * 1e6);
+  if (kind == 'p') {
+    fprintf(T.out, "%llu p %zu\n", us, len);
+    fwrite(text, 1, len, T.out);
+    fputc('\n', T.out);
+  } else {
+    fprintf(T.out, "%llu %c %d\n", us, kind, key);
+  }
+}
+
+// Выход из редактора: записи — итоговый хеш.
+static void traceFinish(void) {
+  if (!T.out) return;
+  fprintf(T.out, "%llu end %016llx\n", (unsigned long long)((platNow() - T.t0) * 1e6), editorBufferHash());
+  fclose(T.out);
+  T.out = NULL;
+}
+
+// Следующая клавиша воспроизведения. Трасса кончилась посреди шага (в
+// подсказке) — ESC, чтобы подсказка закрылась.
+static int traceReplayKey(void) {
+  if (T.at >= T.n) return '\x1b';
+  return T.ev[T.at++].key;
+}
+
+/* ============================ Терминал ============================== */
+
+#ifndef KILO_BENCH
+static void disableRawMode(void) {
+  ewrites("\x1b[?2004l");
+  fflush(stdout);
+  platConsoleRestore();
+}
+
+static void enableRawMode(void) {
+  if (!platConsoleRaw()) die("не удалось перевести консоль в raw-режим");
+  ewrites("\x1b[?2004h"); // bracketed paste: вставка приходит между ESC [200~ и ESC [201~
+  atexit(disableRawMode);
+}
+#endif
+
+// Дочитывает в кольцо всё, что уже пришло (ReadFile ждёт хотя бы байт).
+static void inputFill(void) {
+  unsigned at = E.in_tail & (KILO_INPUT_RING - 1);
+  unsigned room = KILO_INPUT_RING - (E.in_tail - E.in_head);
+  if (room > KILO_INPUT_RING - at) room = KILO_INPUT_RING - at; // до конца кольца
+  if (room == 0) return;
+  long n = platRead(&E.in[at], room);
+  if (n < 0) die("read");
+  if (n == 0) E.in_eof = true;
+  E.in_tail += (unsigned)n;
+}
+
+// Ввод уже ждёт обработки: перерисовывать экран пока рано.
+static bool inputPending(void) {
+  return E.in_tail != E.in_head || platInputReady();
+}
+
+static void editorSavePoll(void);
+static void editorRefreshScreen(void);
+static bool journalPending(void);
+static void journalPoll(void);
+static bool editorWatchPoll(void);
+
+// Следующий байт ввода; без wait — -1, если ничего не пришло. Пока идёт
+// фоновое сохранение, ожидание прерывается, чтобы показывать его прогресс;
+// пока в журнале восстановления лежат неотданные правки — чтобы их отдать;
+// пока главный цикл ждёт команду — чтобы заметить перемену файла на диске.
+static int inputByte(bool wait) {
+  while (E.in_tail == E.in_head) {
+    if (E.in_eof || (!wait && !platInputReady())) return -1;
+    int st = perfEnter(PS_IDLE); // ожидание в замеры не идёт
+    bool busy = E.save || journalPending();
+    if ((busy || E.in_idle) && !platInputWait(busy ? KILO_SAVE_TICK_MS : KILO_WATCH_MS)) {
+      if (E.save) { editorSavePoll(); editorRefreshScreen(); }
+      journalPoll();
+      if (E.in_idle && editorWatchPoll()) editorRefreshScreen();
+    }
+    else inputFill();
+    perfLeave(st);
+  }
+  E.in_idle = false;
+  return E.in[E.in_head++ & (KILO_INPUT_RING - 1)];
+}
+
+// Следующий байт, уже лежащий в кольце, не забирая его; -1 — кольцо пусто.
+static int inputPeek(void) {
+  return E.in_tail != E.in_head ? E.in[E.in_head & (KILO_INPUT_RING - 1)] : -1;
+}
+
+static int editorDecodeKey(void) {
+  int c = inputByte(true);
+  if (c < 0) return '\x1b'; // ввод кончился: подсказка закрывается, главный цикл выйдет
+
+  if (c == '\x1b') {
+    // хвост последовательности консоль кладёт вместе с ESC; нет его — это сам ESC
+    int s0 = inputByte(false); if (s0 < 0) return '\x1b';
+    int s1 = inputByte(false); if (s1 < 0) return '\x1b';
+
+    if (s0 == '[') {
+      if (s1 >= '0' && s1 <= '9') {
+        int num = s1 - '0', d;
+        while ((d = inputByte(false)) >= '0' && d <= '9') num = num * 10 + (d - '0');
+        if (d == '~') {
+          switch (num) {
+            case 1: return HOME_KEY;
+            case 3: return DEL_KEY;
+            case 4: return END_KEY;
+            case 5: return PAGE_UP;
+            case 6: return PAGE_DOWN;
+            case 7: return HOME_KEY;
+            case 8: return END_KEY;
+            case 200: return PASTE_START;
+          }
+        }
+      } else {
+        switch (s1) {
+          case 'A': return ARROW_UP;
+          case 'B': return ARROW_DOWN;
+          case 'C': return ARROW_RIGHT;
+          case 'D': return ARROW_LEFT;
+          case 'H': return HOME_KEY;
+          case 'F': return END_KEY;
+        }
+      }
+    } else if (s0 == 'O') {
+      switch (s1) {
+        case 'H': return HOME_KEY;
+        case 'F': return END_KEY;
+      }
+    }
+    return '\x1b';
+  }
+  // Backspace в Windows часто приходит как 8
+  if (c == 8) return BACKSPACE;
+  return c;
+}
+
+static int editorReadKey(void) {
+  if (T.ev) return traceReplayKey();
+  int st = perfEnter(PS_INPUT);
+  int c = editorDecodeKey();
+  perfLeave(st);
+  if (c != PASTE_START) traceRecord('k', c, NULL, 0); // вставку запишет editorPaste целиком
+  return c;
+}
+
+// Байт набираемого текста: печатный ASCII или часть символа UTF-8
+// (многобайтный символ приходит подряд и вставляется одним куском).
+static inline bool keyText(int c) { return c >= 0x80 ? c <= 0xff : !iscntrl(c); }
+
+// Печатный символ, уже пришедший вслед за набранным, или -1: набранное
+// впрок вставляется одним шагом.
+static int editorReadRunChar(void) {
+  int d;
+  if (T.ev) return T.at < T.n && T.ev[T.at].kind == 'r' ? T.ev[T.at++].key : -1;
+  if ((d = inputPeek()) < 0 || !keyText(d)) return -1;
+  E.in_head++;
+  traceRecord('r', d, NULL, 0);
+  return d;
+}
+
+// Состояние подсветки строки, ещё не развёрнутой из отображения.
+#define LS_KNOWN 1
+#define LS_ENTRY(ls) (((ls) >> 1) & 3) // многострочное правило на входе в строку (0 — код)
+#define LS_EXIT(ls) (((ls) >> 3) & 3)  // и на выходе
+#define LS_STATE(entry, exit) ((unsigned char)(LS_KNOWN | (entry) << 1 | (exit) << 3))
+
+/* ============================== UTF-8 =============================== */
+
+// Текст хранится байтами как есть; колонки считаются по символам UTF-8:
+// CJK и прочие широкие — две колонки, комбинируемые — ноль (рисуются в
+// ячейке предыдущего), испорченные последовательности — по байту на
+// колонку. ASCII без табов (почти весь исходный код) отсеивается блоками
+// по 16/32 байта, и для него rx == cx без разбора.
+
+#define UTF8_BAD 0xffffffffu // байт не начинает верную последовательность
+
+typedef struct utf8Range { unsigned lo, hi; } utf8Range;
+
+static const utf8Range utf8_zero[] = {
+  {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF}, {0x05C1, 0x05C2},
+  {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A}, {0x064B, 0x065F}, {0x0670, 0x0670},
+  {0x06D6, 0x06DC}, {0x06DF, 0x06E4}, {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0900, 0x0902},
+  {0x093C, 0x093C}, {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0E31, 0x0E31}, {0x0E34, 0x0E3A},
+  {0x0E47, 0x0E4E}, {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x202A, 0x202E},
+  {0x2060, 0x2064}, {0x20D0, 0x20FF}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF},
+  {0xE0100, 0xE01EF},
+};
+
+static const utf8Range utf8_wide[] = {
+  {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC}, {0x23F0, 0x23F0},
+  {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267F, 0x267F},
+  {0x2693, 0x2693}, {0x26A1, 0x26A1}, {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5},
+  {0x26CE, 0x26CE}, {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+  {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B}, {0x2728, 0x2728},
+  {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+  {0x27B0, 0x27B0}, {0x27BF, 0x27BF}, {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55},
+  {0x2E80, 0x303E}, {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+  {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19}, {0xFE30, 0xFE6F},
+  {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4}, {0x17000, 0x18AFF}, {0x1B000, 0x1B2FF},
+  {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F2FF},
+  {0x1F300, 0x1F320}, {0x1F32D, 0x1F335}, {0x1F337, 0x1F37C}, {0x1F37E, 0x1F393}, {0x1F3A0, 0x1F3CA},
+  {0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0}, {0x1F3F4, 0x1F3F4}, {0x1F3F8, 0x1F43E}, {0x1F440, 0x1F440},
+  {0x1F442, 0x1F4FC}, {0x1F4FF, 0x1F53D}, {0x1F54B, 0x1F54E}, {0x1F550, 0x1F567}, {0x1F57A, 0x1F57A},
+  {0x1F595, 0x1F596}, {0x1F5A4, 0x1F5A4}, {0x1F5FB, 0x1F64F}, {0x1F680, 0x1F6C5}, {0x1F6CC, 0x1F6CC},
+  {0x1F6D0, 0x1F6D2}, {0x1F6D5, 0x1F6D7}, {0x1F6EB, 0x1F6EC}, {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7EB},
+  {0x1F90C, 0x1F93A}, {0x1F93C, 0x1F945}, {0x1F947, 0x1F9FF}, {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD},
+  {0x30000, 0x3FFFD},
+};
+
+static bool utf8InTable(unsigned cp, const utf8Range *t, int n) {
+  if (cp < t[0].lo || cp > t[n - 1].hi) return false;
+  int lo = 0, hi = n - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (cp > t[mid].hi) lo = mid + 1;
+    else if (cp < t[mid].lo) hi = mid - 1;
+    else return true;
+  }
+  return false;
+}
+
+// Экранная ширина символа; управляющие и испорченные рисуются заменой в одну колонку.
+static int utf8Width(unsigned cp) {
+  if (cp < 0x300 || cp == UTF8_BAD) return 1;
+  if (utf8InTable(cp, utf8_zero, (int)(sizeof(utf8_zero) / sizeof(utf8_zero[0])))) return 0;
+  if (utf8InTable(cp, utf8_wide, (int)(sizeof(utf8_wide) / sizeof(utf8_wide[0])))) return 2;
+  return 1;
+}
+
+// Символ в начале s (доступно n байт): длина последовательности и *cp.
+// Лишние, укороченные, суррогаты и больше U+10FFFF — один байт UTF8_BAD.
+static int utf8Decode(const unsigned char *s, int n, unsigned *cp) {
+  unsigned c = s[0];
+  int len;
+  unsigned lo = 0x80, hi = 0xbf; // допустимый второй байт
+  if (c < 0x80) { *cp = c; return 1; }
+  if (c < 0xc2 || c > 0xf4) { *cp = UTF8_BAD; return 1; }
+  if (c < 0xe0) { len = 2; c &= 0x1f; }
+  else if (c < 0xf0) {
+    len = 3; if (c == 0xe0) lo = 0xa0; else if (c == 0xed) hi = 0x9f;
+    c &= 0x0f;
+  } else {
+    len = 4; if (c == 0xf0) lo = 0x90; else if (c == 0xf4) hi = 0x8f;
+    c &= 0x07;
+  }
+  if (n < len || s[1] < lo || s[1] > hi) { *cp = UTF8_BAD; return 1; }
+  c = (c << 6) | (s[1] & 0x3f);
+  for (int k = 2; k < len; k++) {
+    if ((s[k] & 0xc0) != 0x80) { *cp = UTF8_BAD; return 1; }
+    c = (c << 6) | (s[k] & 0x3f);
+  }
+  *cp = c;
+  return len;
+}
+
+// Длина начала p[0, n) из простого ASCII: без табов и байтов >= 0x80, у
+// которых колонка не равна байту. textSpecial — сколько таких байтов всего.
+static int textPlainScalar(const char *p, int n) {
+  int j = 0;
+  while (j < n && p[j] != '\t' && (unsigned char)p[j] < 0x80) j++;
+  return j;
+}
+
+static size_t textSpecialScalar(const char *p, size_t n) {
+  size_t k = 0;
+  for (size_t j = 0; j < n; j++) k += p[j] == '\t' || (unsigned char)p[j] >= 0x80;
+  return k;
+}
+
+#ifdef KILO_SIMD_X86
+static int textPlainSSE2(const char *p, int n) {
+  const __m128i tab = _mm_set1_epi8('\t');
+  int j = 0;
+  for (; n - j >= 16; j += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p + j));
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, tab)));
+    if (mask) return j + __builtin_ctz(mask);
+  }
+  return j + textPlainScalar(p + j, n - j);
+}
+
+__attribute__((target("avx2")))
+static int textPlainAVX2(const char *p, int n) {
+  const __m256i tab = _mm256_set1_epi8('\t');
+  int j = 0;
+  for (; n - j >= 32; j += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(p + j));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(v, _mm256_cmpeq_epi8(v, tab)));
+    if (mask) return j + __builtin_ctz(mask);
+  }
+  return j + textPlainSSE2(p + j, n - j);
+}
+
+static size_t textSpecialSSE2(const char *p, size_t n) {
+  const __m128i tab = _mm_set1_epi8('\t');
+  size_t j = 0, k = 0;
+  for (; n - j >= 16; j += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p + j));
+    k += __builtin_popcount((unsigned)_mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, tab))));
+  }
+  return k + textSpecialScalar(p + j, n - j);
+}
+
+__attribute__((target("avx2")))
+static size_t textSpecialAVX2(const char *p, size_t n) {
+  const __m256i tab = _mm256_set1_epi8('\t');
+  size_t j = 0, k = 0;
+  for (; n - j >= 32; j += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(p + j));
+    k += __builtin_popcount((unsigned)_mm256_movemask_epi8(_mm256_or_si256(v, _mm256_cmpeq_epi8(v, tab))));
+  }
+  return k + textSpecialSSE2(p + j, n - j);
+}
+#endif
+
+static int textPlain(const char *p, int n) {
+#ifdef KILO_SIMD_X86
+  if (__builtin_cpu_supports("avx2")) return textPlainAVX2(p, n);
+  return textPlainSSE2(p, n);
+#else
+  return textPlainScalar(p, n);
+#endif
+}
+
+static size_t textSpecial(const char *p, size_t n) {
+#ifdef KILO_SIMD_X86
+  if (__builtin_cpu_supports("avx2")) return textSpecialAVX2(p, n);
+  return textSpecialSSE2(p, n);
+#else
+  return textSpecialScalar(p, n);
+#endif
+}
+
+static inline bool chSpecial(char c) { return c == '\t' || (unsigned char)c >= 0x80; }
+
+/* ============================ Буфер строки ========================== */
+
+#define ROW_GAPLEN(row) ((row)->cap - (row)->size)
+
+static inline char rowCh(const erow *row, int i) {
+  if (i < row->gap) return row->chars[i];
+  if (i < row->size) return row->chars[i + ROW_GAPLEN(row)];
+  return '\0';
+}
+
+static inline unsigned char *rowHl(erow *row, int i) {
+  return &row->hl[i < row->gap ? i : i + ROW_GAPLEN(row)];
+}
+
+// Символ в позиции at: длина в байтах и *cp (UTF8_BAD — одиночный байт).
+static int rowChar(const erow *row, int at, unsigned *cp) {
+  unsigned char b[4];
+  int n = 0;
+  for (; n < 4 && at + n < row->size; n++) b[n] = (unsigned char)rowCh(row, at + n);
+  if (n == 0) { *cp = 0; return 1; }
+  return utf8Decode(b, n, cp);
+}
+
+// Начало символа, которому принадлежит байт at.
+static int rowCharStart(const erow *row, int at) {
+  if (((unsigned char)rowCh(row, at) & 0xc0) != 0x80) return at;
+  for (int s = at - 1; s >= 0 && s >= at - 3; s--) {
+    unsigned char c = (unsigned char)rowCh(row, s);
+    if ((c & 0xc0) == 0x80) continue;
+    unsigned cp;
+    return s + rowChar(row, s, &cp) > at ? s : at;
+  }
+  return at;
+}
+
+// Соседние позиции курсора: символы нулевой ширины идут вместе с предыдущим.
+static int rowCharNext(const erow *row, int at) {
+  unsigned cp;
+  if (at < row->size) at += rowChar(row, at, &cp);
+  while (at < row->size && (unsigned char)rowCh(row, at) >= 0x80) {
+    int len = rowChar(row, at, &cp);
+    if (utf8Width(cp)) break;
+    at += len;
+  }
+  return at;
+}
+
+static int rowCharPrev(const erow *row, int at) {
+  unsigned cp;
+  while (at > 0) {
+    at = rowCharStart(row, at - 1);
+    rowChar(row, at, &cp);
+    if (utf8Width(cp)) break;
+  }
+  return at;
+}
+
+// Длина простого ASCII (см. textPlain) в [at, to) поверх разрыва.
+static int rowPlain(const erow *row, int at, int to) {
+  int n = 0;
+  if (at < row->gap) {
+    int end = to < row->gap ? to : row->gap;
+    n = textPlain(row->chars + at, end - at);
+    if (at + n < end || end == to) return n;
+    at = end;
+  }
+  return n + textPlain(row->chars + at + ROW_GAPLEN(row), to - at);
+}
+
+// hl лежит в одном блоке с chars, сразу за ними: строка своя, hl не окно подсветки.
+static inline bool rowHlInline(const erow *row) {
+  return row->hl && !row->mapped && !row->windowed;
+}
+
+// Добавки строки заводятся по первой надобности.
+static erowExt *editorRowExt(erow *row) {
+  if (!row->x) {
+    row->x = (erowExt*)calloc(1, sizeof(erowExt));
+    if (!row->x) die("calloc");
+  }
+  return row->x;
+}
+
+// Строка из отображения становится обычной: символы — к себе, разрыв —
+// сразу на место at (с запасом, чтобы первая же вставка не копировала
+// строку ещё раз). Длинную строку целиком не копируем: она берётся из
+// отображения копией при записи, и система копирует только страницы, в
+// которые пишут.
+static void editorRowOwn(erow *row, int at) {
+  if (!row->mapped) return;
+  size_t gl = (size_t)row->size / 8 + 16;
+  // cap — int; копия из отображения ещё добирает gl до целой страницы
+  if (gl > (size_t)(INT_MAX - row->size)) gl = (size_t)(INT_MAX - row->size);
+  if (row->windowed && row->size <= INT_MAX / 2 && E.mapping.held && row->chars >= E.map && row->chars + row->size <= E.map + E.mapsize) {
+    char *p = platMapCopy(&E.mapping, E.map, (size_t)(row->chars - E.map), at, row->size, &gl, &row->x->copy);
+    if (p) {
+      row->chars = p;
+      row->cap = row->size + (int)gl; row->gap = at;
+      row->mapped = false;
+      return;
+    }
+  }
+  int cap = row->size + (int)gl, tail = row->size - at;
+  bool inl = row->hl && !row->windowed;
+  char *block = (char*)malloc(inl ? 2 * (size_t)cap : (size_t)cap);
+  if (!block) die("malloc");
+  memcpy(block, row->chars, at);
+  memcpy(&block[cap - tail], &row->chars[at], tail);
+  if (inl) {
+    memcpy(block + cap, row->hl, at);
+    memcpy(block + 2 * (size_t)cap - tail, &row->hl[at], tail);
+    free(row->hl);
+    row->hl = (unsigned char*)block + cap;
+  }
+  row->chars = block;
+  row->cap = cap; row->gap = at;
+  row->mapped = false;
+}
+
+static void editorRowHlDrop(erow *row);
+
+// Гарантирует место под extra символов (и '\0'), ёмкость растёт геометрически.
+// Строка, доросшая до KILO_LONG_LINE, теряет hl: дальше её подсветят окном.
+static void editorRowReserve(erow *row, int extra) {
+  editorRowOwn(row, row->gap);
+  if (row->cap - row->size > extra) return;
+  if (extra >= INT_MAX - row->size) die("строка длиннее INT_MAX байт");
+  int newcap = row->cap ? row->cap : 16;
+  while (newcap - row->size <= extra) newcap = newcap <= INT_MAX / 2 ? newcap * 2 : INT_MAX;
+  if (rowHlInline(row) && newcap >= KILO_LONG_LINE) editorRowHlDrop(row);
+  int tail = row->size - row->gap, cap = row->cap;
+  if (row->x && row->x->copy.base) { // копия из отображения не растёт: переезжаем к себе
+    char *block = (char*)malloc(newcap);
+    if (!block) die("malloc");
+    memcpy(block, row->chars, row->gap);
+    memcpy(&block[newcap - tail], &row->chars[cap - tail], tail);
+    platUnmapCopy(&row->x->copy);
+    row->chars = block; row->cap = newcap;
+    return;
+  }
+  bool inl = rowHlInline(row);
+  char *block = (char*)realloc(row->chars, inl ? 2 * (size_t)newcap : (size_t)newcap);
+  if (!block) die("realloc");
+  if (inl) { // сначала hl: он уезжает вправо, на место за новыми chars
+    unsigned char *hl = (unsigned char*)block + cap, *nhl = (unsigned char*)block + newcap;
+    memmove(&nhl[newcap - tail], &hl[cap - tail], tail);
+    memmove(nhl, hl, row->gap);
+    row->hl = nhl;
+  }
+  memmove(&block[newcap - tail], &block[cap - tail], tail);
+  row->chars = block; row->cap = newcap;
+}
+
+// Заводит hl строки: у своей — продлевая блок chars, у окна — отдельно.
+static void editorRowHlAlloc(erow *row) {
+  if (row->mapped) {
+    row->hl = (unsigned char*)malloc(row->cap ? row->cap : 1);
+    if (!row->hl) die("malloc");
+  } else {
+    char *block = (char*)realloc(row->chars, 2 * (size_t)row->cap);
+    if (!block) die("realloc");
+    row->chars = block;
+    row->hl = (unsigned char*)block + row->cap;
+  }
+  E.hl_rows++;
+}
+
+// Снимает hl; состояние на концах строки (hl_known) и контрольные точки
+// длинной строки остаются.
+static void editorRowHlDrop(erow *row) {
+  if (!row->hl) return;
+  if (row->windowed) { free(row->hl); row->x->wincap = 0; }
+  else if (row->mapped) free(row->hl);
+  else {
+    char *block = (char*)realloc(row->chars, row->cap);
+    if (block) row->chars = block;
+  }
+  row->hl = NULL; row->hl_ok = false;
+  E.hl_rows--;
+}
+
+static void editorRowMoveGap(erow *row, int at) {
+  if (at == row->gap) return;
+  if (row->mapped) { editorRowOwn(row, at); return; }
+  int gl = ROW_GAPLEN(row);
+  if (at < row->gap) {
+    memmove(&row->chars[at + gl], &row->chars[at], row->gap - at);
+    if (rowHlInline(row)) memmove(&row->hl[at + gl], &row->hl[at], row->gap - at);
+  } else if (at > row->gap) {
+    memmove(&row->chars[row->gap], &row->chars[row->gap + gl], at - row->gap);
+    if (rowHlInline(row)) memmove(&row->hl[row->gap], &row->hl[row->gap + gl], at - row->gap);
+  }
+  row->gap = at;
+}
+
+// Сдвигает разрыв в конец: chars и hl становятся сплошными массивами
+// (без '\0' — строка может быть окном в отображённый файл).
+static const char *editorRowData(erow *row) {
+  editorRowMoveGap(row, row->size);
+  return row->chars;
+}
+
+static void editorFreeRow(erow *row) {
+  if (row->hl) E.hl_rows--;
+  if (row->mapped || row->windowed) free(row->hl);
+  if (row->x && row->x->copy.base) platUnmapCopy(&row->x->copy);
+  else if (!row->mapped) free(row->chars);
+  if (row->x) { free(row->x->cols); free(row->x->pt); free(row->x); }
+}
+
+// Заполняет row окном на строку line отображённого файла (без копирования).
+static void editorMapLine(erow *row, size_t line) {
+  size_t off = E.lineoff[line];
+  size_t len = E.lineoff[line + 1] - 1 - off;
+  if (len && E.map[off + len - 1] == '\r') len--; // CRLF
+  memset(row, 0, sizeof(*row));
+  row->chars = (char*)&E.map[off];
+  row->size = row->cap = row->gap = (int)len;
+  row->tri = (int)line;
+  row->mapped = true;
+}
+
+// Байты [off, off + n) файла под E.map. Пока файл отображён, они читаются из
+// него самого в buf, а не из памяти: файл, который укоротили на диске, даёт
+// здесь NULL, а не SIGBUS. Зовётся и из потоков.
+static const char *editorMapRead(size_t off, char *buf, size_t n) {
+  if (!E.mapping.held) return E.map + off; // своя копия (или буфер замерщика)
+  return platReadAt(&E.mapping, off, buf, n) == n ? buf : NULL;
+}
+
+/* ============================ Дерево строк ========================== */
+
+// Строки лежат прямо в листьях B+-дерева, каждый узел знает число строк в
+// своём поддереве: поиск строки по номеру, вставка и удаление — O(log n).
+// Листья связаны в список для последовательного обхода. Указатели на erow
+// живут до ближайшей вставки или удаления строки (как и с прежним массивом).
+//
+// Лист-диапазон (LT_SPAN) вместо erow хранит только номер первой строки в
+// E.lineoff: так выглядит весь файл сразу после открытия. Когда строку из
+// диапазона просят показать или изменить, вокруг неё выделяется обычный лист
+// с окнами в отображение (ltMaterialize).
+
+#define LT_LEAF_MAX 64
+#define LT_NODE_MAX 32
+
+enum { LT_INNER = 0, LT_ROWS, LT_SPAN };
+
+typedef struct ltnode {
+  struct ltnode *parent;
+  int leaf;            // LT_INNER, LT_ROWS или LT_SPAN
+  int n;               // строк в листе или детей в узле
+  int count;           // строк во всём поддереве
+} ltnode;
+
+typedef struct ltleaf {
+  ltnode h;
+  struct ltleaf *prev, *next;
+  size_t first;        // LT_SPAN: первая строка диапазона в E.lineoff
+  erow rows[LT_LEAF_MAX]; // только у LT_ROWS (диапазонов мало, место не жалко)
+} ltleaf;
+
+typedef struct ltinner {
+  ltnode h;
+  ltnode *kids[LT_NODE_MAX];
+} ltinner;
+
+// Итератор не разворачивает диапазоны: для их строк он отдаёт окно в
+// view (leaf == NULL, hl == NULL), годное только для чтения символов.
+typedef struct rowIter {
+  ltleaf *leaf;
+  int i;
+  int at;              // номер текущей строки
+  erow view;
+} rowIter;
+
+// Спускается к листу со строкой номер *at; в *at остаётся позиция в листе.
+static ltleaf *ltFind(int *at) {
+  ltnode *n = E.root;
+  while (!n->leaf) {
+    ltinner *in = (ltinner*)n;
+    int k = 0;
+    while (k < n->n - 1 && *at >= in->kids[k]->count) { *at -= in->kids[k]->count; k++; }
+    n = in->kids[k];
+  }
+  return (ltleaf*)n;
+}
+
+static void ltInsertAfter(ltnode *left, ltnode *right) {
+  ltinner *p = (ltinner*)left->parent;
+  int k = 0;
+  while (p->kids[k] != left) k++;
+  memmove(&p->kids[k + 2], &p->kids[k + 1], sizeof(ltnode*) * (p->h.n - k - 1));
+  p->kids[k + 1] = right;
+  p->h.n++;
+  right->parent = &p->h;
+}
+
+static void ltSplitInner(ltinner *p);
+
+// Гарантирует, что у узла есть родитель и в нём есть место для соседа.
+static void ltMakeRoom(ltnode *n) {
+  if (!n->parent) {
+    ltinner *root = (ltinner*)calloc(1, sizeof(ltinner));
+    if (!root) die("calloc");
+    root->h.n = 1; root->h.count = n->count; root->kids[0] = n;
+    n->parent = &root->h;
+    E.root = &root->h;
+  } else if (n->parent->n == LT_NODE_MAX) {
+    ltSplitInner((ltinner*)n->parent);
+  }
+}
+
+static void ltSplitInner(ltinner *p) {
+  ltMakeRoom(&p->h);
+  ltinner *q = (ltinner*)calloc(1, sizeof(ltinner));
+  if (!q) die("calloc");
+  int half = p->h.n / 2;
+  q->h.n = p->h.n - half;
+  memcpy(q->kids, &p->kids[half], sizeof(ltnode*) * q->h.n);
+  p->h.n = half;
+  for (int k = 0; k < q->h.n; k++) { q->kids[k]->parent = &q->h; q->h.count += q->kids[k]->count; }
+  p->h.count -= q->h.count;
+  ltInsertAfter(&p->h, &q->h);
+}
+
+static ltleaf *ltNewLeaf(int kind) {
+  ltleaf *lf = (ltleaf*)calloc(1, sizeof(ltleaf));
+  if (!lf) die("calloc");
+  lf->h.leaf = kind;
+  return lf;
+}
+
+// Вставляет лист right в список листьев сразу после left.
+static void ltLinkAfter(ltleaf *left, ltleaf *right) {
+  right->prev = left; right->next = left->next;
+  if (left->next) left->next->prev = right;
+  left->next = right;
+}
+
+static ltleaf *ltSplitLeaf(ltleaf *lf) {
+  ltMakeRoom(&lf->h);
+  ltleaf *nl = ltNewLeaf(LT_ROWS);
+  int half = lf->h.n / 2;
+  nl->h.n = nl->h.count = lf->h.n - half;
+  memcpy(nl->rows, &lf->rows[half], sizeof(erow) * nl->h.n);
+  for (int j = 0; j < nl->h.n; j++) nl->rows[j].leaf = nl;
+  lf->h.n = lf->h.count = half;
+  ltLinkAfter(lf, nl);
+  ltInsertAfter(&lf->h, &nl->h);
+  return nl;
+}
+
+// Убирает пустой узел из дерева; опустевших родителей — тоже.
+static void ltDetach(ltnode *n) {
+  ltinner *p = (ltinner*)n->parent;
+  if (n->leaf) {
+    ltleaf *lf = (ltleaf*)n;
+    if (lf->prev) lf->prev->next = lf->next;
+    if (lf->next) lf->next->prev = lf->prev;
+  }
+  free(n);
+  if (!p) { E.root = NULL; return; }
+  int k = 0;
+  while (p->kids[k] != n) k++;
+  memmove(&p->kids[k], &p->kids[k + 1], sizeof(ltnode*) * (p->h.n - k - 1));
+  p->h.n--;
+  if (p->h.n == 0) { ltDetach(&p->h); return; }
+  while (!E.root->leaf && E.root->n == 1) {
+    ltinner *root = (ltinner*)E.root;
+    E.root = root->kids[0];
+    E.root->parent = NULL;
+    free(root);
+  }
+}
+
+// Разворачивает около LT_LEAF_MAX/2 строк диапазона вокруг pos в обычный лист.
+static void ltMaterialize(ltleaf *sp, int pos) {
+  int lo = pos - LT_LEAF_MAX / 4; if (lo < 0) lo = 0;
+  int hi = lo + LT_LEAF_MAX / 2; if (hi > sp->h.n) hi = sp->h.n;
+  if (hi < sp->h.n) {
+    ltMakeRoom(&sp->h);
+    ltleaf *right = ltNewLeaf(LT_SPAN);
+    right->first = sp->first + hi;
+    right->h.n = right->h.count = sp->h.n - hi;
+    sp->h.n = sp->h.count = hi;
+    ltLinkAfter(sp, right);
+    ltInsertAfter(&sp->h, &right->h);
+  }
+  ltMakeRoom(&sp->h);
+  ltleaf *mid = ltNewLeaf(LT_ROWS);
+  mid->h.n = mid->h.count = hi - lo;
+  for (int j = 0; j < hi - lo; j++) {
+    erow *row = &mid->rows[j];
+    unsigned char ls = E.linestate[sp->first + lo + j];
+    editorMapLine(row, sp->first + lo + j);
+    row->leaf = mid;
+    row->hl_entry = LS_ENTRY(ls);
+    row->hl_exit = LS_EXIT(ls);
+    row->hl_known = (ls & LS_KNOWN) != 0;
+    row->nspecial = (int)textSpecial(row->chars, row->size);
+  }
+  sp->h.n = sp->h.count = lo;
+  ltLinkAfter(sp, mid);
+  ltInsertAfter(&sp->h, &mid->h);
+  if (lo == 0) ltDetach(&sp->h);
+}
+
+// Как ltFind, но строка at гарантированно лежит в обычном листе.
+static ltleaf *ltFindRows(int *at) {
+  int pos = *at;
+  ltleaf *lf = ltFind(&pos);
+  if (lf->h.leaf == LT_SPAN) {
+    ltMaterialize(lf, pos);
+    pos = *at;
+    lf = ltFind(&pos);
+  }
+  *at = pos;
+  return lf;
+}
+
+// Вставляет пустую строку под номером at и возвращает её.
+static erow *ltInsert(int at) {
+  if (!E.root) E.root = &ltNewLeaf(LT_ROWS)->h;
+  int pos = at;
+  ltleaf *lf = ltFindRows(&pos);
+  if (lf->h.n == LT_LEAF_MAX) {
+    ltleaf *nl = ltSplitLeaf(lf);
+    if (pos > lf->h.n) { pos -= lf->h.n; lf = nl; }
+  }
+  memmove(&lf->rows[pos + 1], &lf->rows[pos], sizeof(erow) * (lf->h.n - pos));
+  lf->h.n++;
+  for (ltnode *n = &lf->h; n; n = n->parent) n->count++;
+  E.numrows++;
+  erow *row = &lf->rows[pos];
+  memset(row, 0, sizeof(*row));
+  row->leaf = lf;
+  return row;
+}
+
+// Удаляет строку at из дерева (её буферы освобождает вызывающий).
+static void ltRemove(int at) {
+  int pos = at;
+  ltleaf *lf = ltFindRows(&pos);
+  memmove(&lf->rows[pos], &lf->rows[pos + 1], sizeof(erow) * (lf->h.n - pos - 1));
+  lf->h.n--;
+  for (ltnode *n = &lf->h; n; n = n->parent) n->count--;
+  E.numrows--;
+  if (lf->h.n == 0) { ltDetach(&lf->h); return; }
+  if (lf->h.n >= LT_LEAF_MAX / 4) return;
+  // неполный лист сливаем с соседом под тем же родителем
+  ltleaf *dst = lf, *src = lf->next;
+  if (!src || src->h.leaf != LT_ROWS || src->h.parent != lf->h.parent || lf->h.n + src->h.n > LT_LEAF_MAX) {
+    dst = lf->prev; src = lf;
+    if (!dst || dst->h.leaf != LT_ROWS || dst->h.parent != lf->h.parent || lf->h.n + dst->h.n > LT_LEAF_MAX) return;
+  }
+  memcpy(&dst->rows[dst->h.n], src->rows, sizeof(erow) * src->h.n);
+  for (int j = dst->h.n; j < dst->h.n + src->h.n; j++) dst->rows[j].leaf = dst;
+  dst->h.n += src->h.n; dst->h.count += src->h.n;
+  src->h.n = src->h.count = 0;
+  ltDetach(&src->h);
+}
+
+static void ltFree(ltnode *n) {
+  if (n->leaf == LT_ROWS) {
+    ltleaf *lf = (ltleaf*)n;
+    for (int j = 0; j < lf->h.n; j++) editorFreeRow(&lf->rows[j]);
+  } else if (n->leaf == LT_INNER) {
+    ltinner *in = (ltinner*)n;
+    for (int k = 0; k < n->n; k++) ltFree(in->kids[k]);
+  }
+  free(n);
+}
+
+static void editorFreeRows(void) {
+  if (E.root) ltFree(E.root);
+  E.root = NULL;
+  E.numrows = 0;
+  E.hl_upto = 0;
+  editorDamage(0, INT_MAX);
+}
+
+static erow *ltIterRow(rowIter *it) {
+  if (it->leaf->h.leaf == LT_ROWS) return &it->leaf->rows[it->i];
+  editorMapLine(&it->view, it->leaf->first + it->i);
+  return &it->view;
+}
+
+static erow *editorRowIterAt(rowIter *it, int at) {
+  if (at < 0 || at >= E.numrows) { it->leaf = NULL; return NULL; }
+  it->i = it->at = at;
+  it->leaf = ltFind(&it->i);
+  return ltIterRow(it);
+}
+
+static erow *editorRowIterNext(rowIter *it) {
+  if (!it->leaf) return NULL;
+  it->at++;
+  if (++it->i >= it->leaf->h.n) {
+    it->leaf = it->leaf->next; it->i = 0;
+    if (!it->leaf) return NULL;
+  }
+  return ltIterRow(it);
+}
+
+static erow *editorRowIterPrev(rowIter *it) {
+  if (!it->leaf) return NULL;
+  it->at--;
+  if (--it->i < 0) {
+    it->leaf = it->leaf->prev;
+    if (!it->leaf) return NULL;
+    it->i = it->leaf->h.n - 1;
+  }
+  return ltIterRow(it);
+}
+
+static erow *editorRowAt(int at) {
+  if (at < 0 || at >= E.numrows) return NULL;
+  ltleaf *lf = ltFindRows(&at);
+  return &lf->rows[at];
+}
+
+// Превращает текущее окно итератора в настоящую строку дерева.
+static erow *editorRowIterMaterialize(rowIter *it) {
+  editorRowAt(it->at);
+  return editorRowIterAt(it, it->at);
+}
+
+// Номер строки дерева: позиция в листе плюс строки левых соседей по пути к корню.
+static int editorRowIndex(const erow *row) {
+  ltnode *n = &row->leaf->h;
+  int at = (int)(row - row->leaf->rows);
+  for (ltnode *p = n->parent; p; n = p, p = p->parent) {
+    ltinner *in = (ltinner*)p;
+    for (int k = 0; in->kids[k] != n; k++) at += in->kids[k]->count;
+  }
+  return at;
+}
+
+static ltleaf *ltFirstLeaf(void) {
+  ltnode *n = E.root;
+  while (n && !n->leaf) n = ((ltinner*)n)->kids[0];
+  return (ltleaf*)n;
+}
+
+/* ========================= Синтакс-подсветка ======================== */
+
+// Разделители: пробельные, '\0' и ",.()+-/*=~%<>[];{}" — таблицей, лексер
+// спрашивает про каждый символ.
+static const bool hl_separators[256] = {
+  [0] = 1, [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1, ['\r'] = 1,
+  [','] = 1, ['.'] = 1, ['('] = 1, [')'] = 1, ['+'] = 1, ['-'] = 1, ['/'] = 1, ['*'] = 1,
+  ['='] = 1, ['~'] = 1, ['%'] = 1, ['<'] = 1, ['>'] = 1, ['['] = 1, [']'] = 1, [';'] = 1,
+  ['{'] = 1, ['}'] = 1
+};
+
+static inline bool is_separator(int c) {
+  return hl_separators[(unsigned char)c];
+}
+
+static char *C_HL_extensions[] = { ".c", ".h", ".cpp", NULL };
+static char *C_HL_keywords[] = {
+  // управляющие
+  "switch", "if", "while", "for", "break", "continue", "return", "else",
+  "struct", "union", "typedef", "static", "enum", "class", "case", "default",
+  // типы (KEYWORD2)
+  "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+  "void|", "short|", "size_t|", "ssize_t|", "const|", "volatile|", NULL
+};
+
+static struct editorSyntax HLDB[] = {
+  {
+    .filetype = "c",
+    .filematch = C_HL_extensions,
+    .keywords = C_HL_keywords,
+    .singleline_comment_start = "//",
+    .multiline_comment_start = "/*",
+    .multiline_comment_end = "*/",
+    .flags = HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+  },
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
+static int editorSyntaxToColor(int hl) {
+  switch (hl) {
+    case HL_COMMENT:
+    case HL_MLCOMMENT: return 36; // cyan
+    case HL_KEYWORD1: return 33;  // yellow
+    case HL_KEYWORD2: return 32;  // green
+    case HL_STRING: return 35;    // magenta
+    case HL_NUMBER: return 31;    // red
+    case HL_MATCH: return 34;     // blue
+    default: return 39;           // default
+  }
+}
+
+static inline unsigned kwHash(const char *w, int len, unsigned seed) {
+  unsigned h = seed;
+  for (int j = 0; j < len; j++) h = (h ^ (unsigned char)w[j]) * 16777619u; // FNV-1a
+  return h ^ (h >> 15) ^ (unsigned)len;
+}
+
+// Подбирает seed, при котором все ключевые слова попадают в разные ячейки
+// таблицы размера 2^k (не меньше удвоенного числа слов): поиск слова —
+// одно хеширование и одно сравнение. Слова не должны содержать разделителей.
+static void editorSyntaxBuildKeywords(struct editorSyntax *s) {
+  if (s->kwtab) return;
+  int n = 0;
+  s->kwmaxlen = 0;
+  for (; s->keywords[n]; n++) {
+    int len = (int)strlen(s->keywords[n]);
+    if (s->keywords[n][len - 1] == '|') len--;
+    if (len > KW_MAXLEN) die("keyword too long");
+    if (len > s->kwmaxlen) s->kwmaxlen = len;
+  }
+  unsigned size = 4;
+  while (size < 2u * (unsigned)n) size *= 2;
+  for (;; size *= 2) {
+    kwslot *tab = (kwslot*)calloc(size, sizeof(kwslot));
+    if (!tab) die("calloc");
+    for (unsigned seed = 2166136261u; seed < 2166136261u + 4096; seed++) {
+      int k = 0;
+      for (; k < n; k++) {
+        const char *w = s->keywords[k];
+        int len = (int)strlen(w), kw2 = (w[len - 1] == '|');
+        if (kw2) len--;
+        kwslot *slot = &tab[kwHash(w, len, seed) & (size - 1)];
+        if (slot->word) break;
+        slot->word = w; slot->len = (unsigned char)len;
+        slot->color = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+      }
+      if (k == n) { s->kwtab = tab; s->kwmask = size - 1; s->kwseed = seed; return; }
+      memset(tab, 0, size * sizeof(kwslot));
+    }
+    free(tab);
+  }
+}
+
+// Цвет ключевого слова w[0..n), либо HL_NORMAL: одно хеширование и одно
+// сравнение.
+static int editorKeywordColor(const struct editorSyntax *s, const char *w, int n) {
+  const kwslot *slot = &s->kwtab[kwHash(w, n, s->kwseed) & s->kwmask];
+  if (slot->len != n || memcmp(slot->word, w, n) != 0) return HL_NORMAL;
+  return slot->color;
+}
+
+// Вся подсветка устарела: строки перелексируются при показе.
+static void editorSyntaxInvalidateAll(void) {
+  for (ltleaf *lf = ltFirstLeaf(); lf; lf = lf->next)
+    if (lf->h.leaf == LT_ROWS) for (int j = 0; j < lf->h.n; j++) {
+      erow *row = &lf->rows[j];
+      row->hl_ok = row->hl_known = false;
+      if (row->x) row->x->npt = 0; // точки длинных строк — заново
+    }
+  if (E.linestate) memset(E.linestate, 0, E.nlines);
+  E.hl_upto = 0;
+  editorDamage(0, INT_MAX);
+}
+
+/* Лексер — детерминированный автомат, собранный из правил языка: на байт
+   — класс символа и переход по таблице, который даёт и цвет, и следующее
+   состояние; один цикл на строку без разбора случаев. Состояние — режим
+   (код после разделителя, слово, число, комментарий, строка,
+   многострочное правило с совпавшим началом закрывающего) и байты,
+   которые ещё могут оказаться началом разделителя правила (байт "/" в
+   C). Когда неясное разрешается или кончается слово, переход несёт
+   действие: перекрасить байты перед текущим или сверить слово с
+   ключевыми. Таблицы строятся перебором: состояние — конфигурация
+   эталонного лексера (lxcFeed), переход считается им на представителе
+   каждого класса символов.
+
+   Переход, после которого байты до текущего окончательны, а дальше всё
+   как из чистого состояния, пишет в hl HL_STEP и номер этого состояния:
+   отсюда строку можно перелексировать. Сборка проверяет, что таких мест
+   не реже чем через LX_OVERRUN байтов. */
+
+#define LX_MAXSTATES 256
+#define LX_RESUME 16               // чистых состояний (номер — 4 бита в hl)
+#define LX_OVERRUN (KW_MAXLEN + 8) // байтов подряд без HL_STEP меньше этого
+
+enum { LXW_START = 1, LXW_END = 2 }; // слово: началось, кончилось (сверить с ключевыми)
+
+// Действие перехода: слово и перекраска back байтов перед текущим.
+typedef struct lxact {
+  unsigned char word, back;
+  unsigned char color[HR_MAXLEN];
+} lxact;
+
+// Таблицы лексера. Переход tab[состояние + класс]: смещение следующего
+// состояния в tab (биты 0..15), байт hl текущей позиции (16..23), номер
+// действия (24..31, 0 — нет). В столбце eol — конец строки: вместо
+// состояния номер многострочного правила, в котором строка кончилась.
+typedef struct lxdfa {
+  unsigned *tab;
+  unsigned char cls[256];
+  int ncls, ncol, eol;
+  lxact *act;
+  int nact, nstates;
+  unsigned short resume[LX_RESUME];      // номер из hl -> смещение состояния
+  unsigned char entry[HL_MAXBLOCKS + 1]; // правило на входе в строку -> байт hl
+} lxdfa;
+
+// Режимы эталонного лексера: код после разделителя, после прочего байта,
+// в числе, в комментарии до конца строки; в слове из k байтов (k не
+// больше kwmaxlen — ещё может оказаться ключевым) — LQ_WORD + k - 1;
+// внутри правила r — LQ_RULE(r, m): совпало m байтов закрывающего, или
+// m == LQ_ESC — после экранирующего символа.
+enum { LQ_SEP, LQ_NOSEP, LQ_NUM, LQ_COMMENT, LQ_WORD };
+#define LQ_RULE(r, m) (LQ_WORD + KW_MAXLEN + (r) * 8 + (m))
+#define LQ_ESC 4
+
+// Конфигурация: режим и байты, которые ещё могут начать разделитель, с
+// цветом, в который они пока покрашены.
+typedef struct lxconf {
+  unsigned char q, n;
+  unsigned char p[HR_MAXLEN], pc[HR_MAXLEN];
+} lxconf;
+
+typedef struct lxcomp {
+  const struct editorSyntax *s;
+  bool numbers;
+  bool start[256];     // байт начинает разделитель правила (и кончает слово)
+} lxcomp;
+
+static inline bool lqWord(int q) { return q >= LQ_WORD && q < LQ_RULE(0, 0); }
+static inline bool lqWordByte(const lxcomp *cc, unsigned char c) { return !is_separator(c) && !cc->start[c]; }
+
+static int lxcColor(const hlrule *r) {
+  return r->kind == HR_COMMENT ? HL_COMMENT : r->kind == HR_BLOCK ? HL_MLCOMMENT : HL_STRING;
+}
+
+// Номер многострочного правила r (1..HL_MAXBLOCKS), 0 — однострочное.
+static int lxcBlock(const struct editorSyntax *s, int r) {
+  if (s->rule[r].kind != HR_BLOCK && s->rule[r].kind != HR_MSTRING) return 0;
+  int b = 1;
+  for (int k = 0; k < r; k++) b += s->rule[k].kind == HR_BLOCK || s->rule[k].kind == HR_MSTRING;
+  return b;
+}
+
+// Чистая конфигурация: ни ожидающих байтов, ни слова — с неё можно начать.
+static bool lxcClean(const lxconf *f) {
+  if (f->n) return false;
+  if (f->q >= LQ_RULE(0, 0)) return (f->q - LQ_RULE(0, 0)) % 8 != LQ_ESC;
+  return !lqWord(f->q);
+}
+
+// Байт c в режиме q, когда разделители правил уже разобраны.
+static int lxcPlain(const lxcomp *cc, int q, unsigned char c, unsigned char *color, int *word) {
+  if (q >= LQ_RULE(0, 0)) {
+    int r = (q - LQ_RULE(0, 0)) / 8, m = (q - LQ_RULE(0, 0)) % 8;
+    const hlrule *rl = &cc->s->rule[r];
+    int len = (int)strlen(rl->close);
+    char seen[HR_MAXLEN + 1];
+    *color = (unsigned char)lxcColor(rl);
+    if (m == LQ_ESC) return LQ_RULE(r, 0);
+    if (rl->esc && c == (unsigned char)rl->esc) return LQ_RULE(r, LQ_ESC);
+    // совпавшее начало закрывающего вместе с c — самое длинное, что кончается на c
+    memcpy(seen, rl->close, m);
+    seen[m] = (char)c;
+    for (int k = m + 1; k > 0; k--)
+      if (memcmp(seen + m + 1 - k, rl->close, k) == 0) return k == len ? LQ_SEP : LQ_RULE(r, k);
+    return LQ_RULE(r, 0);
+  }
+  if (q == LQ_COMMENT) { *color = HL_COMMENT; return q; }
+  *color = HL_NORMAL;
+  bool wb = lqWordByte(cc, c);
+  if (lqWord(q) && wb) return q + 1 < LQ_WORD + cc->s->kwmaxlen ? q + 1 : LQ_NOSEP;
+  if (cc->numbers && (q == LQ_SEP || q == LQ_NUM) && (isdigit(c) || (c == '.' && q == LQ_NUM))) {
+    *color = HL_NUMBER;
+    return LQ_NUM;
+  }
+  if (!wb) return is_separator(c) ? LQ_SEP : LQ_NOSEP;
+  if (q == LQ_SEP && cc->s->kwmaxlen) { *word |= LXW_START; return LQ_WORD; }
+  return LQ_NOSEP;
+}
+
+static lxconf lxcFeed(const lxcomp *cc, lxconf f, unsigned char c, unsigned char *color, int *word);
+
+// Байты s[0..n) в режиме q, когда длиннее разделителя из них уже не
+// сложится: самый длинный разделитель в начале открывает правило, иначе
+// первый байт обычный; остальные подаются заново.
+static lxconf lxcResolve(const lxcomp *cc, int q, const unsigned char *s, int n, unsigned char *color, int *word) {
+  const struct editorSyntax *sx = cc->s;
+  lxconf f;
+  int best = -1, bl = 0, j;
+  for (int r = 0; r < sx->nrules; r++) {
+    int l = (int)strlen(sx->rule[r].open);
+    if (l <= n && l > bl && memcmp(sx->rule[r].open, s, l) == 0) { best = r; bl = l; }
+  }
+  memset(&f, 0, sizeof(f));
+  if (best >= 0) {
+    for (j = 0; j < bl; j++) color[j] = (unsigned char)lxcColor(&sx->rule[best]);
+    f.q = sx->rule[best].kind == HR_COMMENT ? LQ_COMMENT : LQ_RULE(best, 0);
+  } else {
+    f.q = (unsigned char)lxcPlain(cc, q, s[0], color, word);
+    j = 1;
+  }
+  for (; j < n; j++) f = lxcFeed(cc, f, s[j], color + j - f.n, word);
+  return f;
+}
+
+// Разбирает ожидающие байты так, будто дальше ничего нет.
+static lxconf lxcFlush(const lxcomp *cc, lxconf f, unsigned char *color, int *word) {
+  while (f.n) {
+    unsigned char s[HR_MAXLEN];
+    int n = f.n;
+    memcpy(s, f.p, n);
+    f = lxcResolve(cc, f.q, s, n, color, word);
+    color += n - f.n;
+  }
+  return f;
+}
+
+// Шаг эталонного лексера: байт c в конфигурации f. В color[0..f.n] —
+// цвет ожидавших байтов и c, каким он известен теперь.
+static lxconf lxcFeed(const lxcomp *cc, lxconf f, unsigned char c, unsigned char *color, int *word) {
+  if (lqWord(f.q) && !lqWordByte(cc, c)) { *word |= LXW_END; f.q = LQ_NOSEP; }
+  if (f.q >= LQ_COMMENT) { f.q = (unsigned char)lxcPlain(cc, f.q, c, color, word); return f; }
+  unsigned char s[HR_MAXLEN];
+  int n = f.n + 1;
+  memcpy(s, f.p, f.n);
+  s[f.n] = c;
+  for (int r = 0; r < cc->s->nrules; r++) {
+    const char *o = cc->s->rule[r].open;
+    if ((int)strlen(o) > n && memcmp(o, s, n) == 0) { // может оказаться разделителем: ждём
+      lxconf g;
+      int none = 0;
+      memset(&g, 0, sizeof(g));
+      g.q = f.q; g.n = (unsigned char)n;
+      memcpy(g.p, s, n);
+      lxcFlush(cc, g, color, &none); // пока красим так, будто разделителя не будет
+      memcpy(g.pc, color, n);
+      return g;
+    }
+  }
+  return lxcResolve(cc, f.q, s, n, color, word);
+}
+
+static int lxcFind(lxconf *conf, int *n, const lxconf *f) {
+  for (int k = 0; k < *n; k++) if (memcmp(&conf[k], f, sizeof(*f)) == 0) return k;
+  if (*n == LX_MAXSTATES) return -1;
+  conf[*n] = *f;
+  return (*n)++;
+}
+
+static int lxcAction(lxdfa *d, const lxact *a) {
+  if (!a->word && !a->back) return 0;
+  for (int k = 1; k < d->nact; k++) if (memcmp(&d->act[k], a, sizeof(*a)) == 0) return k;
+  if (d->nact == 256) return -1;
+  d->act[d->nact] = *a;
+  return d->nact++;
+}
+
+// Переход из f по байту c, если сделать его действие над байтами до c, —
+// то же, что переход из чистой e: с этого места можно начать в e.
+static bool lxcSame(const lxcomp *cc, const lxconf *f, const lxconf *e, unsigned char c) {
+  unsigned char cf[HR_MAXLEN + 1], ce[HR_MAXLEN + 1];
+  int wf = 0, we = 0;
+  lxconf gf = lxcFeed(cc, *f, c, cf, &wf), ge = lxcFeed(cc, *e, c, ce, &we);
+  return memcmp(&gf, &ge, sizeof(gf)) == 0 && cf[f->n] == ce[0] && (wf & LXW_START) == we;
+}
+
+// Самая длинная цепочка переходов без HL_STEP из состояния k (-1 — цикл).
+static int lxcRun(const lxdfa *d, int k, signed char *mark, int *run) {
+  if (mark[k] == 2) return run[k];
+  if (mark[k] == 1) return -1;
+  mark[k] = 1;
+  int best = 0;
+  for (int c = 0; c < d->ncls; c++) {
+    unsigned e = d->tab[k * d->ncol + c];
+    if ((e >> 16) & HL_STEP) continue;
+    int r = lxcRun(d, (int)(e & 0xffff) / d->ncol, mark, run);
+    if (r < 0) return -1;
+    if (r + 1 > best) best = r + 1;
+  }
+  mark[k] = 2;
+  return run[k] = best;
+}
+
+// Строит таблицы лексера по правилам и ключевым словам s (s->dfa).
+// Возвращает текст ошибки или NULL.
+static const char *lxCompile(struct editorSyntax *s) {
+  lxcomp cc;
+  memset(&cc, 0, sizeof(cc));
+  cc.s = s;
+  cc.numbers = (s->flags & HL_HIGHLIGHT_NUMBERS) != 0;
+  for (int r = 0; r < s->nrules; r++) cc.start[(unsigned char)s->rule[r].open[0]] = true;
+
+  lxdfa *d = (lxdfa*)calloc(1, sizeof(lxdfa));
+  lxconf *conf = (lxconf*)malloc(sizeof(lxconf) * LX_MAXSTATES);
+  unsigned char rep[256], id[LX_MAXSTATES];
+  int key2cls[260], n = 0, nres = 0, nb = 0;
+  if (!d || !conf) die("malloc");
+  // классы: байт из разделителей правил или '.' — сам себе класс, прочие
+  // делятся на разделители, цифры и байты слов
+  memset(key2cls, -1, sizeof(key2cls));
+  for (int c = 0; c < 256; c++) {
+    bool special = c == '.';
+    for (int r = 0; r < s->nrules && c; r++)
+      special |= strchr(s->rule[r].open, c) || strchr(s->rule[r].close, c) || (unsigned char)s->rule[r].esc == c;
+    int key = special ? c : 256 + is_separator(c) + 2 * (isdigit(c) != 0);
+    if (key2cls[key] < 0) { key2cls[key] = d->ncls; rep[d->ncls++] = (unsigned char)c; }
+    d->cls[c] = (unsigned char)key2cls[key];
+  }
+  d->eol = d->ncls;
+  d->ncol = d->ncls + 1;
+  d->tab = (unsigned*)malloc(sizeof(unsigned) * LX_MAXSTATES * d->ncol);
+  d->act = (lxact*)calloc(256, sizeof(lxact));
+  if (!d->tab || !d->act) die("malloc");
+  d->nact = 1;
+
+  // входные состояния: код и начало каждого многострочного правила
+  lxconf f;
+  memset(&f, 0, sizeof(f));
+  f.q = LQ_SEP;
+  lxcFind(conf, &n, &f);
+  for (int r = 0; r < s->nrules; r++)
+    if (lxcBlock(s, r)) { f.q = (unsigned char)LQ_RULE(r, 0); lxcFind(conf, &n, &f); nb++; }
+
+  const char *err = NULL;
+  for (int k = 0; k < n && !err; k++) { // n растёт по ходу обхода
+    id[k] = 0xff;
+    if (lxcClean(&conf[k])) {
+      if (nres == LX_RESUME) { err = "too many lexer states"; break; }
+      d->resume[nres] = (unsigned short)(k * d->ncol);
+      id[k] = (unsigned char)nres++;
+    }
+    for (int c = 0; c <= d->ncls; c++) {
+      unsigned char color[HR_MAXLEN + 1];
+      int word = 0, next;
+      lxact a;
+      memset(&a, 0, sizeof(a));
+      memset(color, 0, sizeof(color));
+      if (c < d->ncls) {
+        lxconf g = lxcFeed(&cc, conf[k], rep[c], color, &word);
+        next = lxcFind(conf, &n, &g) * d->ncol;
+        if (next < 0 || next + d->ncol > 0xffff) { err = "too many lexer states"; break; }
+      } else {
+        lxconf g = lxcFlush(&cc, conf[k], color, &word);
+        if (lqWord(g.q)) word |= LXW_END;
+        next = g.q >= LQ_RULE(0, 0) ? lxcBlock(s, (g.q - LQ_RULE(0, 0)) / 8) : 0;
+      }
+      if (memcmp(color, conf[k].pc, conf[k].n) != 0) {
+        a.back = conf[k].n;
+        memcpy(a.color, color, conf[k].n);
+      }
+      a.word = (unsigned char)word;
+      int ai = lxcAction(d, &a);
+      if (ai < 0) { err = "too many lexer actions"; break; }
+      d->tab[k * d->ncol + c] = (unsigned)next | (unsigned)(c < d->ncls ? color[conf[k].n] : 0) << 16 | (unsigned)ai << 24;
+    }
+  }
+  d->nstates = n;
+  // HL_STEP: переходы из чистых состояний и те, после которых всё как из
+  // чистого (слово кончилось, ожидавшие байты разобрались)
+  for (int k = 0; k < n && !err; k++)
+    for (int c = 0; c < d->ncls; c++) {
+      int e = id[k] != 0xff ? k : -1;
+      for (int j = 0; e < 0 && j < n; j++)
+        if (id[j] != 0xff && lxcSame(&cc, &conf[k], &conf[j], rep[c])) e = j;
+      if (e >= 0) d->tab[k * d->ncol + c] |= (unsigned)(HL_STEP | id[e] << HL_ST_SHIFT) << 16;
+    }
+  if (!err) {
+    signed char mark[LX_MAXSTATES] = {0};
+    int run[LX_MAXSTATES];
+    for (int k = 0; k < n && !err; k++) {
+      int r = lxcRun(d, k, mark, run);
+      if (r < 0 || r >= LX_OVERRUN) err = "lexer has no restart points";
+    }
+  }
+  free(conf);
+  if (err) { free(d->tab); free(d->act); free(d); return err; }
+  d->tab = (unsigned*)realloc(d->tab, sizeof(unsigned) * n * d->ncol);
+  if (!d->tab) die("realloc");
+  for (int b = 0; b <= nb; b++) d->entry[b] = (unsigned char)(HL_STEP | id[b] << HL_ST_SHIFT);
+  s->dfa = d;
+  return NULL;
+}
+
+static void lxFree(lxdfa *d) {
+  if (!d) return;
+  free(d->tab);
+  free(d->act);
+  free(d);
+}
+
+// Определения языков читаются при запуске из файлов *.syn каталога
+// syntax рядом с программой (или из каталога в KILO_SYNTAX) и
+// проверяются раньше встроенных. Строка файла — директива и слова через
+// пробелы, '#' в начале строки — комментарий:
+//   name python             тип файла в строке состояния
+//   files .py SConstruct    расширения (с точкой) или части имени файла
+//   comment #               комментарий до конца строки
+//   block /* */             многострочный комментарий
+//   string " \              строка до кавычки или до конца строки; \ — экранирование
+//   mstring """ \           многострочная строка до того же разделителя
+//   numbers                 подсвечивать числа
+//   keywords if else ...    ключевые слова
+//   types int str ...       типы (второй цвет)
+// Разделители правил — знаки препинания, не длиннее HR_MAXLEN.
+
+static struct editorSyntax *hl_defs;
+static int hl_ndefs;
+
+// Дописывает оставшиеся слова строки (strtok) в список с NULL в конце.
+static char **synWords(char **list, const char *suffix) {
+  int n = 0;
+  while (list[n]) n++;
+  for (char *w; (w = strtok(NULL, " \t\r\n")) != NULL; n++) {
+    list = (char**)realloc(list, sizeof(char*) * (n + 2));
+    if (!list) die("realloc");
+    list[n] = (char*)malloc(strlen(w) + strlen(suffix) + 1);
+    if (!list[n]) die("malloc");
+    strcpy(list[n], w);
+    strcat(list[n], suffix);
+    list[n + 1] = NULL;
+  }
+  return list;
+}
+
+static void synFreeWords(char **list) {
+  if (!list) return;
+  for (int j = 0; list[j]; j++) free(list[j]);
+  free(list);
+}
+
+static void editorSyntaxFree(struct editorSyntax *s) {
+  free(s->filetype);
+  synFreeWords(s->filematch);
+  synFreeWords(s->keywords);
+  free(s->kwtab);
+  lxFree(s->dfa);
+  memset(s, 0, sizeof(*s));
+}
+
+// Читает определение из f в s; *line — номер последней прочитанной строки.
+static const char *editorSyntaxParse(FILE *f, struct editorSyntax *s, int *line) {
+  char buf[1024];
+  memset(s, 0, sizeof(*s));
+  s->filematch = (char**)calloc(1, sizeof(char*));
+  s->keywords = (char**)calloc(1, sizeof(char*));
+  if (!s->filematch || !s->keywords) die("calloc");
+  while (fgets(buf, sizeof(buf), f)) {
+    (*line)++;
+    char *dir = strtok(buf, " \t\r\n");
+    if (!dir || dir[0] == '#') continue;
+    if (strcmp(dir, "name") == 0) {
+      char *w = strtok(NULL, " \t\r\n");
+      if (!w) return "name expected";
+      free(s->filetype);
+      s->filetype = _strdup(w);
+    } else if (strcmp(dir, "files") == 0) {
+      s->filematch = synWords(s->filematch, "");
+    } else if (strcmp(dir, "keywords") == 0) {
+      s->keywords = synWords(s->keywords, "");
+    } else if (strcmp(dir, "types") == 0) {
+      s->keywords = synWords(s->keywords, "|");
+    } else if (strcmp(dir, "numbers") == 0) {
+      s->flags |= HL_HIGHLIGHT_NUMBERS;
+    } else {
+      int kind = strcmp(dir, "comment") == 0 ? HR_COMMENT : strcmp(dir, "block") == 0 ? HR_BLOCK :
+                 strcmp(dir, "string") == 0 ? HR_STRING : strcmp(dir, "mstring") == 0 ? HR_MSTRING : -1;
+      if (kind < 0) return "unknown directive";
+      if (s->nrules == HL_MAXRULES) return "too many rules";
+      char *a = strtok(NULL, " \t\r\n"), *b = strtok(NULL, " \t\r\n");
+      hlrule *r = &s->rule[s->nrules++];
+      if (!a || strlen(a) > HR_MAXLEN) return "bad delimiter";
+      r->kind = (unsigned char)kind;
+      strcpy(r->open, a);
+      if (kind == HR_BLOCK) {
+        if (!b || strlen(b) > HR_MAXLEN) return "bad closing delimiter";
+        strcpy(r->close, b);
+      } else if (kind != HR_COMMENT) {
+        if (b && strlen(b) != 1) return "bad escape character";
+        strcpy(r->close, a);
+        r->esc = b ? b[0] : 0;
+      }
+    }
+  }
+  if (!s->filetype) return "name expected";
+  return NULL;
+}
+
+// Правила встроенного определения — из полей kilo: комментарии и строки
+// "…" и '…' с экранированием '\'.
+static void editorSyntaxLegacyRules(struct editorSyntax *s) {
+  hlrule *r;
+  if (s->singleline_comment_start) {
+    r = &s->rule[s->nrules++];
+    r->kind = HR_COMMENT;
+    snprintf(r->open, sizeof(r->open), "%s", s->singleline_comment_start);
+  }
+  if (s->multiline_comment_start && s->multiline_comment_end) {
+    r = &s->rule[s->nrules++];
+    r->kind = HR_BLOCK;
+    snprintf(r->open, sizeof(r->open), "%s", s->multiline_comment_start);
+    snprintf(r->close, sizeof(r->close), "%s", s->multiline_comment_end);
+  }
+  if (s->flags & HL_HIGHLIGHT_STRINGS)
+    for (const char *q = "\"'"; *q; q++) {
+      r = &s->rule[s->nrules++];
+      r->kind = HR_STRING;
+      r->open[0] = r->close[0] = *q;
+      r->esc = '\\';
+    }
+}
+
+static bool synStarts(const struct editorSyntax *s, char c) {
+  for (int r = 0; r < s->nrules; r++) if (s->rule[r].open[0] == c) return true;
+  return false;
+}
+
+// Годятся ли правила и ключевые слова для таблиц: байты разделителей — не
+// из слов и чисел, следом за первым — разделители или начала других
+// правил (тогда недоразобранное начало разбирается без слов); ключевые
+// слова — без разделителей.
+static const char *editorSyntaxCheck(const struct editorSyntax *s) {
+  int blocks = 0;
+  for (int r = 0; r < s->nrules; r++) {
+    const hlrule *rl = &s->rule[r];
+    if (!rl->open[0] || (rl->kind != HR_COMMENT && !rl->close[0])) return "empty delimiter";
+    for (const char *p = rl->open; *p; p++) {
+      unsigned char c = (unsigned char)*p;
+      if (isalnum(c) || c == '_' || c == '.' || c >= 0x80) return "delimiter must be punctuation";
+      if (p > rl->open && !is_separator(c) && !synStarts(s, (char)c)) return "delimiter must be punctuation";
+    }
+    for (int k = 0; k < r; k++) if (strcmp(s->rule[k].open, rl->open) == 0) return "duplicate delimiter";
+    blocks += rl->kind == HR_BLOCK || rl->kind == HR_MSTRING;
+  }
+  if (blocks > HL_MAXBLOCKS) return "too many multi-line rules";
+  for (int k = 0; s->keywords[k]; k++) {
+    const char *w = s->keywords[k];
+    int len = (int)strlen(w);
+    if (len && w[len - 1] == '|') len--;
+    if (len == 0 || len > KW_MAXLEN) return "bad keyword length";
+    for (int j = 0; j < len; j++) if (is_separator(w[j]) || synStarts(s, w[j])) return "keyword contains a delimiter";
+    for (int j = 0; j < k; j++) {
+      int l = (int)strlen(s->keywords[j]);
+      if (l && s->keywords[j][l - 1] == '|') l--;
+      if (l == len && memcmp(s->keywords[j], w, len) == 0) return "duplicate keyword";
+    }
+  }
+  return NULL;
+}
+
+// Таблицы для s: правила (у встроенных — из полей kilo), совершенный хеш
+// ключевых слов, автомат. Возвращает текст ошибки или NULL.
+static const char *editorSyntaxCompile(struct editorSyntax *s) {
+  if (s->dfa) return NULL;
+  if (!s->nrules) editorSyntaxLegacyRules(s);
+  const char *err = editorSyntaxCheck(s);
+  if (err) return err;
+  editorSyntaxBuildKeywords(s);
+  return lxCompile(s);
+}
+
+static void editorSyntaxLoadFile(const char *path) {
+  struct editorSyntax s;
+  int line = 0;
+  FILE *f = fopen(path, "r");
+  if (!f) return;
+  const char *err = editorSyntaxParse(f, &s, &line);
+  fclose(f);
+  if (!err) err = editorSyntaxCompile(&s);
+  if (err) { // первую ошибку следующие не затирают
+    if (!E.statusmsg[0]) editorSetStatusMessage("%s:%d: %s", path, line, err);
+    editorSyntaxFree(&s);
+    return;
+  }
+  hl_defs = (struct editorSyntax*)realloc(hl_defs, sizeof(struct editorSyntax) * (hl_ndefs + 1));
+  if (!hl_defs) die("realloc");
+  hl_defs[hl_ndefs++] = s;
+}
+
+// Загружает определения языков (до открытия файла).
+static void editorSyntaxLoad(const char *argv0) {
+  char dir[1024];
+  const char *env = getenv("KILO_SYNTAX");
+  if (env) snprintf(dir, sizeof(dir), "%s", env);
+  else {
+    platExeDir(dir, sizeof(dir) - 8, argv0);
+    strcat(dir, "syntax");
+  }
+  platListDir(dir, ".syn", editorSyntaxLoadFile);
+}
+
+// Определение по имени файла: сначала из файлов, потом встроенные.
+static struct editorSyntax *editorSyntaxFind(const char *filename) {
+  const char *ext = strrchr(filename, '.');
+  for (int j = 0; j < hl_ndefs + (int)HLDB_ENTRIES; j++) {
+    struct editorSyntax *s = j < hl_ndefs ? &hl_defs[j] : &HLDB[j - hl_ndefs];
+    for (unsigned int i = 0; s->filematch[i]; i++) {
+      int is_ext = (s->filematch[i][0] == '.');
+      if ((is_ext && ext && _stricmp(ext, s->filematch[i]) == 0) ||
+          (!is_ext && strstr(filename, s->filematch[i])))
+        return s;
+    }
+  }
+  return NULL;
+}
+
+static void editorSelectSyntaxHighlight(void) {
+  E.syntax = NULL;
+  editorSyntaxInvalidateAll();
+  if (!E.filename) return;
+  struct editorSyntax *s = editorSyntaxFind(E.filename);
+  if (s) {
+    const char *err = editorSyntaxCompile(s); // из файлов собраны при загрузке
+    if (err) die(err);
+  }
+  E.syntax = s;
+}
+
+// Лексер в работе. Подсветка пишется в hl строки (base < 0) или в буфер,
+// который начинается с символа base: окно длинной строки, временный буфер.
+// Проход может вылезти за свой конец меньше чем на LX_OVERRUN символов.
+typedef struct lexer {
+  erow *row;
+  unsigned char *hl;
+  int base;
+  int i, st;           // позиция и смещение состояния в таблице
+  int tok;             // начало текущего слова
+  int exit;            // правило на конце строки, когда проход до него дошёл
+  int start, stop;     // за stop остановиться, если состояние совпало с записанным в hl
+} lexer;
+
+static inline unsigned char *lxHl(lexer *lx, int i) {
+  return lx->base < 0 ? rowHl(lx->row, i) : &lx->hl[i - lx->base];
+}
+
+// Состояние из байта hl с HL_STEP (или из lxEntry).
+static void lxSetState(lexer *lx, unsigned char st) {
+  lx->st = E.syntax->dfa->resume[(st & HL_ST_MASK) >> HL_ST_SHIFT];
+}
+
+// Байт hl с HL_STEP для текущего (чистого) состояния: так его пишет
+// любой переход из него.
+static inline unsigned char lxStep(const lexer *lx) {
+  return (unsigned char)(E.syntax->dfa->tab[lx->st] >> 16) & (HL_ST_MASK | HL_STEP);
+}
+
+// Состояние на входе в строку, которая начинается внутри правила block.
+static inline unsigned char lxEntry(int block) {
+  return E.syntax ? E.syntax->dfa->entry[block] : HL_STEP;
+}
+
+static void lxAction(lexer *lx, unsigned a, int i) {
+  const struct editorSyntax *s = E.syntax;
+  const lxact *ac = &s->dfa->act[a];
+  if (ac->word & LXW_END) {
+    char w[KW_MAXLEN];
+    int n = i - lx->tok, color;
+    for (int j = 0; j < n; j++) w[j] = rowCh(lx->row, lx->tok + j);
+    if ((color = editorKeywordColor(s, w, n)) != HL_NORMAL)
+      for (int j = lx->tok; j < i; j++) {
+        unsigned char *h = lxHl(lx, j);
+        *h = (unsigned char)((*h & ~HL_COLOR_MASK) | color);
+      }
+  }
+  if (ac->word & LXW_START) lx->tok = i;
+  for (int j = 0; j < ac->back; j++) {
+    unsigned char *h = lxHl(lx, i - ac->back + j);
+    *h = (unsigned char)((*h & ~HL_COLOR_MASK) | ac->color[j]);
+  }
+}
+
+// Лексирует от lx->i до первого места не левее end, с которого можно
+// начать (HL_STEP), или до конца строки — тогда известен и lx->exit.
+// Возвращает true, если за stop сошёлся с тем, что уже в hl.
+static bool lexRun(lexer *lx, int end) {
+  const lxdfa *d = E.syntax->dfa;
+  const unsigned *tab = d->tab;
+  const unsigned char *cls = d->cls;
+  erow *row = lx->row;
+  int i = lx->i, st = lx->st;
+  int check = lx->stop > lx->start ? lx->stop : lx->start + 1;
+  bool same = false;
+  if (end > row->size) end = row->size;
+
+  // до end и stop — без проверок, кусками подряд (до разрыва и после)
+  int fast = end < check ? end : check;
+  while (i < fast) {
+    int seg = i < row->gap ? row->gap : row->size;
+    if (seg > fast) seg = fast;
+    const unsigned char *c = (const unsigned char*)&row->chars[i < row->gap ? i : i + ROW_GAPLEN(row)];
+    unsigned char *h = lxHl(lx, i);
+    for (; i < seg; i++) {
+      unsigned e = tab[st + cls[*c++]];
+      *h++ = (unsigned char)(e >> 16);
+      st = e & 0xffff;
+      if (e >> 24) lxAction(lx, e >> 24, i);
+    }
+  }
+  for (; i < row->size; i++) {
+    unsigned e = tab[st + cls[(unsigned char)rowCh(row, i)]];
+    unsigned char *h = lxHl(lx, i), b = (unsigned char)(e >> 16);
+    if ((b & HL_STEP) && (i >= end || (i >= check && (*h & (HL_ST_MASK | HL_STEP)) == (b & (HL_ST_MASK | HL_STEP))))) {
+      // байты до i доделать, дальше — из чистого состояния
+      if (e >> 24) lxAction(lx, e >> 24, i);
+      same = i < end;
+      st = d->resume[(b & HL_ST_MASK) >> HL_ST_SHIFT];
+      break;
+    }
+    *h = b;
+    st = e & 0xffff;
+    if (e >> 24) lxAction(lx, e >> 24, i);
+  }
+  if (i == row->size) { // конец строки: разобрать ожидающее
+    unsigned e = tab[st + d->eol];
+    if (e >> 24) lxAction(lx, e >> 24, i);
+    lx->exit = (int)(e & 0xffff);
+  }
+  lx->i = i; lx->st = st;
+  return same;
+}
+
+// Перелексирует строку после правки, изменившей символы [from, dirty_end).
+// Начинаем с ближайшей отметки HL_STEP до from (байты перед ней уже не
+// зависят от правки) и останавливаемся, как только за правкой состояние
+// лексера совпадёт со старым: дальше подсветка гарантированно та же. Если
+// hl ещё не посчитан, строка лексируется целиком от состояния hl_entry.
+// Возвращает true, если поменялось состояние на конце строки.
+static bool editorRowLex(erow *row, int from, int dirty_end) {
+  if (!row->hl) editorRowHlAlloc(row);
+  if (!row->hl_ok) { from = 0; dirty_end = row->size; row->hl_ok = row->hl_known = true; }
+  if (!E.syntax) {
+    for (int i = from; i < dirty_end; i++) *rowHl(row, i) = HL_NORMAL;
+    bool changed = row->hl_exit != 0;
+    row->hl_exit = 0;
+    return changed;
+  }
+
+  lexer lx = { .row = row, .base = -1, .stop = dirty_end };
+  int i = 0;
+  if (from > 0) {
+    i = from - 1;
+    while (i > 0 && !(*rowHl(row, i) & HL_STEP)) i--;
+  }
+  lxSetState(&lx, i == 0 ? lxEntry(row->hl_entry) : *rowHl(row, i));
+  lx.i = lx.start = i;
+  if (lexRun(&lx, row->size)) return false;
+
+  bool changed = row->hl_exit != lx.exit;
+  row->hl_exit = (unsigned char)lx.exit;
+  return changed;
+}
+
+/* Длинные строки (от KILO_LONG_LINE): минифицированный JSON, лог без
+   переводов строк. hl на всю строку не заводится — лексер держит
+   контрольные точки, состояние на начале токена примерно через каждые
+   KILO_LEX_CHUNK символов (у мест правки — через KILO_LEX_FINE), а
+   подсветка считается только для окна у экрана, от ближайшей точки слева.
+   Точки лежат с разрывом на месте последней правки: правее него хранится
+   расстояние до конца строки, так что правка не сдвигает ни одной точки.
+   Правка перелексирует от точки перед собой, пока не встретит старую точку
+   в том же состоянии: тогда и дальше всё как было, и конец строки известен
+   без прохода по ней целиком. */
+
+enum { LXS_UPTO, LXS_SAME, LXS_END }; // чем кончился editorRowLongScan
+
+// Позиция точки k (разрыв пропускается) в строке длины size.
+static inline int lxPos(const erowExt *x, int k, int size) {
+  return k < x->pa ? x->pt[k].pos : size - x->pt[k - x->pa + x->pb].pos;
+}
+
+static inline unsigned char lxSt(const erowExt *x, int k) {
+  return x->pt[k < x->pa ? k : k - x->pa + x->pb].st;
+}
+
+// Сдвигает разрыв точек к позиции at: левее него остаются точки левее at
+// (и первая точка всегда). size — длина строки, от которой отсчитаны точки.
+static void lxGapMove(erowExt *x, int at, int size) {
+  while (x->pa > 1 && x->pt[x->pa - 1].pos >= at) {
+    x->pa--; x->pb--;
+    x->pt[x->pb].st = x->pt[x->pa].st;
+    x->pt[x->pb].pos = size - x->pt[x->pa].pos;
+  }
+  while (x->pb < x->ptcap && size - x->pt[x->pb].pos < at) {
+    x->pt[x->pa].st = x->pt[x->pb].st;
+    x->pt[x->pa].pos = size - x->pt[x->pb].pos;
+    x->pa++; x->pb++;
+  }
+}
+
+// Строка переходит на подсветку окном; точки — заново от hl_entry.
+static void editorRowLongInit(erow *row) {
+  if (!row->windowed) { editorRowHlDrop(row); row->windowed = true; }
+  erowExt *x = editorRowExt(row);
+  if (!x->ptcap) {
+    x->ptcap = 16;
+    x->pt = (lxpoint*)malloc(sizeof(lxpoint) * x->ptcap);
+    if (!x->pt) die("malloc");
+  }
+  x->pt[0].pos = 0;
+  x->pt[0].st = lxEntry(row->hl_entry);
+  x->npt = x->pt_ok = x->pa = 1; x->pb = x->ptcap;
+  x->lsize = row->size;
+  row->hl_ok = false;
+}
+
+// Досчитывает точки от последней верной, пока не дойдёт до upto, до конца
+// строки (LXS_END, конец строки посчитан) или за позицией stop не сойдётся
+// со старой точкой (LXS_SAME). Новые точки ложатся перед разрывом, старые,
+// которые лексер прошёл, выбрасываются. stop < INT_MAX — это перелексирование
+// после правки: точки идут через KILO_LEX_FINE, чтобы следующая правка рядом
+// сошлась со старыми точками быстро.
+static int editorRowLongScan(erow *row, int upto, int stop) {
+  static unsigned char scratch[KILO_LEX_CHUNK + LX_OVERRUN];
+  erowExt *x = row->x;
+  if (!E.syntax) {
+    x->npt = x->pt_ok = x->pa = 1; x->pb = x->ptcap;
+    row->hl_exit = 0; row->hl_known = true;
+    return LXS_END;
+  }
+  if (x->pt_ok > x->pa) lxGapMove(x, INT_MAX, row->size);
+  int step = stop < INT_MAX ? KILO_LEX_FINE : KILO_LEX_CHUNK, res = LXS_UPTO;
+  lexer lx = { .row = row, .hl = scratch, .stop = INT_MAX };
+  lxSetState(&lx, x->pt[x->pa - 1].st);
+  lx.i = x->pt[x->pa - 1].pos;
+  if (!row->size) lexRun(&lx, 0); // пустая строка: только переход конца строки
+  while (lx.i < row->size && lx.i < upto) {
+    bool old = x->pb < x->ptcap;
+    int next = old ? row->size - x->pt[x->pb].pos : INT_MAX;
+    int target = next - lx.i > step ? lx.i + step : next;
+    while (lx.i < target && lx.i < row->size) {
+      lx.base = lx.i;
+      lexRun(&lx, target - lx.i < KILO_LEX_CHUNK ? target : lx.i + KILO_LEX_CHUNK);
+    }
+    if (lx.i >= row->size) break;
+    unsigned char st = lxStep(&lx);
+    if (lx.i == next && st == x->pt[x->pb].st && lx.i >= stop) { res = LXS_SAME; break; }
+    while (x->pb < x->ptcap && row->size - x->pt[x->pb].pos <= lx.i) x->pb++;
+    if (x->pa == x->pb) { // места нет: разрыв растёт, точки за ним — в конец
+      int cap = x->ptcap * 2, back = x->ptcap - x->pb;
+      x->pt = (lxpoint*)realloc(x->pt, sizeof(lxpoint) * cap);
+      if (!x->pt) die("realloc");
+      memmove(&x->pt[cap - back], &x->pt[x->pb], sizeof(lxpoint) * back);
+      x->pb = cap - back; x->ptcap = cap;
+    }
+    x->pt[x->pa].pos = lx.i; x->pt[x->pa].st = st; x->pa++;
+  }
+  x->npt = x->pa + x->ptcap - x->pb;
+  x->pt_ok = res == LXS_SAME ? x->npt : x->pa;
+  if (res == LXS_UPTO && lx.i >= row->size) {
+    x->pb = x->ptcap; x->npt = x->pa;
+    row->hl_exit = (unsigned char)lx.exit;
+    row->hl_known = true;
+    res = LXS_END;
+  }
+  return res;
+}
+
+// Правка длинной строки на месте from (вставлено до dirty_end или удалено
+// сколько-то символов): разрыв точек переезжает к from, точки внутри
+// удалённого выбрасываются, и от последней точки перед правкой лексер идёт
+// до схождения, но не дальше KILO_LEX_BUDGET. Не сошлось — конец строки
+// неизвестен: его досчитает editorSyntaxCatchUp, когда понадобится.
+static void editorRowLongEdit(erow *row, int at, int from, int dirty_end) {
+  erowExt *x = row->x;
+  int delta = row->size - x->lsize, del = delta < 0 ? -delta : 0;
+  int cut = from + del + (from == 0); // точка на месте правки в начале строки совпала бы с первой
+  lxGapMove(x, from, x->lsize);
+  while (x->pb < x->ptcap && x->lsize - x->pt[x->pb].pos < cut) x->pb++;
+  x->npt = x->pa + x->ptcap - x->pb; x->pt_ok = x->pa;
+  x->lsize = row->size;
+  row->hl_ok = false; // окно перелексируется при выводе
+
+  bool known = row->hl_known;
+  int end = row->hl_exit;
+  int upto = row->size - from > KILO_LEX_BUDGET ? from + KILO_LEX_BUDGET : row->size;
+  int res = editorRowLongScan(row, upto, dirty_end);
+  if (res == LXS_END) {
+    if (at < E.hl_upto && (!known || end != row->hl_exit)) E.hl_upto = at + 1;
+  } else if (res == LXS_UPTO) {
+    x->pb = x->ptcap; x->npt = x->pt_ok;
+    row->hl_known = false;
+    if (at < E.hl_upto) E.hl_upto = at;
+  }
+}
+
+// Окно подсветки на символы [from, to): лексируем от последней точки не
+// правее from, досчитав точки до неё.
+static void editorRowLongWindow(erow *row, int from, int to) {
+  erowExt *x = row->x;
+  if (to > row->size) to = row->size;
+  if (row->hl_ok && from >= x->win_from && to <= x->win_to) return;
+  int st = perfEnter(PS_SYNTAX);
+  if (lxPos(x, x->pt_ok - 1, row->size) < from) editorRowLongScan(row, from, INT_MAX);
+  int lo = 0, hi = x->pt_ok; // точка lo не правее from, точка hi — правее
+  while (hi - lo > 1) {
+    int mid = (lo + hi) / 2;
+    if (lxPos(x, mid, row->size) <= from) lo = mid; else hi = mid;
+  }
+  int base = lxPos(x, lo, row->size), need = to - base + LX_OVERRUN;
+  if (need > x->wincap) {
+    if (!row->hl) E.hl_rows++;
+    free(row->hl);
+    row->hl = (unsigned char*)malloc(need);
+    if (!row->hl) die("malloc");
+    x->wincap = need;
+  }
+  if (!E.syntax) memset(row->hl, HL_NORMAL, to - base);
+  else {
+    lexer lx = { .row = row, .hl = row->hl, .base = base, .i = base, .stop = INT_MAX };
+    lxSetState(&lx, lxSt(x, lo));
+    lexRun(&lx, to);
+  }
+  x->win_from = base; x->win_to = to;
+  row->hl_ok = true;
+  perfLeave(st);
+}
+
+// Подсветка после правки строки. Строки за hl_upto не трогаем — их
+// перелексирует editorSyntaxCatchUp, когда они понадобятся на экране.
+// Если поменялся конец строки, дальше цепочка состояний под вопросом.
+static void editorRowHighlight(erow *row, int from, int dirty_end) {
+  int at = editorRowIndex(row);
+  editorDamage(at, at + 1);
+  if (row->windowed && row->x->npt) { // разрыв точек идёт за любой правкой
+    int st = perfEnter(PS_SYNTAX);
+    editorRowLongEdit(row, at, from, dirty_end);
+    perfLeave(st);
+    return;
+  }
+  if (at >= E.hl_upto || !row->hl_ok) {
+    row->hl_ok = row->hl_known = false;
+    if (at < E.hl_upto) E.hl_upto = at;
+    return;
+  }
+  int st = perfEnter(PS_SYNTAX);
+  if (editorRowLex(row, from, dirty_end)) E.hl_upto = at + 1;
+  perfLeave(st);
+}
+
+// Доводит согласованную цепочку состояний до строки upto (не включая):
+// идёт от hl_upto вперёд и перелексирует только строки, у которых
+// сохранённое состояние на входе разошлось с концом предыдущей. Строки в
+// диапазонах и строки без hl лексируются во временный буфер: от них
+// остаётся только состояние на концах. Длинные строки разворачиваются и
+// проходятся по контрольным точкам.
+static void editorSyntaxCatchUp(int upto) {
+  static unsigned char *scratch = NULL;
+  static int scratch_cap = 0;
+  if (upto > E.numrows) upto = E.numrows;
+  if (E.hl_upto >= upto) return;
+
+  int st = perfEnter(PS_SYNTAX);
+  rowIter it;
+  int entry = 0;
+  if (E.hl_upto > 0) {
+    erow *prev = editorRowIterAt(&it, E.hl_upto - 1);
+    entry = prev->leaf ? prev->hl_exit : LS_EXIT(E.linestate[it.leaf->first + it.i]);
+  }
+  for (erow *row = editorRowIterAt(&it, E.hl_upto); E.hl_upto < upto; row = editorRowIterNext(&it), E.hl_upto++) {
+    if (!row->leaf && row->size >= KILO_LONG_LINE) row = editorRowIterMaterialize(&it);
+    if (row->leaf) {
+      if (!row->hl_known || row->hl_entry != entry) {
+        if (row->windowed || row->size >= KILO_LONG_LINE) {
+          if (!row->windowed || !row->x->npt || row->hl_entry != entry) {
+            row->hl_entry = entry;
+            row->hl_known = false; // конец строки был для другого входа
+            editorRowLongInit(row);
+            editorDamage(E.hl_upto, E.hl_upto + 1);
+          }
+          // конец последней нужной строки никому не нужен: окно считается
+          // от точек, а цепочка остановится перед ней
+          if (E.hl_upto == upto - 1) break;
+          editorRowLongScan(row, row->size, INT_MAX);
+        } else {
+          row->hl_entry = entry;
+          row->hl_ok = false;
+          if (row->hl) editorRowLex(row, 0, row->size);
+          else {
+            if (row->cap >= scratch_cap) {
+              scratch_cap = row->cap + 1;
+              scratch = (unsigned char*)realloc(scratch, scratch_cap);
+              if (!scratch) die("realloc");
+            }
+            row->hl = scratch;
+            editorRowLex(row, 0, row->size);
+            row->hl = NULL; row->hl_ok = false;
+          }
+        }
+        editorDamage(E.hl_upto, E.hl_upto + 1);
+      }
+      entry = row->hl_exit;
+      continue;
+    }
+    unsigned char *ls = &E.linestate[it.leaf->first + it.i];
+    if (!(*ls & LS_KNOWN) || LS_ENTRY(*ls) != entry) {
+      if (row->size >= scratch_cap) {
+        scratch_cap = row->size + 1;
+        scratch = (unsigned char*)realloc(scratch, scratch_cap);
+        if (!scratch) die("realloc");
+      }
+      row->hl = scratch;
+      row->hl_entry = entry;
+      editorRowLex(row, 0, row->size);
+      *ls = LS_STATE(entry, row->hl_exit);
+    }
+    entry = LS_EXIT(*ls);
+  }
+  perfLeave(st);
+}
+
+static int editorRowRxToCx(erow *row, int rx, int *at_rx);
+
+// Подсветка строки для вывода: вся строка или, у длинной, окно на
+// символы, видимые с колонки coloff.
+static void editorRowShowHl(erow *row) {
+  if (!row->windowed && row->size < KILO_LONG_LINE) {
+    if (!row->hl_ok) editorRowLex(row, 0, row->size);
+    return;
+  }
+  if (!row->windowed || !row->x->npt) editorRowLongInit(row);
+  int rx, from = editorRowRxToCx(row, E.coloff, &rx);
+  int to = editorRowRxToCx(row, E.coloff + E.screencols, &rx);
+  editorRowLongWindow(row, from, to + 1); // и символ, который не влез целиком
+}
+
+/* ============================ Отмена ================================ */
+
+// Журнал отмены: записи правок на уровне примитивов строк (вставка и
+// удаление текста в строке, вставка и удаление строк) дописываются подряд
+// в цепочку блоков. Каждый шаг отмены начинается записью UOP_GROUP с
+// курсором до и после шага; набор подряд склеивается в один шаг, а соседние
+// символы — в одну запись. Отмена идёт от текущей позиции назад до записи
+// шага, повтор — вперёд, так что цена шага пропорциональна самой правке.
+// Новая правка после отмены отрезает хвост для повтора. Когда журнал
+// больше KILO_UNDO_LIMIT, самые старые блоки выбрасываются целыми шагами.
+
+enum { UOP_GROUP = 1, UOP_INS, UOP_DEL, UOP_INSROW, UOP_DELROW };
+enum { UG_OTHER = 0, UG_TYPE, UG_DELETE, UG_NEWLINE, UG_PASTE }; // вид шага; склеиваются TYPE и DELETE
+
+typedef struct undoRec {
+  unsigned char op;    // UOP_*
+  unsigned char kind;  // UOP_GROUP: UG_*
+  unsigned back;       // на сколько байт раньше начинается предыдущая запись блока, 0 — первая
+  int line, col;       // UOP_GROUP: курсор до шага
+  unsigned len;        // байт текста за заголовком; у UOP_GROUP там курсор после шага
+} undoRec;
+
+typedef struct undoBlock {
+  struct undoBlock *prev, *next;
+  size_t used, cap;
+  size_t last;         // начало последней записи
+  char data[];
+} undoBlock;
+
+typedef struct undoPos {
+  undoBlock *b;
+  size_t off;
+} undoPos;
+
+static struct editorUndo {
+  undoBlock *head, *tail;
+  undoPos start;       // первая запись истории (всё раньше — обрезки вытесненного шага)
+  undoPos cur;         // граница: раньше — сделанное, дальше — отменённое
+  undoPos grp;         // запись текущего шага, b == NULL — нет
+  size_t bytes;        // ёмкость всех блоков
+  size_t grpbytes;     // байт в текущем шаге
+  int depth;           // вложенность undoBegin
+  int kind;            // вид открытого шага (UG_*)
+  int bcx, bcy;        // курсор в его начале
+  bool open;           // запись шага уже в журнале (заводится с первой правкой)
+  bool replaying;      // идёт отмена или повтор: не записывать
+  bool lost;           // шаг не влез в лимит — до его конца не записываем
+} U;
+
+#define UNDO_ALIGN(n) (((n) + 7) & ~(size_t)7)
+#define UNDO_REC(pos) ((undoRec*)&(pos).b->data[(pos).off])
+
+static size_t undoRecSize(const undoRec *r) { return UNDO_ALIGN(sizeof(undoRec) + r->len); }
+
+static void undoClear(void) {
+  for (undoBlock *b = U.head, *next; b; b = next) { next = b->next; free(b); }
+  memset(&U, 0, sizeof(U));
+}
+
+// Отрезает отменённые записи после cur: с новой правкой их уже не повторить.
+static void undoTruncate(void) {
+  undoBlock *b = U.cur.b;
+  if (!b) return;
+  while (b->next) {
+    undoBlock *n = b->next;
+    b->next = n->next;
+    U.bytes -= n->cap;
+    free(n);
+  }
+  U.tail = b;
+  if (U.cur.off < b->used) {
+    b->last = U.cur.off ? U.cur.off - UNDO_REC(U.cur)->back : 0;
+    b->used = U.cur.off;
+  }
+}
+
+// Вытесняет самые старые блоки, пока журнал больше лимита; история
+// после них начинается с ближайшего целого шага.
+static void undoEvict(void) {
+  bool orphan = false; // в первом блоке нет начала шага — он целиком хвост вытесненного
+  while ((U.bytes > KILO_UNDO_LIMIT || orphan) && U.head != U.cur.b) {
+    undoBlock *b = U.head;
+    U.head = b->next;
+    U.head->prev = NULL;
+    U.bytes -= b->cap;
+    free(b);
+    U.start.b = U.head; U.start.off = 0;
+    while (U.start.off < U.head->used && UNDO_REC(U.start)->op != UOP_GROUP)
+      U.start.off += undoRecSize(UNDO_REC(U.start));
+    orphan = U.start.off == U.head->used;
+  }
+}
+
+// Место под запись из len байт текста в конце журнала (== cur).
+static undoRec *undoAppend(int op, int line, int col, size_t len) {
+  size_t need = UNDO_ALIGN(sizeof(undoRec) + len);
+  undoBlock *b = U.tail;
+  if (!b || b->cap - b->used < need) {
+    size_t cap = need > KILO_UNDO_BLOCK ? need : KILO_UNDO_BLOCK;
+    undoBlock *nb = (undoBlock*)malloc(sizeof(undoBlock) + cap);
+    if (!nb) die("malloc");
+    nb->prev = b; nb->next = NULL;
+    nb->used = nb->last = 0; nb->cap = cap;
+    if (b) b->next = nb; else U.head = nb;
+    if (!U.start.b) { U.start.b = nb; U.start.off = 0; }
+    U.tail = b = nb;
+    U.bytes += cap;
+  }
+  undoRec *r = (undoRec*)&b->data[b->used];
+  r->op = (unsigned char)op; r->kind = 0;
+  r->back = b->used ? (unsigned)(b->used - b->last) : 0;
+  r->line = line; r->col = col; r->len = (unsigned)len;
+  b->last = b->used;
+  b->used += need;
+  U.cur.b = b; U.cur.off = b->used;
+  U.grpbytes += need;
+  return r;
+}
+
+// Начало правки. Вложенные вызовы входят в шаг внешнего. Запись шага
+// появляется с первой правкой: правка, которая ничего не изменила, не
+// оставляет пустого шага и не отрезает хвост для повтора.
+static void undoBegin(int kind) {
+  if (U.depth++ || U.replaying) return;
+  U.kind = kind;
+  U.bcx = E.cx; U.bcy = E.cy;
+  U.open = U.lost = false;
+}
+
+// Заводит запись шага. Набор (или удаление) подряд с того места, где
+// закончился прошлый такой же шаг, продолжает его.
+static void undoOpen(void) {
+  U.open = true;
+  if (U.grp.b && (U.kind == UG_TYPE || U.kind == UG_DELETE) && UNDO_REC(U.grp)->kind == U.kind &&
+      U.cur.b == U.tail && U.cur.off == U.tail->used) {
+    int *after = (int*)(UNDO_REC(U.grp) + 1);
+    if (after[0] == U.bcx && after[1] == U.bcy) return;
+  }
+  undoTruncate();
+  undoEvict();
+  U.grpbytes = 0;
+  undoRec *g = undoAppend(UOP_GROUP, U.bcy, U.bcx, 2 * sizeof(int));
+  g->kind = (unsigned char)U.kind;
+  U.grp.b = U.cur.b; U.grp.off = U.cur.b->last;
+}
+
+static void undoEnd(void) {
+  if (--U.depth || U.replaying || !U.open || !U.grp.b) return;
+  int *after = (int*)(UNDO_REC(U.grp) + 1);
+  after[0] = E.cx; after[1] = E.cy;
+}
+
+// Шаг оказался больше всего лимита: история теряется целиком, остаток
+// шага не записывается.
+static void undoOverflow(void) {
+  int depth = U.depth;
+  undoClear();
+  U.depth = depth;
+  U.lost = true;
+  editorSetStatusMessage("Правка больше лимита истории — отмена недоступна");
+}
+
+static void journalRecord(int op, int line, int col, const char *s, size_t len);
+
+// Записывает правку строки line. Правка вне undoBegin — отдельный шаг.
+// Через это же место все правки (и отмены с повторами) идут в журнал
+// восстановления.
+static void undoRecord(int op, int line, int col, const char *s, size_t len) {
+  journalRecord(op, line, col, s, len);
+  if (U.replaying) return;
+  bool solo = U.depth == 0;
+  if (solo) undoBegin(UG_OTHER);
+  if (U.lost) { if (solo) undoEnd(); return; }
+  if (!U.open) undoOpen();
+  // символ рядом с прошлым — дописываем в ту же запись, если она последняя в блоке
+  undoBlock *b = U.tail;
+  undoRec *last = (undoRec*)&b->data[b->last];
+  if ((op == UOP_INS || op == UOP_DEL) && last->op == op && last->line == line && len == 1 &&
+      b->cap - b->last >= UNDO_ALIGN(sizeof(undoRec) + last->len + 1)) {
+    char *t = (char*)(last + 1);
+    bool ok = true;
+    if (op == UOP_INS && col == last->col + (int)last->len) t[last->len] = *s;             // набор
+    else if (op == UOP_DEL && col == last->col) t[last->len] = *s;                        // Delete
+    else if (op == UOP_DEL && col + 1 == last->col) { memmove(t + 1, t, last->len); t[0] = *s; last->col--; } // Backspace
+    else ok = false;
+    if (ok) {
+      last->len++;
+      size_t used = b->last + undoRecSize(last);
+      U.grpbytes += used - b->used;
+      b->used = used;
+      U.cur.off = used;
+      if (solo) undoEnd();
+      return;
+    }
+  }
+  undoRec *r = undoAppend(op, line, col, len);
+  memcpy(r + 1, s, len);
+  if (U.grpbytes > KILO_UNDO_LIMIT) undoOverflow();
+  if (solo) undoEnd();
+}
+
+/* ============================ Индекс поиска ========================= */
+
+// У больших файлов (от KILO_SEARCH_INDEX_MIN) фоновый поток после открытия
+// строит индекс триграмм. Файл делится на блоки по 2^shift байт, строка
+// относится к блоку своего начала. Для каждой триграммы хранится
+// возрастающий список блоков, где она встречается; '\n' в триграммы не
+// входит, буквы ASCII приводятся к нижнему регистру, так что индекс годится
+// и для поиска без учёта регистра. Триграммы хешируются в TRI_BUCKETS
+// корзин: совпадение корзин даёт только лишнего кандидата. Поиск
+// пересекает списки триграмм запроса и сканирует только блоки-кандидаты;
+// пока индекс строится, буфер сканируется целиком.
+//
+// Сам индекс после постройки не меняется: он описывает отображение. Правки
+// строк дописывают в дельту пары (корзина, группа строк) для триграмм у
+// места правки (вокруг вставки, на стыке после удаления); остальные
+// триграммы строки прежние и уже учтены. Группа строки файла — 2^TRI_GROUP_BITS
+// соседних строк lineoff, новые строки собираются в группы по порядку
+// появления, и каждая такая группа — ещё один блок после блоков файла.
+// Удалённый текст остаётся в индексе лишними кандидатами.
+//
+// Память ограничена KILO_SEARCH_INDEX_LIMIT: если списки не влезают в свою
+// часть, блоки укрупняются вдвое (списки сжимаются на месте); если не влезает
+// дельта — индекс выбрасывается, и поиск снова сканирует.
+
+#define TRI_BITS 18
+#define TRI_BUCKETS (1u << TRI_BITS)
+#define TRI_SHIFT0 16        // начальный блок — 64 КБ
+#define TRI_SHIFT_MAX 30     // блоки крупнее бесполезны: индекс бросаем
+#define TRI_GROUP_BITS 6     // строк в группе дельты
+#define TRI_QUERY 8          // триграмм запроса, списки которых пересекаются
+#define TRI_DELTA_LIMIT (KILO_SEARCH_INDEX_LIMIT / 4)
+#define TRI_EDIT_GROUP 0x80000000u
+#define TRI_READ (1u << 20)  // файл читается такими кусками
+
+typedef struct triList {
+  unsigned *id;        // блоки по возрастанию
+  unsigned n, cap;
+} triList;
+
+static struct searchIndex {
+  // пишет поток; главный читает только после его конца (ready)
+  triList *list;       // TRI_BUCKETS списков
+  int shift;           // блок файла — 2^shift байт
+  unsigned nfile;      // блоков файла; группа новых строк k — блок nfile + k
+  size_t mem;          // байт под списки
+  bool failed;         // не влез или не хватило памяти
+  platThread thread;
+  volatile size_t done; // проиндексировано байт, для прогресса
+  volatile bool stop;  // поток должен бросить работу
+  // дальше — только главный поток
+  bool on;             // индекс ведётся: строится или готов
+  bool ready;          // построен, поиск идёт по нему
+  bool lost;           // выброшен: не хватило памяти
+  unsigned long long *delta; // (корзина + 1) << 32 | группа; открытая адресация, 0 — пусто
+  size_t dn, dcap;
+  int nedit, editrows; // групп новых строк и строк в последней
+  unsigned long long *cand; // битовые наборы блоков для запроса
+  size_t candwords;
+} TI;
+
+static inline unsigned triFold(unsigned char c) { return (c >= 'A' && c <= 'Z') ? c | 0x20u : c; }
+static inline unsigned triBucket(unsigned t) { return (t * 2654435761u) >> (32 - TRI_BITS); }
+
+static inline int triCtz(unsigned long long m) {
+#ifdef __GNUC__
+  return __builtin_ctzll(m);
+#else
+  int k = 0;
+  while (!(m & 1)) { m >>= 1; k++; }
+  return k;
+#endif
+}
+
+static bool triAppend(triList *l, unsigned blk) {
+  if (l->n && l->id[l->n - 1] == blk) return true;
+  if (l->n == l->cap) {
+    unsigned cap = l->cap ? l->cap * 2 : 4;
+    unsigned *id = (unsigned*)realloc(l->id, sizeof(unsigned) * cap);
+    if (!id) return false;
+    TI.mem += sizeof(unsigned) * (size_t)(cap - l->cap);
+    l->id = id; l->cap = cap;
+  }
+  l->id[l->n++] = blk;
+  return true;
+}
+
+// Укрупняет блоки вдвое: соседние номера сливаются, списки ужимаются.
+static bool triCoarsen(void) {
+  if (++TI.shift > TRI_SHIFT_MAX) return false;
+  for (unsigned b = 0; b < TRI_BUCKETS; b++) {
+    triList *l = &TI.list[b];
+    unsigned w = 0;
+    for (unsigned r = 0; r < l->n; r++) {
+      unsigned v = l->id[r] >> 1;
+      if (!w || l->id[w - 1] != v) l->id[w++] = v;
+    }
+    l->n = w;
+    if (w && w * 2 <= l->cap) {
+      unsigned *id = (unsigned*)realloc(l->id, sizeof(unsigned) * w);
+      if (id) { TI.mem -= sizeof(unsigned) * (size_t)(l->cap - w); l->id = id; l->cap = w; }
+    }
+  }
+  return true;
+}
+
+static void triFreeLists(void) {
+  if (TI.list) for (unsigned b = 0; b < TRI_BUCKETS; b++) free(TI.list[b].id);
+  free(TI.list);
+  TI.list = NULL;
+}
+
+// Поток: строки отображения по порядку; корзины, встреченные в блоке,
+// копятся в наборе seen и дописываются в списки, когда блок кончился, —
+// по возрастанию номера, чтобы заголовки списков читались подряд.
+static void triWorker(void *arg) {
+  (void)arg;
+  const size_t limit = KILO_SEARCH_INDEX_LIMIT - TRI_DELTA_LIMIT;
+  unsigned long long *seen = (unsigned long long*)calloc(TRI_BUCKETS / 64, sizeof(unsigned long long));
+  TI.list = (triList*)calloc(TRI_BUCKETS, sizeof(triList));
+  TI.mem = sizeof(triList) * (size_t)TRI_BUCKETS;
+  TI.shift = TRI_SHIFT0;
+  char *buf = (char*)malloc(TRI_READ);
+  const unsigned char *win = NULL;
+  size_t wfrom = 0, wto = 0; // в win — байты файла [wfrom, wto)
+  bool ok = seen && TI.list && buf, any = false;
+  unsigned cur = 0;
+  for (size_t ln = 0; ok && ln < E.nlines && !TI.stop; ln++) {
+    size_t off = ln + 1 < E.nlines ? E.lineoff[ln] : E.mapsize; // последний шаг — сброс блока
+    if ((off >> TI.shift) != cur || ln + 1 == E.nlines) {
+      for (unsigned w = 0; any && w < TRI_BUCKETS / 64; w++) {
+        for (unsigned long long m = seen[w]; m && ok; m &= m - 1)
+          ok = triAppend(&TI.list[w * 64 + triCtz(m)], cur);
+        seen[w] = 0;
+      }
+      any = false;
+      while (ok && TI.mem > limit) ok = triCoarsen();
+      cur = (unsigned)(off >> TI.shift);
+      if (ln + 1 == E.nlines) break;
+    }
+    size_t end = E.lineoff[ln + 1] - 1;
+    TI.done = off;
+    if (end - off < 3) continue;
+    unsigned t = 0;
+    for (size_t at = off; ok && at < end; ) {
+      if (at >= wto) { // файл читается мимо отображения: укороченный не уронит поток
+        size_t n = E.mapsize - at < TRI_READ ? E.mapsize - at : TRI_READ;
+        if (!(ok = (win = (const unsigned char*)editorMapRead(at, buf, n)) != NULL)) break;
+        wfrom = at; wto = at + n;
+      }
+      for (size_t stop = end < wto ? end : wto; at < stop; at++) {
+        t = (t << 8 | triFold(win[at - wfrom])) & 0xffffff;
+        if (at < off + 2) continue;
+        unsigned b = triBucket(t);
+        seen[b >> 6] |= 1ull << (b & 63);
+      }
+    }
+    any = true;
+  }
+  TI.nfile = ok ? (unsigned)(E.mapsize >> TI.shift) + 1 : 0;
+  TI.failed = !ok || TI.stop;
+  if (TI.failed) triFreeLists();
+  free(seen); free(buf);
+}
+
+static void triStop(void) {
+  if (TI.on && !TI.ready) { TI.stop = true; platThreadJoin(&TI.thread); }
+  triFreeLists();
+  free(TI.delta); free(TI.cand);
+  memset(&TI, 0, sizeof(TI));
+}
+
+// Запускает постройку индекса по только что отображённому файлу.
+static void triStart(void) {
+  triStop();
+  if (E.mapsize < KILO_SEARCH_INDEX_MIN) return;
+  TI.on = platThreadStart(&TI.thread, triWorker, NULL);
+}
+
+// Подбирает законченный поток (wait — дожидается его); true — индексом
+// можно пользоваться.
+static bool triPoll(bool wait) {
+  if (!TI.on || TI.ready) return TI.ready;
+  if (wait) platThreadJoin(&TI.thread);
+  else if (!platThreadDone(&TI.thread)) return false;
+  if (TI.failed) { TI.on = false; triStop(); TI.lost = true; return false; }
+  TI.ready = true;
+  return true;
+}
+
+static inline unsigned triGroup(const erow *row) {
+  return row->tri >= 0 ? (unsigned)row->tri >> TRI_GROUP_BITS : TRI_EDIT_GROUP | (unsigned)(-row->tri - 1);
+}
+
+static void triDeltaInsert(unsigned long long key) {
+  size_t h = (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & (TI.dcap - 1);
+  while (TI.delta[h] && TI.delta[h] != key) h = (h + 1) & (TI.dcap - 1);
+  if (!TI.delta[h]) { TI.delta[h] = key; TI.dn++; }
+}
+
+static void triDeltaAdd(unsigned b, unsigned group) {
+  if (2 * (TI.dn + 1) > TI.dcap) {
+    size_t cap = TI.dcap ? TI.dcap * 2 : 1024;
+    unsigned long long *old = TI.delta;
+    size_t oldcap = TI.dcap;
+    if (sizeof(*old) * cap > TRI_DELTA_LIMIT ||
+        !(TI.delta = (unsigned long long*)calloc(cap, sizeof(*old)))) {
+      TI.delta = old;
+      triStop(); // дельта не влезла: дальше без индекса
+      TI.lost = true;
+      return;
+    }
+    TI.dcap = cap; TI.dn = 0;
+    for (size_t j = 0; j < oldcap; j++) if (old[j]) triDeltaInsert(old[j]);
+    free(old);
+  }
+  triDeltaInsert((unsigned long long)(b + 1) << 32 | group);
+}
+
+// Строка изменилась: в дельту — триграммы, начинающиеся в [from, to).
+static void triNote(const erow *row, int from, int to) {
+  if (!TI.on) return;
+  if (from < 0) from = 0;
+  if (to > row->size - 2) to = row->size - 2;
+  if (from >= to) return;
+  unsigned g = triGroup(row);
+  unsigned t = triFold((unsigned char)rowCh(row, from)) << 8 | triFold((unsigned char)rowCh(row, from + 1));
+  for (int i = from; i < to && TI.on; i++) {
+    t = (t << 8 | triFold((unsigned char)rowCh(row, i + 2))) & 0xffffff;
+    triDeltaAdd(triBucket(t), g);
+  }
+}
+
+// Новая строка: группа по порядку появления, в дельту — вся строка.
+static void triNewRow(erow *row) {
+  if (!TI.on) return;
+  if (TI.editrows++ % (1 << TRI_GROUP_BITS) == 0) TI.nedit++;
+  row->tri = -TI.nedit;
+  triNote(row, 0, row->size);
+}
+
+// Блок индекса, к которому относится строка.
+static unsigned triRowBlock(const erow *row) {
+  return row->tri >= 0 ? (unsigned)(E.lineoff[row->tri] >> TI.shift) : TI.nfile + (unsigned)(-row->tri - 1);
+}
+
+static inline bool triHas(const unsigned long long *set, unsigned blk) { return (set[blk >> 6] >> (blk & 63)) & 1; }
+
+static void triSetRange(unsigned long long *set, unsigned lo, unsigned hi) {
+  for (unsigned k = lo; k <= hi; k++) set[k >> 6] |= 1ull << (k & 63);
+}
+
+// Байт под индексом (списки и дельта), для отчёта.
+static size_t triMemory(void) {
+  return (TI.ready ? TI.mem : 0) + TI.dcap * sizeof(*TI.delta);
+}
+
+/* ============================ Строки ================================ */
+
+// Колонки строки с табами или не-ASCII: rx считается от ближайшей
+// контрольной точки cols[k] (каждые KILO_COL_STEP байт), а не от начала
+// строки. Ширина символа приписана его первому байту. Правка в позиции at
+// портит только точки правее at (и трёх байт перед ним: там мог начаться
+// символ, чей хвост поменялся); они досчитываются от последней верной при
+// следующем запросе, так что набор в конце длинной строки пересчитывает
+// один шаг. Простой ASCII между особыми байтами пропускается блоками.
+
+static int editorRowColsWalk(erow *row, int from, int to, int rx) {
+  unsigned cp;
+  int j = rowCharStart(row, from);
+  if (j < from) j += rowChar(row, j, &cp); // ширина уже учтена до from
+  while (j < to) {
+    int n = rowPlain(row, j, to);
+    rx += n; j += n;
+    if (j >= to) break;
+    if (rowCh(row, j) == '\t') { rx = (rx / KILO_TAB_STOP + 1) * KILO_TAB_STOP; j++; continue; }
+    j += rowChar(row, j, &cp);
+    rx += utf8Width(cp);
+  }
+  return rx;
+}
+
+// Досчитывает контрольные точки до k включительно.
+static void editorRowColsUpto(erow *row, int k) {
+  erowExt *x = editorRowExt(row);
+  if (k < x->ncols) return;
+  if (k >= x->colcap) {
+    x->colcap = row->size / KILO_COL_STEP + 1;
+    if (x->colcap <= k) x->colcap = k + 1;
+    x->cols = (int*)realloc(x->cols, sizeof(int) * x->colcap);
+    if (!x->cols) die("realloc");
+  }
+  if (x->ncols == 0) x->cols[x->ncols++] = 0;
+  for (; x->ncols <= k; x->ncols++) {
+    int j = (x->ncols - 1) * KILO_COL_STEP;
+    x->cols[x->ncols] = editorRowColsWalk(row, j, j + KILO_COL_STEP, x->cols[x->ncols - 1]);
+  }
+}
+
+// Текст строки поменялся начиная с at.
+static void editorRowColsDirty(erow *row, int at) {
+  int k = at < 3 ? 0 : (at - 3) / KILO_COL_STEP;
+  if (row->x && row->x->ncols > k + 1) row->x->ncols = k + 1;
+}
+
+static int editorRowCxToRx(erow *row, int cx) {
+  if (row->nspecial == 0) return cx;
+  if (cx > row->size) cx = row->size;
+  int k = cx / KILO_COL_STEP;
+  editorRowColsUpto(row, k);
+  return editorRowColsWalk(row, k * KILO_COL_STEP, cx, row->x->cols[k]);
+}
+
+// Первый символ, видимый с экранной колонки rx (таб и широкий видны, пока
+// не кончились); *at_rx — колонка, с которой он начинается. rx правее
+// строки — её конец.
+static int editorRowRxToCx(erow *row, int rx, int *at_rx) {
+  if (row->nspecial == 0) { int cx = rx < row->size ? rx : row->size; *at_rx = cx; return cx; }
+  // последняя контрольная точка не правее rx: сначала среди уже верных,
+  // дальше — досчитывая по одной
+  int last = row->size / KILO_COL_STEP, k;
+  editorRowColsUpto(row, 0);
+  erowExt *e = row->x;
+  if (e->cols[e->ncols - 1] <= rx) {
+    k = e->ncols - 1;
+    while (k < last) {
+      editorRowColsUpto(row, k + 1);
+      if (e->cols[k + 1] > rx) break;
+      k++;
+    }
+  } else {
+    int lo = 0, hi = e->ncols - 1; // cols[lo] <= rx < cols[hi]
+    while (hi - lo > 1) {
+      int mid = (lo + hi) / 2;
+      if (e->cols[mid] <= rx) lo = mid; else hi = mid;
+    }
+    k = lo;
+  }
+  unsigned cp;
+  int cx = k * KILO_COL_STEP, x = e->cols[k], s = rowCharStart(row, cx);
+  if (s < cx) cx = s + rowChar(row, s, &cp);
+  while (cx < row->size) {
+    int n = rowPlain(row, cx, rx - x < row->size - cx ? cx + (rx - x) : row->size);
+    x += n; cx += n;
+    if (cx >= row->size) break;
+    int w, len = 1;
+    if (rowCh(row, cx) == '\t') w = KILO_TAB_STOP - (x % KILO_TAB_STOP);
+    else { len = rowChar(row, cx, &cp); w = utf8Width(cp); }
+    if (x + w > rx) break;
+    x += w; cx += len;
+  }
+  *at_rx = x;
+  return cx;
+}
+
+// Полный пересчёт строки: число особых байтов, подсветка — при показе.
+static void editorUpdateRow(erow *row) {
+  if (row->x) row->x->ncols = 0;
+  row->nspecial = (int)(textSpecial(row->chars, row->gap) +
+                        textSpecial(row->chars + row->gap + ROW_GAPLEN(row), row->size - row->gap));
+  row->hl_ok = row->hl_known = false;
+  editorRowHighlight(row, 0, row->size);
+}
+
+static void editorInsertRow(int at, const char *s, size_t len) {
+  if (at < 0 || at > E.numrows) return;
+  erow *row = ltInsert(at);
+  editorDamage(at, INT_MAX);
+  row->size = (int)len;
+  row->cap = (int)len + 1;
+  row->gap = (int)len;
+  row->chars = (char*)malloc(len + 1); // hl заведётся, когда строку покажут
+  if (!row->chars) die("malloc");
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  triNewRow(row);
+  editorUpdateRow(row);
+  undoRecord(UOP_INSROW, at, 0, row->chars, len);
+  E.dirty++;
+}
+
+static void editorDelRow(int at) {
+  if (at < 0 || at >= E.numrows) return;
+  erow *row = editorRowAt(at);
+  undoRecord(UOP_DELROW, at, 0, editorRowData(row), row->size);
+  editorFreeRow(row);
+  ltRemove(at);
+  editorDamage(at, INT_MAX);
+  if (at < E.hl_upto) E.hl_upto = at;
+  E.dirty++;
+}
+
+// Вставка и удаление у курсора: разрыв уже стоит на месте при наборе подряд,
+// так что цена — O(1) плюс перелексирование затронутого участка.
+static void editorRowInsertChar(erow *row, int at, int c) {
+  if (at < 0 || at > row->size) at = row->size;
+  editorRowMoveGap(row, at);
+  editorRowReserve(row, 1);
+  row->chars[at] = (char)c;
+  if (rowHlInline(row)) row->hl[at] = HL_NORMAL;
+  row->gap++; row->size++;
+  if (chSpecial((char)c)) row->nspecial++;
+  editorRowColsDirty(row, at);
+  triNote(row, at - 2, at + 1);
+  undoRecord(UOP_INS, editorRowIndex(row), at, &row->chars[at], 1);
+  editorRowHighlight(row, at, at + 1);
+  E.dirty++;
+}
+
+static void editorRowInsertString(erow *row, int at, const char *s, size_t len) {
+  if (at < 0 || at > row->size) at = row->size;
+  editorRowMoveGap(row, at);
+  editorRowReserve(row, (int)len);
+  memcpy(&row->chars[at], s, len);
+  row->nspecial += (int)textSpecial(s, len);
+  row->gap += (int)len; row->size += (int)len;
+  editorRowColsDirty(row, at);
+  triNote(row, at - 2, at + (int)len);
+  undoRecord(UOP_INS, editorRowIndex(row), at, &row->chars[at], len);
+  editorRowHighlight(row, at, at + (int)len);
+  E.dirty++;
+}
+
+static void editorRowDelChar(erow *row, int at) {
+  if (at < 0 || at >= row->size) return;
+  editorRowMoveGap(row, at + 1);
+  undoRecord(UOP_DEL, editorRowIndex(row), at, &row->chars[at], 1);
+  if (chSpecial(row->chars[at])) row->nspecial--;
+  row->gap--; row->size--;
+  editorRowColsDirty(row, at);
+  triNote(row, at - 2, at);
+  editorRowHighlight(row, at, at);
+  E.dirty++;
+}
+
+// Удаляет [at, at + n): участок уходит в разрыв.
+static void editorRowDelRange(erow *row, int at, int n) {
+  if (at < 0 || n <= 0 || at + n > row->size) return;
+  editorRowMoveGap(row, at + n);
+  undoRecord(UOP_DEL, editorRowIndex(row), at, &row->chars[at], n);
+  row->nspecial -= (int)textSpecial(&row->chars[at], n);
+  row->gap = at; row->size -= n;
+  editorRowColsDirty(row, at);
+  triNote(row, at - 2, at);
+  editorRowHighlight(row, at, at);
+  E.dirty++;
+}
+
+// Заменяет [at, at + n) на s: старый участок уходит в разрыв, новый ложится
+// на его место. Одна правка строки — один сдвиг разрыва, одно
+// перелексирование и по записи удаления и вставки в журнале.
+static void editorRowReplace(erow *row, int at, int n, const char *s, size_t len) {
+  if (at < 0 || n < 0 || at + n > row->size) return;
+  int line = editorRowIndex(row);
+  editorRowMoveGap(row, at + n);
+  if (n) undoRecord(UOP_DEL, line, at, &row->chars[at], n);
+  row->nspecial -= (int)textSpecial(&row->chars[at], n);
+  row->gap = at; row->size -= n;
+  // у длинной строки точки внутри старого участка должны уйти до вставки
+  if (n && row->windowed && row->x->npt) editorRowHighlight(row, at, at);
+  editorRowReserve(row, (int)len);
+  memcpy(&row->chars[at], s, len);
+  row->nspecial += (int)textSpecial(s, len);
+  row->gap += (int)len; row->size += (int)len;
+  editorRowColsDirty(row, at);
+  triNote(row, at - 2, at + (int)len);
+  if (len) undoRecord(UOP_INS, line, at, &row->chars[at], len);
+  editorRowHighlight(row, at, at + (int)len);
+  E.dirty++;
+}
+
+// Отрезает строку по позиции at.
+static void editorRowTruncate(erow *row, int at) {
+  if (at >= 0 && at < row->size) editorRowDelRange(row, at, row->size - at);
+}
+
+/* ============================ Редактирование ======================== */
+
+static void editorInsertChar(int c) {
+  undoBegin(UG_TYPE);
+  if (E.cy == E.numrows) editorInsertRow(E.numrows, "", 0);
+  editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+  E.cx++;
+  undoEnd();
+}
+
+static void editorInsertNewline(void) {
+  undoBegin(UG_NEWLINE);
+  if (E.cx == 0) {
+    editorInsertRow(E.cy, "", 0);
+  } else {
+    erow *row = editorRowAt(E.cy);
+    // хвост после разрыва лежит сплошным куском — его и переносим
+    editorRowMoveGap(row, E.cx);
+    editorInsertRow(E.cy + 1, &row->chars[E.cx + ROW_GAPLEN(row)], row->size - E.cx);
+    editorRowTruncate(editorRowAt(E.cy), E.cx);
+  }
+  E.cy++; E.cx = 0;
+  undoEnd();
+}
+
+// Вставка куска текста в позицию курсора (вставка из буфера обмена, набор
+// впрок): строки режутся за один проход и вставляются целиком, подсветка
+// досчитывается один раз при следующей отрисовке. '\r', '\n' и "\r\n" — перевод строки.
+static void editorInsertText(const char *s, size_t len) {
+  const char *end = s + len, *p = s, *q = s;
+  if (len == 0) return;
+  undoBegin(UG_PASTE); // набор впрок вызывающий открывает как UG_TYPE
+  while (q < end && *q != '\r' && *q != '\n') q++;
+  if (q > p) {
+    if (E.cy == E.numrows) editorInsertRow(E.numrows, "", 0);
+    editorRowInsertString(editorRowAt(E.cy), E.cx, p, q - p);
+    E.cx += (int)(q - p);
+  }
+  if (q == end) { undoEnd(); return; }
+  editorInsertNewline(); // хвост строки под курсором уезжает на новую строку
+  int typed = 0;
+  while (1) {
+    p = q + ((*q == '\r' && q + 1 < end && q[1] == '\n') ? 2 : 1);
+    for (q = p; q < end && *q != '\r' && *q != '\n'; q++) ;
+    if (q == end) break;
+    editorInsertRow(E.cy++, p, q - p);
+    typed |= q > p;
+  }
+  // за концом файла — как при наборе: после вставленного текста
+  // завершающий перевод оставляет пустую строку под курсором
+  if (E.cy == E.numrows) {
+    if (q > p || typed) editorInsertRow(E.numrows, p, q - p);
+  } else if (q > p) {
+    editorRowInsertString(editorRowAt(E.cy), 0, p, q - p);
+  }
+  E.cx = (int)(q - p);
+  undoEnd();
+}
+
+static void editorDelChar(void) {
+  if (E.cy == E.numrows) return;
+  if (E.cx == 0 && E.cy == 0) return;
+  undoBegin(UG_DELETE);
+  erow *row = editorRowAt(E.cy);
+  if (E.cx > 0) {
+    int at = rowCharStart(row, E.cx - 1); // символ UTF-8 — целиком
+    if (at == E.cx - 1) editorRowDelChar(row, at);
+    else editorRowDelRange(row, at, E.cx - at);
+    E.cx = at;
+  } else {
+    // предыдущая строка может лежать в диапазоне: разворачиваем её первой,
+    // а текущую берём заново — разворачивание перекладывает листья
+    erow *prev = editorRowAt(E.cy - 1);
+    row = editorRowAt(E.cy);
+    E.cx = prev->size;
+    editorRowInsertString(prev, prev->size, editorRowData(row), row->size);
+    editorDelRow(E.cy);
+    E.cy--;
+  }
+  undoEnd();
+}
+
+// Правка-примитив по записи журнала (отмены или восстановления); у
+// удалений текст не нужен.
+static void editorApply(int op, int line, int col, const char *t, size_t len) {
+  switch (op) {
+    case UOP_INS: editorRowInsertString(editorRowAt(line), col, t, len); break;
+    case UOP_DEL: editorRowDelRange(editorRowAt(line), col, (int)len); break;
+    case UOP_INSROW: editorInsertRow(line, t, len); break;
+    case UOP_DELROW: editorDelRow(line); break;
+  }
+}
+
+// Применяет запись журнала: вперёд (повтор) или обратной правкой (отмена).
+static void undoApply(const undoRec *r, bool redo) {
+  static const unsigned char inverse[] = {
+    [UOP_INS] = UOP_DEL, [UOP_DEL] = UOP_INS, [UOP_INSROW] = UOP_DELROW, [UOP_DELROW] = UOP_INSROW,
+  };
+  editorApply(redo ? r->op : inverse[r->op], r->line, r->col, (const char*)(r + 1), r->len);
+}
+
+static void editorUndo(void) {
+  undoPos p = U.cur;
+  if (!p.b || (p.b == U.start.b && p.off == U.start.off)) { editorSetStatusMessage("Нечего отменять"); return; }
+  U.replaying = true;
+  while (1) {
+    if (p.off == 0) { p.b = p.b->prev; p.off = p.b->used; }
+    p.off = p.off == p.b->used ? p.b->last : p.off - UNDO_REC(p)->back;
+    undoRec *r = UNDO_REC(p);
+    if (r->op == UOP_GROUP) { E.cy = r->line; E.cx = r->col; break; }
+    undoApply(r, false);
+  }
+  U.replaying = false;
+  U.cur = p;
+  U.grp.b = NULL; // следующий набор — уже новый шаг
+}
+
+static void editorRedo(void) {
+  undoPos p = U.cur;
+  if (p.b && p.off == p.b->used && p.b->next) { p.b = p.b->next; p.off = 0; }
+  if (!p.b || p.off == p.b->used) { editorSetStatusMessage("Нечего повторять"); return; }
+  const int *after = (const int*)(UNDO_REC(p) + 1);
+  U.replaying = true;
+  while (1) {
+    p.off += undoRecSize(UNDO_REC(p));
+    if (p.off == p.b->used && p.b->next) { p.b = p.b->next; p.off = 0; }
+    if (p.off == p.b->used || UNDO_REC(p)->op == UOP_GROUP) break;
+    undoApply(UNDO_REC(p), true);
+  }
+  U.replaying = false;
+  E.cx = after[0]; E.cy = after[1];
+  U.cur = p;
+  U.grp.b = NULL;
+}
+
+/* ======================= Журнал восстановления ===================== */
+
+// Правки буфера — те же примитивы, что пишет журнал отмены (вставка и
+// удаление текста в строке, вставка и удаление строк), — дописываются в
+// файл <имя>.kilo-swp рядом с редактируемым. Записи копятся в памяти (набор
+// и удаление подряд склеиваются в одну запись) и уходят в файл пачкой,
+// когда их набралось KILO_JOURNAL_BATCH или первая из них ждёт дольше
+// KILO_JOURNAL_SYNC_MS; тогда же файл сбрасывается на диск. Запись на диск
+// пропорциональна правкам, а не размеру файла.
+//
+// В заголовке журнала — размер и время изменения версии файла, поверх
+// которой правки, у каждой записи — контрольная сумма: хвост, оборванный
+// падением, отбрасывается. editorOpen, найдя журнал к той же версии файла,
+// предлагает воспроизвести его. Сохранение начинает журнал заново: в новый
+// попадают только правки, сделанные после снимка сохранения. Выход
+// (в том числе подтверждённый без сохранения) журнал удаляет.
+
+#define JOURNAL_MAGIC "kilojrn1"
+#define JOURNAL_SUM0 2166136261u
+
+typedef struct journalHead {
+  char magic[8];
+  unsigned long long size, mtime; // версия файла, поверх которой правки (0, 0 — файла не было)
+  unsigned sum;        // FNV-1a заголовка с sum = 0
+  unsigned pad;
+} journalHead;
+
+typedef struct journalRec {
+  unsigned sum;        // FNV-1a записи с sum = 0 и её текста
+  unsigned char op;    // UOP_INS, UOP_DEL, UOP_INSROW, UOP_DELROW
+  unsigned char pad[3];
+  int line, col;
+  unsigned len;        // байт текста; у удалений текста нет, у UOP_DEL len — сколько удалено
+} journalRec;
+
+static struct editorJournal {
+  char *path;          // <файл>.kilo-swp; NULL — журнал не ведётся
+  platFile f;
+  bool made;           // файл журнала заведён (заводится с первой пачкой)
+  bool open;           // и открыт на дозапись
+  bool failed;         // запись не удалась: журнал больше не ведётся
+  bool unsynced;       // отдано в файл, но не сброшено на диск
+  char *buf;           // записи, ещё не отданные в файл
+  size_t n, cap;
+  size_t last;         // начало последней записи в buf; >= n — продолжать нечего
+  double since;        // когда появилась первая неотданная правка
+  bool keep;           // идёт сохранение: отданное после снимка копится в kept
+  char *kept;
+  size_t nkept, capkept;
+  size_t bytes;        // байт в файле журнала
+} J;
+
+static inline size_t journalTextLen(const journalRec *r) {
+  return r->op == UOP_DEL || r->op == UOP_DELROW ? 0 : r->len;
+}
+
+static unsigned journalSum(unsigned h, const void *p, size_t n) {
+  const unsigned char *s = (const unsigned char*)p;
+  for (size_t i = 0; i < n; i++) h = (h ^ s[i]) * 16777619u;
+  return h;
+}
+
+static void journalReserve(char **buf, size_t *cap, size_t need) {
+  if (need <= *cap) return;
+  size_t c = *cap ? *cap : 4096;
+  while (c < need) c *= 2;
+  char *b = (char*)realloc(*buf, c);
+  if (!b) die("realloc");
+  *buf = b; *cap = c;
+}
+
+static bool journalWrite(platFile f, const char *p, size_t n) {
+  while (n) {
+    size_t wr = platWrite(f, p, n);
+    if (wr == 0) return false;
+    p += wr; n -= wr;
+  }
+  return true;
+}
+
+static char *journalPath(const char *filename) {
+  char *path = (char*)malloc(strlen(filename) + sizeof(".kilo-swp"));
+  if (!path) die("malloc");
+  sprintf(path, "%s.kilo-swp", filename);
+  return path;
+}
+
+static void journalFail(void) {
+  unsigned long err = platError();
+  if (J.open) platClose(J.f);
+  J.open = false; J.failed = true;
+  J.n = 0; J.unsynced = false;
+  editorSetStatusMessage("Журнал правок %s не пишется (ошибка %lu)", J.path, err);
+}
+
+// Заводит файл журнала заново: заголовок текущей версии файла и записи
+// recs. Пишется рядом и переименовывается на место, так что прежний журнал
+// пропадает только вместе с появлением нового.
+static bool journalRewrite(const char *recs, size_t n) {
+  if (J.open) platClose(J.f);
+  J.open = J.unsynced = false;
+  journalHead h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, JOURNAL_MAGIC, sizeof(h.magic));
+  h.size = E.fsize; h.mtime = E.ftime;
+  h.sum = journalSum(JOURNAL_SUM0, &h, sizeof(h));
+  char *tmp = (char*)malloc(strlen(J.path) + sizeof(".tmp"));
+  if (!tmp) die("malloc");
+  sprintf(tmp, "%s.tmp", J.path);
+  platFile f = platCreate(tmp);
+  bool ok = f != PLAT_NOFILE;
+  if (ok) {
+    ok = journalWrite(f, (const char*)&h, sizeof(h)) && journalWrite(f, recs, n) && platSync(f);
+    platClose(f);
+    ok = ok && platRename(tmp, J.path, true);
+    if (!ok) platDelete(tmp);
+  }
+  free(tmp);
+  if (ok) J.made = true;
+  if (ok && (J.f = platAppend(J.path)) == PLAT_NOFILE) ok = false;
+  J.open = ok;
+  J.bytes = sizeof(h) + n;
+  return ok;
+}
+
+// Отдаёт накопленные записи в файл; sync — и сбрасывает его на диск.
+static void journalFlush(bool sync) {
+  if (J.n) {
+    for (size_t at = 0; at < J.n; ) { // суммы — только сейчас: склейка меняет записи
+      journalRec r;
+      memcpy(&r, J.buf + at, sizeof(r));
+      size_t t = journalTextLen(&r);
+      r.sum = 0;
+      r.sum = journalSum(journalSum(JOURNAL_SUM0, &r, sizeof(r)), J.buf + at + sizeof(r), t);
+      memcpy(J.buf + at, &r, sizeof(r));
+      at += sizeof(r) + t;
+    }
+    if (!J.open && !journalRewrite(NULL, 0)) { journalFail(); return; }
+    if (!journalWrite(J.f, J.buf, J.n)) { journalFail(); return; }
+    if (J.keep) {
+      journalReserve(&J.kept, &J.capkept, J.nkept + J.n);
+      memcpy(J.kept + J.nkept, J.buf, J.n);
+      J.nkept += J.n;
+    }
+    J.bytes += J.n;
+    J.n = 0;
+    J.unsynced = true;
+  }
+  if (sync && J.unsynced) {
+    if (!platSync(J.f)) { journalFail(); return; }
+    J.unsynced = false;
+  }
+}
+
+// Правка буфера (вызывается из undoRecord). Набор с того места, где
+// кончилась прошлая вставка, и удаление подряд дописываются в её запись.
+static void journalRecord(int op, int line, int col, const char *s, size_t len) {
+  if (!J.path || J.failed) return;
+  journalRec r;
+  bool joined = false;
+  if (J.last < J.n) {
+    memcpy(&r, J.buf + J.last, sizeof(r));
+    if (r.op == op && r.line == line) {
+      if (op == UOP_INS && col == r.col + (int)r.len) {
+        journalReserve(&J.buf, &J.cap, J.n + len);
+        memcpy(J.buf + J.n, s, len);
+        J.n += len;
+        joined = true;
+      } else if (op == UOP_DEL && col == r.col) joined = true;                          // Delete
+      else if (op == UOP_DEL && col + (int)len == r.col) { r.col = col; joined = true; } // Backspace
+    }
+    if (joined) {
+      r.len += (unsigned)len;
+      memcpy(J.buf + J.last, &r, sizeof(r));
+    }
+  }
+  if (!joined) {
+    memset(&r, 0, sizeof(r));
+    r.op = (unsigned char)op; r.line = line; r.col = col; r.len = (unsigned)len;
+    size_t t = journalTextLen(&r);
+    journalReserve(&J.buf, &J.cap, J.n + sizeof(r) + t);
+    if (!J.n) J.since = platNow();
+    J.last = J.n;
+    memcpy(J.buf + J.n, &r, sizeof(r));
+    if (t) memcpy(J.buf + J.n + sizeof(r), s, t);
+    J.n += sizeof(r) + t;
+  }
+  if (J.n >= KILO_JOURNAL_BATCH) journalFlush(false);
+}
+
+static bool journalPending(void) { return J.n || J.unsynced; }
+
+// Пачка уходит на диск не позже KILO_JOURNAL_SYNC_MS после первой правки в ней.
+static void journalPoll(void) {
+  if (journalPending() && !J.failed && platNow() - J.since >= KILO_JOURNAL_SYNC_MS / 1000.0) journalFlush(true);
+}
+
+// Буфер брошен (выход, открытие другого файла): журнал больше не нужен.
+static void journalDrop(void) {
+  if (J.open) platClose(J.f);
+  if (J.made) platDelete(J.path);
+  free(J.path); free(J.buf); free(J.kept);
+  memset(&J, 0, sizeof(J));
+}
+
+// Снят снимок для сохранения: что отдано в журнал до него, остаётся в
+// старом журнале, что после — копится для нового.
+static void journalSaveBegin(void) {
+  if (!J.path) J.path = journalPath(E.filename);
+  if (J.failed) return;
+  journalFlush(false);
+  J.keep = true;
+  J.nkept = 0;
+}
+
+// Сохранение кончилось. Удалось — журнал начинается заново от записанной
+// версии (E.fsize и E.ftime уже её) с правками, сделанными за время записи.
+static void journalSaveEnd(bool ok) {
+  J.keep = false;
+  if (ok && !J.failed) {
+    if (J.nkept) {
+      if (!journalRewrite(J.kept, J.nkept)) journalFail();
+    } else if (J.made) {
+      if (J.open) platClose(J.f);
+      platDelete(J.path);
+      J.made = J.open = J.unsynced = false;
+      J.bytes = 0;
+    }
+  }
+  J.nkept = 0;
+}
+
+// Вопрос с ответом y/n в строке сообщений.
+static bool editorAsk(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+  va_end(ap);
+  E.statusmsg_time = time(NULL);
+  while (1) {
+    editorRefreshScreen();
+    int c = editorReadKey();
+    if (c == 'y' || c == 'Y') return true;
+    if (c == 'n' || c == 'N' || c == '\x1b') return false;
+  }
+}
+
+// Запись r приложима к буферу как он есть.
+static bool journalFits(const journalRec *r) {
+  if (r->line < 0 || r->col < 0) return false;
+  switch (r->op) {
+    case UOP_INSROW: return r->line <= E.numrows;
+    case UOP_DELROW: return r->line < E.numrows;
+    case UOP_INS: return r->line < E.numrows && r->col <= editorRowAt(r->line)->size;
+    case UOP_DEL: return r->line < E.numrows && (size_t)r->col + r->len <= (size_t)editorRowAt(r->line)->size;
+  }
+  return false;
+}
+
+// Проверяет журнал path и, если он к открытой версии файла, предлагает
+// воспроизвести его. Воспроизведённые записи остаются журналом буфера.
+static void journalRecover(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) return;
+  char *data = NULL;
+  size_t size = 0, cap = 0, rd;
+  do {
+    journalReserve(&data, &cap, size + 65536);
+    rd = fread(data + size, 1, cap - size, fp);
+    size += rd;
+  } while (rd > 0);
+  fclose(fp);
+
+  journalHead h;
+  bool ok = size >= sizeof(h);
+  if (ok) {
+    memcpy(&h, data, sizeof(h));
+    unsigned sum = h.sum;
+    h.sum = 0;
+    ok = memcmp(h.magic, JOURNAL_MAGIC, sizeof(h.magic)) == 0 && journalSum(JOURNAL_SUM0, &h, sizeof(h)) == sum;
+  }
+  // записи до первой битой: дальше — хвост, оборванный падением
+  size_t at = sizeof(h), nrec = 0;
+  while (ok && size - at >= sizeof(journalRec)) {
+    journalRec r;
+    memcpy(&r, data + at, sizeof(r));
+    if (r.op < UOP_INS || r.op > UOP_DELROW) break;
+    size_t t = journalTextLen(&r);
+    if (size - at - sizeof(r) < t) break;
+    unsigned sum = r.sum;
+    r.sum = 0;
+    if (journalSum(journalSum(JOURNAL_SUM0, &r, sizeof(r)), data + at + sizeof(r), t) != sum) break;
+    at += sizeof(r) + t;
+    nrec++;
+  }
+  if (!ok || nrec == 0) { platDelete(path); free(data); return; }
+  if (h.size != E.fsize || h.mtime != E.ftime) {
+    // файл менялся после журнала: правки к нему не приложить, но и не выбрасываем
+    char *aside = (char*)malloc(strlen(path) + sizeof("-old"));
+    if (!aside) die("malloc");
+    sprintf(aside, "%s-old", path);
+    platRename(path, aside, true);
+    editorSetStatusMessage("Журнал правок к другой версии файла — отложен в %s", aside);
+    free(aside); free(data);
+    return;
+  }
+  if (!editorAsk("Найден журнал несохранённых правок (%zu). Восстановить? (y/n)", nrec)) {
+    platDelete(path); free(data);
+    editorSetStatusMessage("");
+    return;
+  }
+
+  double t0 = platNow();
+  size_t end = sizeof(h), done = 0;
+  E.cx = E.cy = 0; // сюда же вернёт курсор отмена восстановления
+  undoBegin(UG_OTHER); // восстановление отменяется одним шагом
+  for (; done < nrec; done++) {
+    journalRec r;
+    memcpy(&r, data + end, sizeof(r));
+    if (!journalFits(&r)) break;
+    editorApply(r.op, r.line, r.col, data + end + sizeof(r), r.len);
+    end += sizeof(r) + journalTextLen(&r);
+  }
+  undoEnd();
+  J.path = _strdup(path);
+  if (!J.path) die("strdup");
+  if (!journalRewrite(data + sizeof(h), end - sizeof(h))) journalFail();
+  else if (done < nrec) editorSetStatusMessage("Журнал не сходится с файлом: восстановлено %zu правок из %zu", done, nrec);
+  else editorSetStatusMessage("Восстановлено правок: %zu (%.0f мс) — сохраните файл", done, (platNow() - t0) * 1e3);
+  free(data);
+}
+
+// Журнал для только что открытого файла; прежний (брошенного буфера)
+// удаляется.
+static void journalStart(const char *filename) {
+  journalDrop();
+  char *path = journalPath(filename);
+  journalRecover(path); // воспроизведение в журнал не пишется: J.path ещё нет
+  if (!J.path) J.path = path;
+  else free(path);
+}
+
+/* ============================ Файл I/O ============================== */
+
+// Сохранение пишет файл потоком прямо из хранилища строк, без сборки всего
+// текста в одну строку. Снимок буфера — список кусков: строки диапазонов
+// остаются ссылками на отображение (оно не меняется, пока его не закроют),
+// тексты развёрнутых строк копируются подряд в одну арену. По снимку пишется
+// временный файл рядом с настоящим, сбрасывается на диск и переименовывается
+// на место: упавшая посередине запись не портит старую версию. Большие файлы
+// пишет фоновый поток, а редактирование тем временем продолжается.
+//
+// Пишется сам файл, а не ссылка на него (ссылки разыменовываются), и
+// временный файл получает его права и владельца. Если замена потеряла бы
+// владельца или жёсткие ссылки, временный файл переписывается поверх
+// настоящего.
+
+typedef struct savePiece {
+  const char *p;       // байты (уже с '\n'); NULL — из файла: строки [line, line + len)
+  size_t len;          // или, у строки-окна (row), её байты [line, line + len) и '\n'
+  size_t line;
+  bool row;
+} savePiece;
+
+typedef struct saveJob {
+  savePiece *pc;
+  int n, cap;
+  char *copy;          // тексты развёрнутых строк
+  char *dst;           // E.filename с разыменованными ссылками
+  char *tmp;           // временный файл рядом с dst
+  bool inplace;        // dst не заменить: временный файл переписывается поверх него
+  platThread thread;
+  size_t total;        // примерный размер файла, для прогресса
+  volatile size_t done; // записано байт (пишет поток, читает интерфейс)
+  unsigned long err;   // 0 — файл записан и сброшен на диск
+  int dirty;           // E.dirty на момент снимка
+  char *batch;         // мелкие куски копятся здесь до одной записи
+  size_t blen;
+  char *rbuf;          // строки файла, прочитанные мимо отображения
+  bool shrunk;         // файл укоротили на диске, пока его строки писались
+} saveJob;
+
+static void savePush(saveJob *j, const char *p, size_t len, size_t line) {
+  if (j->n == j->cap) {
+    j->cap = j->cap ? j->cap * 2 : 16;
+    j->pc = (savePiece*)realloc(j->pc, sizeof(savePiece) * j->cap);
+    if (!j->pc) die("realloc");
+  }
+  j->pc[j->n].p = p; j->pc[j->n].len = len; j->pc[j->n].line = line;
+  j->pc[j->n].row = false;
+  j->n++;
+}
+
+static void saveFreeJob(saveJob *j) {
+  free(j->pc); free(j->copy); free(j->dst); free(j->tmp); free(j->batch); free(j->rbuf);
+  free(j);
+}
+
+// Строки [first, first + n) файла — в снимок, к соседнему такому куску.
+static void saveAddLines(saveJob *j, size_t first, size_t n) {
+  savePiece *last = j->n ? &j->pc[j->n - 1] : NULL;
+  j->total += E.lineoff[first + n] - E.lineoff[first];
+  if (last && !last->p && !last->row && last->line + last->len == first) last->len += n;
+  else savePush(j, NULL, n, first);
+}
+
+// Копии строк j->copy[start, end) — в снимок, к соседнему такому куску.
+static void saveAddCopy(saveJob *j, size_t start, size_t end) {
+  savePiece *last = j->n ? &j->pc[j->n - 1] : NULL;
+  j->total += end - start;
+  if (last && last->p && last->p + last->len == &j->copy[start]) last->len += end - start;
+  else if (end > start) savePush(j, &j->copy[start], end - start, 0);
+}
+
+// Снимок буфера для записи. NULL — не хватило памяти на копию строк.
+static saveJob *editorSaveSnapshot(void) {
+  saveJob *j = (saveJob*)calloc(1, sizeof(saveJob));
+  if (!j) return NULL;
+  size_t copylen = 0;
+  for (ltleaf *lf = E.root ? ltFirstLeaf() : NULL; lf; lf = lf->next)
+    if (lf->h.leaf == LT_ROWS)
+      for (int i = 0; i < lf->h.n; i++)
+        if (!lf->rows[i].mapped) copylen += (size_t)lf->rows[i].size + 1;
+  j->copy = (char*)malloc(copylen ? copylen : 1);
+  if (!j->copy) { free(j); return NULL; }
+
+  size_t c = 0;
+  for (ltleaf *lf = E.root ? ltFirstLeaf() : NULL; lf; lf = lf->next) {
+    if (lf->h.leaf == LT_SPAN) {
+      saveAddLines(j, lf->first, (size_t)lf->h.n);
+      continue;
+    }
+    size_t start = c;
+    for (int i = 0; i < lf->h.n; i++) {
+      erow *row = &lf->rows[i];
+      if (row->mapped) { // окно в файл: его байты прочтёт запись, отображение здесь не читается
+        saveAddCopy(j, start, c);
+        savePush(j, NULL, (size_t)row->size, (size_t)(row->chars - E.map));
+        j->pc[j->n - 1].row = true;
+        j->total += (size_t)row->size + 1;
+        start = c;
+        continue;
+      }
+      memcpy(&j->copy[c], editorRowData(row), row->size);
+      c += row->size;
+      j->copy[c++] = '\n';
+    }
+    saveAddCopy(j, start, c);
+  }
+  j->dirty = E.dirty;
+  return j;
+}
+
+// Пишет len байт целиком.
+static bool saveWrite(saveJob *j, platFile f, const char *p, size_t len) {
+  while (len) {
+    size_t wr = platWrite(f, p, len);
+    if (wr == 0) return false;
+    p += wr; len -= wr;
+    j->done += wr;
+  }
+  return true;
+}
+
+// Кусок в очередь записи: мелкие копятся в batch, крупные идут мимо него.
+static bool saveEmit(saveJob *j, platFile h, const char *p, size_t len) {
+  if (j->blen + len <= KILO_SAVE_BATCH) {
+    memcpy(&j->batch[j->blen], p, len);
+    j->blen += len;
+    return true;
+  }
+  if (j->blen && !saveWrite(j, h, j->batch, j->blen)) return false;
+  j->blen = 0;
+  if (len >= KILO_SAVE_BATCH / 2) return saveWrite(j, h, p, len);
+  memcpy(j->batch, p, len);
+  j->blen = len;
+  return true;
+}
+
+// Строки [line, line + n) отображения как есть, кроме '\r' перед '\n' и в
+// конце файла (их отрезает editorMapLine) и '\n' у последней строки без него.
+// Байты читаются мимо отображения (editorMapRead): файл, который укоротили
+// во время записи, — ошибка сохранения, а не падение.
+static bool saveEmitLines(saveJob *j, platFile h, size_t line, size_t n) {
+  size_t off = E.lineoff[line], endoff = E.lineoff[line + n];
+  size_t end = endoff > E.mapsize ? E.mapsize : endoff;
+  bool cr = false; // прошлый кусок кончился на '\r': оставить его решит следующий
+  while (off < end) {
+    size_t len = end - off < KILO_SAVE_BATCH ? end - off : KILO_SAVE_BATCH;
+    const char *p = editorMapRead(off, j->rbuf, len), *e, *r;
+    if (!p) { j->shrunk = true; return false; }
+    e = p + len;
+    if (cr && *p != '\n' && !saveEmit(j, h, "\r", 1)) return false;
+    cr = false;
+    while ((r = (const char*)memchr(p, '\r', e - p)) != NULL) {
+      if (r + 1 == e) { cr = true; break; }
+      if (!saveEmit(j, h, p, r + (r[1] != '\n') - p)) return false;
+      p = r + 1;
+    }
+    if (e - cr > p && !saveEmit(j, h, p, e - cr - p)) return false;
+    off += len;
+  }
+  if (cr && endoff <= E.mapsize && !saveEmit(j, h, "\r", 1)) return false;
+  return endoff <= E.mapsize || saveEmit(j, h, "\n", 1);
+}
+
+// Байты [off, off + len) файла и '\n' — строка-окно.
+static bool saveEmitRow(saveJob *j, platFile h, size_t off, size_t len) {
+  while (len) {
+    size_t n = len < KILO_SAVE_BATCH ? len : KILO_SAVE_BATCH;
+    const char *p = editorMapRead(off, j->rbuf, n);
+    if (!p) { j->shrunk = true; return false; }
+    if (!saveEmit(j, h, p, n)) return false;
+    off += n; len -= n;
+  }
+  return saveEmit(j, h, "\n", 1);
+}
+
+// Пишет снимок во временный файл и сбрасывает его на диск; при ошибке файл
+// удаляется, код ошибки остаётся в err.
+static void saveRun(saveJob *j) {
+  platFile h = platCreate(j->tmp);
+  if (h == PLAT_NOFILE) { j->err = platError(); return; }
+  if (!j->inplace && !platCopyMeta(h, j->dst)) {
+    j->err = platError();
+    platClose(h);
+    platDelete(j->tmp);
+    return;
+  }
+  bool ok = (j->batch = (char*)malloc(KILO_SAVE_BATCH)) != NULL && (j->rbuf = (char*)malloc(KILO_SAVE_BATCH)) != NULL;
+  for (int i = 0; ok && i < j->n; i++) {
+    savePiece *pc = &j->pc[i];
+    ok = pc->p     ? saveEmit(j, h, pc->p, pc->len)
+       : pc->row ? saveEmitRow(j, h, pc->line, pc->len)
+                 : saveEmitLines(j, h, pc->line, pc->len);
+  }
+  ok = ok && (!j->blen || saveWrite(j, h, j->batch, j->blen)) && platSync(h);
+  if (!ok) j->err = j->rbuf ? platError() : PLAT_ENOMEM;
+  if (!ok && !j->err) j->err = PLAT_ENOMEM; // запись вернула 0 или файл кончился, без кода ошибки
+  platClose(h);
+  if (!ok) platDelete(j->tmp);
+}
+
+static void saveWorker(void *arg) {
+  saveRun((saveJob*)arg);
+}
+
+// Индекс строк: смещения символов, следующих за каждым '\n'. Файл режется
+// на куски по числу ядер; каждый поток векторно (AVX2/SSE2, иначе memchr)
+// сначала считает переводы строк в своём куске, затем по префиксным суммам
+// пишет смещения прямо на своё место в общем массиве — без переаллокаций
+// и отдельной склейки. Одному потоку считать заранее незачем: он проходит
+// файл один раз, дописывая в растущий массив. '\r' перед '\n' отрезается
+// позже, в editorMapLine.
+
+typedef struct lineChunk {
+  const char *base;    // смещения считаются от начала этого файла
+  const char *begin, *end;
+  size_t *out;         // NULL — только подсчитать
+  size_t n;
+} lineChunk;
+
+static void lineScanScalar(lineChunk *c, const char *p) {
+  while ((p = (const char*)memchr(p, '\n', c->end - p)) != NULL) {
+    p++;
+    if (c->out) c->out[c->n] = (size_t)(p - c->base);
+    c->n++;
+  }
+}
+
+#ifdef KILO_SIMD_X86
+static void lineScanSSE2(lineChunk *c) {
+  const char *p = c->begin;
+  const __m128i nl = _mm_set1_epi8('\n');
+  for (; c->end - p >= 16; p += 16) {
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), nl));
+    if (!c->out) { c->n += __builtin_popcount(mask); continue; }
+    size_t base = (size_t)(p - c->base) + 1;
+    while (mask) { c->out[c->n++] = base + __builtin_ctz(mask); mask &= mask - 1; }
+  }
+  lineScanScalar(c, p);
+}
+
+__attribute__((target("avx2")))
+static void lineScanAVX2(lineChunk *c) {
+  const char *p = c->begin;
+  const __m256i nl = _mm256_set1_epi8('\n');
+  for (; c->end - p >= 32; p += 32) {
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), nl));
+    if (!c->out) { c->n += __builtin_popcount(mask); continue; }
+    size_t base = (size_t)(p - c->base) + 1;
+    while (mask) { c->out[c->n++] = base + __builtin_ctz(mask); mask &= mask - 1; }
+  }
+  lineScanScalar(c, p);
+}
+#endif
+
+static void lineScan(lineChunk *c) {
+#ifdef KILO_SIMD_X86
+  if (__builtin_cpu_supports("avx2")) lineScanAVX2(c);
+  else lineScanSSE2(c);
+#else
+  lineScanScalar(c, c->begin);
+#endif
+}
+
+static void lineScanWorker(void *arg) {
+  lineScan((lineChunk*)arg);
+}
+
+// Прогоняет lineScan по всем кускам: нулевой здесь, остальные в потоках.
+static void lineScanAll(lineChunk *chunk, int nchunks) {
+  platThread th[KILO_INDEX_MAX_THREADS];
+  bool started[KILO_INDEX_MAX_THREADS];
+  for (int t = 1; t < nchunks; t++) started[t] = platThreadStart(&th[t], lineScanWorker, &chunk[t]);
+  lineScan(&chunk[0]);
+  for (int t = 1; t < nchunks; t++) {
+    if (started[t]) platThreadJoin(&th[t]);
+    else lineScan(&chunk[t]); // поток не создался — доделываем сами
+  }
+}
+
+static void lineReserve(size_t **v, size_t *cap, size_t need) {
+  if (need <= *cap) return;
+  size_t c = *cap * 2 > need ? *cap * 2 : need;
+  size_t *nv = (size_t*)realloc(*v, sizeof(size_t) * c);
+  if (!nv) die("realloc");
+  *v = nv; *cap = c;
+}
+
+// Дописывает в (*v)[n..] начала строк после каждого '\n' в base[from, to) и
+// возвращает новое n; в массиве остаётся место ещё под два элемента. Большой
+// диапазон размечается параллельно.
+static size_t lineIndexRange(const char *base, size_t from, size_t to, size_t **v, size_t n, size_t *cap) {
+  int nchunks = 1;
+  if (to - from >= KILO_INDEX_PAR_MIN) {
+    nchunks = platCpuCount();
+    if (nchunks < 1) nchunks = 1;
+    if (nchunks > KILO_INDEX_MAX_THREADS) nchunks = KILO_INDEX_MAX_THREADS;
+  }
+
+  if (nchunks == 1) {
+    lineChunk c = { base, NULL, NULL, NULL, n };
+    for (size_t at = from; at < to; at += KILO_INDEX_BLOCK) {
+      size_t end = to - at > KILO_INDEX_BLOCK ? at + KILO_INDEX_BLOCK : to;
+      lineReserve(v, cap, c.n + (end - at) + 2); // '\n' в куске не больше, чем байт
+      c.begin = base + at; c.end = base + end; c.out = *v;
+      lineScan(&c);
+    }
+    lineReserve(v, cap, c.n + 2);
+    return c.n;
+  }
+
+  lineChunk chunk[KILO_INDEX_MAX_THREADS];
+  size_t part = (to - from) / nchunks;
+  for (int t = 0; t < nchunks; t++) {
+    chunk[t].base = base;
+    chunk[t].begin = base + from + part * t;
+    chunk[t].end = (t == nchunks - 1) ? base + to : chunk[t].begin + part;
+    chunk[t].out = NULL;
+    chunk[t].n = 0;
+  }
+  lineScanAll(chunk, nchunks);
+
+  size_t total = 0;
+  for (int t = 0; t < nchunks; t++) total += chunk[t].n;
+  lineReserve(v, cap, n + total + 2);
+  for (int t = 0; t < nchunks; t++) {
+    chunk[t].out = *v + n;
+    n += chunk[t].n;
+    chunk[t].n = 0;
+  }
+  lineScanAll(chunk, nchunks);
+  return n;
+}
+
+// Строит индекс начал строк файла map в *lo и возвращает число элементов
+// (строк + 1).
+static size_t lineIndexFile(const char *map, size_t size, size_t **lo) {
+  size_t cap = 0;
+  *lo = NULL;
+  size_t n = lineIndexRange(map, 0, size, lo, 1, &cap);
+  (*lo)[0] = 0;
+  // последняя строка без '\n': её конец + 1 за пределами файла
+  if ((*lo)[n - 1] < size) (*lo)[n++] = size + 1;
+  if (cap > n) { // запас роста больше не нужен
+    size_t *fit = (size_t*)realloc(*lo, sizeof(size_t) * n);
+    if (fit) *lo = fit;
+  }
+  return n;
+}
+
+// Строит E.lineoff по E.map и возвращает число элементов (строк + 1).
+static size_t editorIndexLines(void) {
+  return lineIndexFile(E.map, E.mapsize, &E.lineoff);
+}
+
+// Номера и длины строк в буфере — int: файл из INT_MAX строк и больше или
+// со строкой от INT_MAX байт он не вмещает. lo — индекс файла размера size.
+static bool lineIndexFits(const size_t *lo, size_t n, size_t size) {
+  if (n - 1 >= INT_MAX) return false;
+  if (size < INT_MAX) return true; // длинной строке неоткуда взяться
+  for (size_t k = 1; k < n; k++)
+    if (lo[k] - lo[k - 1] > INT_MAX) return false; // строка и её '\n'
+  return true;
+}
+
+static void editorUnmapFile(void) {
+  triStop(); // поток индекса читает отображение
+  if (E.mapcopy) free((void*)E.map);
+  else platUnmapFile(&E.mapping, E.map, E.mapsize);
+  E.mapcopy = false;
+  if (E.stale) { platDelete(E.stale); free(E.stale); E.stale = NULL; }
+  free(E.lineoff);
+  free(E.linestate);
+  E.map = NULL; E.mapsize = 0; E.lineoff = NULL;
+  E.linestate = NULL; E.nlines = 0;
+}
+
+// Отображённый файл укоротили на диске (ротация логов через copytruncate):
+// страница отображения за его новым концом при чтении роняет процесс.
+static bool editorMapShrunk(void) {
+  return E.mapping.held && E.map && platMapSize(&E.mapping) < E.mapsize;
+}
+
+// FNV-1a последних KILO_WATCH_TAIL байт из первых size байт отображения.
+static unsigned long long mapTailSum(const char *map, size_t size) {
+  unsigned long long h = 14695981039346656037ull;
+  for (size_t i = size > KILO_WATCH_TAIL ? size - KILO_WATCH_TAIL : 0; i < size; i++)
+    h = (h ^ (unsigned char)map[i]) * 1099511628211ull;
+  return h;
+}
+
+// Строки отображённого файла (lineoff и linestate готовы) — одним
+// листом-диапазоном; индекс поиска строится заново.
+static void editorMapRows(void) {
+  if (E.nlines > 1) {
+    ltleaf *sp = ltNewLeaf(LT_SPAN);
+    sp->h.n = sp->h.count = (int)(E.nlines - 1);
+    E.root = &sp->h;
+    E.numrows = (int)(E.nlines - 1);
+  }
+  triStart();
+}
+
+// Отображает файл в память и строит индекс начал строк; сами строки остаются
+// одним листом-диапазоном. 0 — успех, -1 — файла нет или он не открылся,
+// -2 — буфер его не вмещает (lineIndexFits).
+static int editorMapFile(const char *filename) {
+  if (platMapFile(filename, &E.mapping, &E.map, &E.mapsize) != 0) { editorUnmapFile(); return -1; }
+  E.ftail = mapTailSum(E.map, E.mapsize);
+  if (!E.map) return 0; // пустой файл не отображается
+
+  E.nlines = editorIndexLines();
+  if (!lineIndexFits(E.lineoff, E.nlines, E.mapsize)) { editorUnmapFile(); return -2; }
+  E.linestate = (unsigned char*)calloc(E.nlines, 1);
+  if (!E.linestate) die("calloc");
+  editorMapRows();
+  return 0;
+}
+
+static void editorOpen(const char *filename) {
+  free(E.filename);
+  E.filename = _strdup(filename);
+  editorSelectSyntaxHighlight();
+
+  editorFreeRows();
+  editorUnmapFile();
+  int rc = editorMapFile(filename); // нет файла — значит новый
+  undoClear();
+  E.dirty = 0;
+  if (rc == -2) { // буфер остаётся без имени: Ctrl-S не запишет пустоту поверх файла
+    editorSetStatusMessage("%s не открыт: строк или байт в строке — от INT_MAX", filename);
+    journalDrop();
+    free(E.filename);
+    E.filename = NULL;
+    E.fsize = E.ftime = 0;
+    return;
+  }
+  if (!platFileStamp(filename, &E.fsize, &E.ftime)) E.fsize = E.ftime = 0;
+  journalStart(filename);
+}
+
+// FNV-1a содержимого буфера (строки через \n): сверка итога воспроизведения.
+static unsigned long long editorBufferHash(void) {
+  unsigned long long h = 14695981039346656037ull;
+  rowIter it;
+  int at = 0;
+  for (erow *row = editorRowIterAt(&it, 0); row; row = editorRowIterNext(&it), at++) {
+    const unsigned char *p = (const unsigned char*)editorRowData(row);
+    if (at) h = (h ^ '\n') * 1099511628211ull;
+    for (int j = 0; j < row->size; j++) h = (h ^ p[j]) * 1099511628211ull;
+  }
+  return h;
+}
+
+static char *editorPrompt(const char *prompt, void (*callback)(const char *, int), bool empty);
+static void editorMapCheck(void);
+static void searchReset(void);
+
+// Переписывает временный файл поверх настоящего. Строки буфера ссылаются
+// на настоящий, поэтому буфер сначала его отпускает (editorSaveFinish
+// отобразит записанное заново). Запись не удалась — буфер берёт текст из
+// временного файла, и тот удалится вместе с отображением.
+static bool saveInPlace(saveJob *j) {
+  platMapping m;
+  const char *p = NULL;
+  size_t size = 0;
+  memset(&m, 0, sizeof(m));
+  if (platMapFile(j->tmp, &m, &p, &size) != 0) {
+    j->err = platError();
+    platUnmapFile(&m, p, size);
+    return false;
+  }
+  editorFreeRows();
+  editorUnmapFile();
+  platFile h = platCreate(j->dst);
+  j->done = 0;
+  bool ok = h != PLAT_NOFILE && saveWrite(j, h, p, size) && platSync(h);
+  if (!ok) j->err = platError();
+  if (h != PLAT_NOFILE) platClose(h);
+  platUnmapFile(&m, p, size);
+  if (ok) { platDelete(j->tmp); return true; }
+  if (!j->err) j->err = PLAT_ENOMEM; // запись вернула 0 без кода ошибки
+  editorMapFile(j->tmp);
+  E.stale = _strdup(j->tmp);
+  if (!E.stale) die("strdup");
+  return false;
+}
+
+// Ставит записанный временный файл на место настоящего. Отображённый файл
+// Windows заменить не даёт, но переименовать даёт: тогда старая версия
+// отодвигается в сторону и живёт, пока на неё ссылаются строки буфера.
+static bool saveReplace(saveJob *j) {
+  if (j->inplace) return saveInPlace(j);
+  if (platReplace(j->tmp, j->dst, NULL)) return true;
+  if (!E.mapping.held || E.stale) return false;
+  char *aside = (char*)malloc(strlen(j->dst) + sizeof(".kilo-old"));
+  if (!aside) die("malloc");
+  sprintf(aside, "%s.kilo-old", j->dst);
+  if (platReplace(j->tmp, j->dst, aside)) { E.stale = aside; return true; }
+  free(aside);
+  return false;
+}
+
+// Завершает сохранение: файл на место, и если за время записи буфер не
+// менялся — открываем записанный файл заново (индекс строк, без копий).
+static void editorSaveFinish(saveJob *j) {
+  if (!j->err && !saveReplace(j)) {
+    if (!j->err) j->err = platError();
+    platDelete(j->tmp);
+  }
+  if (!j->err && !platFileStamp(E.filename, &E.fsize, &E.ftime)) E.fsize = E.ftime = 0;
+  journalSaveEnd(!j->err);
+  if (j->shrunk) {
+    editorSetStatusMessage("Не удалось сохранить %s: файл укоротили на диске во время записи", E.filename);
+  } else if (j->err) {
+    editorSetStatusMessage("Не удалось сохранить %s (ошибка %lu)", E.filename, (unsigned long)j->err);
+  } else {
+    if (E.dirty == j->dirty) {
+      editorFreeRows();
+      editorUnmapFile();
+      editorMapFile(E.filename);
+      E.dirty = 0;
+    }
+    editorSetStatusMessage("%llu bytes written%s", (unsigned long long)j->done,
+                           E.dirty ? " (буфер менялся во время записи)" : "");
+  }
+  saveFreeJob(j);
+}
+
+// Проверяет фоновое сохранение: закончилось — завершает, иначе показывает прогресс.
+static void editorSavePoll(void) {
+  saveJob *j = E.save;
+  if (!j) return;
+  if (platThreadDone(&j->thread)) {
+    E.save = NULL;
+    editorSaveFinish(j);
+    return;
+  }
+  size_t done = j->done;
+  editorSetStatusMessage("Сохранение %s: %d%% (%llu МБ)", E.filename,
+                         j->total ? (int)((done > j->total ? j->total : done) * 100 / j->total) : 0,
+                         (unsigned long long)(done >> 20));
+}
+
+static void editorSaveWait(void) {
+  if (!E.save) return;
+  saveJob *j = E.save;
+  platThreadJoin(&j->thread);
+  E.save = NULL;
+  editorSaveFinish(j);
+}
+
+static void editorSave(void) {
+  if (E.save) { editorSavePoll(); return; } // уже пишется: пусть покажет прогресс
+  if (!E.filename) {
+    char *name = editorPrompt("Сохранить как: %s (ESC отмена)", NULL, false);
+    if (!name) { editorSetStatusMessage("Сохранение отменено"); return; }
+    E.filename = name; // владение переходит в E
+    editorSelectSyntaxHighlight();
+  }
+
+  editorMapCheck(); // снимок читает свои строки из отображения
+  saveJob *j = editorSaveSnapshot();
+  if (!j) { editorSetStatusMessage("Не хватает памяти для сохранения"); return; }
+  journalSaveBegin();
+  j->dst = platRealPath(E.filename);
+  if (!j->dst) die("strdup");
+  j->inplace = !platCanReplace(j->dst);
+  j->tmp = (char*)malloc(strlen(j->dst) + sizeof(".kilo-tmp"));
+  if (!j->tmp) die("malloc");
+  sprintf(j->tmp, "%s.kilo-tmp", j->dst);
+  // поверх файла пишется сразу: пока не записано, буфер не должен меняться
+  if (!j->inplace && j->total >= KILO_SAVE_ASYNC_MIN && platThreadStart(&j->thread, saveWorker, j)) {
+    E.save = j;
+    editorSavePoll();
+    return;
+  }
+  saveRun(j);
+  editorSaveFinish(j);
+}
+
+/* ========================= Слежение за файлом ======================= */
+
+// Раз в KILO_WATCH_MS главный цикл (и ожидание клавиши в нём) сверяет размер
+// и время изменения файла на диске с E.fsize/E.ftime. Если файл поменяла
+// другая программа, а несохранённых правок нет, буфер перечитывается;
+// курсор и прокрутка остаются на тех же номерах строк. Есть правки —
+// только предупреждение: следующее сохранение перезапишет чужую версию.
+//
+// Перечитывание не начинается с нуля. Тот же файл, ставший длиннее, с
+// прежним хвостом (E.ftail) считается дописанным: размечаются только новые
+// байты, у прежних строк остаются начала и состояние подсветки. Файл,
+// подменённый другим под тем же именем (так пишут файл почти все программы,
+// так работает и ротация логов), сравнивается с прежним отображением по
+// кускам, границы которых определяет содержимое: скользящий gear-хеш по
+// последним 64 байтам, граница — после ближайшего за ним '\n', так что
+// кусок — целые строки, а правка сдвигает только соседние границы. Куски,
+// нашедшиеся в прежней версии (по хешу и сверкой байтов), переносят начала
+// строк и их состояние подсветки, размечаются только остальные. Файл,
+// переписанный на месте, прежнее отображение уже не показывает — тогда он
+// разбирается заново.
+
+#define WATCH_CHUNK_MIN (2u << 10)  // до этого граница не ищется
+#define WATCH_CHUNK_BITS 13         // граница — нули в старших битах хеша: ещё ~8 КБ
+#define WATCH_CHUNK_MAX (64u << 10) // дальше граница — первый же '\n'
+
+typedef struct watchChunk {
+  size_t off, len;
+  unsigned long long sum;
+  size_t line;         // первая строка куска: в прежнем индексе — у найденных
+  long long match;     // у кусков новой версии: такой же кусок прежней, -1 — нет
+} watchChunk;
+
+typedef struct watchSplit {
+  const char *p;
+  size_t size;
+  watchChunk *c;       // места хватает: кусок не короче WATCH_CHUNK_MIN, кроме последнего
+  size_t n;
+} watchSplit;
+
+typedef struct watchSlot {
+  unsigned long long sum;
+  long long head;      // первый ещё не пройденный прежний кусок с этим хешем, -1 — кончились
+} watchSlot;
+
+static struct editorWatch {
+  double next;         // когда снова смотреть на файл
+  unsigned long long size, mtime; // версия на диске, о которой уже сказали
+} W;
+
+static unsigned long long watch_gear[256];
+
+static void watchGearInit(void) {
+  static bool done = false;
+  if (done) return;
+  unsigned long long x = 0;
+  for (int i = 0; i < 256; i++) { // splitmix64
+    unsigned long long z = (x += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    watch_gear[i] = z ^ (z >> 31);
+  }
+  done = true;
+}
+
+// Хеш куска по 8 байт: сравнение кусков, байты потом сверяются.
+static unsigned long long watchSum(const char *p, size_t n) {
+  unsigned long long h = n * 0x9E3779B97F4A7C15ull, w;
+  for (; n >= 8; p += 8, n -= 8) {
+    memcpy(&w, p, 8);
+    h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+    h ^= h >> 32;
+  }
+  w = 0;
+  memcpy(&w, p, n);
+  h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+  return h ^ (h >> 32);
+}
+
+// Режет файл на куски (в потоке для прежней версии, пока режется новая).
+static void watchSplitRun(void *arg) {
+  watchSplit *w = (watchSplit*)arg;
+  const unsigned char *p = (const unsigned char*)w->p;
+  for (size_t at = 0; at < w->size; ) {
+    size_t i = w->size - at > WATCH_CHUNK_MIN ? at + WATCH_CHUNK_MIN : w->size;
+    size_t lim = w->size - at > WATCH_CHUNK_MAX ? at + WATCH_CHUNK_MAX : w->size;
+    unsigned long long g = 0;
+    for (; i < lim; i++) {
+      g = (g << 1) + watch_gear[p[i]];
+      if (!(g >> (64 - WATCH_CHUNK_BITS))) break;
+    }
+    const unsigned char *nl = i < w->size ? (const unsigned char*)memchr(p + i, '\n', w->size - i) : NULL;
+    size_t end = nl ? (size_t)(nl - p) + 1 : w->size;
+    watchChunk *c = &w->c[w->n++];
+    c->off = at; c->len = end - at;
+    c->sum = watchSum(w->p + at, c->len);
+    c->line = 0; c->match = -1;
+    at = end;
+  }
+}
+
+static void watchSplitInit(watchSplit *w, const char *p, size_t size) {
+  w->p = p; w->size = size; w->n = 0;
+  w->c = (watchChunk*)malloc(sizeof(watchChunk) * (size / WATCH_CHUNK_MIN + 1));
+  if (!w->c) die("malloc");
+}
+
+// Первый элемент прежнего индекса, не меньший off (E.nlines — нет такого).
+static size_t watchOldLine(size_t off) {
+  size_t lo = 0, hi = E.nlines;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (E.lineoff[mid] < off) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+
+// Строки, развёрнутые из диапазонов, держат состояние подсветки у себя:
+// возвращаем его в linestate, откуда его возьмёт перечитывание.
+static void watchKeepStates(void) {
+  for (ltleaf *lf = E.root ? ltFirstLeaf() : NULL; lf; lf = lf->next) {
+    if (lf->h.leaf != LT_ROWS) continue;
+    for (int i = 0; i < lf->h.n; i++) {
+      erow *row = &lf->rows[i];
+      if (row->tri >= 0 && row->hl_known) E.linestate[row->tri] = LS_STATE(row->hl_entry, row->hl_exit);
+    }
+  }
+}
+
+// Тот же файл дописан: прежний индекс (кроме незаконченной последней
+// строки) остаётся, размечается только новое. Возвращает число элементов
+// индекса; *keep — первая затронутая строка, *fresh — размечено строк.
+static size_t watchAppend(const char *map, size_t size, size_t **lo, unsigned char **ls, size_t *keep, size_t *fresh) {
+  size_t n = E.nlines, cap = E.nlines;
+  *lo = E.lineoff; E.lineoff = NULL;
+  if ((*lo)[n - 1] > E.mapsize) n--; // прежний конец без '\n': строка продолжится
+  *keep = n - 1;
+  n = lineIndexRange(map, E.mapsize, size, lo, n, &cap);
+  if ((*lo)[n - 1] < size) (*lo)[n++] = size + 1;
+  *ls = (unsigned char*)realloc(E.linestate, n);
+  if (!*ls) die("realloc");
+  E.linestate = NULL;
+  memset(*ls + *keep, 0, n - *keep);
+  *fresh = n - 1 - *keep;
+  return n;
+}
+
+// Файл подменён: новая версия режется на куски и сверяется с прежней.
+// Найденный кусок переносит начала строк и их состояния, остальные
+// размечаются. Куски сопоставляются по возрастанию в обеих версиях.
+static size_t watchDiff(const char *map, size_t size, size_t **lo, unsigned char **ls, size_t *keep, size_t *fresh) {
+  watchGearInit();
+  watchSplit a, b;
+  watchSplitInit(&a, E.map, E.mapsize);
+  watchSplitInit(&b, map, size);
+  platThread th;
+  bool started = platThreadStart(&th, watchSplitRun, &a);
+  watchSplitRun(&b);
+  if (started) platThreadJoin(&th);
+  else watchSplitRun(&a);
+
+  // прежние куски по хешу: открытая адресация, одинаковые — цепочкой по возрастанию
+  size_t tcap = 16;
+  while (tcap < 2 * a.n) tcap *= 2;
+  watchSlot *tab = (watchSlot*)malloc(sizeof(watchSlot) * tcap);
+  long long *same = (long long*)malloc(sizeof(long long) * (a.n + 1));
+  if (!tab || !same) die("malloc");
+  for (size_t h = 0; h < tcap; h++) tab[h].head = -2; // -2 — пусто
+  for (size_t k = a.n; k-- > 0; ) {
+    size_t h = (size_t)a.c[k].sum & (tcap - 1);
+    while (tab[h].head != -2 && tab[h].sum != a.c[k].sum) h = (h + 1) & (tcap - 1);
+    same[k] = tab[h].head == -2 ? -1 : tab[h].head;
+    tab[h].sum = a.c[k].sum;
+    tab[h].head = (long long)k;
+  }
+
+  size_t next = 0, cap = E.nlines + 2, n = 1;
+  *lo = (size_t*)malloc(sizeof(size_t) * cap);
+  if (!*lo) die("malloc");
+  (*lo)[0] = 0;
+  bool changed = false;
+  *fresh = 0;
+  for (size_t c = 0; c < b.n; c++) {
+    watchChunk *nc = &b.c[c];
+    long long k = -1;
+    if (next < a.n && a.c[next].sum == nc->sum) k = (long long)next; // чаще всего — следующий по порядку
+    else {
+      size_t h = (size_t)nc->sum & (tcap - 1);
+      while (tab[h].head != -2 && tab[h].sum != nc->sum) h = (h + 1) & (tcap - 1);
+      if (tab[h].head != -2) {
+        while (tab[h].head >= 0 && (size_t)tab[h].head < next) tab[h].head = same[tab[h].head];
+        k = tab[h].head;
+      }
+    }
+    if (k >= 0 && (a.c[k].len != nc->len || memcmp(E.map + a.c[k].off, map + nc->off, nc->len) != 0)) k = -1;
+    nc->line = n - 1;
+    if (!changed && (k < 0 || (size_t)k != c || a.c[k].off != nc->off)) { *keep = nc->line; changed = true; }
+    if (k < 0) {
+      n = lineIndexRange(map, nc->off, nc->off + nc->len, lo, n, &cap);
+      *fresh += n - 1 - nc->line;
+      continue;
+    }
+    watchChunk *oc = &a.c[k];
+    nc->match = k;
+    next = (size_t)k + 1;
+    oc->line = watchOldLine(oc->off);
+    size_t stop = watchOldLine(oc->off + oc->len + 1); // начала строк куска — до stop
+    lineReserve(lo, &cap, n + (stop - oc->line - 1) + 2);
+    for (size_t j = oc->line + 1; j < stop; j++) (*lo)[n++] = E.lineoff[j] - oc->off + nc->off;
+  }
+  if ((*lo)[n - 1] < size) (*lo)[n++] = size + 1;
+  if (!changed) *keep = n - 1; // прежний текст или его начало
+
+  *ls = (unsigned char*)calloc(n, 1);
+  if (!*ls) die("calloc");
+  for (size_t c = 0; c < b.n; c++) {
+    if (b.c[c].match < 0) continue;
+    size_t to = c + 1 < b.n ? b.c[c + 1].line : n - 1;
+    memcpy(*ls + b.c[c].line, E.linestate + a.c[b.c[c].match].line, to - b.c[c].line);
+  }
+  free(tab); free(same); free(a.c); free(b.c);
+  return n;
+}
+
+// Перечитывает файл, в котором нет несохранённых правок; false — файл не
+// открылся или буфер его не вмещает, буфер прежний.
+static bool editorReload(void) {
+  platMapping m;
+  const char *map;
+  size_t size;
+  memset(&m, 0, sizeof(m));
+  if (platMapFile(E.filename, &m, &map, &size) != 0) {
+    platUnmapFile(&m, map, size);
+    editorSetStatusMessage("%s изменён на диске, но не открывается (ошибка %lu)", E.filename, platError());
+    return false;
+  }
+
+  double t0 = platNow();
+  int cx = E.cx, cy = E.cy, rowoff = E.rowoff, upto = E.hl_upto;
+  size_t *lo = NULL, n = 0, keep = 0, fresh = 0;
+  size_t last = E.nlines ? E.lineoff[E.nlines - 1] : 0; // его затирает watchAppend
+  unsigned char *ls = NULL;
+  const char *how = "разобран заново";
+  if (E.map && map && !editorMapShrunk()) { // укороченное отображение не читаем
+    triStop(); // поток индекса поиска читает lineoff
+    watchKeepStates();
+    if (!platSameFile(&E.mapping, &m)) {
+      n = watchDiff(map, size, &lo, &ls, &keep, &fresh);
+      how = "подменён";
+    } else if (size > E.mapsize && mapTailSum(map, E.mapsize) == E.ftail) {
+      n = watchAppend(map, size, &lo, &ls, &keep, &fresh);
+      how = "дописан";
+    }
+  }
+  if (map && !lo) {
+    n = lineIndexFile(map, size, &lo);
+    fresh = n - 1;
+  }
+  if (map && !lineIndexFits(lo, n, size)) {
+    if (!E.lineoff) { // watchAppend забрал прежний индекс: возвращаем
+      E.lineoff = lo; E.linestate = ls;
+      E.lineoff[E.nlines - 1] = last;
+    } else {
+      free(lo); free(ls);
+    }
+    platUnmapFile(&m, map, size);
+    if (!TI.on) triStart();
+    editorSetStatusMessage("%s изменён на диске, но не перечитан: строк или байт в строке — от INT_MAX", E.filename);
+    return false;
+  }
+
+  editorFreeRows();
+  editorUnmapFile();
+  E.mapping = m; E.map = map; E.mapsize = size;
+  E.ftail = mapTailSum(map, size);
+  if (map) {
+    if (ls) {
+      size_t *fit = (size_t*)realloc(lo, sizeof(size_t) * n); // запас роста не нужен
+      E.lineoff = fit ? fit : lo; E.linestate = ls;
+    } else {
+      E.lineoff = lo;
+      E.linestate = (unsigned char*)calloc(n, 1);
+      if (!E.linestate) die("calloc");
+    }
+    E.nlines = n;
+    editorMapRows();
+  }
+  E.hl_upto = (size_t)upto < keep ? upto : (int)keep;
+  undoClear(); // история — о прежнем тексте
+  searchReset(); // и вхождения поиска (перечитать могли и посреди него)
+
+  E.cy = cy < E.numrows ? cy : E.numrows;
+  E.rowoff = rowoff < E.cy ? rowoff : E.cy;
+  erow *row = E.cy < E.numrows ? editorRowAt(E.cy) : NULL;
+  E.cx = !row ? 0 : cx < row->size ? rowCharStart(row, cx) : row->size;
+  editorSetStatusMessage("%s %s: размечено строк %zu из %d (%.0f мс)", E.filename, how, fresh, E.numrows,
+                         (platNow() - t0) * 1e3);
+  return true;
+}
+
+// Копия при записи (editorRowOwn) из укороченного файла переезжает в свою
+// память. Страницы за новым концом файла не читаются и из строки выпадают;
+// набранное (в своей памяти копии) остаётся. true — строка стала короче.
+static bool editorRowUncopy(erow *row) {
+  int tail = row->size - row->gap, old = row->size;
+  char *block = (char*)malloc(row->cap);
+  if (!block) die("malloc");
+  int size = (int)platProbeCopy(block, row->chars, row->gap);
+  if (size == row->gap) size += (int)platProbeCopy(block + size, row->chars + row->gap + ROW_GAPLEN(row), tail);
+  platUnmapCopy(&row->x->copy);
+  row->chars = block;
+  row->gap = row->size = size;
+  if (size == old) return false;
+  row->nspecial = (int)textSpecial(block, size);
+  editorRowColsDirty(row, size);
+  editorRowHighlight(row, size, size);
+  return true;
+}
+
+// Файл укоротили на диске, а в буфере несохранённые правки: отображение
+// заменяется своей копией того, что от файла осталось. Строки, от которых
+// в файле ничего или не всё осталось, становятся короче или пустыми, но
+// число строк не меняется: свои (правленые) строки буфера и журнал правок
+// остаются на своих номерах. Отмена — о прежнем тексте, она сбрасывается.
+static void editorMapDetach(void) {
+  triStop(); // поток индекса читает отображение
+  size_t have = (size_t)platMapSize(&E.mapping), nl = E.nlines - 1;
+  if (have > E.mapsize) have = E.mapsize;
+  char *buf = (char*)malloc(have + nl + 1);
+  if (!buf) die("malloc");
+  have = platReadAt(&E.mapping, 0, buf, have);
+  // целы строки, чьи '\n' на прежних местах (после укорачивания в файл
+  // могли уже дописать новое); от первой другой остаётся начало до '\n'
+  size_t lo = 0;
+  const char *nlp = NULL;
+  while (lo < nl && (nlp = (const char*)memchr(buf + E.lineoff[lo], '\n', have - E.lineoff[lo])) != NULL &&
+         (size_t)(nlp - buf) + 1 == E.lineoff[lo + 1])
+    lo++;
+  if (lo < nl && nlp) have = (size_t)(nlp - buf);
+  else if (lo == nl) have = E.lineoff[nl];
+  // дальше у каждой строки — только свой '\n'
+  memset(buf + have, '\n', nl - lo);
+  for (size_t k = lo + 1; k <= nl; k++) E.lineoff[k] = have + (k - lo);
+  memset(E.linestate + lo, 0, E.nlines - lo);
+  const char *old = E.map;
+  size_t oldsize = E.mapsize;
+  E.map = buf; E.mapsize = have + nl - lo; E.mapcopy = true;
+
+  int at = 0, first = E.numrows;
+  for (ltleaf *lf = E.root ? ltFirstLeaf() : NULL; lf; at += lf->h.n, lf = lf->next) {
+    if (lf->h.leaf == LT_SPAN) {
+      if (lf->first + (size_t)lf->h.n > lo && first > at)
+        first = at + (lo > lf->first ? (int)(lo - lf->first) : 0);
+      continue;
+    }
+    for (int i = 0; i < lf->h.n; i++) {
+      erow *row = &lf->rows[i];
+      if (row->mapped && (size_t)row->tri < lo) {
+        row->chars = buf + E.lineoff[row->tri];
+      } else if (row->mapped) { // строка та же, текст — что от неё осталось
+        int line = row->tri;
+        editorFreeRow(row);
+        editorMapLine(row, (size_t)line);
+        row->leaf = lf;
+        row->nspecial = (int)textSpecial(row->chars, row->size);
+        if (first > at + i) first = at + i;
+      } else if (row->x && row->x->copy.base && editorRowUncopy(row) && first > at + i) {
+        first = at + i;
+      }
+    }
+  }
+  platUnmapFile(&E.mapping, old, oldsize);
+  E.ftail = mapTailSum(E.map, E.mapsize);
+  if (first < E.hl_upto) E.hl_upto = first;
+  editorDamage(0, INT_MAX);
+  undoClear();
+  searchReset();
+  erow *row = editorRowAt(E.cy);
+  if (row && E.cx > row->size) E.cx = row->size;
+  if (!platFileStamp(E.filename, &W.size, &W.mtime)) W.size = W.mtime = 0; // поллинг не повторит
+  editorSetStatusMessage("%s укоротили на диске: строки с %zu остались без текста, правки в буфере целы — "
+                         "Ctrl-S запишет буфер", E.filename, lo + 1);
+}
+
+// Перед чтением отображения (кадр, клавиша, сохранение): не укоротили ли
+// файл на диске. Чистый буфер перечитывается, в буфере с правками
+// отображение заменяет копия остатка файла (editorMapDetach).
+static void editorMapCheck(void) {
+  if (!editorMapShrunk()) return;
+  editorSaveWait(); // поток сохранения читает индекс строк; укороченный файл он не запишет
+  if (!editorMapShrunk()) return;
+  unsigned long long size, mtime;
+  if (!E.dirty && platFileStamp(E.filename, &size, &mtime) && editorReload()) {
+    E.fsize = W.size = size; E.ftime = W.mtime = mtime;
+    journalSaveBegin(); // перечитанная версия для журнала — как сохранённая
+    journalSaveEnd(true);
+    return;
+  }
+  editorMapDetach();
+}
+
+// Смотрит, не поменялся ли файл на диске (не чаще KILO_WATCH_MS); true —
+// буфер перечитан или выставлено предупреждение.
+static bool editorWatchPoll(void) {
+  double now = platNow();
+  if (!E.filename || E.save || now < W.next) return false;
+  W.next = now + KILO_WATCH_MS / 1000.0;
+  unsigned long long size, mtime;
+  bool exists = platFileStamp(E.filename, &size, &mtime);
+  if (!exists) size = mtime = 0;
+  if ((size == E.fsize && mtime == E.ftime) || (size == W.size && mtime == W.mtime)) return false;
+  W.size = size; W.mtime = mtime;
+  if (!exists) {
+    editorSetStatusMessage("%s удалён с диска — Ctrl-S запишет буфер заново", E.filename);
+  } else if (E.dirty) {
+    editorSetStatusMessage("%s изменён на диске, а в буфере несохранённые правки — Ctrl-S перезапишет файл", E.filename);
+  } else if (editorReload()) {
+    E.fsize = size; E.ftime = mtime;
+    journalSaveBegin(); // перечитанная версия для журнала — как сохранённая
+    journalSaveEnd(true);
+  }
+  return true;
+}
+
+/* ====================== Регулярные выражения ======================== */
+
+// Регулярные выражения для поиска (Ctrl-R в строке поиска): литералы,
+// '.', классы [a-z] и [^...] (в том числе с символами UTF-8), \d \w \s и
+// \D \W \S, группы, '|', повторы * + ? {m} {m,} {m,n}, якоря ^ и $. '.' и
+// классы совпадают с символом UTF-8 целиком. Вхождение — самое левое, из
+// начатых там же — самое длинное; вхождения не перекрываются, пустые не
+// считаются.
+//
+// Из дерева разбора берётся обязательный литерал — самая длинная строка,
+// которая есть в любом вхождении. Его ищет обычный поиск (векторно, по
+// индексу триграмм), а выражение проверяется только на строках, где
+// литерал нашёлся.
+//
+// Проверка — ленивый ДКА над НКА Томпсона перевёрнутого выражения, без
+// возвратов: строка проходится один раз справа налево, и на каждой границе
+// заводится группа нитей для вхождений, кончающихся здесь. Состояние ДКА —
+// список групп от старой к новой; состояние НКА держит только самая старая
+// группа, где оно есть: продолжение у всех одно, а конец у неё дальше.
+// Концы групп проход держит сам, переход ДКА говорит, какие группы выжили.
+// Так на каждой границе известен самый дальний конец вхождения, которое с
+// неё начинается, и вхождения набираются жадно слева направо — линейно по
+// длине строки при любом выражении. Длинная строка идёт кусками по
+// RE_CHUNK: первый проход запоминает состояния на границах кусков, второй
+// повторяет каждый кусок перед тем, как выбирать в нём вхождения.
+//
+// Состояния и переходы ДКА строятся по мере надобности; кеш больше
+// RE_CACHE сбрасывается целиком и строится дальше с текущего состояния.
+
+#define RE_NEST_MAX 64       // вложенность скобок
+#define RE_REPEAT_MAX 1000   // предел в {m,n}
+#define RE_NFA_MAX 100000    // состояний НКА
+#define RE_RANGES 256        // диапазонов в классе
+#define RE_LIT_MAX 64        // длина обязательного литерала
+#define RE_CHUNK (1 << 16)   // кусок длинной строки
+#define RE_CACHE (8u << 20)  // байт под ленивый ДКА
+
+enum { RE_SET, RE_CAT, RE_ALT, RE_REP, RE_BOL, RE_EOL, RE_EMPTY }; // узлы дерева
+enum { NF_SET, NF_SPLIT, NF_BOL, NF_EOL, NF_MATCH };              // состояния НКА
+
+typedef struct reNode {
+  unsigned char op;
+  int a, b;            // RE_SET: a — набор байтов; RE_CAT, RE_ALT: части; RE_REP: a — что повторять
+  int min, max;        // RE_REP; max < 0 — без предела
+} reNode;
+
+typedef struct reNfa {
+  unsigned char op;
+  int arg;             // NF_SET: набор; NF_SPLIT: вторая ветка
+  int out;
+} reNfa;
+
+typedef struct reDfa {
+  size_t key;          // в RX.key: число групп, затем у каждой размер и состояния НКА
+  int klen;
+  int acc, acc0;       // группа с концом вхождения, начатого на этой границе
+                       // (acc0 — если граница — начало строки); -1 — нет
+} reDfa;
+
+typedef struct reTrans {
+  int next;            // -1 — ещё не построен
+  int map;             // RE_MAP_SAME, RE_MAP_PUSH или начало в RX.map
+} reTrans;
+
+#define RE_MAP_SAME (-1)     // группы прежние
+#define RE_MAP_PUSH (-2)     // прежние и новая в конце
+// иначе в RX.map: число групп, затем у каждой номер прежней или -1 — новая
+
+typedef struct reRange { unsigned lo, hi; } reRange;
+
+// Приёмник вхождений; false — хватит.
+typedef bool (*reSink)(void *ctx, int col, int len);
+
+static struct regex {
+  bool ok;             // выражение разобрано, можно искать
+  bool icase;
+  char err[48];        // почему не разобрано
+  const char *p;       // разбор: текущий символ
+  reNode *node;
+  int nnode, capnode;
+  unsigned char (*set)[32];
+  int nset, capset;
+  reNfa *nfa;
+  int nnfa, capnfa;
+  int start;           // вход НКА
+  unsigned *mark;      // метки обхода НКА
+  unsigned gen;
+  int *stack, *mt;     // стек обхода; перестановка групп строящегося перехода
+  unsigned char cls[256], rep[256]; // класс байта, представитель класса
+  int ncls;
+  char lit[RE_LIT_MAX + 1]; // обязательный литерал (после fold, если icase)
+  int litlen;
+  char run[RE_LIT_MAX];
+  int runlen;
+  // ленивый ДКА
+  reDfa *d;
+  int nd, capd;
+  reTrans *tr;         // nd * ncls
+  int *key, *map, *tmp; // ключи состояний, перестановки, ключ строящегося
+  size_t nkey, capkey, nmap, capmap, ntmp, captmp;
+  int *hash;           // номер состояния + 1, 0 — пусто
+  int hcap;
+  int init;            // состояние на конце строки, -1 — не построено
+  unsigned long long flushes;
+  // проход
+  int *pos;            // концы групп
+  int *end;            // самый дальний конец вхождения от границы куска
+  int *snap;           // снимки на границах кусков: граница, ключ, концы групп
+  size_t nsnap, capsnap;
+  size_t *snapoff;
+  int nsnapoff, capsnapoff;
+} RX;
+
+static int reFail(const char *msg) {
+  if (!RX.err[0]) snprintf(RX.err, sizeof(RX.err), "%s", msg);
+  return -1;
+}
+
+static int reAdd(int op, int a, int b, int min, int max) {
+  if (RX.nnode == RX.capnode) {
+    RX.capnode = RX.capnode ? RX.capnode * 2 : 64;
+    RX.node = (reNode*)realloc(RX.node, sizeof(reNode) * RX.capnode);
+    if (!RX.node) die("realloc");
+  }
+  reNode *x = &RX.node[RX.nnode];
+  x->op = (unsigned char)op; x->a = a; x->b = b; x->min = min; x->max = max;
+  return RX.nnode++;
+}
+
+static int reCat(int a, int b) { return a < 0 ? b : reAdd(RE_CAT, a, b, 0, 0); }
+static int reAlt(int a, int b) { return a < 0 ? b : reAdd(RE_ALT, a, b, 0, 0); }
+
+// Узел-набор из байтов bits.
+static int reSetNode(const unsigned char *bits) {
+  if (RX.nset == RX.capset) {
+    RX.capset = RX.capset ? RX.capset * 2 : 16;
+    RX.set = (unsigned char(*)[32])realloc(RX.set, 32 * (size_t)RX.capset);
+    if (!RX.set) die("realloc");
+  }
+  memcpy(RX.set[RX.nset], bits, 32);
+  return reAdd(RE_SET, RX.nset++, 0, 0, 0);
+}
+
+static int reByteRange(unsigned lo, unsigned hi) {
+  unsigned char bits[32] = {0};
+  for (unsigned c = lo; c <= hi; c++) bits[c >> 3] |= (unsigned char)(1u << (c & 7));
+  return reSetNode(bits);
+}
+
+static int reUtf8Encode(unsigned cp, unsigned char *s) {
+  if (cp < 0x80) { s[0] = (unsigned char)cp; return 1; }
+  if (cp < 0x800) { s[0] = (unsigned char)(0xc0 | cp >> 6); s[1] = (unsigned char)(0x80 | (cp & 0x3f)); return 2; }
+  if (cp < 0x10000) {
+    s[0] = (unsigned char)(0xe0 | cp >> 12); s[1] = (unsigned char)(0x80 | (cp >> 6 & 0x3f));
+    s[2] = (unsigned char)(0x80 | (cp & 0x3f));
+    return 3;
+  }
+  s[0] = (unsigned char)(0xf0 | cp >> 18); s[1] = (unsigned char)(0x80 | (cp >> 12 & 0x3f));
+  s[2] = (unsigned char)(0x80 | (cp >> 6 & 0x3f)); s[3] = (unsigned char)(0x80 | (cp & 0x3f));
+  return 4;
+}
+
+// Символы [lo, hi] как последовательности байтовых диапазонов: диапазон
+// делится, пока у концов не станут одной длины и с общим началом, а хвосты
+// байтов не займут диапазоны целиком.
+static int reUtf8(unsigned lo, unsigned hi) {
+  static const unsigned lim[] = { 0x7f, 0x7ff, 0xffff };
+  for (int k = 0; k < 3; k++)
+    if (lo <= lim[k] && hi > lim[k]) return reAlt(reUtf8(lo, lim[k]), reUtf8(lim[k] + 1, hi));
+  if (hi < 0x80) return reByteRange(lo, hi);
+  for (int k = 1; k < 4; k++) {
+    unsigned m = (1u << (6 * k)) - 1;
+    if ((lo & ~m) == (hi & ~m)) continue;
+    if (lo & m) return reAlt(reUtf8(lo, lo | m), reUtf8((lo | m) + 1, hi));
+    if ((hi & m) != m) return reAlt(reUtf8(lo, (hi & ~m) - 1), reUtf8(hi & ~m, hi));
+  }
+  unsigned char a[4], b[4];
+  int n = reUtf8Encode(lo, a), node = -1;
+  reUtf8Encode(hi, b);
+  for (int k = 0; k < n; k++) node = reCat(node, reByteRange(a[k], b[k]));
+  return node;
+}
+
+static bool reRangeAdd(reRange *r, int *n, unsigned lo, unsigned hi) {
+  if (*n == RE_RANGES) { reFail("class too big"); return false; }
+  r[*n].lo = lo; r[*n].hi = hi;
+  (*n)++;
+  return true;
+}
+
+static int reRangeCmp(const void *a, const void *b) {
+  unsigned x = ((const reRange*)a)->lo, y = ((const reRange*)b)->lo;
+  return x < y ? -1 : x > y;
+}
+
+// Сортирует и сливает диапазоны; not — заменяет их дополнением до всех символов.
+static int reRangeNorm(reRange *r, int n, bool not) {
+  qsort(r, n, sizeof(reRange), reRangeCmp);
+  int w = 0;
+  for (int k = 0; k < n; k++) {
+    if (w && r[k].lo <= r[w - 1].hi + 1) { if (r[k].hi > r[w - 1].hi) r[w - 1].hi = r[k].hi; }
+    else r[w++] = r[k];
+  }
+  if (!not) return w;
+  reRange c[RE_RANGES + 1];
+  int nc = 0;
+  unsigned next = 0;
+  for (int k = 0; k < w; k++) {
+    if (r[k].lo > next) { c[nc].lo = next; c[nc].hi = r[k].lo - 1; nc++; }
+    next = r[k].hi + 1;
+  }
+  if (next <= 0x10ffff) { c[nc].lo = next; c[nc].hi = 0x10ffff; nc++; }
+  if (nc > RE_RANGES) { reFail("class too big"); return 0; }
+  memcpy(r, c, sizeof(reRange) * nc);
+  return nc;
+}
+
+// Узел-класс: ASCII одним набором, остальное — последовательностями UTF-8.
+static int reClassNode(reRange *r, int n, bool not) {
+  if (RX.icase)
+    for (int k = 0, n0 = n; k < n0; k++) {
+      unsigned lo = r[k].lo, hi = r[k].hi;
+      if (lo <= 'Z' && hi >= 'A' && !reRangeAdd(r, &n, (lo < 'A' ? 'A' : lo) | 0x20, (hi > 'Z' ? 'Z' : hi) | 0x20)) return -1;
+      if (lo <= 'z' && hi >= 'a' && !reRangeAdd(r, &n, (lo < 'a' ? 'a' : lo) & ~0x20u, (hi > 'z' ? 'z' : hi) & ~0x20u)) return -1;
+    }
+  n = reRangeNorm(r, n, not);
+  if (RX.err[0]) return -1;
+  unsigned char bits[32] = {0};
+  int node = -1;
+  for (int k = 0; k < n; k++) {
+    for (unsigned c = r[k].lo; c <= r[k].hi && c < 0x80; c++) bits[c >> 3] |= (unsigned char)(1u << (c & 7));
+    if (r[k].hi >= 0x80) node = reAlt(node, reUtf8(r[k].lo < 0x80 ? 0x80 : r[k].lo, r[k].hi));
+  }
+  return reAlt(node, reSetNode(bits)); // пустой набор не совпадает ни с чем
+}
+
+// \d \w \s и \D \W \S: диапазоны в r; false — это не они.
+static bool reClassEscape(char e, reRange *r, int *n) {
+  reRange t[8];
+  int nt = 0;
+  switch (e | 0x20) {
+    case 'd': t[nt++] = (reRange){'0', '9'}; break;
+    case 'w': t[nt++] = (reRange){'0', '9'}; t[nt++] = (reRange){'A', 'Z'}; t[nt++] = (reRange){'_', '_'};
+              t[nt++] = (reRange){'a', 'z'}; break;
+    case 's': t[nt++] = (reRange){'\t', '\r'}; t[nt++] = (reRange){' ', ' '}; break;
+    default: return false;
+  }
+  if (e >= 'A' && e <= 'Z') {
+    reRange c[8];
+    int nc = 0;
+    unsigned next = 0;
+    for (int k = 0; k < nt; k++) { if (t[k].lo > next) c[nc++] = (reRange){next, t[k].lo - 1}; next = t[k].hi + 1; }
+    c[nc++] = (reRange){next, 0x10ffff};
+    memcpy(t, c, sizeof(reRange) * nc);
+    nt = nc;
+  }
+  for (int k = 0; k < nt; k++) if (!reRangeAdd(r, n, t[k].lo, t[k].hi)) return true;
+  return true;
+}
+
+// Символ UTF-8 в разбираемом выражении; испорченный — UTF8_BAD, байт пропущен.
+static unsigned reCodepoint(void) {
+  unsigned cp;
+  RX.p += utf8Decode((const unsigned char*)RX.p, (int)strnlen(RX.p, 4), &cp);
+  return cp;
+}
+
+static unsigned reEscapeChar(char e) {
+  return e == 't' ? '\t' : e == 'n' ? '\n' : e == 'r' ? '\r' : (unsigned char)e;
+}
+
+static int reParseClass(void) {
+  reRange r[RE_RANGES];
+  int n = 0;
+  bool not = *RX.p == '^';
+  if (not) RX.p++;
+  for (bool first = true; ; first = false) {
+    if (!*RX.p) return reFail("missing ]");
+    if (*RX.p == ']' && !first) { RX.p++; break; }
+    unsigned lo, hi;
+    if (*RX.p == '\\') {
+      char e = *++RX.p;
+      if (!e) return reFail("trailing \\");
+      if (reClassEscape(e, r, &n)) { RX.p++; if (RX.err[0]) return -1; continue; }
+      if (isalnum((unsigned char)e) && e != 't' && e != 'n' && e != 'r') return reFail("unknown escape in []");
+      RX.p++;
+      lo = reEscapeChar(e);
+    } else lo = reCodepoint();
+    hi = lo;
+    if (RX.p[0] == '-' && RX.p[1] && RX.p[1] != ']') {
+      RX.p++;
+      if (*RX.p == '\\' && RX.p[1]) { RX.p++; hi = reEscapeChar(*RX.p++); }
+      else hi = reCodepoint();
+      if (hi < lo) return reFail("bad range in []");
+    }
+    if (lo == UTF8_BAD || hi == UTF8_BAD) return reFail("bad UTF-8 in []");
+    if (!reRangeAdd(r, &n, lo, hi)) return -1;
+  }
+  return reClassNode(r, n, not);
+}
+
+static int reParseAlt(int depth);
+
+static int reParseAtom(int depth) {
+  unsigned char c = (unsigned char)*RX.p;
+  if (c == '(') {
+    RX.p++;
+    int n = reParseAlt(depth + 1);
+    if (n < 0) return -1;
+    if (*RX.p != ')') return reFail("missing )");
+    RX.p++;
+    return n;
+  }
+  if (c == '*' || c == '+' || c == '?') return reFail("nothing to repeat");
+  if (c == '^') { RX.p++; return reAdd(RE_BOL, 0, 0, 0, 0); }
+  if (c == '$') { RX.p++; return reAdd(RE_EOL, 0, 0, 0, 0); }
+  if (c == '[') { RX.p++; return reParseClass(); }
+  reRange r[RE_RANGES];
+  int n = 0;
+  if (c == '.') {
+    RX.p++;
+    r[n++] = (reRange){0, '\n' - 1}; r[n++] = (reRange){'\n' + 1, 0x10ffff};
+    return reClassNode(r, n, false);
+  }
+  if (c == '\\') {
+    char e = *++RX.p;
+    if (!e) return reFail("trailing \\");
+    RX.p++;
+    if (reClassEscape(e, r, &n)) return RX.err[0] ? -1 : reClassNode(r, n, false);
+    if (isalnum((unsigned char)e) && e != 't' && e != 'n' && e != 'r') return reFail("unknown escape");
+    c = (unsigned char)reEscapeChar(e);
+  } else if (c >= 0x80) {
+    // символ UTF-8 — один атом, чтобы повтор относился к нему целиком
+    unsigned cp;
+    int len = utf8Decode((const unsigned char*)RX.p, (int)strnlen(RX.p, 4), &cp), node = -1;
+    for (int k = 0; k < len; k++) node = reCat(node, reByteRange((unsigned char)RX.p[k], (unsigned char)RX.p[k]));
+    RX.p += len;
+    return node;
+  } else RX.p++;
+  r[n++] = (reRange){c, c};
+  return reClassNode(r, n, false);
+}
+
+// {m}, {m,}, {m,n}; не повтор — false, '{' тогда обычный символ.
+static bool reParseBraces(int *min, int *max) {
+  const char *q = RX.p + 1;
+  if (!isdigit((unsigned char)*q)) return false;
+  long a = strtol(q, (char**)&q, 10), b = a;
+  if (*q == ',') {
+    q++;
+    if (*q == '}') b = -1;
+    else if (isdigit((unsigned char)*q)) b = strtol(q, (char**)&q, 10);
+    else return false;
+  }
+  if (*q != '}') return false;
+  if (a > RE_REPEAT_MAX || b > RE_REPEAT_MAX) { reFail("repeat count over 1000"); return false; }
+  if (b >= 0 && b < a) { reFail("bad repeat range"); return false; }
+  *min = (int)a; *max = (int)b;
+  RX.p = q + 1;
+  return true;
+}
+
+static int reParseRepeat(int depth) {
+  int n = reParseAtom(depth);
+  while (n >= 0) {
+    int min, max;
+    char c = *RX.p;
+    if (c == '*') { min = 0; max = -1; RX.p++; }
+    else if (c == '+') { min = 1; max = -1; RX.p++; }
+    else if (c == '?') { min = 0; max = 1; RX.p++; }
+    else if (c != '{' || !reParseBraces(&min, &max)) break;
+    n = reAdd(RE_REP, n, 0, min, max);
+  }
+  return RX.err[0] ? -1 : n;
+}
+
+static int reParseAlt(int depth) {
+  if (depth > RE_NEST_MAX) return reFail("too deeply nested");
+  int n = -1;
+  for (;;) {
+    int cat = -1;
+    while (*RX.p && *RX.p != '|' && *RX.p != ')') {
+      int m = reParseRepeat(depth);
+      if (m < 0) return -1;
+      cat = reCat(cat, m);
+    }
+    if (cat < 0) cat = reAdd(RE_EMPTY, 0, 0, 0, 0);
+    n = n < 0 ? cat : reAdd(RE_ALT, n, cat, 0, 0);
+    if (*RX.p != '|') return n;
+    RX.p++;
+  }
+}
+
+// Байт, с которым только и совпадает набор (буква без учёта регистра — в
+// нижнем), или -1.
+static int reSetByte(int s) {
+  int n = 0, c = -1;
+  for (int k = 0; k < 256; k++) if (RX.set[s][k >> 3] >> (k & 7) & 1) { n++; c = k; }
+  if (n == 1) return c;
+  if (n == 2 && RX.icase && c >= 'a' && c <= 'z' && (RX.set[s][(c ^ 0x20) >> 3] >> ((c ^ 0x20) & 7) & 1)) return c;
+  return -1;
+}
+
+// Строка, с которой только и совпадает узел (не длиннее RE_LIT_MAX), в buf;
+// длина или -1.
+static int reExact(int n, char *buf) {
+  const reNode *x = &RX.node[n];
+  char tmp[RE_LIT_MAX];
+  int a, b;
+  switch (x->op) {
+    case RE_EMPTY: case RE_BOL: case RE_EOL: return 0;
+    case RE_SET:
+      if ((a = reSetByte(x->a)) < 0) return -1;
+      buf[0] = (char)a;
+      return 1;
+    case RE_CAT:
+      if ((a = reExact(x->a, buf)) < 0 || (b = reExact(x->b, tmp)) < 0 || a + b > RE_LIT_MAX) return -1;
+      memcpy(buf + a, tmp, b);
+      return a + b;
+    case RE_REP:
+      if (x->min != x->max || (a = reExact(x->a, tmp)) < 0 || a * x->min > RE_LIT_MAX) return -1;
+      for (b = 0; b < x->min; b++) memcpy(buf + a * b, tmp, a);
+      return a * x->min;
+    default: return -1;
+  }
+}
+
+static void reLitFlush(void) {
+  if (RX.runlen > RX.litlen) { memcpy(RX.lit, RX.run, RX.runlen); RX.litlen = RX.runlen; }
+  RX.runlen = 0;
+}
+
+static void reLitRun(const char *s, int n) {
+  if (RX.runlen + n > RE_LIT_MAX) reLitFlush();
+  if (n > RE_LIT_MAX) return;
+  memcpy(RX.run + RX.runlen, s, n);
+  RX.runlen += n;
+}
+
+// Обход узла, который есть в любом вхождении: точные части конкатенации
+// подряд склеиваются в RX.run, остальные разбираются сами. У повтора хотя
+// бы раз его первые копии примыкают к тексту слева, а дальнейшие — нет.
+static void reRequired(int n) {
+  const reNode *x = &RX.node[n];
+  char buf[RE_LIT_MAX];
+  int len;
+  if (x->op == RE_CAT) { reRequired(x->a); reRequired(x->b); return; }
+  if ((len = reExact(n, buf)) >= 0) { reLitRun(buf, len); return; }
+  if (x->op == RE_REP && x->min > 0) {
+    if ((len = reExact(x->a, buf)) >= 0) for (int k = 0; k < x->min; k++) reLitRun(buf, len);
+    else { reLitFlush(); reRequired(x->a); }
+  }
+  reLitFlush();
+}
+
+static int reNfaNew(int op, int arg, int out) {
+  if (RX.nnfa == RE_NFA_MAX) { reFail("pattern too big"); return out; }
+  if (RX.nnfa == RX.capnfa) {
+    RX.capnfa = RX.capnfa ? RX.capnfa * 2 : 256;
+    RX.nfa = (reNfa*)realloc(RX.nfa, sizeof(reNfa) * RX.capnfa);
+    if (!RX.nfa) die("realloc");
+  }
+  reNfa *s = &RX.nfa[RX.nnfa];
+  s->op = (unsigned char)op; s->arg = arg; s->out = out;
+  return RX.nnfa++;
+}
+
+// НКА узла n для чтения справа налево, с продолжением next; вход.
+static int reEmit(int n, int next) {
+  if (RX.err[0]) return next;
+  reNode x = RX.node[n];
+  switch (x.op) {
+    case RE_SET: return reNfaNew(NF_SET, x.a, next);
+    case RE_BOL: return reNfaNew(NF_BOL, 0, next);
+    case RE_EOL: return reNfaNew(NF_EOL, 0, next);
+    case RE_CAT: return reEmit(x.b, reEmit(x.a, next));
+    case RE_ALT: { int a = reEmit(x.a, next); return reNfaNew(NF_SPLIT, reEmit(x.b, next), a); }
+    case RE_REP: {
+      int out = next;
+      for (int k = 0; k < x.min; k++) out = reEmit(x.a, out);
+      if (x.max < 0) {
+        int loop = reNfaNew(NF_SPLIT, out, -1), body = reEmit(x.a, loop);
+        if (!RX.err[0]) RX.nfa[loop].out = body;
+        return loop;
+      }
+      int opt = out;
+      for (int k = x.min; k < x.max; k++) opt = reNfaNew(NF_SPLIT, out, reEmit(x.a, opt));
+      return opt;
+    }
+    default: return next;
+  }
+}
+
+// Классы байтов: байты, которые ни один набор не различает, — один класс.
+static void reClasses(void) {
+  memset(RX.cls, 0, sizeof(RX.cls));
+  RX.ncls = 1;
+  for (int s = 0; s < RX.nset; s++) {
+    short remap[512];
+    int n = 0;
+    memset(remap, -1, sizeof(remap));
+    for (int c = 0; c < 256; c++) {
+      int k = RX.cls[c] * 2 + (RX.set[s][c >> 3] >> (c & 7) & 1);
+      if (remap[k] < 0) remap[k] = (short)n++;
+      RX.cls[c] = (unsigned char)remap[k];
+    }
+    RX.ncls = n;
+  }
+  for (int c = 255; c >= 0; c--) RX.rep[RX.cls[c]] = (unsigned char)c;
+}
+
+static void reCacheFree(void) {
+  free(RX.d); free(RX.tr); free(RX.key); free(RX.map); free(RX.hash);
+  RX.d = NULL; RX.tr = NULL; RX.key = RX.map = RX.hash = NULL;
+  RX.nd = RX.capd = RX.hcap = 0;
+  RX.nkey = RX.capkey = RX.nmap = RX.capmap = 0;
+  RX.init = -1;
+}
+
+static void reFree(void) {
+  reCacheFree();
+  free(RX.node); free(RX.set); free(RX.nfa); free(RX.mark); free(RX.stack); free(RX.mt);
+  free(RX.tmp); free(RX.pos); free(RX.end); free(RX.snap); free(RX.snapoff);
+  memset(&RX, 0, sizeof(RX));
+  RX.init = -1;
+}
+
+static void *reAlloc(size_t n) {
+  void *p = malloc(n);
+  if (!p) die("malloc");
+  return p;
+}
+
+// Разбирает и компилирует выражение; false — ошибка, причина в RX.err.
+static bool reCompile(const char *pattern, bool icase) {
+  reFree();
+  RX.icase = icase;
+  RX.p = pattern;
+  int root = reParseAlt(0);
+  if (root >= 0 && *RX.p) reFail("unmatched )");
+  if (!RX.err[0]) {
+    reRequired(root);
+    reLitFlush();
+    RX.lit[RX.litlen] = '\0';
+    RX.start = reEmit(root, reNfaNew(NF_MATCH, 0, -1));
+  }
+  if (RX.err[0]) { char err[sizeof(RX.err)]; memcpy(err, RX.err, sizeof(err)); reFree(); memcpy(RX.err, err, sizeof(err)); return false; }
+  reClasses();
+  RX.mark = (unsigned*)calloc(RX.nnfa, sizeof(unsigned));
+  if (!RX.mark) die("calloc");
+  RX.stack = (int*)reAlloc(sizeof(int) * (3 * (size_t)RX.nnfa + 2));
+  RX.mt = (int*)reAlloc(sizeof(int) * ((size_t)RX.nnfa + 2));
+  RX.pos = (int*)reAlloc(sizeof(int) * ((size_t)RX.nnfa + 2));
+  RX.end = (int*)reAlloc(sizeof(int) * (RE_CHUNK + 1));
+  RX.ok = true;
+  return true;
+}
+
+static void reTmpPush(int v) {
+  if (RX.ntmp == RX.captmp) {
+    RX.captmp = RX.captmp ? RX.captmp * 2 : 256;
+    RX.tmp = (int*)realloc(RX.tmp, sizeof(int) * RX.captmp);
+    if (!RX.tmp) die("realloc");
+  }
+  RX.tmp[RX.ntmp++] = v;
+}
+
+// Дописывает в RX.tmp состояния, достижимые из s пустыми переходами
+// (eol — граница на конце строки): наборы, NF_BOL и NF_MATCH. Уже
+// помеченные в этом поколении пропускаются — они в группе постарше.
+static void reClose(int s, bool eol) {
+  int sp = 0;
+  RX.stack[sp++] = s;
+  while (sp) {
+    int k = RX.stack[--sp];
+    if (RX.mark[k] == RX.gen) continue;
+    RX.mark[k] = RX.gen;
+    const reNfa *x = &RX.nfa[k];
+    if (x->op == NF_SPLIT) { RX.stack[sp++] = x->arg; RX.stack[sp++] = x->out; }
+    else if (x->op == NF_EOL) { if (eol) RX.stack[sp++] = x->out; }
+    else reTmpPush(k);
+  }
+}
+
+// Новое поколение меток обхода НКА.
+static void reGen(void) {
+  if (++RX.gen == 0) { memset(RX.mark, 0, sizeof(unsigned) * RX.nnfa); RX.gen = 1; }
+}
+
+static int reIntCmp(const void *a, const void *b) {
+  int x = *(const int*)a, y = *(const int*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Группа в строящемся ключе: место под размер, затем состояния.
+static size_t reGroupOpen(void) {
+  reTmpPush(0);
+  return RX.ntmp - 1;
+}
+
+static bool reGroupClose(size_t at) {
+  int len = (int)(RX.ntmp - at - 1);
+  if (!len) { RX.ntmp = at; return false; }
+  qsort(RX.tmp + at + 1, len, sizeof(int), reIntCmp);
+  RX.tmp[at] = len;
+  RX.tmp[0]++;
+  return true;
+}
+
+static unsigned reHash(const int *key, int n) {
+  unsigned h = 2166136261u;
+  for (int k = 0; k < n; k++) h = (h ^ (unsigned)key[k]) * 16777619u;
+  return h ^ (h >> 15);
+}
+
+// Состояние с ключом RX.tmp: найденное или новое.
+static int reIntern(void) {
+  int klen = (int)RX.ntmp;
+  unsigned h = reHash(RX.tmp, klen);
+  for (unsigned j = h & (RX.hcap - 1); RX.hcap && RX.hash[j]; j = (j + 1) & (RX.hcap - 1)) {
+    const reDfa *d = &RX.d[RX.hash[j] - 1];
+    if (d->klen == klen && memcmp(RX.key + d->key, RX.tmp, sizeof(int) * klen) == 0) return RX.hash[j] - 1;
+  }
+  if (RX.nd == RX.capd) {
+    RX.capd = RX.capd ? RX.capd * 2 : 64;
+    RX.d = (reDfa*)realloc(RX.d, sizeof(reDfa) * RX.capd);
+    RX.tr = (reTrans*)realloc(RX.tr, sizeof(reTrans) * RX.ncls * (size_t)RX.capd);
+    free(RX.hash);
+    RX.hcap = RX.capd * 2;
+    RX.hash = (int*)calloc(RX.hcap, sizeof(int));
+    if (!RX.d || !RX.tr || !RX.hash) die("realloc");
+    for (int k = 0; k < RX.nd; k++) {
+      unsigned j = reHash(RX.key + RX.d[k].key, RX.d[k].klen) & (RX.hcap - 1);
+      while (RX.hash[j]) j = (j + 1) & (RX.hcap - 1);
+      RX.hash[j] = k + 1;
+    }
+  }
+  if (RX.nkey + klen > RX.capkey) {
+    while (RX.nkey + klen > RX.capkey) RX.capkey = RX.capkey ? RX.capkey * 2 : 1024;
+    RX.key = (int*)realloc(RX.key, sizeof(int) * RX.capkey);
+    if (!RX.key) die("realloc");
+  }
+  int id = RX.nd++;
+  reDfa *d = &RX.d[id];
+  d->key = RX.nkey; d->klen = klen;
+  memcpy(RX.key + RX.nkey, RX.tmp, sizeof(int) * klen);
+  RX.nkey += klen;
+  for (int k = 0; k < RX.ncls; k++) RX.tr[(size_t)id * RX.ncls + k].next = -1;
+  // группы с концом вхождения: здесь и если дальше только начало строки
+  d->acc = d->acc0 = -1;
+  reGen();
+  const int *g = RX.key + d->key + 1;
+  for (int j = 0, ng = g[-1]; j < ng; g += 1 + g[0], j++) {
+    int sp = 0;
+    for (int t = 1; t <= g[0]; t++) {
+      if (RX.nfa[g[t]].op == NF_MATCH) { d->acc = j; if (d->acc0 < 0) d->acc0 = j; }
+      RX.stack[sp++] = g[t];
+    }
+    while (sp && d->acc0 < 0) {
+      int k = RX.stack[--sp];
+      if (RX.mark[k] == RX.gen) continue;
+      RX.mark[k] = RX.gen;
+      const reNfa *x = &RX.nfa[k];
+      if (x->op == NF_MATCH) d->acc0 = j;
+      else if (x->op == NF_SPLIT) { RX.stack[sp++] = x->arg; RX.stack[sp++] = x->out; }
+      else if (x->op == NF_BOL) RX.stack[sp++] = x->out;
+    }
+    if (d->acc >= 0) break;
+  }
+  unsigned j = h & (RX.hcap - 1);
+  while (RX.hash[j]) j = (j + 1) & (RX.hcap - 1);
+  RX.hash[j] = id + 1;
+  return id;
+}
+
+static size_t reCacheSize(void) {
+  return (size_t)RX.nd * (sizeof(reDfa) + sizeof(reTrans) * RX.ncls) + (RX.nkey + RX.nmap) * sizeof(int);
+}
+
+// Сбрасывает кеш ДКА; состояние *cur строится заново.
+static void reFlush(int *cur) {
+  const reDfa *d = &RX.d[*cur];
+  RX.ntmp = 0;
+  for (int k = 0; k < d->klen; k++) reTmpPush(RX.key[d->key + k]);
+  RX.nd = 0; RX.nkey = RX.nmap = 0;
+  memset(RX.hash, 0, sizeof(int) * RX.hcap);
+  RX.init = -1;
+  RX.flushes++;
+  *cur = reIntern();
+}
+
+// Строит переход из *cur по классу байта k.
+static reTrans reBuild(int *cur, int k) {
+  if (reCacheSize() > RE_CACHE) reFlush(cur);
+  unsigned c = RX.rep[k];
+  const int *g = RX.key + RX.d[*cur].key + 1;
+  int ng = g[-1], nm = 0;
+  bool same = true;
+  RX.ntmp = 0;
+  reTmpPush(0);
+  reGen();
+  for (int j = 0; j < ng; g += 1 + g[0], j++) {
+    size_t at = reGroupOpen();
+    for (int t = 1; t <= g[0]; t++) {
+      const reNfa *x = &RX.nfa[g[t]];
+      if (x->op == NF_SET && (RX.set[x->arg][c >> 3] >> (c & 7) & 1)) reClose(x->out, false);
+    }
+    if (reGroupClose(at)) RX.mt[nm++] = j; else same = false;
+  }
+  size_t at = reGroupOpen();
+  reClose(RX.start, false);
+  bool push = reGroupClose(at);
+  if (push) RX.mt[nm++] = -1;
+  reTrans t;
+  t.next = reIntern();
+  if (same) t.map = push ? RE_MAP_PUSH : RE_MAP_SAME;
+  else {
+    if (RX.nmap + nm + 1 > RX.capmap) {
+      while (RX.nmap + nm + 1 > RX.capmap) RX.capmap = RX.capmap ? RX.capmap * 2 : 1024;
+      RX.map = (int*)realloc(RX.map, sizeof(int) * RX.capmap);
+      if (!RX.map) die("realloc");
+    }
+    t.map = (int)RX.nmap;
+    RX.map[RX.nmap++] = nm;
+    memcpy(RX.map + RX.nmap, RX.mt, sizeof(int) * nm);
+    RX.nmap += nm;
+  }
+  RX.tr[(size_t)*cur * RX.ncls + k] = t;
+  return t;
+}
+
+// Состояние на конце строки: одна группа, концы вхождений — здесь.
+static int reInit(void) {
+  if (RX.init >= 0) return RX.init;
+  RX.ntmp = 0;
+  reTmpPush(0);
+  reGen();
+  size_t at = reGroupOpen();
+  reClose(RX.start, true);
+  reGroupClose(at);
+  return RX.init = reIntern();
+}
+
+static void reSnapPush(const int *v, int n) {
+  if (RX.nsnap + n > RX.capsnap) {
+    while (RX.nsnap + n > RX.capsnap) RX.capsnap = RX.capsnap ? RX.capsnap * 2 : 1024;
+    RX.snap = (int*)realloc(RX.snap, sizeof(int) * RX.capsnap);
+    if (!RX.snap) die("realloc");
+  }
+  memcpy(RX.snap + RX.nsnap, v, sizeof(int) * n);
+  RX.nsnap += n;
+}
+
+// Запоминает состояние cur и концы групп на границе i.
+static void reSnapshot(int i, int cur) {
+  if (RX.nsnapoff == RX.capsnapoff) {
+    RX.capsnapoff = RX.capsnapoff ? RX.capsnapoff * 2 : 64;
+    RX.snapoff = (size_t*)realloc(RX.snapoff, sizeof(size_t) * RX.capsnapoff);
+    if (!RX.snapoff) die("realloc");
+  }
+  RX.snapoff[RX.nsnapoff++] = RX.nsnap;
+  const reDfa *d = &RX.d[cur];
+  int head[2] = { i, d->klen };
+  reSnapPush(head, 2);
+  reSnapPush(RX.key + d->key, d->klen);
+  reSnapPush(RX.pos, RX.key[d->key]);
+}
+
+// Состояние из снимка k (концы групп — в RX.pos); *at — его граница.
+static int reRestore(int k, int *at) {
+  const int *s = RX.snap + RX.snapoff[k];
+  *at = s[0];
+  RX.ntmp = 0;
+  for (int j = 0; j < s[1]; j++) reTmpPush(s[2 + j]);
+  memcpy(RX.pos, s + 2 + s[1], sizeof(int) * s[2]);
+  return reIntern();
+}
+
+// Обратный проход по text от границы hi до lo; состояние cur и концы групп
+// в RX.pos — на границе hi. end[i - lo] — самый дальний конец вхождения,
+// начатого на границе i, или -1; snap — вместо этого запоминать состояния
+// на границах, кратных RE_CHUNK.
+static void reRun(const char *text, int lo, int hi, int cur, int *end, bool snap) {
+  // таблицы — в локальных: записи в pos и end иначе заставляют перечитывать RX
+  const reDfa *d = RX.d;
+  const reTrans *tr = RX.tr;
+  const int *map = RX.map;
+  int *pos = RX.pos, ncls = RX.ncls, np = RX.key[d[cur].key];
+  for (int i = hi; ; i--) {
+    if (snap) { if (i % RE_CHUNK == 0 && i != hi && i != lo) reSnapshot(i, cur); }
+    else { int a = i ? d[cur].acc : d[cur].acc0; end[i - lo] = a >= 0 ? pos[a] : -1; }
+    if (i == lo) break;
+    int k = RX.cls[(unsigned char)text[i - 1]];
+    reTrans t = tr[(size_t)cur * ncls + k];
+    if (t.next < 0) { t = reBuild(&cur, k); d = RX.d; tr = RX.tr; map = RX.map; }
+    if (t.map == RE_MAP_PUSH) pos[np++] = i - 1;
+    else if (t.map != RE_MAP_SAME) {
+      const int *m = map + t.map;
+      np = m[0];
+      for (int g = 0; g < np; g++) pos[g] = m[g + 1] < 0 ? i - 1 : pos[m[g + 1]];
+    }
+    cur = t.next;
+  }
+}
+
+// Вхождения в строке text[0, n), начатые не раньше from, по порядку.
+static void reLine(const char *text, int n, int from, reSink sink, void *ctx) {
+  if (!RX.ok || from > n) return;
+  RX.nsnap = 0; RX.nsnapoff = 0;
+  if (n - from > RE_CHUNK) { RX.pos[0] = n; reRun(text, from, n, reInit(), NULL, true); }
+  // куски слева направо; снимки записаны справа налево
+  int p = from;
+  for (int k = RX.nsnapoff; k >= 0 && p < n; k--) {
+    int lo = (k == RX.nsnapoff) ? from : RX.snap[RX.snapoff[k]], hi = n, cur;
+    if (k > 0) cur = reRestore(k - 1, &hi);
+    else { cur = reInit(); RX.pos[0] = n; }
+    if (hi <= p) continue;
+    reRun(text, lo, hi, cur, RX.end, false);
+    while (p < hi) {
+      int e = RX.end[p - lo];
+      if (e <= p) { p++; continue; }
+      if (!sink(ctx, p, e - p)) return;
+      p = e;
+    }
+  }
+}
+
+/* ============================== Поиск =============================== */
+
+
+// Поиск считает все вхождения запроса (с перекрытиями) по всему буферу и
+// держит их списком (строка, колонка) — отсюда "match i of N" и переходы
+// стрелками без повторного сканирования. Если запрос удлинился, новые
+// вхождения — подмножество старых: список фильтруется на месте, буфер не
+// читается; если список не влез в память, дочитывается только хвост буфера
+// после последнего запомненного вхождения. Текст сканируется векторно: сравниваются первый и последний
+// байт запроса сразу для 16/32 позиций, кандидаты проверяются целиком.
+// Строки в неразвёрнутых диапазонах ищутся прямо по отображению, кусками.
+// Если готов индекс триграмм, сканируются только блоки-кандидаты.
+// Регулярное выражение (Ctrl-R) ищется так же по своему обязательному
+// литералу, а на строках с литералом проверяется целиком (reLine).
+
+typedef struct searchMatch {
+  int line, col, len;
+} searchMatch;
+
+static struct editorSearch {
+  char *query;         // запрос как введён
+  char *needle;        // запрос после fold; у выражения — его литерал
+  int qlen;
+  bool icase;
+  bool regex;          // запрос — регулярное выражение
+  unsigned char fold[256]; // без учёта регистра — 'A'..'Z' в 'a'..'z'
+  unsigned char fbit, lbit; // 0x20, если первый/последний байт — буква и icase
+  searchMatch *m;
+  size_t n, cap;
+  size_t total;        // всего вхождений; больше n, если список не влез
+  bool full;           // список не влез: m — все вхождения до stop, дальше только счёт
+  int stop_line, stop_col;
+  long long cur;       // текущее вхождение в m, -1 — нет
+  int hl_line, hl_col, hl_len; // вхождение, показанное на экране (строка -1 — нет)
+  char info[112];      // для строки состояния
+} S;
+
+static void searchCompile(const char *query, bool icase) {
+  S.qlen = (int)strlen(query);
+  S.icase = icase;
+  for (int c = 0; c < 256; c++) S.fold[c] = (unsigned char)((icase && c >= 'A' && c <= 'Z') ? c | 0x20 : c);
+  free(S.needle);
+  S.needle = (char*)malloc(S.qlen + 1);
+  if (!S.needle) die("malloc");
+  for (int j = 0; j <= S.qlen; j++) S.needle[j] = (char)S.fold[(unsigned char)query[j]];
+  if (S.qlen == 0) return;
+  unsigned char f = (unsigned char)S.needle[0], l = (unsigned char)S.needle[S.qlen - 1];
+  S.fbit = (icase && f >= 'a' && f <= 'z') ? 0x20 : 0;
+  S.lbit = (icase && l >= 'a' && l <= 'z') ? 0x20 : 0;
+}
+
+static inline bool searchVerify(const char *p) {
+  if (!S.icase) return memcmp(p, S.needle, S.qlen) == 0;
+  for (int j = 0; j < S.qlen; j++) if (S.fold[(unsigned char)p[j]] != (unsigned char)S.needle[j]) return false;
+  return true;
+}
+
+static const char *searchFindScalar(const char *p, const char *end) {
+  for (; end - p >= S.qlen; p++) {
+    if (!S.icase) {
+      p = (const char*)memchr(p, S.needle[0], end - p - S.qlen + 1);
+      if (!p) return NULL;
+    } else if (S.fold[(unsigned char)*p] != (unsigned char)S.needle[0]) continue;
+    if (searchVerify(p)) return p;
+  }
+  return NULL;
+}
+
+#ifdef KILO_SIMD_X86
+static const char *searchFindSSE2(const char *p, const char *end) {
+  const __m128i first = _mm_set1_epi8(S.needle[0]), last = _mm_set1_epi8(S.needle[S.qlen - 1]);
+  const __m128i fbit = _mm_set1_epi8((char)S.fbit), lbit = _mm_set1_epi8((char)S.lbit);
+  for (; end - p >= S.qlen + 15; p += 16) {
+    __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i*)p), fbit);
+    __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + S.qlen - 1)), lbit);
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      const char *c = p + __builtin_ctz(mask);
+      if (searchVerify(c)) return c;
+      mask &= mask - 1;
+    }
+  }
+  return searchFindScalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *searchFindAVX2(const char *p, const char *end) {
+  const __m256i first = _mm256_set1_epi8(S.needle[0]), last = _mm256_set1_epi8(S.needle[S.qlen - 1]);
+  const __m256i fbit = _mm256_set1_epi8((char)S.fbit), lbit = _mm256_set1_epi8((char)S.lbit);
+  for (; end - p >= S.qlen + 31; p += 32) {
+    __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)p), fbit);
+    __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(p + S.qlen - 1)), lbit);
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    while (mask) {
+      const char *c = p + __builtin_ctz(mask);
+      if (searchVerify(c)) return c;
+      mask &= mask - 1;
+    }
+  }
+  return searchFindSSE2(p, end);
+}
+#endif
+
+// Первое вхождение запроса в [p, end) или NULL.
+static const char *searchFind(const char *p, const char *end) {
+  if (S.qlen == 0) return NULL;
+#ifdef KILO_SIMD_X86
+  if (__builtin_cpu_supports("avx2")) return searchFindAVX2(p, end);
+  return searchFindSSE2(p, end);
+#else
+  return searchFindScalar(p, end);
+#endif
+}
+
+static void searchAdd(int line, int col, int len) {
+  S.total++;
+  if (S.full) return;
+  if (S.n == S.cap) {
+    if (S.cap >= KILO_SEARCH_MAX_MATCHES) { S.full = true; S.stop_line = line; S.stop_col = col; return; }
+    S.cap = S.cap ? S.cap * 2 : 256;
+    S.m = (searchMatch*)realloc(S.m, sizeof(searchMatch) * S.cap);
+    if (!S.m) die("realloc");
+  }
+  S.m[S.n].line = line; S.m[S.n].col = col; S.m[S.n].len = len;
+  S.n++;
+}
+
+static bool searchAddSink(void *ctx, int col, int len) {
+  searchAdd(*(const int*)ctx, col, len);
+  return true;
+}
+
+// Вхождения выражения в строке отображения ln (номер в буфере line) с колонки col.
+static void searchSpanLine(size_t ln, int line, int col) {
+  const char *text = E.map + E.lineoff[ln];
+  int len = (int)(E.lineoff[ln + 1] - 1 - E.lineoff[ln]);
+  if (len && text[len - 1] == '\r') len--; // CRLF, как в editorMapLine
+  reLine(text, len, col, searchAddSink, &line);
+}
+
+// Все вхождения в строках отображения [first, first + n) начиная с колонки
+// col первой из них; номер строки first — at. Переводы строк в запрос не попадают, так что
+// кусок ищется целиком, а номер строки находится в lineoff галопом от
+// строки предыдущего вхождения (обычно она же или соседняя). У выражения
+// литерал только указывает строку, а та проверяется целиком.
+static void searchSpan(size_t first, int n, int at, int col) {
+  if (S.regex && S.qlen == 0) { // литерала нет: проверяется каждая строка
+    for (int j = 0; j < n; j++) searchSpanLine(first + j, at + j, j ? 0 : col);
+    return;
+  }
+  const char *base = E.map + E.lineoff[first] + col;
+  const char *end = E.map + E.lineoff[first + n] - 1;
+  size_t ln = first, last = first + n;
+  for (const char *p = base; (p = searchFind(p, end)) != NULL; p++) {
+    size_t off = (size_t)(p - E.map), lo = ln, hi = ln + 1, step = 1;
+    while (hi < last && E.lineoff[hi] <= off) { lo = hi; step *= 2; hi = (last - hi > step) ? hi + step : last; }
+    while (hi - lo > 1) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (E.lineoff[mid] <= off) lo = mid; else hi = mid;
+    }
+    ln = lo;
+    if (!S.regex) { searchAdd(at + (int)(ln - first), (int)(off - E.lineoff[ln]), S.qlen); continue; }
+    searchSpanLine(ln, at + (int)(ln - first), ln == first ? col : 0);
+    p = E.map + E.lineoff[ln + 1] - 1; // дальше — со следующей строки
+  }
+}
+
+// Блоки, где могут быть вхождения запроса: пересечение списков его
+// триграмм (не больше TRI_QUERY самых коротких) вместе с дельтой. NULL —
+// индекса нет, запрос короче триграммы или кандидаты почти все:
+// сканировать всё.
+static const unsigned long long *searchCandidates(void) {
+  if (!triPoll(false) || S.qlen < 3) return NULL;
+  unsigned q[TRI_QUERY];
+  int nq = 0;
+  unsigned t = triFold((unsigned char)S.needle[0]) << 8 | triFold((unsigned char)S.needle[1]);
+  for (int j = 2; j < S.qlen; j++) {
+    t = (t << 8 | triFold((unsigned char)S.needle[j])) & 0xffffff;
+    unsigned b = triBucket(t);
+    int k = 0;
+    while (k < nq && q[k] != b) k++;
+    if (k < nq) continue;
+    if (nq < TRI_QUERY) { q[nq++] = b; continue; }
+    int worst = 0; // полно: вытесняем самый длинный список
+    for (k = 1; k < nq; k++) if (TI.list[q[k]].n > TI.list[q[worst]].n) worst = k;
+    if (TI.list[b].n < TI.list[q[worst]].n) q[worst] = b;
+  }
+
+  size_t words = ((size_t)TI.nfile + TI.nedit + 63) / 64;
+  if (TI.candwords < words) {
+    free(TI.cand);
+    TI.cand = (unsigned long long*)malloc(sizeof(unsigned long long) * words * (TRI_QUERY + 1));
+    if (!TI.cand) die("malloc");
+    TI.candwords = words;
+  }
+  unsigned long long *all = TI.cand, *set = TI.cand + words;
+  memset(set, 0, sizeof(unsigned long long) * words * nq);
+  for (int k = 0; k < nq; k++) {
+    const triList *l = &TI.list[q[k]];
+    for (unsigned r = 0; r < l->n; r++) triSetRange(set + k * words, l->id[r], l->id[r]);
+  }
+  for (size_t h = 0; h < TI.dcap; h++) {
+    unsigned long long key = TI.delta[h];
+    if (!key) continue;
+    unsigned b = (unsigned)(key >> 32) - 1, g = (unsigned)key, lo, hi;
+    int k = 0;
+    while (k < nq && q[k] != b) k++;
+    if (k == nq) continue;
+    if (g & TRI_EDIT_GROUP) lo = hi = TI.nfile + (g & ~TRI_EDIT_GROUP);
+    else {
+      size_t first = (size_t)g << TRI_GROUP_BITS, last = first + (1 << TRI_GROUP_BITS) - 1;
+      if (last > E.nlines - 2) last = E.nlines - 2;
+      lo = (unsigned)(E.lineoff[first] >> TI.shift);
+      hi = (unsigned)(E.lineoff[last] >> TI.shift);
+    }
+    triSetRange(set + k * words, lo, hi);
+  }
+  size_t hits = 0;
+  for (size_t w = 0; w < words; w++) {
+    unsigned long long v = ~0ull;
+    for (int k = 0; k < nq; k++) v &= set[k * words + w];
+    all[w] = v;
+    for (; v; v &= v - 1) hits++;
+  }
+  // кандидаты почти везде: сплошное сканирование дешевле обхода по блокам
+  return hits * 4 > ((size_t)TI.nfile + TI.nedit) * 3 ? NULL : all;
+}
+
+// Первая строка из [l, h), начинающаяся в блоке b или дальше.
+static size_t searchBlockLine(size_t l, size_t h, unsigned b) {
+  while (l < h) {
+    size_t m = l + (h - l) / 2;
+    if ((E.lineoff[m] >> TI.shift) < b) l = m + 1; else h = m;
+  }
+  return l;
+}
+
+// Как searchSpan, но только по строкам, начинающимся в блоках-кандидатах.
+static void searchSpanIndexed(const unsigned long long *cand, size_t first, int n, int at, int col) {
+  size_t ln = first, end = first + n;
+  unsigned last = (unsigned)(E.lineoff[end - 1] >> TI.shift);
+  while (ln < end) {
+    unsigned b = (unsigned)(E.lineoff[ln] >> TI.shift);
+    while (b <= last && !triHas(cand, b)) b++;
+    if (b > last) return;
+    size_t lo = searchBlockLine(ln, end, b), hi = searchBlockLine(lo, end, b + 1);
+    if (lo < hi) searchSpan(lo, (int)(hi - lo), at + (int)(lo - first), lo == first ? col : 0);
+    ln = hi;
+  }
+}
+
+// Дописывает вхождения, начинающиеся не раньше позиции (line, col).
+static void searchScan(int line, int col) {
+  const unsigned long long *cand = searchCandidates();
+  int at = 0;
+  for (ltleaf *lf = ltFirstLeaf(); lf; at += lf->h.n, lf = lf->next) {
+    if (at + lf->h.n <= line) continue;
+    int j = (line > at) ? line - at : 0, c = (at + j == line) ? col : 0;
+    if (lf->h.leaf == LT_SPAN) {
+      if (cand) searchSpanIndexed(cand, lf->first + j, lf->h.n - j, at + j, c);
+      else searchSpan(lf->first + j, lf->h.n - j, at + j, c);
+      continue;
+    }
+    for (; j < lf->h.n; j++, c = 0) {
+      if (cand && !triHas(cand, triRowBlock(&lf->rows[j]))) continue;
+      const char *text = editorRowData(&lf->rows[j]), *end = text + lf->rows[j].size;
+      if (c > lf->rows[j].size) continue;
+      if (S.regex) {
+        int line = at + j;
+        if (S.qlen == 0 || searchFind(text + c, end)) reLine(text, lf->rows[j].size, c, searchAddSink, &line);
+        continue;
+      }
+      for (const char *p = text + c; (p = searchFind(p, end)) != NULL; p++) searchAdd(at + j, (int)(p - text), S.qlen);
+    }
+  }
+}
+
+// Запрос удлинился: оставляем вхождения, где совпадает и новый хвост.
+static void searchRefine(void) {
+  size_t kept = 0;
+  rowIter it;
+  erow *row = NULL;
+  int line = -1;
+  for (size_t k = 0; k < S.n; k++) {
+    if (S.m[k].line != line) {
+      // вхождения идут по порядку: к близкой строке дешевле дойти итератором
+      if (row && S.m[k].line - line <= 32) while (line < S.m[k].line) { row = editorRowIterNext(&it); line++; }
+      else { line = S.m[k].line; row = editorRowIterAt(&it, line); }
+    }
+    if (S.m[k].col + S.qlen <= row->size && searchVerify(editorRowData(row) + S.m[k].col)) {
+      S.m[kept] = S.m[k];
+      S.m[kept++].len = S.qlen;
+    }
+  }
+  S.n = S.total = kept;
+  if (S.full) { S.full = false; searchScan(S.stop_line, S.stop_col); }
+}
+
+// Пересчитывает вхождения под новый запрос; если запрос продолжает прежний,
+// буфер заново не сканируется (кроме хвоста за переполнившимся списком).
+// Выражение всегда ищется заново: его удлинение не сужает вхождения.
+static void searchUpdate(const char *query, bool icase, bool regex) {
+  if (S.query && strcmp(query, S.query) == 0 && icase == S.icase && regex == S.regex) return; // запрос не изменился
+  int oldlen = S.qlen;
+  bool extends = !regex && !S.regex && S.needle && icase == S.icase && (int)strlen(query) >= oldlen;
+  for (int j = 0; extends && j < oldlen; j++)
+    if (S.fold[(unsigned char)query[j]] != (unsigned char)S.needle[j]) extends = false;
+  free(S.query);
+  S.query = _strdup(query);
+  if (!S.query) die("strdup");
+  S.regex = regex;
+  if (regex) {
+    bool ok = *query && reCompile(query, icase);
+    if (!*query) reFree();
+    searchCompile(ok ? RX.lit : "", icase);
+    S.n = S.total = 0; S.full = false;
+    if (ok) searchScan(0, 0);
+  } else {
+    searchCompile(query, icase);
+    if (extends && oldlen > 0) searchRefine();
+    else { S.n = S.total = 0; S.full = false; searchScan(0, 0); }
+  }
+  S.cur = S.n ? 0 : -1;
+}
+
+static void searchReset(void) {
+  free(S.query); free(S.needle); free(S.m);
+  bool icase = S.icase, regex = S.regex;
+  memset(&S, 0, sizeof(S));
+  S.icase = icase; S.regex = regex; // режимы переживают сам поиск
+  S.cur = -1; S.hl_line = -1;
+  reFree();
+}
+
+typedef struct searchPick {
+  int from, to;        // первое вхождение не левее from или последнее левее to
+  bool first;
+  int col, len;        // найденное; col -1 — нет
+} searchPick;
+
+static bool searchPickSink(void *ctx, int col, int len) {
+  searchPick *k = (searchPick*)ctx;
+  if (col >= k->to) return false;
+  if (col < k->from) return true;
+  k->col = col; k->len = len;
+  return !k->first;
+}
+
+// Первое вхождение выражения в строке правее колонки col (dir > 0) или
+// последнее левее неё; col < 0 — в любом месте. Выбор — среди вхождений
+// всей строки, как в списке.
+static bool searchPickRegex(erow *row, int col, int dir, int *at, int *len) {
+  searchPick k = { 0, INT_MAX, dir > 0, -1, 0 };
+  const char *text = editorRowData(row);
+  if (col >= 0) { if (dir > 0) k.from = col + 1; else k.to = col; }
+  if (S.qlen && !searchFind(text, text + row->size)) return false;
+  reLine(text, row->size, 0, searchPickSink, &k);
+  if (k.col < 0) return false;
+  *at = k.col; *len = k.len;
+  return true;
+}
+
+// Переход, когда список вхождений не влез в память: ищем по строкам от
+// текущей позиции, как раньше. Возвращает номер строки или -1.
+static int searchStep(int line, int *col, int *len, int dir) {
+  rowIter it;
+  erow *row = editorRowIterAt(&it, line);
+  *len = S.qlen;
+  for (int i = 0; i <= E.numrows; i++) {
+    const char *text = editorRowData(row), *end = text + row->size, *best = NULL;
+    if (S.regex) { if (searchPickRegex(row, i == 0 ? *col : -1, dir, col, len)) return line; }
+    else if (dir > 0) best = searchFind(text + (i == 0 ? *col + 1 : 0), end);
+    else for (const char *p = text; (p = searchFind(p, end)) != NULL && (i > 0 || p - text < *col); p++) best = p;
+    if (best) { *col = (int)(best - text); return line; }
+    line += dir;
+    row = (dir > 0) ? editorRowIterNext(&it) : editorRowIterPrev(&it);
+    if (line < 0 || line >= E.numrows) { line = (line < 0) ? E.numrows - 1 : 0; row = editorRowIterAt(&it, line); }
+  }
+  return -1;
+}
+
+static void editorFindCallback(const char *query, int key) {
+  editorDamage(0, INT_MAX); // подсвечены все видимые вхождения
+  S.hl_line = -1;
+
+  if (key == '\r' || key == '\x1b' || key == CTRL_KEY('g')) { searchReset(); return; }
+
+  int line = -1, col = 0, len = 0;
+  if (key == ARROW_RIGHT || key == ARROW_DOWN || key == ARROW_LEFT || key == ARROW_UP) {
+    int dir = (key == ARROW_RIGHT || key == ARROW_DOWN) ? 1 : -1;
+    if (!S.full && S.n) {
+      S.cur = (S.cur + dir + (long long)S.n) % (long long)S.n;
+    } else if (S.total) {
+      line = E.cy; col = E.cx;
+      line = searchStep(line, &col, &len, dir);
+      S.cur = -1;
+    }
+  } else {
+    searchUpdate(query, key == CTRL_KEY('t') ? !S.icase : S.icase, key == CTRL_KEY('r') ? !S.regex : S.regex);
+  }
+  if (S.cur >= 0) { line = S.m[S.cur].line; col = S.m[S.cur].col; len = S.m[S.cur].len; }
+
+  char idx[40] = "", mode[56];
+  if (triPoll(false)) snprintf(idx, sizeof(idx), " [index %lluMB]", (unsigned long long)(triMemory() >> 20));
+  else if (TI.on) snprintf(idx, sizeof(idx), " [indexing %d%%]", (int)(TI.done * 100 / (E.mapsize ? E.mapsize : 1)));
+  else if (TI.lost) snprintf(idx, sizeof(idx), " [no index: over %uMB]", (unsigned)(KILO_SEARCH_INDEX_LIMIT >> 20));
+  snprintf(mode, sizeof(mode), "%s%s%s", S.icase ? " (icase)" : "", S.regex ? " (regex)" : "", idx);
+  if (!*query) snprintf(S.info, sizeof(S.info), "%s%s%s", S.icase ? "icase" : "", S.icase && S.regex ? " " : "", S.regex ? "regex" : "");
+  else if (S.regex && !RX.ok) snprintf(S.info, sizeof(S.info), "regex: %s", RX.err);
+  else if (S.total == 0) snprintf(S.info, sizeof(S.info), "no matches%s", mode);
+  else if (S.cur >= 0) snprintf(S.info, sizeof(S.info), "match %lld of %llu%s", S.cur + 1, (unsigned long long)S.total, mode);
+  else snprintf(S.info, sizeof(S.info), "%llu matches%s", (unsigned long long)S.total, mode);
+  if (line < 0) return;
+
+  E.cy = line;
+  E.cx = col;
+  E.rowoff = E.numrows;
+
+  // hl строки не трогаем: вхождение красит editorComposeRow
+  S.hl_line = line; S.hl_col = col; S.hl_len = len;
+}
+
+// Первое вхождение строки line в списке, кончающееся правее колонки cx:
+// концы вхождений строки возрастают (выражения не перекрываются, у
+// остальных длина одна).
+static size_t searchFirstIn(int line, int cx) {
+  size_t lo = 0, hi = S.n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    const searchMatch *m = &S.m[mid];
+    if (m->line < line || (m->line == line && m->col + m->len <= cx)) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+
+// Строка ввода в строке сообщений; empty — Enter принимает и пустой ввод.
+static char *editorPrompt(const char *prompt, void (*callback)(const char *, int), bool empty) {
+  size_t bufsize = 128; char *buf = (char*)malloc(bufsize); size_t buflen = 0; buf[0] = '\0';
+  while (1) {
+    editorSetStatusMessage(prompt, buf);
+    if (!inputPending()) editorRefreshScreen(); // видно, куда перешёл поиск
+    int c = editorReadKey();
+    if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+      while (buflen && ((unsigned char)buf[--buflen] & 0xc0) == 0x80) {} // символ UTF-8 целиком
+      buf[buflen] = '\0';
+    }
+    else if (c == '\x1b') { editorSetStatusMessage(""); if (callback) callback(buf, c); free(buf); return NULL; }
+    else if (c == '\r') { if (buflen || empty) { editorSetStatusMessage(""); if (callback) callback(buf, c); return buf; } }
+    else if (keyText(c)) {
+      if (buflen == bufsize - 1) { bufsize *= 2; buf = (char*)realloc(buf, bufsize); }
+      buf[buflen++] = (char)c; buf[buflen] = '\0';
+    }
+    if (callback) callback(buf, c);
+  }
+}
+
+/* ============================ Замена ================================ */
+
+// Замена всех вхождений берёт их из списка поиска. Вхождения одной строки
+// собираются в новый текст участка от начала первого до конца последнего,
+// и строка переписывается одной правкой (editorRowReplace): разрыв,
+// подсветка, индекс триграмм и журнал трогаются по разу на строку, а вся
+// замена — один шаг отмены. Перекрывающиеся вхождения литерала берутся
+// слева направо. Замена ставится как есть (групп у выражений нет).
+//
+// Если список не влез, после его обработки поиск продолжается с места
+// остановки: номера строк замена не меняет, а колонки строки остановки
+// сдвигаются на накопленную разницу длин.
+
+// Возвращает число замен, -1 — выражение не разобралось (сообщение уже показано).
+static long long editorReplaceAll(const char *query, const char *with, bool icase, bool regex) {
+  static char *buf = NULL;
+  static size_t bufcap = 0;
+  size_t wlen = strlen(with);
+  long long count = 0;
+  searchReset();
+  searchUpdate(query, icase, regex);
+  if (regex && !RX.ok) { editorSetStatusMessage("regex: %s", RX.err); searchReset(); return -1; }
+  undoBegin(UG_OTHER);
+  while (1) {
+    int line = -1, end = 0, delta = 0; // последняя переписанная строка: конец её последней замены и сдвиг
+    for (size_t k = 0; k < S.n; ) {
+      line = S.m[k].line;
+      erow *row = editorRowAt(line);
+      const char *text = editorRowData(row);
+      int from = S.m[k].col;
+      size_t blen = 0;
+      end = from;
+      for (; k < S.n && S.m[k].line == line; k++) {
+        const searchMatch *m = &S.m[k];
+        if (m->col < end) continue; // перекрывает предыдущее
+        size_t need = blen + (m->col - end) + wlen;
+        if (need > bufcap) {
+          bufcap = need * 2;
+          buf = (char*)realloc(buf, bufcap);
+          if (!buf) die("realloc");
+        }
+        memcpy(buf + blen, text + end, m->col - end); blen += m->col - end;
+        memcpy(buf + blen, with, wlen); blen += wlen;
+        end = m->col + m->len;
+        count++;
+      }
+      delta = (int)blen - (end - from);
+      editorRowReplace(row, from, end - from, buf, blen);
+    }
+    if (!S.full) break;
+    int col = S.stop_col;
+    if (line == S.stop_line) col = (col > end ? col : end) + delta;
+    int stop = S.stop_line;
+    S.n = S.total = 0; S.full = false;
+    searchScan(stop, col);
+  }
+  undoEnd();
+  searchReset();
+  return count;
+}
+
+// Ctrl-E: запрос вводится, как в поиске (с подсветкой вхождений и теми же
+// режимами), потом — чем заменить; пустая замена удаляет вхождения.
+static void editorReplace(void) {
+  char *q = editorPrompt("Заменить: %s (ESC отмена, Ctrl-T — регистр, Ctrl-R — регулярное выражение)", editorFindCallback, false);
+  if (!q) return;
+  bool icase = S.icase, regex = S.regex;
+  char *with = editorPrompt("Заменить на: %s (ESC отмена)", NULL, true);
+  if (with) {
+    long long n = editorReplaceAll(q, with, icase, regex);
+    if (n == 0) editorSetStatusMessage("Не найдено: %s", q);
+    else if (n > 0) editorSetStatusMessage("Заменено вхождений: %lld", n);
+    erow *row = editorRowAt(E.cy); // строка под курсором могла укоротиться
+    if (row && E.cx > row->size) E.cx = row->size;
+    if (row && E.cx < row->size) E.cx = rowCharStart(row, E.cx);
+  }
+  free(q); free(with);
+}
+
+/* ============================ Вывод ================================ */
+
+// Буфер кадра живёт в E.out между кадрами и только растёт (вдвое), так что
+// в установившемся режиме вывод не выделяет память.
+static void abReserve(abuf *ab, size_t extra) {
+  if (ab->len + extra <= ab->cap) return;
+  size_t cap = ab->cap ? ab->cap : 4096;
+  while (cap < ab->len + extra) cap *= 2;
+  char *b = (char*)realloc(ab->b, cap);
+  if (!b) die("realloc");
+  ab->b = b; ab->cap = cap;
+}
 
 static void abAppend(abuf *ab, const char *s, size_t len) {
-  char *newb = (char*)realloc(ab->b, ab->len + len);
-  if (!newb) return; memcpy(&newb[ab->len], s, len); ab->b = newb; ab->len += len;
+  abReserve(ab, len);
+  memcpy(&ab->b[ab->len], s, len);
+  ab->len += len;
+}
+
+static void abAppendNum(abuf *ab, unsigned v) {
+  char tmp[10];
+  int n = 0;
+  do { tmp[sizeof(tmp) - ++n] = (char)('0' + v % 10); v /= 10; } while (v);
+  abAppend(ab, &tmp[sizeof(tmp) - n], n);
+}
+
+static void editorScroll(void) {
+  E.rx = 0; if (E.cy < E.numrows) E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
+  if (E.cy < E.rowoff) E.rowoff = E.cy;
+  if (E.cy >= E.rowoff + E.screenrows) E.rowoff = E.cy - E.screenrows + 1;
+  if (E.rx < E.coloff) E.coloff = E.rx;
+  if (E.rx >= E.coloff + E.screencols) E.coloff = E.rx - E.screencols + 1;
+}
+
+// Кадр собирается построчно в ячейки и сравнивается с теневым: в терминал
+// уходят только отличающиеся участки (с позиционированием курсора), хвост
+// строки из пробелов стирается \x1b[K. Строки текста пересобираются, только
+// если их задели правки (E.damage_*) или сдвинула прокрутка; вертикальная
+// прокрутка на несколько строк делается областью прокрутки терминала.
+
+typedef struct frameOut {
+  abuf *ab;
+  int attr;            // текущий атрибут терминала
+  bool hidden;         // курсор уже спрятан
+} frameOut;
+
+#define SPAN_JOIN 8          // разрывы короче склеиваем: позиционирование дороже
+
+// Готовые SGR-последовательности для каждого атрибута ячейки.
+static struct { char s[12]; unsigned char len; } frame_sgr[256];
+
+static void frameInitSgr(void) {
+  for (int a = 0; a < 256; a++) {
+    int fg = a & ~SCELL_INVERSE;
+    frame_sgr[a].len = (unsigned char)snprintf(frame_sgr[a].s, sizeof(frame_sgr[a].s), "\x1b[%s;%dm",
+                                               (a & SCELL_INVERSE) ? "7" : "27", fg ? fg : 39);
+  }
+}
+
+static void frameAttr(frameOut *fo, int attr) {
+  if (attr == fo->attr) return;
+  abAppend(fo->ab, frame_sgr[attr].s, frame_sgr[attr].len);
+  fo->attr = attr;
+}
+
+static void frameMove(abuf *ab, int y, int x) {
+  abAppend(ab, "\x1b[", 2);
+  abAppendNum(ab, (unsigned)y + 1);
+  abAppend(ab, ";", 1);
+  abAppendNum(ab, (unsigned)x + 1);
+  abAppend(ab, "H", 1);
+}
+
+// Переход к ячейке перед выводом: курсор прячется до конца кадра.
+static void frameGoto(frameOut *fo, int y, int x) {
+  if (!fo->hidden) { abAppend(fo->ab, "\x1b[?25l", 6); fo->hidden = true; }
+  frameMove(fo->ab, y, x);
+}
+
+// Ячейки подряд: смена атрибута — по готовой последовательности, символы
+// одного атрибута копируются одним куском.
+static void frameCells(frameOut *fo, const scell *c, int n) {
+  for (int j = 0; j < n; ) {
+    frameAttr(fo, c[j].attr);
+    abReserve(fo->ab, (size_t)(n - j) * sizeof(c->ch));
+    char *d = &fo->ab->b[fo->ab->len];
+    int k = j;
+    for (; k < n && c[k].attr == c[j].attr; k++) {
+      const char *s = c[k].ch;
+      if (!s[1]) { if (s[0]) *d++ = s[0]; continue; }
+      for (int b = 0; b < (int)sizeof(c->ch) && s[b]; b++) *d++ = s[b];
+    }
+    fo->ab->len = (size_t)(d - fo->ab->b);
+    j = k;
+  }
+}
+
+static inline bool scellBlank(const scell *c) { return c->ch[0] == ' ' && !c->ch[1] && c->attr == 0; }
+static inline bool scellTail(const scell *c) { return c->ch[0] == '\0'; }
+
+// Выводит строку кадра y, отличающуюся от теневой. Участок не режет
+// широкий символ ни в новой строке, ни в старой: половину терминал не
+// перерисует, а затёртую половину старого сотрёт.
+static void frameLine(frameOut *fo, int y, const scell *line) {
+  int cols = E.screencols;
+  scell *old = &E.shadow[y * cols];
+  int tail = cols;
+  while (tail > 0 && scellBlank(&line[tail - 1])) tail--;
+  if (!E.shadow_ok[y]) {
+    frameGoto(fo, y, 0);
+    frameCells(fo, line, tail);
+    if (tail < cols) { frameAttr(fo, 0); abAppend(fo->ab, "\x1b[K", 3); }
+  } else {
+    for (int a = 0; a < cols; ) {
+      while (a < cols && !memcmp(&old[a], &line[a], sizeof(scell))) a++;
+      if (a == cols) break;
+      if (a > 0 && (scellTail(&line[a]) || scellTail(&old[a]))) a--;
+      int b = a + 1, j = b;
+      for (; j < cols && j - b < SPAN_JOIN; j++)
+        if (memcmp(&old[j], &line[j], sizeof(scell))) b = j + 1;
+      while (b < cols && (scellTail(&line[b]) || scellTail(&old[b]))) b++;
+      frameGoto(fo, y, a);
+      if (b > tail) {
+        // дальше в новой строке одни пробелы: стираем до конца строки
+        frameCells(fo, &line[a], tail > a ? tail - a : 0);
+        frameAttr(fo, 0);
+        abAppend(fo->ab, "\x1b[K", 3);
+        break;
+      }
+      frameCells(fo, &line[a], b - a);
+      a = b;
+    }
+  }
+  memcpy(old, line, sizeof(scell) * cols);
+  E.shadow_ok[y] = true;
+}
+
+static inline void scellSet(scell *c, char ch, int attr) {
+  c->ch[0] = ch;
+  memset(&c->ch[1], 0, sizeof(c->ch) - 1);
+  c->attr = (unsigned char)attr;
+}
+
+// Ячейки копируются целиком с первой: сборка ячейки по байтам на каждую
+// заметно дороже на полном кадре.
+static void lineFill(scell *line, int from, int to, char ch, int attr) {
+  if (from >= to) return;
+  scellSet(&line[from], ch, attr);
+  for (int j = from + 1; j < to; j++) line[j] = line[from];
+}
+
+// Символ [s, s + len) шириной w в ячейку x (у широкого — и правую половину).
+static void lineChar(scell *line, int x, const char *s, int len, int w, int attr) {
+  memset(line[x].ch, 0, sizeof(line[x].ch));
+  memcpy(line[x].ch, s, len);
+  line[x].attr = (unsigned char)attr;
+  if (w == 2) { memset(line[x + 1].ch, 0, sizeof(line[x + 1].ch)); line[x + 1].attr = (unsigned char)attr; }
+}
+
+// Комбинируемый символ — к ячейке x, если в ней есть место; иначе пропадает.
+static void lineCombine(scell *line, int x, const char *s, int len) {
+  int n = 0;
+  while (n < (int)sizeof(line[x].ch) && line[x].ch[n]) n++;
+  if (n + len <= (int)sizeof(line[x].ch)) memcpy(&line[x].ch[n], s, len);
 }
-static void abFree(abuf *ab) { free(ab->b); }
 
-static void editorScroll(void) {
-  E.rx = 0; if (E.cy < E.numrows) E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
-  if (E.cy < E.rowoff) E.rowoff = E.cy;
-  if (E.cy >= E.rowoff + E.screenrows) E.rowoff = E.cy - E.screenrows + 1;
-  if (E.rx < E.coloff) E.coloff = E.rx;
-  if (E.rx >= E.coloff + E.screencols) E.coloff = E.rx - E.screencols + 1;
+// Текст UTF-8 в ячейки с колонки x; возвращает колонку за ним. Не влезшее
+// в строку обрезается, испорченное показывается '?'.
+static int lineText(scell *line, int x, const char *s, int len, int attr) {
+  int cols = E.screencols;
+  for (int j = 0; j < len && x < cols; ) {
+    unsigned cp;
+    int n = utf8Decode((const unsigned char*)&s[j], len - j, &cp), w = utf8Width(cp);
+    if (cp == UTF8_BAD || cp < 0x20 || (cp >= 0x7f && cp < 0xa0)) scellSet(&line[x++], '?', attr);
+    else if (w == 0) { if (x > 0) lineCombine(line, scellTail(&line[x - 1]) ? x - 2 : x - 1, &s[j], n); }
+    else if (x + w > cols) break;
+    else { lineChar(line, x, &s[j], n, w, attr); x += w; }
+    j += n;
+  }
+  return x;
 }
 
-static void editorDrawRows(abuf *ab) {
-  for (int y = 0; y < E.screenrows; y++) {
-    int filerow = y + E.rowoff;
-    if (filerow >= E.numrows) {
-      if (E.numrows == 0 && y == E.screenrows/3) {
-        char welcome[120];
-        int wl = snprintf(welcome, sizeof(welcome), "Kilo (Windows) -- version %s", KILO_VERSION);
-        if (wl > E.screencols) wl = E.screencols;
-        int padding = (E.screencols - wl) / 2;
-        if (padding) { abAppend(ab, "~", 1); padding--; }
-        while (padding--) abAppend(ab, " ", 1);
-        abAppend(ab, welcome, wl);
-      } else abAppend(ab, "~", 1);
-    } else {
-      int len = E.row[filerow].rsize - E.coloff; if (len < 0) len = 0; if (len > E.screencols) len = E.screencols;
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
-      int current_color = -1;
-      for (int j = 0; j < len; j++) {
-        if (iscntrl((unsigned char)c[j])) {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4); abAppend(ab, &sym, 1); abAppend(ab, "\x1b[m", 3);
-          if (current_color != -1) { char buf[16]; int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color); abAppend(ab, buf, (size_t)clen); }
-        } else if (hl[j] == HL_NORMAL) {
-          if (current_color != -1) { abAppend(ab, "\x1b[39m", 5); current_color = -1; }
-          abAppend(ab, &c[j], 1);
-        } else {
-          int color = editorSyntaxToColor(hl[j]);
-          if (color != current_color) { current_color = color; char buf[16]; int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color); abAppend(ab, buf, (size_t)clen); }
-          abAppend(ab, &c[j], 1);
-        }
-      }
-      abAppend(ab, "\x1b[39m", 5);
+// Ширина текста UTF-8 в колонках.
+static int textWidth(const char *s, int len) {
+  int w = 0;
+  for (int j = 0; j < len; ) {
+    unsigned cp;
+    j += utf8Decode((const unsigned char*)&s[j], len - j, &cp);
+    w += utf8Width(cp);
+  }
+  return w;
+}
+
+// Строка текста (или '~') в ячейки.
+static void editorComposeRow(erow *row, int y, scell *line) {
+  int cols = E.screencols;
+  lineFill(line, 0, cols, ' ', 0);
+  if (!row) {
+    if (E.numrows == 0 && y == E.screenrows/3) {
+      char welcome[120];
+      int wl = snprintf(welcome, sizeof(welcome), "Kilo (Windows) -- version %s", KILO_VERSION);
+      if (wl > cols) wl = cols;
+      int padding = (cols - wl) / 2;
+      if (padding) line[0].ch[0] = '~';
+      lineText(line, padding, welcome, wl, 0);
+    } else line[0].ch[0] = '~';
+    return;
+  }
+  // табы раскрываем на лету, начиная с первого символа, видимого с колонки coloff;
+  // вхождения поиска красятся поверх подсветки, текущее — ещё и инверсией
+  int filerow = E.rowoff + y;
+  int rx, cx = editorRowRxToCx(row, E.coloff, &rx);
+  size_t mk = S.n ? searchFirstIn(filerow, cx) : 0;
+  while (cx < row->size && rx < E.coloff + cols) {
+    char c = rowCh(row, cx);
+    int hl = (row->windowed ? row->hl[cx - row->x->win_from] : *rowHl(row, cx)) & HL_COLOR_MASK, inv = 0;
+    while (mk < S.n && S.m[mk].line == filerow && S.m[mk].col + S.m[mk].len <= cx) mk++;
+    if (mk < S.n && S.m[mk].line == filerow && S.m[mk].col <= cx) hl = HL_MATCH;
+    if (filerow == S.hl_line && cx >= S.hl_col && cx - S.hl_col < S.hl_len) { hl = HL_MATCH; inv = SCELL_INVERSE; }
+    int x = rx - E.coloff, attr = (hl == HL_NORMAL ? 0 : editorSyntaxToColor(hl)) | inv;
+    if (c == '\t') {
+      rx += KILO_TAB_STOP - (rx % KILO_TAB_STOP); // пробелы уже на месте
+      cx++;
+      continue;
+    }
+    if ((unsigned char)c < 0x80) {
+      if (iscntrl((unsigned char)c)) scellSet(&line[x], (c <= 26) ? '@' + c : '?', SCELL_INVERSE);
+      else scellSet(&line[x], c, attr);
+      rx++; cx++;
+      continue;
     }
-    abAppend(ab, "\x1b[K\r\n", 5);
+    char s[4];
+    unsigned cp;
+    int len = rowChar(row, cx, &cp), w = utf8Width(cp);
+    for (int k = 0; k < len; k++) s[k] = rowCh(row, cx + k);
+    if (cp == UTF8_BAD || cp < 0xa0) scellSet(&line[x], '?', SCELL_INVERSE);
+    else if (w == 0) { if (x > 0) lineCombine(line, scellTail(&line[x - 1]) ? x - 2 : x - 1, s, len); }
+    else if (rx >= E.coloff) { // у широкого, начатого левее края, правая половина — пробел
+      if (x + w > cols) break;
+      lineChar(line, x, s, len, w, attr);
+    }
+    rx += w; cx += len;
   }
 }
 
-static void editorDrawStatusBar(abuf *ab) {
-  abAppend(ab, "\x1b[7m", 4);
+static void editorComposeStatusBar(scell *line) {
   char status[120], rstatus[120];
   int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
                      E.filename ? E.filename : "[No Name]", E.numrows,
                      E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s%s | %d/%d",
+                      S.info, S.info[0] ? " | " : "",
                       E.syntax ? E.syntax->filetype : "no ft",
                       E.cy + 1, E.numrows);
-  if (len > E.screencols) len = E.screencols;
-  abAppend(ab, status, len);
-  while (len < E.screencols) {
-    if (E.screencols - len == rlen) { abAppend(ab, rstatus, rlen); break; }
-    else { abAppend(ab, " ", 1); len++; }
+  lineFill(line, 0, E.screencols, ' ', SCELL_INVERSE);
+  int x = lineText(line, 0, status, len, SCELL_INVERSE), rw = textWidth(rstatus, rlen);
+  if (x + rw <= E.screencols) lineText(line, E.screencols - rw, rstatus, rlen, SCELL_INVERSE);
+}
+
+static void editorComposeMessageBar(scell *line) {
+  lineFill(line, 0, E.screencols, ' ', 0);
+  if (PF.overlay) {
+    char perf[200];
+    perfOverlay(perf, sizeof(perf));
+    lineText(line, 0, perf, (int)strlen(perf), 0);
+    return;
+  }
+  if (E.statusmsg[0] && time(NULL) - E.statusmsg_time < 5)
+    lineText(line, 0, E.statusmsg, (int)strlen(E.statusmsg), 0);
+}
+
+// Размер окна поменялся (или первый кадр): теневой кадр неизвестен.
+static void editorShadowReset(void) {
+  int lines = E.screenrows + 2;
+  if (E.shadow_rows != E.screenrows || E.shadow_cols != E.screencols) {
+    free(E.shadow); free(E.shadow_ok);
+    E.shadow = (scell*)malloc(sizeof(scell) * lines * E.screencols);
+    E.shadow_ok = (bool*)malloc(sizeof(bool) * lines);
+    if (!E.shadow || !E.shadow_ok) die("malloc");
+    E.shadow_rows = E.screenrows; E.shadow_cols = E.screencols;
+    frameInitSgr();
+  }
+  memset(E.shadow_ok, 0, sizeof(bool) * lines);
+  E.shadow_rowoff = E.rowoff; E.shadow_coloff = E.coloff;
+  E.shadow_cy = E.shadow_cx = -1;
+}
+
+// Сдвигает содержимое экрана на d строк (d > 0 — текст уезжает вверх)
+// областью прокрутки и теневой кадр вместе с ним; открывшиеся строки пусты.
+static void frameScroll(frameOut *fo, int d) {
+  int rows = E.screenrows, cols = E.screencols, n = d > 0 ? d : -d;
+  frameAttr(fo, 0);
+  if (!fo->hidden) { abAppend(fo->ab, "\x1b[?25l", 6); fo->hidden = true; }
+  abAppend(fo->ab, "\x1b[1;", 4);
+  abAppendNum(fo->ab, (unsigned)rows);
+  abAppend(fo->ab, "r\x1b[", 3);
+  abAppendNum(fo->ab, (unsigned)n);
+  abAppend(fo->ab, d > 0 ? "S\x1b[r" : "T\x1b[r", 4);
+  if (d > 0) {
+    memmove(E.shadow, &E.shadow[n * cols], sizeof(scell) * (rows - n) * cols);
+    memmove(E.shadow_ok, &E.shadow_ok[n], sizeof(bool) * (rows - n));
+  } else {
+    memmove(&E.shadow[n * cols], E.shadow, sizeof(scell) * (rows - n) * cols);
+    memmove(&E.shadow_ok[n], E.shadow_ok, sizeof(bool) * (rows - n));
+  }
+  int from = d > 0 ? rows - n : 0;
+  lineFill(&E.shadow[from * cols], 0, n * cols, ' ', 0);
+  memset(&E.shadow_ok[from], 1, sizeof(bool) * n);
+  E.shadow_cy = E.shadow_cx = -1; // DECSTBM ставит курсор в начало
+}
+
+// Строк с hl стало много (прокрутили далеко): снимаем его со всех, кроме
+// окрестности экрана. Проход по строкам раз на KILO_HL_ROWS заведённых hl.
+static void editorHlTrim(void) {
+  int keep = KILO_HL_ROWS > 4 * E.screenrows ? KILO_HL_ROWS : 4 * E.screenrows;
+  if (E.hl_rows <= keep) return;
+  int lo = E.rowoff - E.screenrows, hi = E.rowoff + 2 * E.screenrows, at = 0;
+  for (ltleaf *lf = ltFirstLeaf(); lf; at += lf->h.n, lf = lf->next) {
+    if (lf->h.leaf != LT_ROWS) continue;
+    for (int j = 0; j < lf->h.n; j++)
+      if (lf->rows[j].hl && (at + j < lo || at + j >= hi)) editorRowHlDrop(&lf->rows[j]);
   }
-  abAppend(ab, "\x1b[m\r\n", 6);
 }
 
-static void editorDrawMessageBar(abuf *ab) {
-  abAppend(ab, "\x1b[K", 3);
-  int msglen = (int)strlen(E.statusmsg); if (msglen > E.screencols) msglen = E.screencols;
-  if (msglen && time(NULL) - E.statusmsg_time < 5) abAppend(ab, E.statusmsg, (size_t)msglen);
+static void editorDrawRows(frameOut *fo) {
+  int rows = E.screenrows;
+  bool all = E.coloff != E.shadow_coloff;
+  int d = E.rowoff - E.shadow_rowoff;
+  // строки экрана, открывшиеся при прокрутке: [exp_lo, exp_hi)
+  int exp_lo = 0, exp_hi = 0;
+  if (!all && d != 0) {
+    if (d > -rows && d < rows) {
+      frameScroll(fo, d);
+      exp_lo = d > 0 ? rows - d : 0;
+      exp_hi = d > 0 ? rows : -d;
+    } else all = true;
+  }
+  E.shadow_rowoff = E.rowoff; E.shadow_coloff = E.coloff;
+
+  editorSyntaxCatchUp(E.rowoff + rows);
+  scell line[E.screencols];
+  rowIter it;
+  erow *row = editorRowIterAt(&it, E.rowoff);
+  for (int y = 0; y < rows; y++, row = editorRowIterNext(&it)) {
+    int filerow = E.rowoff + y;
+    bool need = all || !E.shadow_ok[y] || (y >= exp_lo && y < exp_hi) ||
+                (filerow >= E.damage_lo && filerow < E.damage_hi);
+    if (!need) continue;
+    if (row && !row->leaf) row = editorRowIterMaterialize(&it);
+    if (row) editorRowShowHl(row);
+    editorComposeRow(row, y, line);
+    frameLine(fo, y, line);
+  }
+  E.damage_lo = E.damage_hi = 0;
+  editorHlTrim();
 }
 
 static void editorRefreshScreen(void) {
+  editorMapCheck(); // кадр читает строки из отображения
+  int st = perfEnter(PS_DRAW);
   editorScroll();
-  abuf ab = ABUF_INIT;
-  abAppend(&ab, "\x1b[?25l\x1b[H", 10);
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-  abAppend(&ab, buf, strlen(buf));
-  abAppend(&ab, "\x1b[?25h", 6);
-  ewrite(ab.b, ab.len); fflush(stdout);
-  abFree(&ab);
+  if (!E.shadow || E.shadow_rows != E.screenrows || E.shadow_cols != E.screencols) editorShadowReset();
+  abuf *ab = &E.out;
+  ab->len = 0;
+  frameOut fo = { ab, 0, false };
+  editorDrawRows(&fo);
+  scell line[E.screencols];
+  editorComposeStatusBar(line);
+  frameLine(&fo, E.screenrows, line);
+  editorComposeMessageBar(line);
+  frameLine(&fo, E.screenrows + 1, line);
+  frameAttr(&fo, 0);
+
+  int cy = E.cy - E.rowoff, cx = E.rx - E.coloff;
+  if (ab->len || cy != E.shadow_cy || cx != E.shadow_cx) {
+    frameMove(ab, cy, cx);
+    E.shadow_cy = cy; E.shadow_cx = cx;
+  }
+  if (fo.hidden) abAppend(ab, "\x1b[?25h", 6);
+  E.frame_bytes = ab->len;
+  E.frames++;
+  E.frames_bytes += ab->len;
+  perfEnter(PS_WRITE);
+  if (ab->len) { ewrite(ab->b, ab->len); fflush(stdout); }
+  perfLeave(st);
 }
 
 /* ========================= Обработка клавиш ========================= */
 
 static void editorMoveCursor(int key) {
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  erow *row = editorRowAt(E.cy);
   switch (key) {
     case ARROW_LEFT:
-      if (E.cx != 0) E.cx--; else if (E.cy > 0) { E.cy--; E.cx = E.row[E.cy].size; }
+      if (E.cx != 0) E.cx = rowCharPrev(row, E.cx); else if (E.cy > 0) { E.cy--; E.cx = editorRowAt(E.cy)->size; }
       break;
     case ARROW_RIGHT:
-      if (row && E.cx < row->size) E.cx++; else if (row && E.cx == row->size) { E.cy++; E.cx = 0; }
+      if (row && E.cx < row->size) E.cx = rowCharNext(row, E.cx); else if (row && E.cx == row->size) { E.cy++; E.cx = 0; }
       break;
     case ARROW_UP: if (E.cy != 0) E.cy--; break;
     case ARROW_DOWN: if (E.cy < E.numrows) E.cy++; break;
   }
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  row = editorRowAt(E.cy);
   int rowlen = row ? row->size : 0; if (E.cx > rowlen) E.cx = rowlen;
+  if (row && row->nspecial && E.cx < rowlen) E.cx = rowCharStart(row, E.cx); // не в середину символа
+}
+
+// Вставка в скобках ESC [200~ … ESC [201~ целиком, одной правкой.
+static void editorPaste(void) {
+  static const char end[] = "\x1b[201~";
+  if (T.ev) { // текст вставки лежит в трассе вместе с её клавишей
+    const traceEvent *e = &T.ev[T.at - 1];
+    editorInsertText(e->text, e->len);
+    return;
+  }
+  size_t cap = 4096, len = 0;
+  char *buf = (char*)malloc(cap);
+  if (!buf) die("malloc");
+  while (1) {
+    if (len == cap) { cap *= 2; buf = (char*)realloc(buf, cap); if (!buf) die("realloc"); }
+    int c = inputByte(true);
+    if (c < 0) break; // ввод кончился посреди вставки: вставить пришедшее
+    buf[len++] = (char)c;
+    if (len >= 6 && buf[len - 1] == '~' && !memcmp(&buf[len - 6], end, 6)) { len -= 6; break; }
+  }
+  traceRecord('p', PASTE_START, buf, len);
+  editorInsertText(buf, len);
+  free(buf);
+}
+
+// Выход: Ctrl-Q (о несохранённом он уже спросил) или конец ввода. Когда
+// ввод кончился, спросить некого: несохранённые правки остаются в журнале,
+// и editorOpen предложит их восстановить.
+static void editorQuit(void) {
+  editorSaveWait(); // недописанное сохранение не бросаем
+  traceFinish();
+  ewrites("\x1b[2J\x1b[H");
+  bool keep = E.in_eof && E.dirty && J.path && !J.failed;
+  if (keep) journalFlush(true);
+  editorUnmapFile(); // заодно удаляет отодвинутую сохранением старую версию
+  if (keep && J.made && !J.failed) fprintf(stderr, "Ввод кончился; несохранённые правки — в %s\n", J.path);
+  else journalDrop();
+  exit(0);
 }
 
 static void editorProcessKeypress(void) {
   static int quit_times = KILO_QUIT_TIMES;
   int c = editorReadKey();
+  editorMapCheck(); // пока ждали клавишу, файл могли укоротить
   switch (c) {
     case '\r': editorInsertNewline(); break;
     case CTRL_KEY('q'):
+      editorSaveWait(); // недописанное сохранение не бросаем
       if (E.dirty && quit_times > 0) { editorSetStatusMessage("Есть несохранённые изменения — Ctrl-Q ещё %d", quit_times); quit_times--; return; }
-      ewrites("\x1b[2J\x1b[H"); exit(0);
+      editorQuit(); break;
     case CTRL_KEY('s'): editorSave(); break;
-    case CTRL_KEY('f'): { char *q = editorPrompt("Поиск: %s (ESC отмена, стрелки — след./пред.)", editorFindCallback); if (q) free(q); } break;
+    case CTRL_KEY('e'): editorReplace(); break;
+    case CTRL_KEY('z'): editorUndo(); break;
+    case CTRL_KEY('y'): editorRedo(); break;
+    case CTRL_KEY('p'): perfToggleOverlay(); break;
+    case CTRL_KEY('f'): { char *q = editorPrompt("Поиск: %s (ESC отмена, стрелки — след./пред., Ctrl-T — регистр, Ctrl-R — регулярное выражение)", editorFindCallback, false); if (q) free(q); } break;
     case BACKSPACE:
     case CTRL_KEY('h'):
     case DEL_KEY:
+      undoBegin(UG_DELETE); // Delete — сдвиг вправо и Backspace, один шаг
       if (c == DEL_KEY) editorMoveCursor(ARROW_RIGHT);
       editorDelChar();
+      undoEnd();
       break;
     case CTRL_KEY('l'):
     case '\x1b': break; // ignore
     case HOME_KEY: E.cx = 0; break;
-    case END_KEY: if (E.cy < E.numrows) E.cx = E.row[E.cy].size; break;
+    case END_KEY: if (E.cy < E.numrows) E.cx = editorRowAt(E.cy)->size; break;
     case PAGE_UP:
     case PAGE_DOWN: {
       if (c == PAGE_UP) E.cy = E.rowoff; else { E.cy = E.rowoff + E.screenrows - 1; if (E.cy > E.numrows) E.cy = E.numrows; }
@@ -779,8 +7169,19 @@ static void editorProcessKeypress(void) {
     }
     case ARROW_UP: case ARROW_DOWN: case ARROW_LEFT: case ARROW_RIGHT:
       editorMoveCursor(c); break;
+    case PASTE_START: editorPaste(); break;
     default:
-      if (!iscntrl(c) && c < 128) editorInsertChar(c);
+      if (keyText(c)) {
+        // символы, набранные впрок (или вставка без скобок), — одним куском
+        char run[256];
+        int n = 0, d;
+        run[n++] = (char)c;
+        while (n < (int)sizeof(run) && (d = editorReadRunChar()) >= 0) run[n++] = (char)d;
+        undoBegin(UG_TYPE);
+        if (n == 1) editorInsertChar(c);
+        else editorInsertText(run, n);
+        undoEnd();
+      }
       break;
   }
   quit_times = KILO_QUIT_TIMES;
@@ -788,16 +7189,1350 @@ static void editorProcessKeypress(void) {
 
 /* ============================== Инициализация ======================= */
 
+#ifndef KILO_BENCH
 static void initEditor(void) {
-  E.cx = E.cy = E.rx = 0; E.rowoff = E.coloff = 0; E.numrows = 0; E.row = NULL; E.dirty = 0; E.filename = NULL; E.statusmsg[0] = '\0'; E.statusmsg_time = 0; E.syntax = NULL;
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+  E.cx = E.cy = E.rx = 0; E.rowoff = E.coloff = 0; E.numrows = 0; E.root = NULL; E.dirty = 0; E.filename = NULL; E.statusmsg[0] = '\0'; E.statusmsg_time = 0; E.syntax = NULL;
+  if (platWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
   E.screenrows -= 2;
 }
+#endif
+
+#ifdef KILO_BENCH
+
+/* ============================== Бенчмарки ========================== */
+
+static double benchNow(void) { return platNow(); }
+
+static void benchReset(void) {
+  editorFreeRows();
+  undoClear();
+  E.cx = E.cy = 0; E.dirty = 0;
+}
+
+// Цена нажатия в середине одной длинной строки: должна не зависеть от длины.
+// Первое нажатие переносит разрыв к курсору (разовая цена, растёт с длиной
+// строки) — оно выводится отдельно и в цену нажатия не входит.
+static void benchKeystroke(int linelen) {
+  static const char pat[] = "ts=1700000000 level=info msg=\"request done\" status=200 ";
+  char *line = (char*)malloc(linelen);
+  for (int j = 0; j < linelen; j++) line[j] = pat[j % (sizeof(pat) - 1)];
+  benchReset();
+  editorInsertRow(0, line, linelen);
+  editorSyntaxCatchUp(1);
+  editorRowShowHl(editorRowAt(0)); // как после отрисовки: дальше правки лексируются сразу
+  free(line);
+
+  const int keys = 20000;
+  E.cy = 0; E.cx = linelen / 2;
+  double f0 = benchNow();
+  editorInsertChar(' ');
+  editorDelChar();
+  double t0 = benchNow();
+  for (int k = 0; k < keys; k++) editorInsertChar("int x = 42; "[k % 12]);
+  for (int k = 0; k < keys; k++) editorDelChar();
+  double t1 = benchNow();
+  printf("keystroke  line=%-9d %8.1f ns/key  first %8.1f us\n", linelen,
+         (t1 - t0) * 1e9 / (2.0 * keys), (t0 - f0) * 1e6);
+}
+
+// Курсор в конце длинной строки с табами: набор с кадром и проход стрелками
+// по её концу; цена не должна расти с длиной строки.
+static void benchColumns(int linelen) {
+  char *line = (char*)malloc(linelen);
+  if (!line) die("malloc");
+  for (int j = 0; j < linelen; j++) line[j] = j % 10 == 0 ? '\t' : 'a' + j % 7;
+  benchReset();
+  editorInsertRow(0, line, linelen);
+  free(line);
+  E.cy = 0; E.cx = linelen;
+  editorRefreshScreen();
+  const int keys = 2000;
+  double t0 = benchNow();
+  for (int k = 0; k < keys; k++) { editorInsertChar(k % 5 ? 'x' : '\t'); editorRefreshScreen(); }
+  double t1 = benchNow();
+  for (int k = 0; k < keys; k++) { editorMoveCursor(k % 200 < 100 ? ARROW_LEFT : ARROW_RIGHT); editorRefreshScreen(); }
+  double t2 = benchNow();
+  printf("columns    line=%-9d type %8.1f us/key  move %8.1f us/key\n", linelen,
+         (t1 - t0) * 1e6 / keys, (t2 - t1) * 1e6 / keys);
+  benchReset();
+}
+
+// Текст на разных письменностях: подсчёт особых байтов (блоками и побайтно)
+// по всему файлу и полная перерисовка экрана без прокрутки и с
+// горизонтальной прокруткой (rx -> cx в каждой строке).
+static void benchText(void) {
+  static const char *src[][4] = {
+    { "\tfor (int i = 0; i < n; i++) sum += a[i] * b[i]; // dot product of two",
+      "static int parse_header(const char *buf, size_t len, struct hdr *out) {",
+      "\tif (len < sizeof(struct hdr)) return -1; /* too short for a header */",
+      "#define HDR_MAGIC 0x4b494c4f" },
+    { "\tfor (int i = 0; i < n; i++) sum += a[i] * b[i]; // скалярное произведение",
+      "static int parse_header(const char *buf, size_t len, struct hdr *out) {",
+      "\tif (len < sizeof(struct hdr)) return -1; /* короче заголовка */",
+      "// разбор заголовка: магия, версия, длина" },
+    { "\tfor (int i = 0; i < n; i++) sum += a[i] * b[i]; // 两个向量的点积",
+      "static int parse_header(const char *buf, size_t len, struct hdr *out) {",
+      "\tif (len < sizeof(struct hdr)) return -1; /* 比头部短 */",
+      "// 解析头部：魔数、版本、长度" },
+  };
+  static const char *name[] = { "ascii", "cyrillic", "cjk" };
+  int rows = E.screenrows, cols = E.screencols;
+  E.screenrows = 48; E.screencols = 120;
+  for (int t = 0; t < 3; t++) {
+    benchReset();
+    char *buf = (char*)malloc(20000 * 128);
+    if (!buf) die("malloc");
+    size_t bytes = 0;
+    for (int l = 0; l < 20000; l++) {
+      const char *s = src[t][l % 4];
+      editorInsertRow(E.numrows, s, strlen(s));
+      memcpy(&buf[bytes], s, strlen(s));
+      bytes += strlen(s);
+    }
+    size_t sink = 0;
+    double t0 = benchNow();
+    for (int k = 0; k < 20; k++) sink += textSpecial(buf, bytes);
+    double t1 = benchNow();
+    for (int k = 0; k < 20; k++) sink += textSpecialScalar(buf, bytes);
+    double t2 = benchNow();
+    free(buf);
+    double us[2] = {0, 0};
+    for (int h = 0; h < 2; h++) {
+      E.coloff = h ? 16 : 0; E.cx = 0;
+      for (int k = 0; k < 200; k++) {
+        int rx;
+        E.rowoff = E.cy = (k * E.screenrows) % (E.numrows - E.screenrows);
+        if (h) E.cx = editorRowRxToCx(editorRowAt(E.cy), E.coloff + 4, &rx);
+        editorShadowReset();
+        double f0 = benchNow();
+        editorRefreshScreen();
+        us[h] += (benchNow() - f0) * 1e6;
+      }
+    }
+    printf("text %-9s special %6.2f GB/s (bytewise %5.2f)  frame %6.1f us  hscroll %6.1f us  [%zu]\n", name[t],
+           20.0 * bytes / (t1 - t0) / 1e9, 20.0 * bytes / (t2 - t1) / 1e9, us[0] / 200, us[1] / 200, sink % 10);
+  }
+  E.screenrows = rows; E.screencols = cols;
+  benchReset();
+}
+
+// Память под миллион развёрнутых строк: вставка (как из буфера обмена),
+// затем подсветка всех до конца с экраном в начале файла и с экраном в
+// конце. Считается прирост рабочего набора процесса.
+static void benchRowMemory(void) {
+  static const char *src = "\tif (x->len > 0) memcpy(buf, x->data, x->len); /* copy */\n";
+  const int nlines = 1000000;
+  size_t sl = strlen(src), len = sl * nlines;
+  char *text = (char*)malloc(len);
+  if (!text) die("malloc");
+  for (int l = 0; l < nlines; l++) memcpy(text + sl * l, src, sl);
+  benchReset();
+  size_t r0 = platResident();
+  U.replaying = true; // журнал отмены не пишем: меряем только строки
+  editorInsertText(text, len);
+  U.replaying = false;
+  free(text);
+  size_t r1 = platResident();
+  E.cy = 0; E.rowoff = 0;
+  editorSyntaxCatchUp(E.numrows);
+  editorRefreshScreen();
+  size_t r2 = platResident();
+  E.cy = E.numrows - 1;
+  editorRefreshScreen();
+  size_t r3 = platResident();
+  printf("rows       1M lines of %zu B: inserted %6.1f MB  +highlighted %6.1f MB  +scrolled to end %6.1f MB\n",
+         sl - 1, (double)(r1 - r0) / 1e6, (double)(r2 - r0) / 1e6, (double)(r3 - r0) / 1e6);
+  benchReset();
+}
+
+// Индексация строк: прежний однопоточный memchr против векторного и
+// многопоточного editorIndexLines на буфере в памяти (без диска).
+static void benchIndex(const char *name, size_t size, int linelen) {
+  char *buf = (char*)malloc(size);
+  if (!buf) { printf("index %-12s skipped: no memory\n", name); return; }
+  for (size_t j = 0; j < size; j++) buf[j] = (j % linelen == (size_t)linelen - 1) ? '\n' : 'a' + (char)(j % 23);
+  for (size_t j = linelen; j < size; j += 7 * (size_t)linelen) buf[j - 2] = '\r'; // немного CRLF
+  E.map = buf; E.mapsize = size;
+
+  // прежний загрузчик: memchr в растущий массив
+  size_t cap = 4096, cnt = 0;
+  size_t *off = (size_t*)malloc(sizeof(size_t) * cap);
+  double t0 = benchNow();
+  for (const char *p = buf; (p = (const char*)memchr(p, '\n', buf + size - p)) != NULL; ) {
+    if (cnt == cap) { cap *= 2; off = (size_t*)realloc(off, sizeof(size_t) * cap); }
+    off[cnt++] = (size_t)(++p - buf);
+  }
+  double t1 = benchNow();
+  size_t n = editorIndexLines();
+  double t2 = benchNow();
+  printf("index %-12s lines=%-9llu memchr %7.1f ms  simd+threads %7.1f ms  (%s)\n", name,
+         (unsigned long long)cnt, (t1 - t0) * 1e3, (t2 - t1) * 1e3,
+         (n - 1 == cnt + 1 || n - 1 == cnt) ? "ok" : "MISMATCH");
+  free(off);
+  free(E.lineoff);
+  E.lineoff = NULL; E.map = NULL; E.mapsize = 0;
+  free(buf);
+}
+
+// Прежний поиск: memchr по первому байту и memcmp, строка за строкой.
+static const char *benchMemfind(const char *hay, size_t n, const char *needle, size_t m) {
+  while (n >= m) {
+    const char *p = (const char*)memchr(hay, needle[0], n - m + 1);
+    if (!p) return NULL;
+    if (!memcmp(p, needle, m)) return p;
+    n -= (size_t)(p - hay) + 1; hay = p + 1;
+  }
+  return NULL;
+}
+
+// Поиск по отображённому буферу: прежний построчный memfind против
+// векторного сканирования кусками, затем набор запроса по букве — каждая
+// следующая буква только фильтрует найденное.
+static void benchSearch(size_t size) {
+  static const char *pat[] = {
+    "2024-05-01T12:00:00Z INFO request done path=/api/v1/items status=200 took=3ms\n",
+    "2024-05-01T12:00:01Z WARN slow Request path=/api/v1/orders status=200 took=950ms\n",
+    "2024-05-01T12:00:02Z ERROR upstream timeout path=/api/v2/pay status=504\n",
+  };
+  char *buf = (char*)malloc(size);
+  if (!buf) { printf("search skipped: no memory\n"); return; }
+  for (size_t j = 0, k = 0; j < size; k++) {
+    size_t l = strlen(pat[k % 3]);
+    if (l > size - j) l = size - j;
+    memcpy(&buf[j], pat[k % 3], l);
+    j += l;
+  }
+  benchReset();
+  E.map = buf; E.mapsize = size;
+  size_t n = editorIndexLines();
+  ltleaf *sp = ltNewLeaf(LT_SPAN);
+  sp->h.n = sp->h.count = (int)(n - 1);
+  E.root = &sp->h;
+  E.numrows = (int)(n - 1);
+
+  const char *query = "timeout";
+  size_t old = 0;
+  double t0 = benchNow();
+  rowIter it;
+  for (erow *row = editorRowIterAt(&it, 0); row; row = editorRowIterNext(&it)) {
+    const char *text = editorRowData(row), *p = text;
+    while ((p = benchMemfind(p, row->size - (p - text), query, strlen(query))) != NULL) { old++; p++; }
+  }
+  double t1 = benchNow();
+  searchReset();
+  searchUpdate(query, false, false);
+  double t2 = benchNow();
+  printf("search %-10s %4lluMB  per-row memfind %7.1f ms  simd %7.1f ms  (%s)\n", query,
+         (unsigned long long)(size >> 20), (t1 - t0) * 1e3, (t2 - t1) * 1e3, old == S.total ? "ok" : "MISMATCH");
+
+  const char *typed = "request";
+  for (int icase = 0; icase < 2; icase++) {
+    searchReset();
+    for (int l = 1; typed[l - 1]; l++) {
+      char q[16];
+      memcpy(q, typed, l); q[l] = '\0';
+      double t3 = benchNow();
+      searchUpdate(q, icase, false);
+      double t4 = benchNow();
+      printf("search typed %-9s%s %10llu matches  %7.1f ms\n", q, icase ? " (icase)" : "        ",
+             (unsigned long long)S.total, (t4 - t3) * 1e3);
+    }
+  }
+  searchReset();
+  editorFreeRows();
+  free(E.lineoff);
+  E.lineoff = NULL; E.map = NULL; E.mapsize = 0;
+  free(buf);
+}
+
+// Индекс триграмм на журнале: постройка в фоне, память, повторные поиски
+// редкого и частого запроса по индексу против сканирования; после правок
+// (новые строки, вставка в строку файла) ответы должны совпадать.
+static void benchSearchIndex(size_t size) {
+  char *buf = (char*)malloc(size);
+  if (!buf) { printf("search index skipped: no memory\n"); return; }
+  unsigned x = 12345;
+  for (size_t j = 0; j < size; ) {
+    char line[160];
+    x = x * 1103515245u + 12345u;
+    int l = snprintf(line, sizeof(line), "2024-05-01T12:%02u:%02uZ %s req=%08x path=/api/v%u/items status=%u took=%ums\n",
+                     x >> 26, (x >> 20) & 63, (x & 0x300) ? "INFO request done" : "WARN slow request",
+                     x * 2654435761u, x % 3 + 1, 200 + (x >> 8) % 5, (x >> 4) % 1000);
+    if ((size_t)l > size - j) l = (int)(size - j);
+    memcpy(&buf[j], line, l);
+    j += l;
+  }
+  benchReset();
+  E.map = buf; E.mapsize = size;
+  E.nlines = editorIndexLines();
+  E.linestate = (unsigned char*)calloc(E.nlines, 1);
+  if (!E.linestate) die("calloc");
+  ltleaf *sp = ltNewLeaf(LT_SPAN);
+  sp->h.n = sp->h.count = (int)(E.nlines - 1);
+  E.root = &sp->h;
+  E.numrows = (int)(E.nlines - 1);
+  char rare[16]; // "req=xxxxxxxx" строки из середины
+  memcpy(rare, strstr(&buf[E.lineoff[E.nlines / 2]], "req="), 12); rare[12] = '\0';
+
+  double t0 = benchNow();
+  triStart();
+  triPoll(true);
+  printf("search index %4lluMB  build %7.1f ms  memory %6.1f MB  block %u KB\n",
+         (unsigned long long)(size >> 20), (benchNow() - t0) * 1e3, triMemory() / 1048576.0,
+         TI.ready ? 1u << (TI.shift - 10) : 0);
+  for (int pass = 0; pass < 2; pass++) {
+    if (pass) { // правки: новая строка с редким запросом и вставка в строку файла
+      editorInsertRow(10, rare, strlen(rare));
+      editorRowInsertString(editorRowAt(E.numrows - 100), 5, rare, strlen(rare));
+      editorRowInsertString(editorRowAt(E.numrows / 3), 20, "timeout", 7);
+    }
+    const char *query[] = { rare, "timeout", "slow request" };
+    for (int k = 0; k < 3; k++) {
+      size_t got[2];
+      double t[2];
+      for (int idx = 1; idx >= 0; idx--) {
+        bool on = TI.on, ready = TI.ready;
+        if (!idx) TI.on = TI.ready = false;
+        searchReset();
+        double t1 = benchNow();
+        for (int r = 0; r < 5; r++) { searchReset(); searchUpdate(query[k], false, false); }
+        t[idx] = (benchNow() - t1) / 5;
+        got[idx] = S.total;
+        TI.on = on; TI.ready = ready;
+      }
+      printf("search index %-14s%s %9llu matches  scan %7.1f ms  index %7.2f ms  (%s)\n", query[k],
+             pass ? " edited" : "       ", (unsigned long long)got[1], t[0] * 1e3, t[1] * 1e3,
+             got[0] == got[1] ? "ok" : "MISMATCH");
+    }
+  }
+  searchReset();
+  triStop();
+  editorFreeRows();
+  undoClear();
+  free(E.lineoff); free(E.linestate);
+  E.lineoff = NULL; E.linestate = NULL; E.map = NULL; E.mapsize = 0; E.nlines = 0;
+  free(buf);
+}
+
+// Регулярный поиск: пропускная способность на логе (с литералом и без) и на
+// выражениях, на которых поиск с возвратами экспоненциален или квадратичен.
+static void benchRegexMap(char *buf, size_t size) {
+  benchReset();
+  free(E.lineoff); free(E.linestate); // от прошлого вызова
+  E.lineoff = NULL; E.linestate = NULL;
+  E.map = buf; E.mapsize = size;
+  E.nlines = editorIndexLines();
+  ltleaf *sp = ltNewLeaf(LT_SPAN);
+  sp->h.n = sp->h.count = (int)(E.nlines - 1);
+  E.root = &sp->h;
+  E.numrows = (int)(E.nlines - 1);
+}
+
+static void benchRegexRun(const char *pattern, size_t size) {
+  searchReset();
+  double t0 = benchNow();
+  searchUpdate(pattern, false, true);
+  double t = benchNow() - t0;
+  printf("regex %-34s %4lluMB %10llu matches  %7.1f ms  %7.0f MB/s  literal '%s'\n", pattern,
+         (unsigned long long)(size >> 20), (unsigned long long)S.total, t * 1e3, size / 1048576.0 / t, RX.lit);
+}
+
+static void benchRegex(size_t size) {
+  char *buf = (char*)malloc(size);
+  if (!buf) { printf("regex skipped: no memory\n"); return; }
+  unsigned x = 12345;
+  for (size_t j = 0; j < size; ) {
+    char line[160];
+    x = x * 1103515245u + 12345u;
+    int l = snprintf(line, sizeof(line), "2024-05-01T12:%02u:%02uZ %s req=%08x path=/api/v%u/items status=%u took=%ums\n",
+                     x >> 26, (x >> 20) & 63, (x & 0x300) ? "INFO request done" : "WARN slow request",
+                     x * 2654435761u, x % 3 + 1, 200 + (x >> 8) % 5, (x >> 4) % 1000);
+    if ((size_t)l > size - j) l = (int)(size - j);
+    memcpy(&buf[j], line, l);
+    j += l;
+  }
+  benchRegexMap(buf, size);
+  searchReset();
+  searchUpdate("slow request", false, false);
+  size_t lit = S.total;
+  benchRegexRun("slow request", size);
+  printf("regex literal as regex: %s\n", lit == S.total ? "ok" : "MISMATCH");
+  static const char *pat[] = {
+    "status=20[34]", "took=9\\d\\dms$", "req=[0-9a-f]*ff[0-9a-f]* path=/api/v3",
+    "\\d\\d:\\d\\dZ WARN", "[a-z]+=[0-9]{3}ms", "(a|aa)*b|(x+x+)+y", "[^ ]+/items",
+  };
+  for (size_t k = 0; k < sizeof(pat) / sizeof(pat[0]); k++) benchRegexRun(pat[k], size);
+
+  // короткие строки из 'a' и одна длинная "abab...": (a+)+b и (a|aa)*c с
+  // возвратами экспоненциальны, ab|a.*z при поиске слева направо
+  // перечитывает хвост строки после каждого вхождения
+  size_t small = size / 4;
+  for (size_t j = 0; j < small; j++) buf[j] = (j % 1000 == 999) ? '\n' : 'a';
+  benchRegexMap(buf, small);
+  benchRegexRun("(a+)+b", small);
+  benchRegexRun("(a|aa)*c", small);
+  for (size_t j = 0; j < small; j++) buf[j] = (j & 1) ? 'b' : 'a';
+  buf[small - 1] = '\n';
+  benchRegexMap(buf, small);
+  benchRegexRun("ab|a.*z", small);
+  benchRegexRun("(a|b)*(a|b)*(a|b)*c", small);
+
+  searchReset();
+  editorFreeRows();
+  free(E.lineoff); free(E.linestate);
+  E.lineoff = NULL; E.linestate = NULL; E.map = NULL; E.mapsize = 0; E.nlines = 0;
+  free(buf);
+}
+
+// Байт на кадр: перерисовка только изменившегося против полной (как раньше,
+// теневой кадр сбрасывается перед каждым кадром) на типичных действиях.
+static void benchRender(void) {
+  static const char *src[] = {
+    "static int table_size(const struct entry *e) {",
+    "\tfor (int i = 0; i < e->n; i++) if (e->a[i] == KEY) return i; // found",
+    "\t/* long comment explaining the loop above in some detail */",
+    "\treturn -1;",
+    "}",
+    "",
+    "#define KEY 42",
+  };
+  static const char *name[] = { "move", "type", "line-scroll", "page-scroll" };
+  int rows = E.screenrows, cols = E.screencols;
+  E.screenrows = 48; E.screencols = 120;
+  for (int sc = 0; sc < 4; sc++) {
+    unsigned long long bytes[2] = {0, 0};
+    double us = 0;
+    for (int full = 0; full < 2; full++) {
+      benchReset();
+      for (int l = 0; l < 20000; l++) editorInsertRow(E.numrows, src[l % 7], strlen(src[l % 7]));
+      E.rowoff = E.coloff = 0; E.cy = 10; E.cx = 0;
+      editorShadowReset();
+      editorRefreshScreen();
+      for (int k = 0; k < 200; k++) {
+        switch (sc) {
+          case 0: editorMoveCursor(k % 40 < 20 ? ARROW_RIGHT : ARROW_DOWN); break;
+          case 1: editorInsertChar("x = 1; "[k % 7]); break;
+          case 2: E.cy = E.rowoff + E.screenrows; break;
+          case 3: E.cy = E.rowoff + 2 * E.screenrows - 1; break;
+        }
+        if (full) editorShadowReset();
+        double t0 = benchNow();
+        editorRefreshScreen();
+        if (!full) us += (benchNow() - t0) * 1e6;
+        bytes[full] += E.frame_bytes;
+      }
+    }
+    printf("render %-12s %8.0f bytes/frame  (full redraw %8.0f)  %6.1f us/frame\n", name[sc],
+           bytes[0] / 200.0, bytes[1] / 200.0, us / 200);
+  }
+  E.screenrows = rows; E.screencols = cols;
+  benchReset();
+}
+
+// Вставка nlines строк в середину файла: по клавише с кадром после каждой
+// (как шла вставка без bracketed paste) и одним куском с одним кадром.
+static void benchPaste(int nlines) {
+  static const char *src = "\tif (x->len > 0) memcpy(buf, x->data, x->len); /* copy */\r\n";
+  size_t sl = strlen(src), len = sl * nlines;
+  char *text = (char*)malloc(len);
+  if (text == NULL) die("malloc");
+  for (int l = 0; l < nlines; l++) memcpy(text + sl * l, src, sl);
+  double t[2];
+  for (int bulk = 0; bulk < 2; bulk++) {
+    benchReset();
+    for (int l = 0; l < 1000; l++) editorInsertRow(E.numrows, "int a = 0;", 10);
+    E.cy = 500; E.cx = 4;
+    editorRefreshScreen();
+    double t0 = benchNow();
+    if (bulk) {
+      editorInsertText(text, len);
+    } else {
+      for (size_t i = 0; i < len; i++) {
+        if (text[i] == '\r') { editorInsertNewline(); i++; }
+        else editorInsertChar(text[i]);
+        editorRefreshScreen();
+      }
+    }
+    editorRefreshScreen();
+    t[bulk] = benchNow() - t0;
+  }
+  printf("paste      lines=%-8d per-key %8.1f ms  bulk %7.2f ms\n", nlines, t[0] * 1e3, t[1] * 1e3);
+  free(text);
+  benchReset();
+}
+
+// Отмена и повтор вставки 100k строк в файлы разной длины: цена должна
+// зависеть от размера правки, а не файла.
+static void benchUndo(int filelines) {
+  static const char *src = "\tif (x->len > 0) memcpy(buf, x->data, x->len); /* copy */\n";
+  const int nlines = 100000;
+  size_t sl = strlen(src), len = sl * nlines;
+  char *text = (char*)malloc(len);
+  if (text == NULL) die("malloc");
+  for (int l = 0; l < nlines; l++) memcpy(text + sl * l, src, sl);
+  benchReset();
+  for (int l = 0; l < filelines; l++) editorInsertRow(E.numrows, "int a = 0;", 10);
+  undoClear();
+  E.cy = filelines / 2; E.cx = 4;
+  double t0 = benchNow();
+  editorInsertText(text, len);
+  double t1 = benchNow();
+  editorUndo();
+  double t2 = benchNow();
+  editorRedo();
+  double t3 = benchNow();
+  printf("undo       file=%-8d paste %7.1f ms  undo %7.1f ms  redo %7.1f ms  journal %zu KB\n", filelines,
+         (t1 - t0) * 1e3, (t2 - t1) * 1e3, (t3 - t2) * 1e3, U.bytes >> 10);
+  free(text);
+  benchReset();
+}
+
+// Замена всех вхождений на файле из lines строк, где вхождение в каждой
+// второй: литерал и выражение, отмена и повтор всей замены; после отмены
+// буфер должен совпасть с исходным.
+static void benchReplace(int lines) {
+  size_t cap = (size_t)lines * 96, size = 0;
+  char *buf = (char*)malloc(cap);
+  if (!buf) { printf("replace skipped: no memory\n"); return; }
+  for (int l = 0; l < lines; l++)
+    size += snprintf(buf + size, cap - size, "2024-05-01T12:00:%02dZ INFO request done path=/api/v1/items status=%d\n",
+                     l % 60, l & 1 ? 404 : 200);
+  benchReset();
+  E.map = buf; E.mapsize = size;
+  E.nlines = editorIndexLines();
+  E.linestate = (unsigned char*)calloc(E.nlines, 1);
+  if (!E.linestate) die("calloc");
+  ltleaf *sp = ltNewLeaf(LT_SPAN);
+  sp->h.n = sp->h.count = (int)(E.nlines - 1);
+  E.root = &sp->h;
+  E.numrows = (int)(E.nlines - 1);
+  unsigned long long h0 = editorBufferHash();
+
+  static const struct { const char *query, *with; bool regex; } job[] = {
+    { "status=200", "status=OK", false },
+    { "status=OK", "status=200", false },
+    { "status=[0-9]+$", "status=-", true },
+  };
+  for (size_t k = 0; k < sizeof(job) / sizeof(job[0]); k++) {
+    double t0 = benchNow();
+    long long n = editorReplaceAll(job[k].query, job[k].with, false, job[k].regex);
+    double t1 = benchNow();
+    printf("replace %-16s %7d lines %8lld replaced  %7.1f ms  journal %zu KB\n", job[k].query, lines, n,
+           (t1 - t0) * 1e3, U.bytes >> 10);
+  }
+  double t0 = benchNow();
+  for (size_t k = 0; k < sizeof(job) / sizeof(job[0]); k++) editorUndo();
+  double t1 = benchNow();
+  bool same = editorBufferHash() == h0;
+  editorRedo();
+  double t2 = benchNow();
+  printf("replace undo all %7.1f ms  redo one %7.1f ms  (%s)\n", (t1 - t0) * 1e3, (t2 - t1) * 1e3,
+         same ? "ok" : "MISMATCH");
+
+  searchReset();
+  triStop();
+  editorFreeRows();
+  undoClear();
+  free(E.lineoff); free(E.linestate);
+  E.lineoff = NULL; E.linestate = NULL; E.map = NULL; E.mapsize = 0; E.nlines = 0;
+  free(buf);
+}
+
+// Журнал восстановления: цена правок с журналом и без него, сколько байт
+// уходит в журнал против размера файла, и воспроизведение после «падения»
+// (журнал брошен без удаления) — буфер должен совпасть.
+static void benchJournal(int lines, int keys) {
+  const char *name = "kilo-journal.tmp.c";
+  FILE *fp = fopen(name, "wb");
+  if (!fp) { printf("journal skipped: cannot create %s\n", name); return; }
+  for (int l = 0; l < lines; l++) fprintf(fp, "\tint x%d = %d; /* row */\n", l, l * 7);
+  fclose(fp);
+  unsigned long long hash = 0;
+  for (int on = 0; on < 2; on++) {
+    editorOpen(name);
+    if (!on) journalDrop(); // J.path == NULL: журнал не ведётся
+    unsigned x = 12345;
+    double t0 = benchNow();
+    for (int k = 0; k < keys; ) {
+      x = x * 1103515245u + 12345u;
+      E.cy = (int)((x >> 8) % (unsigned)E.numrows); E.cx = 0;
+      for (int r = 0; r < 20 && k < keys; r++, k++) editorInsertChar("int y = 0; "[r % 11]);
+      for (int r = 0; r < 5 && k < keys; r++, k++) editorDelChar();
+      if ((x & 7) == 0) { editorInsertNewline(); k++; }
+      journalPoll();
+    }
+    journalFlush(true);
+    double t1 = benchNow();
+    printf("journal %-3s %8d lines %7d keys %8.1f ns/key  file %6.1f MB  journal %7.1f KB\n", on ? "on" : "off",
+           lines, keys, (t1 - t0) * 1e9 / keys, E.fsize / 1048576.0, J.bytes / 1024.0);
+    hash = editorBufferHash();
+  }
+  // падение: журнал остаётся на диске
+  if (J.open) platClose(J.f);
+  free(J.path); free(J.buf); free(J.kept);
+  memset(&J, 0, sizeof(J));
+  E.in[E.in_tail++ & (KILO_INPUT_RING - 1)] = 'y'; // ответ на вопрос о восстановлении
+  double t0 = benchNow();
+  editorOpen(name);
+  double t1 = benchNow();
+  printf("journal recover %7.1f ms  (%s)\n", (t1 - t0) * 1e3, editorBufferHash() == hash ? "ok" : "MISMATCH");
+  journalDrop();
+  editorFreeRows();
+  editorUnmapFile();
+  undoClear();
+  platDelete(name);
+}
+
+// Перемена файла на диске: дописывание на месте и подмена файла с
+// несколькими правками посередине. Перечитывание и подсветка до конца
+// файла (курсор внизу) против открытия заново; буфер и состояние
+// подсветки в конце должны совпасть с открытым заново.
+static bool benchWatchWrite(const char *name, int lines, int edits) {
+  FILE *fp = fopen(name, "wb");
+  if (!fp) return false;
+  for (int l = 0; l < lines; l++) {
+    if (edits && l % (lines / edits) == lines / edits / 2) fprintf(fp, "\tedited(%d); /* changed\n", l);
+    else if (l % 1000 == 0) fprintf(fp, "/* block %d\n", l);
+    else if (l % 1000 == 10) fprintf(fp, "   end */\n");
+    else fprintf(fp, "\tint x%d = %d; /* row */\n", l, l * 7);
+  }
+  fclose(fp);
+  return true;
+}
+
+static void benchWatch(int lines) {
+  const char *name = "kilo-watch.tmp.c", *tmp = "kilo-watch.tmp.c.new";
+  benchWatchWrite(name, lines, 0);
+  for (int step = 0; step < 2; step++) {
+    editorOpen(name);
+    E.cy = E.numrows - 1; E.rowoff = E.cy;
+    editorSyntaxCatchUp(E.numrows);
+    if (step == 0) { // дописывание на месте
+      FILE *fp = fopen(name, "ab");
+      if (!fp) break;
+      for (int l = 0; l < 10000; l++) fprintf(fp, "\tlog(%d); /* tail */\n", l);
+      fclose(fp);
+    } else { // подмена: тот же файл с правками в 8 местах
+      benchWatchWrite(tmp, lines, 8);
+      platRename(tmp, name, true);
+    }
+    E.ftime ^= 1; // время изменения могло не сдвинуться
+    W.next = 0;
+    double t0 = benchNow();
+    editorWatchPoll();
+    double t1 = benchNow();
+    editorSyntaxCatchUp(E.numrows);
+    double t2 = benchNow();
+    char msg[sizeof(E.statusmsg)];
+    snprintf(msg, sizeof(msg), "%s", E.statusmsg);
+    unsigned long long hash = editorBufferHash();
+    int rows = E.numrows, exit = editorRowAt(E.numrows - 1)->hl_exit;
+    double t3 = benchNow();
+    editorOpen(name);
+    editorSyntaxCatchUp(E.numrows);
+    double t4 = benchNow();
+    bool ok = hash == editorBufferHash() && rows == E.numrows && exit == editorRowAt(E.numrows - 1)->hl_exit;
+    printf("watch %-7s %8d lines  reload %7.1f ms + highlight %7.1f ms  vs reopen %7.1f ms  (%s)\n  %s\n",
+           step ? "replace" : "append", rows, (t1 - t0) * 1e3, (t2 - t1) * 1e3, (t4 - t3) * 1e3, ok ? "ok" : "MISMATCH", msg);
+  }
+  journalDrop();
+  editorFreeRows();
+  editorUnmapFile();
+  undoClear();
+  platDelete(name);
+}
+
+// Открытый файл укоротили на диске (переписали его первой половиной, как
+// ротация логов через copytruncate), а на экране — его конец. Кадр не
+// должен читать отображение за новым концом файла. Чистый буфер
+// перечитывается и совпадает с открытым заново; в буфере с правками
+// строки остаются на местах, потерянные пустеют, правки целы и
+// сохраняются. Windows укоротить отображённый файл не даёт.
+static void benchTruncate(int lines) {
+  const char *name = "kilo-trunc.tmp.c";
+  for (int step = 0; step < 2; step++) {
+    benchWatchWrite(name, lines, 0);
+    editorOpen(name);
+    E.cy = E.numrows - 1; E.rowoff = E.cy;
+    editorRefreshScreen();
+    bool dirty = step == 1;
+    if (dirty) {
+      E.cy = 10; E.cx = 0; editorInsertChar('A');
+      E.cy = E.numrows - 1; E.cx = 0; editorInsertChar('B');
+    }
+    if (!benchWatchWrite(name, lines / 2, 0)) {
+      printf("truncate %-5s skipped: the mapped file cannot be truncated\n", dirty ? "dirty" : "clean");
+      break;
+    }
+    double t0 = benchNow();
+    editorRefreshScreen(); // конец файла на экране
+    double t1 = benchNow();
+    char msg[sizeof(E.statusmsg)];
+    snprintf(msg, sizeof(msg), "%s", E.statusmsg);
+    bool ok;
+    double t2 = t1;
+    if (!dirty) {
+      unsigned long long hash = editorBufferHash();
+      int rows = E.numrows;
+      editorOpen(name);
+      ok = hash == editorBufferHash() && rows == E.numrows;
+    } else {
+      erow *a = editorRowAt(10), *lost = editorRowAt(lines / 2 + 1), *b = editorRowAt(lines - 1);
+      ok = E.numrows == lines && a->size && rowCh(a, 0) == 'A' && lost->size == 0 && b->size && rowCh(b, 0) == 'B';
+      unsigned long long hash = editorBufferHash();
+      editorSave();
+      t2 = benchNow();
+      editorOpen(name);
+      ok = ok && hash == editorBufferHash() && E.numrows == lines;
+    }
+    char how[64];
+    if (dirty) snprintf(how, sizeof(how), "detach %7.1f ms + save %7.1f ms", (t1 - t0) * 1e3, (t2 - t1) * 1e3);
+    else snprintf(how, sizeof(how), "reload %7.1f ms", (t1 - t0) * 1e3);
+    printf("truncate %-5s %8d lines  %s  (%s)\n  %s\n", dirty ? "dirty" : "clean", lines, how,
+           ok ? "ok" : "MISMATCH", msg);
+  }
+  journalDrop();
+  editorFreeRows();
+  editorUnmapFile();
+  undoClear();
+  platDelete(name);
+}
+
+/* ------------------ Ручной лексер (эталон для сравнения) ------------ */
+
+// Лексер, который был до таблиц: разбор случаев на каждый символ по полям
+// editorSyntax, сравнение разделителей комментариев в каждой позиции и
+// поиск ключевого слова на каждой границе. Красит всю строку от начала;
+// возвращает, кончилась ли строка внутри многострочного комментария.
+
+static bool rowMatch(const erow *row, int at, const char *s, int len) {
+  if (at + len > row->size) return false;
+  for (int j = 0; j < len; j++) if (rowCh(row, at + j) != s[j]) return false;
+  return true;
+}
+
+// Ключевое слово, начинающееся в позиции at: цвет и длина, либо HL_NORMAL.
+static int editorKeywordAt(const erow *row, int at, int *len) {
+  const struct editorSyntax *s = E.syntax;
+  char word[KW_MAXLEN + 1];
+  int n = 0;
+  char c;
+  while (!is_separator(c = rowCh(row, at + n))) {
+    if (n == s->kwmaxlen) return HL_NORMAL;
+    word[n++] = c;
+  }
+  if (n == 0) return HL_NORMAL;
+  int color = editorKeywordColor(s, word, n);
+  if (color != HL_NORMAL) *len = n;
+  return color;
+}
+
+enum { HX_CODE = 0, HX_MLCOMMENT, HX_DQUOTE, HX_SQUOTE };
+enum { HX_NOSEP = 0, HX_SEP, HX_NUMBER, HX_COMMENT };
+
+static bool benchLexHand(erow *row, bool entry) {
+  char *scs = E.syntax->singleline_comment_start;
+  char *mcs = E.syntax->multiline_comment_start;
+  char *mce = E.syntax->multiline_comment_end;
+  int scs_len = scs ? (int)strlen(scs) : 0;
+  int mcs_len = (mcs && mce) ? (int)strlen(mcs) : 0;
+  int mce_len = (mcs && mce) ? (int)strlen(mce) : 0;
+  int i = 0, mode = entry ? HX_MLCOMMENT : HX_CODE, prev = HX_SEP;
+
+  while (i < row->size) {
+    unsigned char *h = rowHl(row, i);
+    char c = rowCh(row, i);
+    if (prev == HX_COMMENT) { *h = HL_COMMENT; i++; continue; }
+    if (mode == HX_MLCOMMENT) {
+      if (rowMatch(row, i, mce, mce_len)) {
+        for (int j = 0; j < mce_len; j++) *rowHl(row, i + j) = HL_MLCOMMENT;
+        i += mce_len; mode = HX_CODE; prev = HX_SEP;
+      } else { *h = HL_MLCOMMENT; i++; }
+      continue;
+    }
+    if (mode == HX_DQUOTE || mode == HX_SQUOTE) {
+      if (c == '\\' && i + 1 < row->size) { *h = *rowHl(row, i + 1) = HL_STRING; i += 2; continue; }
+      *h = HL_STRING;
+      if (c == (mode == HX_DQUOTE ? '"' : '\'')) mode = HX_CODE;
+      prev = HX_SEP; i++; continue;
+    }
+    if (scs_len && rowMatch(row, i, scs, scs_len)) { prev = HX_COMMENT; continue; }
+    if (mcs_len && rowMatch(row, i, mcs, mcs_len)) {
+      for (int j = 0; j < mcs_len; j++) *rowHl(row, i + j) = HL_MLCOMMENT;
+      i += mcs_len; mode = HX_MLCOMMENT; prev = HX_SEP; continue;
+    }
+    if ((E.syntax->flags & HL_HIGHLIGHT_STRINGS) && (c == '"' || c == '\'')) {
+      *h = HL_STRING; i++;
+      mode = (c == '"') ? HX_DQUOTE : HX_SQUOTE; prev = HX_SEP; continue;
+    }
+    if ((E.syntax->flags & HL_HIGHLIGHT_NUMBERS) &&
+        ((isdigit((unsigned char)c) && (prev == HX_SEP || prev == HX_NUMBER)) || (c == '.' && prev == HX_NUMBER))) {
+      *h = HL_NUMBER; i++; prev = HX_NUMBER; continue;
+    }
+    if (prev == HX_SEP) {
+      int klen, color = editorKeywordAt(row, i, &klen);
+      if (color != HL_NORMAL) {
+        for (int j = 0; j < klen; j++) *rowHl(row, i + j) = (unsigned char)color;
+        i += klen; prev = HX_NOSEP; continue;
+      }
+    }
+    *h = HL_NORMAL;
+    prev = is_separator(c) ? HX_SEP : HX_NOSEP;
+    i++;
+  }
+  return mode == HX_MLCOMMENT;
+}
+
+// Таблицы против ручного лексера на одном и том же C-коде (комментарии,
+// строки, числа, ключевые слова), байты в секунду; и совпадают ли цвета.
+static void benchLexer(int nlines) {
+  static const char *src[] = {
+    "static const unsigned int table_size = sizeof(struct entry) * 16; // size",
+    "  for (int i = 0; i < n; i++) if (a[i] == key) return (long)i;",
+    "  printf(\"%d items, %s\\n\", count, name); /* report */",
+    "/* block comment that spans",
+    "   several lines with 'quotes' and \"strings\" inside */",
+    "  else if (x > 0) { double d = (double)x / 3.0; float f = 0.5 * d; }",
+    "  while (p != NULL && p->next) { p = p->next; continue; }",
+    "  char c = '\\''; const char *s = \"tab\\there\"; unsigned long m = 0xff;",
+  };
+  const int nsrc = (int)(sizeof(src) / sizeof(src[0]));
+  erow *rows = (erow*)calloc(nlines, sizeof(erow));
+  unsigned char *ref = NULL;
+  size_t bytes = 0, off = 0, diff = 0;
+  if (!rows) die("calloc");
+  for (int l = 0; l < nlines; l++) {
+    erow *row = &rows[l];
+    row->chars = (char*)src[l % nsrc];
+    row->size = row->gap = (int)strlen(row->chars);
+    row->cap = row->size + 1;
+    bytes += row->size;
+  }
+  unsigned char *hl = (unsigned char*)malloc(bytes + nlines);
+  ref = (unsigned char*)malloc(bytes + nlines);
+  if (!hl || !ref) die("malloc");
+  for (int l = 0; l < nlines; l++) { rows[l].hl = hl + off; off += rows[l].size + 1; }
+  double t[2];
+  for (int pass = 0; pass < 2; pass++) {
+    double t0 = benchNow();
+    unsigned char entry = 0;
+    for (int l = 0; l < nlines; l++) {
+      erow *row = &rows[l];
+      if (pass == 0) { entry = benchLexHand(row, entry); continue; }
+      row->hl_entry = entry; row->hl_ok = false;
+      editorRowLex(row, 0, row->size);
+      entry = row->hl_exit;
+    }
+    t[pass] = benchNow() - t0;
+    if (pass == 0) memcpy(ref, hl, off);
+  }
+  for (size_t j = 0; j < off; j++) diff += (ref[j] & HL_COLOR_MASK) != (hl[j] & HL_COLOR_MASK);
+  printf("lexer      lines=%-8d hand %7.1f MB/s  tables %7.1f MB/s  (%s)\n", nlines,
+         bytes / t[0] / 1e6, bytes / t[1] / 1e6, diff ? "MISMATCH" : "same colors");
+  for (int j = 0; j < hl_ndefs; j++) { // определения из файлов — на том же тексте
+    struct editorSyntax *keep = E.syntax;
+    E.syntax = &hl_defs[j];
+    double t0 = benchNow();
+    unsigned char entry = 0;
+    for (int l = 0; l < nlines; l++) {
+      rows[l].hl_entry = entry; rows[l].hl_ok = false;
+      editorRowLex(&rows[l], 0, rows[l].size);
+      entry = rows[l].hl_exit;
+    }
+    printf("lexer      %-14s tables %7.1f MB/s  (%d states)\n", hl_defs[j].filetype,
+           bytes / (benchNow() - t0) / 1e6, hl_defs[j].dfa->nstates);
+    E.syntax = keep;
+  }
+  free(ref); free(hl); free(rows);
+}
+
+// Прежний поиск ключевого слова: перебор всего списка со strlen и сравнением.
+static int benchKeywordLinear(const erow *row, int at, int *len) {
+  char **keywords = E.syntax->keywords;
+  for (int j = 0; keywords[j]; j++) {
+    int klen = (int)strlen(keywords[j]);
+    int kw2 = keywords[j][klen-1] == '|';
+    if (kw2) klen--;
+    if (rowMatch(row, at, keywords[j], klen) && is_separator(rowCh(row, at + klen))) {
+      *len = klen;
+      return kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+    }
+  }
+  return HL_NORMAL;
+}
+
+// Ключевые слова на плотном C-коде: поиск на каждой границе идентификатора
+// (перебор против хеша) и полный лексер строки.
+static void benchKeywords(int nlines) {
+  static const char *src[] = {
+    "static const unsigned int table_size = sizeof(struct entry) * 16;",
+    "  for (int i = 0; i < n; i++) if (a[i] == key) return (long)i;",
+    "  while (p != NULL && p->next) { p = p->next; continue; }",
+    "typedef struct node { void *data; size_t len; char flags; } node;",
+    "  switch (kind) { case 0: break; default: return -1; }",
+    "  unsigned long long total = (unsigned long long)count * width;",
+    "  else if (x > 0) { double d = (double)x / 3.0; float f = (float)d; }",
+    "extern volatile signed short ready; static inline void spin(void);",
+  };
+  const int nsrc = (int)(sizeof(src) / sizeof(src[0]));
+  unsigned char hl[128];
+  double t[3] = {0, 0, 0};
+  long long hits[2] = {0, 0}, bytes = 0;
+  for (int pass = 0; pass < 3; pass++) {
+    double t0 = benchNow();
+    for (int l = 0; l < nlines; l++) {
+      erow row;
+      memset(&row, 0, sizeof(row));
+      row.chars = (char*)src[l % nsrc];
+      row.size = row.cap = row.gap = (int)strlen(row.chars);
+      row.hl = hl;
+      if (pass == 2) { editorRowLex(&row, 0, row.size); bytes += row.size; continue; }
+      for (int i = 0; i < row.size; i++) {
+        if (is_separator(row.chars[i]) || (i > 0 && !is_separator(row.chars[i - 1]))) continue;
+        int klen;
+        int color = pass ? editorKeywordAt(&row, i, &klen) : benchKeywordLinear(&row, i, &klen);
+        if (color != HL_NORMAL) hits[pass]++;
+      }
+    }
+    t[pass] = benchNow() - t0;
+  }
+  printf("keywords   lines=%-8d linear %7.1f ms  hash %7.1f ms  (%s)  lex %6.1f MB/s\n", nlines,
+         t[0] * 1e3, t[1] * 1e3, hits[0] == hits[1] ? "ok" : "MISMATCH", bytes / t[2] / 1e6);
+}
+
+/* ------------------------ Набор операций --------------------------- */
+
+// Серия замеров одной операции: время каждого повтора и выделения памяти
+// за всю серию. Массив времён выделяется заранее и в счёт не идёт.
+typedef struct benchSeries {
+  double *t;
+  int n, cap;
+  double t0;
+  unsigned long long allocs, bytes, allocs0, bytes0;
+} benchSeries;
+
+static void benchSeriesInit(benchSeries *s, int cap) {
+  memset(s, 0, sizeof(*s));
+  s->t = (double*)malloc(sizeof(double) * cap);
+  if (!s->t) die("malloc");
+  s->cap = cap;
+}
+
+static void benchBegin(benchSeries *s) {
+  s->allocs0 = __atomic_load_n(&mem_allocs, __ATOMIC_RELAXED);
+  s->bytes0 = __atomic_load_n(&mem_bytes, __ATOMIC_RELAXED);
+  s->t0 = benchNow();
+}
+
+static void benchEnd(benchSeries *s) {
+  double t = benchNow() - s->t0;
+  if (s->n < s->cap) s->t[s->n++] = t;
+  s->allocs += __atomic_load_n(&mem_allocs, __ATOMIC_RELAXED) - s->allocs0;
+  s->bytes += __atomic_load_n(&mem_bytes, __ATOMIC_RELAXED) - s->bytes0;
+}
+
+static int benchCmp(const void *a, const void *b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Ближайший ранг: p-й процентиль — наименьший замер, не меньше которого p% серии.
+static double benchPct(const benchSeries *s, int p) {
+  int k = (s->n * p + 99) / 100;
+  return s->t[k > 0 ? k - 1 : 0];
+}
+
+static void benchReport(const char *name, benchSeries *s) {
+  if (s->n == 0) return;
+  qsort(s->t, s->n, sizeof(double), benchCmp);
+  printf("%-10s n=%-6d p50 %9.1f us  p90 %9.1f us  p99 %9.1f us  max %9.1f us  %8.1f allocs/op %9.1f KB/op\n",
+         name, s->n, benchPct(s, 50) * 1e6, benchPct(s, 90) * 1e6, benchPct(s, 99) * 1e6, s->t[s->n - 1] * 1e6,
+         (double)s->allocs / s->n, (double)s->bytes / s->n / 1024);
+  free(s->t);
+  s->t = NULL;
+}
+
+// Гистограмма серии по степеням двойки: сколько замеров в [2^k, 2^(k+1)) мкс.
+static void benchHisto(const benchSeries *s) {
+  int b[32] = {0}, top = 0, hi = 0;
+  for (int j = 0; j < s->n; j++) {
+    double us = s->t[j] * 1e6;
+    int k = 0;
+    while (us >= 2 && k < 31) { us /= 2; k++; }
+    if (++b[k] > top) top = b[k];
+    if (k > hi) hi = k;
+  }
+  for (int k = 0; k <= hi; k++) {
+    if (!b[k] && !(k && b[k - 1])) continue;
+    printf("  %8llu us %7d %.*s\n", 1ull << k, b[k], (int)((b[k] * 50LL + top - 1) / top),
+           "##################################################");
+  }
+}
+
+// Основные операции редактора на сгенерированном C-файле из nlines строк:
+// открытие, набор, перевод строки, поиск, полная подсветка, полный кадр и
+// сохранение. Каждое нажатие — как в цикле редактора: шаг отмены и кадр.
+static void benchSuite(int nlines) {
+  static const char *src[] = {
+    "static int table_size(const struct entry *e) {",
+    "\tfor (int i = 0; i < e->n; i++) if (e->a[i] == KEY) return i; // found",
+    "\t/* long comment explaining the loop above in some detail */",
+    "\tchar *name = \"request timeout\"; unsigned long long total = 0;",
+    "\treturn -1;",
+    "}",
+    "",
+    "#define KEY 42",
+  };
+  const int nsrc = (int)(sizeof(src) / sizeof(src[0]));
+  const char *name = "kilo-bench.tmp.c";
+  FILE *fp = fopen(name, "wb");
+  if (!fp) { printf("suite skipped: cannot create %s\n", name); return; }
+  for (int l = 0; l < nlines; l++) fprintf(fp, "%s\n", src[l % nsrc]);
+  fclose(fp);
+  int rows = E.screenrows, cols = E.screencols;
+  E.screenrows = 48; E.screencols = 120;
+  benchSeries s;
+
+  benchSeriesInit(&s, 20);
+  for (int r = 0; r < 20; r++) {
+    benchBegin(&s);
+    editorOpen(name);
+    editorRefreshScreen();
+    benchEnd(&s);
+  }
+  benchReport("open", &s);
+
+  E.cy = E.numrows / 2; E.cx = 0;
+  editorRefreshScreen();
+  benchSeriesInit(&s, 5000);
+  for (int k = 0; k < 5000; k++) {
+    benchBegin(&s);
+    undoBegin(UG_TYPE);
+    editorInsertChar("int x = 42; "[k % 12]);
+    undoEnd();
+    editorRefreshScreen();
+    benchEnd(&s);
+  }
+  benchReport("type", &s);
+
+  benchSeriesInit(&s, 2000);
+  for (int k = 0; k < 2000; k++) {
+    benchBegin(&s);
+    editorInsertNewline();
+    editorRefreshScreen();
+    benchEnd(&s);
+  }
+  benchReport("newline", &s);
+
+  static const char *query[] = { "timeout", "e->a[i]", "KEY", "zzz" };
+  benchSeriesInit(&s, 40);
+  for (int r = 0; r < 40; r++) {
+    benchBegin(&s);
+    searchReset();
+    searchUpdate(query[r % 4], r % 8 >= 4, false);
+    benchEnd(&s);
+  }
+  searchReset();
+  benchReport("search", &s);
+
+  benchSeriesInit(&s, 10);
+  for (int r = 0; r < 10; r++) {
+    benchBegin(&s);
+    editorSyntaxInvalidateAll();
+    editorSyntaxCatchUp(E.numrows);
+    benchEnd(&s);
+  }
+  benchReport("highlight", &s);
+
+  benchSeriesInit(&s, 1000);
+  for (int k = 0; k < 1000; k++) {
+    E.cy = (int)((long long)k * 7919 % E.numrows);
+    editorScroll();
+    benchBegin(&s);
+    editorShadowReset();
+    editorRefreshScreen();
+    benchEnd(&s);
+  }
+  benchReport("frame", &s);
+
+  benchSeriesInit(&s, 10);
+  for (int r = 0; r < 10; r++) {
+    E.cy = r; E.cx = 0;
+    editorInsertChar('x'); // иначе сохранять нечего: ремап делает буфер чистым
+    benchBegin(&s);
+    editorSave();
+    editorSaveWait();
+    benchEnd(&s);
+  }
+  benchReport("save", &s);
+
+  journalDrop();
+  editorFreeRows();
+  editorUnmapFile();
+  undoClear();
+  platDelete(name);
+  E.screenrows = rows; E.screencols = cols;
+  E.cx = E.cy = 0; E.dirty = 0;
+}
+
+// Файл из одной строки в size байт (минифицированный JSON): открытие с
+// первым кадром, первая правка в середине (строка становится своей:
+// копией при записи из отображения), набор там же с кадром на каждую
+// клавишу, прыжки курсора
+// в конец и обратно, открытие комментария, который не закрывается до
+// конца строки.
+static void benchLongLine(size_t size) {
+  static const char rec[] = "{\"id\":12345,\"name\":\"request timeout\",\"tags\":[\"a\",\"b\"],\"ok\":true},";
+  const char *name = "kilo-long.tmp.c";
+  FILE *fp = fopen(name, "wb");
+  if (!fp) { printf("long line skipped: cannot create %s\n", name); return; }
+  for (size_t n = 0; n < size; n += sizeof(rec) - 1) fwrite(rec, 1, sizeof(rec) - 1, fp);
+  fputc('\n', fp);
+  fclose(fp);
+  printf("long line  %zu MB\n", size >> 20);
+  int rows = E.screenrows, cols = E.screencols;
+  E.screenrows = 48; E.screencols = 120;
+  benchSeries s;
+
+  benchSeriesInit(&s, 1);
+  benchBegin(&s);
+  editorOpen(name);
+  editorRefreshScreen();
+  benchEnd(&s);
+  benchReport("long open", &s);
+
+  erow *row = editorRowAt(0);
+  E.cy = 0; E.cx = row->size / 2;
+  editorScroll();
+  editorRefreshScreen();
+  benchSeriesInit(&s, 1);
+  benchBegin(&s);
+  editorInsertChar('x');
+  editorRefreshScreen();
+  benchEnd(&s);
+  benchReport("long first", &s);
+
+  benchSeriesInit(&s, 2000);
+  for (int k = 0; k < 2000; k++) {
+    benchBegin(&s);
+    undoBegin(UG_TYPE);
+    editorInsertChar("\"id\":7, "[k % 9]);
+    undoEnd();
+    editorRefreshScreen();
+    benchEnd(&s);
+  }
+  benchReport("long type", &s);
+
+  benchSeriesInit(&s, 20);
+  for (int k = 0; k < 20; k++) {
+    benchBegin(&s);
+    E.cx = k % 2 ? 0 : row->size;
+    editorScroll();
+    editorRefreshScreen();
+    benchEnd(&s);
+  }
+  benchReport("long jump", &s);
+
+  E.cx = row->size / 3;
+  editorScroll();
+  editorRefreshScreen();
+  benchSeriesInit(&s, 1);
+  benchBegin(&s);
+  editorInsertChar('/');
+  editorInsertChar('*');
+  editorRefreshScreen();
+  benchEnd(&s);
+  benchReport("long /*", &s);
+
+  journalDrop();
+  editorFreeRows();
+  editorUnmapFile();
+  undoClear();
+  platDelete(name);
+  E.screenrows = rows; E.screencols = cols;
+  E.cx = E.cy = 0; E.dirty = 0;
+}
+
+/* ---------------------- Воспроизведение трассы ---------------------- */
+
+// Читает трассу (формат — у editorTrace) в T.ev; тексты вставок указывают
+// в buf. Последний Ctrl-Q перед end — сам выход: его не воспроизводим.
+static bool benchTraceLoad(char *buf, size_t size, int *rows, int *cols,
+                           unsigned long long *start, unsigned long long *end, char **file) {
+  char *p = buf, *lim = buf + size, *eol = (char*)memchr(p, '\n', size);
+  int pos = 0;
+  if (!eol || sscanf(p, "kilo-trace 1 %d %d %llx %n", rows, cols, start, &pos) < 3 || pos == 0) return false;
+  *eol = '\0';
+  *file = p + pos;
+  *end = 0;
+  int cap = 0;
+  for (p = eol + 1; p < lim && (eol = (char*)memchr(p, '\n', lim - p)) != NULL; p = eol + 1) {
+    *eol = '\0';
+    char kind[4];
+    unsigned long long us, v;
+    if (sscanf(p, "%llu %3s %llx", &us, kind, &v) == 3 && !strcmp(kind, "end")) { *end = v; break; }
+    if (sscanf(p, "%llu %3s %lld", &us, kind, (long long*)&v) != 3 || kind[1]) return false;
+    if (T.n == cap) {
+      cap = cap ? cap * 2 : 1024;
+      T.ev = (traceEvent*)realloc(T.ev, sizeof(traceEvent) * cap);
+      if (!T.ev) die("realloc");
+    }
+    traceEvent *e = &T.ev[T.n++];
+    e->us = us; e->kind = kind[0]; e->key = (int)v; e->text = NULL; e->len = 0;
+    if (e->kind == 'p') {
+      e->key = PASTE_START; e->text = eol + 1; e->len = (size_t)v;
+      if (e->len >= (size_t)(lim - e->text)) return false;
+      eol += e->len + 1; // текст вставки и его перевод строки
+    } else if (e->kind != 'k' && e->kind != 'r') {
+      return false;
+    }
+  }
+  if (*end && T.n && T.ev[T.n - 1].kind == 'k' && T.ev[T.n - 1].key == CTRL_KEY('q')) T.n--;
+  return T.n > 0 || *end;
+}
+
+// Воспроизводит трассу на копии файла (трасса могла сохранять — корпус не
+// трогаем): по шагу editorProcessKeypress, после каждого кадр. Печатает
+// гистограммы задержек обработки и кадра и сверяет итоговый хеш буфера.
+static int benchReplay(const char *path, const char *file) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) { printf("replay: cannot open %s\n", path); return 2; }
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  char *buf = (char*)malloc(size > 0 ? (size_t)size : 1);
+  if (!buf) die("malloc");
+  size_t got = fread(buf, 1, size > 0 ? (size_t)size : 0, fp);
+  fclose(fp);
+  int rows, cols;
+  unsigned long long start, end;
+  char *recorded;
+  if (!benchTraceLoad(buf, got, &rows, &cols, &start, &end, &recorded)) { printf("replay: bad trace %s\n", path); return 2; }
+  if (!file && strcmp(recorded, "-") != 0) file = recorded;
+
+  // копия с тем же расширением: от него зависит подсветка
+  const char *ext = file ? strrchr(file, '.') : NULL;
+  char copy[64];
+  snprintf(copy, sizeof(copy), "kilo-replay.tmp%s", ext && strlen(ext) < 16 ? ext : "");
+  free(E.filename);
+  E.filename = NULL;
+  if (file) {
+    FILE *in = fopen(file, "rb"), *out = in ? fopen(copy, "wb") : NULL;
+    char chunk[65536];
+    size_t n;
+    if (!out) { printf("replay: cannot copy %s\n", file); if (in) fclose(in); return 2; }
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) fwrite(chunk, 1, n, out);
+    fclose(in); fclose(out);
+    editorOpen(copy);
+  }
+  E.screenrows = rows; E.screencols = cols;
+  E.cx = E.cy = E.rowoff = E.coloff = 0;
+  editorShadowReset();
+  if (editorBufferHash() != start) printf("replay: initial buffer differs from the recorded one\n");
+
+  benchSeries key, frame;
+  benchSeriesInit(&key, T.n);
+  benchSeriesInit(&frame, T.n);
+  editorRefreshScreen();
+  T.at = 0;
+  while (T.at < T.n) {
+    benchBegin(&key);
+    editorProcessKeypress();
+    benchEnd(&key);
+    benchBegin(&frame);
+    editorRefreshScreen();
+    benchEnd(&frame);
+  }
+  editorSaveWait();
+  unsigned long long h = editorBufferHash();
+  printf("replay %s: %d keys in %d steps, recorded %.1f s\n", path, T.n, key.n,
+         T.n ? T.ev[T.n - 1].us / 1e6 : 0.0);
+  printf("key:\n");
+  benchHisto(&key);
+  printf("frame:\n");
+  benchHisto(&frame);
+  benchReport("key", &key);
+  benchReport("frame", &frame);
+  int rc = 0;
+  if (!end) printf("final hash %016llx (trace has no end record)\n", h);
+  else if (h == end) printf("final hash %016llx ok\n", h);
+  else { printf("final hash %016llx MISMATCH (recorded %016llx)\n", h, end); rc = 1; }
+
+  journalDrop();
+  editorFreeRows();
+  editorUnmapFile();
+  undoClear();
+  if (file) platDelete(copy);
+  free(T.ev);
+  T.ev = NULL; T.n = T.at = 0;
+  free(buf);
+  return rc;
+}
+
+int main(int argc, char **argv) {
+  mem_counting = true;
+  if (argc >= 3 && strcmp(argv[1], "replay") == 0) return benchReplay(argv[2], argc >= 4 ? argv[3] : NULL);
+  E.screenrows = 24; E.screencols = 80;
+  editorSyntaxLoad(argv[0]);
+  E.filename = _strdup("bench.c");
+  editorSelectSyntaxHighlight();
+  benchSuite(200000);
+  if (argc < 2 || strcmp(argv[1], "all") != 0) return 0;
+  for (int len = 1000; len <= 10000000; len *= 10) benchKeystroke(len);
+  for (int len = 1000; len <= 1000000; len *= 10) benchColumns(len);
+  benchText();
+  benchLexer(1000000);
+  benchRowMemory();
+  benchLongLine((size_t)300 << 20);
+  benchKeywords(1000000);
+  benchRender();
+  benchPaste(2000);
+  benchUndo(10000);
+  benchUndo(1000000);
+  benchSearch((size_t)256 << 20);
+  benchSearchIndex((size_t)1 << 30);
+  benchRegex((size_t)256 << 20);
+  benchReplace(1000000);
+  benchJournal(1000000, 200000);
+  benchWatch(2000000);
+  benchTruncate(200000);
+  benchIndex("100MB", (size_t)100 << 20, 80);
+  benchIndex("1GB", (size_t)1 << 30, 80);
+  benchIndex("short-lines", (size_t)256 << 20, 2);
+  benchReset();
+  return 0;
+}
+
+#else
 
 int main(int argc, char **argv) {
+  const char *trace = NULL;
+  while (argc >= 3 && argv[1][0] == '-') {
+    if (strcmp(argv[1], "--record") == 0) trace = argv[2];
+    else if (strcmp(argv[1], "--stats") == 0) PF.dump = argv[2];
+    else break;
+    argc -= 2; argv += 2;
+  }
   enableRawMode();
   initEditor();
+  if (PF.dump) { perfStart(); atexit(perfDump); }
+  editorSyntaxLoad(argv[0]); // ошибку в определении покажет вместо подсказки
   if (argc >= 2) editorOpen(argv[1]);
-  editorSetStatusMessage("HELP: Ctrl-S=save | Ctrl-Q=quit | Ctrl-F=find");
-  while (1) { editorRefreshScreen(); editorProcessKeypress(); }
+  if (trace) traceStart(trace);
+  if (!E.statusmsg[0])
+    editorSetStatusMessage("HELP: Ctrl-S=save | Ctrl-Q=quit | Ctrl-F=find | Ctrl-Z/Y=undo/redo | Ctrl-P=perf");
+  while (1) {
+    perfFrame();
+    editorSavePoll();
+    journalPoll();
+    editorWatchPoll();
+    if (!inputPending()) editorRefreshScreen(); // пока ввод идёт, кадры не рисуем
+    E.in_idle = true;
+    int st = perfEnter(PS_EDIT);
+    editorProcessKeypress();
+    perfLeave(st);
+    if (E.in_eof && E.in_tail == E.in_head) editorQuit(); // всё пришедшее обработано
+  }
 }
+
+#endif